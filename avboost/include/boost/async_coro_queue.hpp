@@ -395,6 +395,19 @@ public:
 		return m_list.empty();
 	}
 
+	/*
+	 * 列队里有数据就立即取出一个并返回 true, 没有则返回 false, 不会等待.
+	 */
+	bool try_pop(value_type & value)
+	{
+		if (m_list.empty())
+			return false;
+
+		value = m_list.front();
+		m_list.pop_front();
+		return true;
+	}
+
 private:
 
 	boost::asio::io_service & m_io_service;
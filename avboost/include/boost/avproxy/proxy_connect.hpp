@@ -14,6 +14,9 @@
 #include <boost/asio/detail/handler_type_requirements.hpp>
 #include <boost/asio/async_result.hpp>
 
+#include <avhttp/dns_cache.hpp>
+#include <avhttp/detail/happy_eyeballs.hpp>
+
 #include "detail/proxy_chain.hpp"
 
 namespace avproxy {
@@ -25,47 +28,67 @@ namespace avproxy {
 //    void handle_connect(
 //         const boost::system::error_code & ec
 //    )
-class async_connect : boost::asio::coroutine
+// 主机名通过 avhttp::dns_cache 解析, 重连的时候不用每次都查 DNS.
+// 没有指定 connect_condition 的时候用 happy eyeballs 的方式同时连接 ipv6 和 ipv4 地址.
+class async_connect
 {
 public:
 	typedef void result_type; // for boost::bind
+	typedef avhttp::dns_cache::endpoints_ptr endpoints_ptr;
 public:
 	template<class Socket, class Handler, class connect_condition>
 	async_connect(Socket & socket,const typename Socket::protocol_type::resolver::query & _query, BOOST_ASIO_MOVE_ARG(Handler) handler, connect_condition _connect_condition)
 	{
 		//BOOST_ASIO_CONNECT_HANDLER_CHECK(Handler, handler) type_check;
-		_async_connect(socket, _query, boost::function<void (const boost::system::error_code&)>(handler), _connect_condition);
+		boost::asio::use_service<avhttp::dns_cache>(socket.get_io_service()).async_resolve(
+			_query.host_name(), _query.service_name(),
+			boost::bind(&async_connect::handle_resolve<Socket, connect_condition>, _1, _2, boost::ref(socket),
+				boost::function<void (const boost::system::error_code&)>(handler), _connect_condition)
+		);
 	}
 
 	template<class Socket, class Handler>
 	async_connect(Socket & socket,const typename Socket::protocol_type::resolver::query & _query, BOOST_ASIO_MOVE_ARG(Handler) handler)
 	{
 		//BOOST_ASIO_CONNECT_HANDLER_CHECK(Handler, handler) type_check;
-		_async_connect(socket, _query, boost::function<void (const boost::system::error_code&)>(handler), detail::avproxy_default_connect_condition());
+		boost::asio::use_service<avhttp::dns_cache>(socket.get_io_service()).async_resolve(
+			_query.host_name(), _query.service_name(),
+			boost::bind(&async_connect::handle_resolve_racing, _1, _2, boost::ref(socket),
+				boost::function<void (const boost::system::error_code&)>(handler))
+		);
 	}
 
-	template<class Handler, class Socket, class connect_condition>
-	void operator()(const boost::system::error_code & ec, typename Socket::protocol_type::resolver::iterator begin, Socket & socket, boost::shared_ptr<typename Socket::protocol_type::resolver> resolver, Handler handler, connect_condition _connect_condition)
-	{
- 		//BOOST_ASIO_CONNECT_HANDLER_CHECK(Handler, handler) type_check;
+private:
+	typedef boost::function<void (const boost::system::error_code&)> handler_type;
 
-		BOOST_ASIO_CORO_REENTER(this)
+	static void handle_resolve_racing(const boost::system::error_code & ec, endpoints_ptr endpoints, boost::asio::ip::tcp::socket & socket, handler_type handler)
+	{
+		if (ec)
 		{
-			BOOST_ASIO_CORO_YIELD boost::asio::async_connect(socket,begin, _connect_condition, boost::bind(*this, _1, _2, boost::ref(socket), resolver, handler, _connect_condition));
-			socket.get_io_service().post(boost::asio::detail::bind_handler(handler,ec));
+			handler(ec);
+			return;
 		}
+
+		avhttp::detail::async_connect_racing(socket, *endpoints, handler);
 	}
-private:
-	template<class Socket, class Handler, class connect_condition>
-	void _async_connect(Socket & socket,const typename Socket::protocol_type::resolver::query & _query, BOOST_ASIO_MOVE_ARG(Handler) handler, connect_condition _connect_condition)
+
+	template<class Socket, class connect_condition>
+	static void handle_resolve(const boost::system::error_code & ec, endpoints_ptr endpoints, Socket & socket, handler_type handler, connect_condition _connect_condition)
 	{
-		//BOOST_ASIO_CONNECT_HANDLER_CHECK(Handler, handler) type_check;
+		if (ec)
+		{
+			handler(ec);
+			return;
+		}
 
-		typedef typename Socket::protocol_type::resolver resolver_type;
+		// endpoints 要活到连接结束.
+		boost::asio::async_connect(socket, endpoints->begin(), endpoints->end(), _connect_condition,
+			boost::bind(&async_connect::handle_connect, _1, endpoints, handler));
+	}
 
-		boost::shared_ptr<resolver_type>
-			resolver(new resolver_type(socket.get_io_service()));
-		resolver->async_resolve(_query, boost::bind(*this, _1, _2, boost::ref(socket), resolver, handler, _connect_condition));
+	static void handle_connect(const boost::system::error_code & ec, endpoints_ptr, handler_type handler)
+	{
+		handler(ec);
 	}
 };
 
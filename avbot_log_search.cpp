@@ -1,10 +1,15 @@
 ﻿#include <string>
 #include <vector>
+#include <cctype>
+#include <algorithm>
 
 #include <boost/function.hpp>
 #include <boost/property_tree/ptree.hpp>
 namespace pt = boost::property_tree;
 #include <boost/asio.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
 
 #include <boost/timer/timer.hpp>
 
@@ -15,38 +20,289 @@ namespace pt = boost::property_tree;
 #include <soci.h>
 
 #include "boost/logging.hpp"
-#include <avhttp/detail/escape_string.hpp>
 
-void avlog_do_search(boost::asio::io_service & io_service,
-	std::string c, std::string q, std::string date,
-	boost::function<void (boost::system::error_code, pt::ptree)> handler,
-	soci::session & db)
+#include "avbot_log_search.hpp"
+
+namespace {
+
+// 一段连续的文字. ASCII 的字母数字是一个单词, 其他文字 (主要是中文) 则逐字保存.
+struct fts_segment
+{
+	bool ascii;
+	std::vector<std::string> units;
+};
+
+// 返回 utf8 字符串 pos 处的字符占用的字节数, 并解出 code point.
+static std::size_t utf8_next(const std::string & str, std::size_t pos, unsigned & cp)
+{
+	unsigned char c = str[pos];
+	std::size_t len = 1;
+
+	if (c >= 0xF0)
+	{
+		len = 4;
+		cp = c & 0x07;
+	}
+	else if (c >= 0xE0)
+	{
+		len = 3;
+		cp = c & 0x0F;
+	}
+	else if (c >= 0xC0)
+	{
+		len = 2;
+		cp = c & 0x1F;
+	}
+	else
+	{
+		cp = c;
+		return 1;
+	}
+
+	if (pos + len > str.size())
+	{
+		cp = c;
+		return 1;
+	}
+
+	for (std::size_t i = 1; i < len; i++)
+		cp = (cp << 6) | (static_cast<unsigned char>(str[pos + i]) & 0x3F);
+	return len;
+}
+
+// 全角标点和 CJK 标点当作分隔符, 不进索引.
+static bool is_cjk_separator(unsigned cp)
+{
+	return (cp >= 0x3000 && cp <= 0x303F)
+		|| (cp >= 0xFF00 && cp <= 0xFF0F)
+		|| (cp >= 0xFF1A && cp <= 0xFF20)
+		|| cp == 0xFEFF;
+}
+
+static std::vector<fts_segment> fts_split(const std::string & text)
+{
+	std::vector<fts_segment> segments;
+	fts_segment cur;
+
+	for (std::size_t pos = 0; pos < text.size();)
+	{
+		unsigned cp;
+		std::size_t len = utf8_next(text, pos, cp);
+		bool ascii_word = cp < 0x80 && std::isalnum(cp);
+		bool other_word = cp >= 0x80 && !is_cjk_separator(cp);
+
+		if (!cur.units.empty() && (!(ascii_word || other_word) || cur.ascii != ascii_word))
+		{
+			segments.push_back(cur);
+			cur.units.clear();
+		}
+
+		if (ascii_word)
+		{
+			if (cur.units.empty())
+				cur.units.push_back(std::string());
+			cur.ascii = true;
+			cur.units.back() += static_cast<char>(std::tolower(cp));
+		}
+		else if (other_word)
+		{
+			cur.ascii = false;
+			cur.units.push_back(text.substr(pos, len));
+		}
+
+		pos += len;
+	}
+
+	if (!cur.units.empty())
+		segments.push_back(cur);
+
+	return segments;
+}
+
+// 把消息文本转换成 FTS 的 simple 分词器能正确处理的形式.
+// ASCII 单词原样保留, 中文按相邻两字切分 (bigram), 每一段的最后一个字再单独
+// 作为一个词, 这样单字查询也能用前缀匹配命中.
+static std::string fts_tokenize(const std::string & text)
+{
+	std::string out;
+	std::vector<fts_segment> segments = fts_split(text);
+
+	for (std::size_t i = 0; i < segments.size(); i++)
+	{
+		const std::vector<std::string> & units = segments[i].units;
+
+		if (segments[i].ascii)
+		{
+			out += units[0];
+			out += ' ';
+			continue;
+		}
+
+		for (std::size_t j = 0; j + 1 < units.size(); j++)
+		{
+			out += units[j];
+			out += units[j + 1];
+			out += ' ';
+		}
+		out += units.back();
+		out += ' ';
+	}
+
+	return out;
+}
+
+// 把用户输入的关键字转换成 FTS 的 MATCH 表达式. 每一段都必须命中 (AND).
+// ASCII 单词和单个中文字用前缀匹配, 多个中文字用 bigram 短语匹配.
+static std::string fts_build_query(const std::string & q)
+{
+	std::string out;
+	std::vector<fts_segment> segments = fts_split(q);
+
+	for (std::size_t i = 0; i < segments.size(); i++)
+	{
+		const std::vector<std::string> & units = segments[i].units;
+
+		if (!out.empty())
+			out += ' ';
+
+		if (segments[i].ascii)
+		{
+			// 以前是 LIKE '%q%', 用前缀匹配保证输入单词的开头也能找到, 比如 avbo 能找到 avbot.
+			out += units[0];
+			out += '*';
+		}
+		else if (units.size() == 1)
+		{
+			out += units[0];
+			out += '*';
+		}
+		else
+		{
+			// 多个字要求 bigram 连续出现, 用短语查询.
+			out += '"';
+			for (std::size_t j = 0; j + 1 < units.size(); j++)
+			{
+				if (j)
+					out += ' ';
+				out += units[j];
+				out += units[j + 1];
+			}
+			out += '"';
+		}
+	}
+
+	return out;
+}
+
+// sqlite 函数 avlog_tokenize(text), 用于导入旧日志.
+static void sqlite_avlog_tokenize(sqlite_api::sqlite3_context * ctx, int argc, sqlite_api::sqlite3_value ** argv)
+{
+	const unsigned char * text = sqlite_api::sqlite3_value_text(argv[0]);
+
+	if (!text)
+	{
+		sqlite_api::sqlite3_result_null(ctx);
+		return;
+	}
+
+	std::string tokens = fts_tokenize(std::string(reinterpret_cast<const char*>(text),
+		sqlite_api::sqlite3_value_bytes(argv[0])));
+
+	sqlite_api::sqlite3_result_text(ctx, tokens.data(), tokens.size(),
+		((sqlite_api::sqlite3_destructor_type)-1));
+}
+
+// sqlite 函数 avlog_rank(matchinfo(avlog_fts, 'pcx')).
+// 每个短语在这一行的命中次数除以在所有行的命中次数, 累加起来就是相关度.
+static void sqlite_avlog_rank(sqlite_api::sqlite3_context * ctx, int argc, sqlite_api::sqlite3_value ** argv)
+{
+	const unsigned * info = static_cast<const unsigned*>(sqlite_api::sqlite3_value_blob(argv[0]));
+	std::size_t n = sqlite_api::sqlite3_value_bytes(argv[0]) / sizeof(unsigned);
+	double score = 0.0;
+
+	if (info && n >= 2)
+	{
+		unsigned phrases = info[0], cols = info[1];
+
+		for (unsigned p = 0; p < phrases; p++)
+		{
+			for (unsigned c = 0; c < cols; c++)
+			{
+				std::size_t idx = 2 + 3 * (c + p * cols);
+
+				if (idx + 1 < n && info[idx + 1])
+					score += static_cast<double>(info[idx]) / info[idx + 1];
+			}
+		}
+	}
+
+	sqlite_api::sqlite3_result_double(ctx, score);
+}
+
+static sqlite_api::sqlite3 * sqlite_handle(soci::session & db)
+{
+	if (db.get_backend_name() != "sqlite3")
+		return NULL;
+	return dynamic_cast<soci::sqlite3_session_backend*>(db.get_backend())->conn_;
+}
+
+static void register_sqlite_functions(sqlite_api::sqlite3 * conn)
+{
+	sqlite_api::sqlite3_create_function(conn, "avlog_tokenize", 1, SQLITE_UTF8, NULL,
+		&sqlite_avlog_tokenize, NULL, NULL);
+	sqlite_api::sqlite3_create_function(conn, "avlog_rank", 1, SQLITE_UTF8, NULL,
+		&sqlite_avlog_rank, NULL, NULL);
+}
+
+static pt::ptree do_search(soci::session & db, avlog_search_request request)
 {
 	pt::ptree outjson;
-	std::string q_escaped;
 	// 根据 channel_name , query string , date 像数据库查找
-	AVLOG_DBG << " c = " << c << " q =  " << q << " date= " << date ;
+	AVLOG_DBG << " c = " << request.channel << " q =  " << request.q
+		<< " from= " << request.date_from << " to= " << request.date_to;
 
-	std::vector<std::string>	r_date(1000);
-	std::vector<std::string>	r_channel(1000);
-	std::vector<std::string>	r_nick(1000);
-	std::vector<std::string>	r_message(1000);
-	std::vector<std::string>	r_rowid(1000);
+	request.limit = std::max(1, std::min(request.limit, 1000));
+	request.offset = std::max(0, request.offset);
 
-	avhttp::detail::unescape_path(q, q_escaped);
+	std::string match = fts_build_query(request.q);
+
+	// soci 的 sqlite3 后端把只有一个元素的 vector 当单行处理, 所以多留一个位置.
+	std::vector<std::string>	r_date(request.limit + 1);
+	std::vector<std::string>	r_channel(request.limit + 1);
+	std::vector<std::string>	r_nick(request.limit + 1);
+	std::vector<std::string>	r_message(request.limit + 1);
+	std::vector<std::string>	r_rowid(request.limit + 1);
 
 	boost::timer::cpu_timer cputimer;
 
 	cputimer.start();
 
-	db << "select date,channel,nick,message,rowid from avlog where channel=:c "
-		"and message like \"%" << q_escaped << "%\" order  by strftime(`date`) DESC"
-		, soci::into(r_date)
-		, soci::into(r_channel)
-		, soci::into(r_nick)
-		, soci::into(r_message)
-		, soci::into(r_rowid)
-		, soci::use(c);
+	if (!match.empty())
+	{
+		std::string date_to = request.date_to.empty() ? std::string("9999") : request.date_to;
+
+		db << "select avlog.date, avlog.channel, avlog.nick, avlog.message, avlog.rowid "
+			"from avlog_fts join avlog on avlog.rowid = avlog_fts.docid "
+			"where avlog_fts match :match and avlog.channel = :c "
+			"and avlog.date >= :date_from and avlog.date <= :date_to "
+			"order by avlog_rank(matchinfo(avlog_fts, 'pcx')) desc, avlog.rowid desc "
+			"limit cast(:limit as integer) offset cast(:offset as integer)"
+			, soci::into(r_date)
+			, soci::into(r_channel)
+			, soci::into(r_nick)
+			, soci::into(r_message)
+			, soci::into(r_rowid)
+			, soci::use(match)
+			, soci::use(request.channel)
+			, soci::use(request.date_from)
+			, soci::use(date_to)
+			, soci::use(request.limit)
+			, soci::use(request.offset);
+	}
+	else
+	{
+		r_date.clear();
+	}
 
 	pt::ptree results;
 	// print out the result
@@ -56,7 +312,6 @@ void avlog_do_search(boost::asio::io_service & io_service,
 		onemsg.put("date", r_date[i]);
 		onemsg.put("channel", r_channel[i]);
 		onemsg.put("nick", r_nick[i]);
-		onemsg.put("channel", r_channel[i]);
 		onemsg.put("message", r_message[i]);
 		onemsg.put("id", r_rowid[i]);
 
@@ -64,14 +319,211 @@ void avlog_do_search(boost::asio::io_service & io_service,
 	}
 
 	outjson.put("params.num_results", r_date.size());
+	outjson.put("params.offset", request.offset);
+	outjson.put("params.limit", request.limit);
 	outjson.put_child("data", results);
 
 	outjson.put("params.time_used", boost::timer::format(cputimer.elapsed(), 6, "%w"));
 
-	io_service.post(
-		boost::asio::detail::bind_handler(handler,
-			boost::system::error_code(),
-			outjson
+	return outjson;
+}
+
+} // namespace
+
+void avlog_init_index(soci::session & db)
+{
+	sqlite_api::sqlite3 * conn = sqlite_handle(db);
+
+	if (!conn)
+		return;
+
+	register_sqlite_functions(conn);
+
+	int has_index = 0;
+	db << "select count(*) from sqlite_master where type='table' and name='avlog_fts'",
+		soci::into(has_index);
+
+	if (has_index)
+		return;
+
+	// contentless 索引, 原文仍然只保存在 avlog 表里, docid 就是 avlog 的 rowid.
+	AVLOG_INFO << "building full text index for avlog, this may take a while ...";
+
+	soci::transaction tr(db);
+	db << "create virtual table avlog_fts using fts4(content=\"\", message)";
+	db << "insert into avlog_fts (docid, message) "
+		"select rowid, avlog_tokenize(message) from avlog";
+	tr.commit();
+
+	AVLOG_INFO << "full text index for avlog built";
+}
+
+std::string avlog_fts_tokenize(const std::string & textmessage)
+{
+	return fts_tokenize(textmessage);
+}
+
+struct avlog_search_job
+{
+	avlog_search_request request;
+	avlog_search_executor::search_handler handler;
+
+	// 以下由 avlog_search_executor::m_mutex 保护.
+	bool cancelled;
+	sqlite_api::sqlite3 * running_on;
+};
+
+// 在 io_service 线程里调用 handler, 并且在 io_service 线程里释放 handler 持有的对象.
+static void invoke_search_handler(boost::shared_ptr<avlog_search_job> job,
+	boost::system::error_code ec, pt::ptree result)
+{
+	avlog_search_executor::search_handler handler;
+	handler.swap(job->handler);
+	handler(ec, result);
+}
+
+avlog_search_executor::avlog_search_executor(boost::asio::io_service & io_service,
+	const std::string & dbfile, int threads, std::size_t max_pending)
+	: m_io_service(io_service)
+	, m_dbfile(dbfile)
+	, m_max_pending(max_pending)
+	, m_quit(false)
+{
+	for (int i = 0; i < threads; i++)
+	{
+		m_threads.create_thread(boost::bind(&avlog_search_executor::worker_thread, this));
+	}
+}
+
+avlog_search_executor::~avlog_search_executor()
+{
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_quit = true;
+
+		// 正在执行的搜索也中断掉.
+		BOOST_FOREACH(search_id job, m_running)
+		{
+			sqlite_api::sqlite3_interrupt(job->running_on);
+		}
+	}
+	m_cond.notify_all();
+	m_threads.join_all();
+}
+
+avlog_search_executor::search_id avlog_search_executor::async_search(
+	const avlog_search_request & request, search_handler handler)
+{
+	search_id job = boost::make_shared<avlog_search_job>();
+	job->request = request;
+	job->handler = handler;
+	job->cancelled = false;
+	job->running_on = NULL;
+
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+
+		if (m_pending.size() < m_max_pending)
+		{
+			m_pending.push_back(job);
+			m_cond.notify_one();
+			return job;
+		}
+	}
+
+	// 排队的搜索太多了, 直接拒绝, 而不是让队列无限增长.
+	m_io_service.post(
+		boost::bind(&invoke_search_handler, job,
+			boost::system::errc::make_error_code(boost::system::errc::resource_unavailable_try_again),
+			pt::ptree()
 		)
 	);
-};
+	return search_id();
+}
+
+void avlog_search_executor::cancel(search_id job)
+{
+	if (!job)
+		return;
+
+	boost::mutex::scoped_lock l(m_mutex);
+
+	job->cancelled = true;
+
+	// 已经开始执行了, 就中断 sqlite 的查询.
+	if (job->running_on)
+		sqlite_api::sqlite3_interrupt(job->running_on);
+}
+
+void avlog_search_executor::worker_thread()
+{
+	soci::session db;
+	sqlite_api::sqlite3 * conn;
+
+	try
+	{
+		db.open(soci::sqlite3, m_dbfile);
+		conn = sqlite_handle(db);
+		// 只读连接. 数据库是 WAL 模式, 读不会阻塞 avbot_log 的写入.
+		db << "pragma query_only=1";
+		sqlite_api::sqlite3_busy_timeout(conn, 5000);
+		register_sqlite_functions(conn);
+	}
+	catch (const soci::soci_error & e)
+	{
+		AVLOG_ERR << "failed to open " << m_dbfile << " for search: " << e.what();
+		return;
+	}
+
+	for (;;)
+	{
+		search_id job;
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+
+			while (!m_quit && m_pending.empty())
+				m_cond.wait(l);
+
+			if (m_quit)
+				return;
+
+			job = m_pending.front();
+			m_pending.pop_front();
+
+			if (job->cancelled)
+			{
+				m_io_service.post(boost::bind(&invoke_search_handler, job,
+					boost::asio::error::make_error_code(boost::asio::error::operation_aborted),
+					pt::ptree()));
+				continue;
+			}
+
+			job->running_on = conn;
+			m_running.insert(job);
+		}
+
+		boost::system::error_code ec;
+		pt::ptree result;
+
+		try
+		{
+			result = do_search(db, job->request);
+		}
+		catch (const soci::soci_error & e)
+		{
+			AVLOG_WARN << "avlog search failed: " << e.what();
+			ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			job->running_on = NULL;
+			m_running.erase(job);
+
+			if (job->cancelled)
+				ec = boost::asio::error::make_error_code(boost::asio::error::operation_aborted);
+		}
+
+		m_io_service.post(boost::bind(&invoke_search_handler, job, ec, result));
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <set>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <session.h>
+
+// 一次日志搜索的参数.
+struct avlog_search_request
+{
+	avlog_search_request()
+		: offset(0)
+		, limit(50)
+	{}
+
+	std::string channel;
+	// 查询的关键字, 已经 url 解码过.
+	std::string q;
+	// 日期范围, 格式和 avlog::current_time() 一样, 留空表示不限制.
+	std::string date_from, date_to;
+	// 分页.
+	int offset, limit;
+};
+
+// 为 avlog 表建立全文索引 (sqlite FTS4), 并注册索引需要的 sqlite 函数.
+// 旧数据库第一次打开的时候会把已有的日志全部导入索引.
+void avlog_init_index(soci::session & db);
+
+// 把消息转换成写入 avlog_fts 索引的形式.
+std::string avlog_fts_tokenize(const std::string & textmessage);
+
+struct avlog_search_job;
+
+// 日志搜索的执行器.
+// 搜索在自己的线程池里进行, 每个线程使用一个只读的数据库连接,
+// 结果通过 io_service.post 投递回来, 这样慢查询不会拖慢消息转发.
+class avlog_search_executor : boost::noncopyable
+{
+public:
+	typedef boost::function<void (boost::system::error_code, boost::property_tree::ptree)> search_handler;
+	typedef boost::shared_ptr<avlog_search_job> search_id;
+
+	avlog_search_executor(boost::asio::io_service & io_service, const std::string & dbfile,
+		int threads = 2, std::size_t max_pending = 32);
+	~avlog_search_executor();
+
+	// 按照 FTS 索引查找日志, 结果按相关度和时间排序.
+	// 排队的搜索超过 max_pending 的时候, handler 会收到 resource_unavailable_try_again.
+	search_id async_search(const avlog_search_request & request, search_handler handler);
+
+	// 取消搜索, handler 会收到 operation_aborted.
+	void cancel(search_id);
+
+private:
+	void worker_thread();
+
+private:
+	boost::asio::io_service & m_io_service;
+	std::string m_dbfile;
+	std::size_t m_max_pending;
+
+	boost::mutex m_mutex;
+	boost::condition_variable m_cond;
+	std::deque<search_id> m_pending;
+	std::set<search_id> m_running;
+	bool m_quit;
+
+	boost::thread_group m_threads;
+};
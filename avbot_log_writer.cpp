@@ -0,0 +1,226 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <soci-sqlite3.h>
+#include <boost-optional.h>
+#include <boost-tuple.h>
+#include <boost-gregorian-date.h>
+#include <soci.h>
+
+#include "boost/logging.hpp"
+
+#include "avbot_log_writer.hpp"
+#include "avbot_log_search.hpp"
+
+avlog_writer::avlog_writer(boost::asio::io_service & io_service, soci::session & db,
+	std::size_t batch_size, int flush_ms)
+	: m_io_service(io_service)
+	, m_db(db)
+	, m_batch_size(std::max<std::size_t>(batch_size, 1))
+	, m_flush_ms(flush_ms)
+	, m_quit(false)
+	, m_committed_rows(0)
+	, m_commits(0)
+	, m_failed_commits(0)
+	, m_last_commit_ms(0)
+	, m_total_commit_ms(0)
+	, m_max_commit_ms(0)
+{
+	m_thread = boost::thread(boost::bind(&avlog_writer::writer_thread, this));
+}
+
+avlog_writer::~avlog_writer()
+{
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_all();
+	m_thread.join();
+
+	BOOST_FOREACH(boost::function<void()> & f, m_leftover)
+	{
+		f();
+	}
+}
+
+void avlog_writer::async_insert(const avlog_row & row, insert_handler handler)
+{
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_pending.push_back(std::make_pair(row, handler));
+	}
+	m_cond.notify_one();
+}
+
+boost::property_tree::ptree avlog_writer::status()
+{
+	boost::property_tree::ptree out;
+	boost::mutex::scoped_lock l(m_mutex);
+
+	out.put("queue_depth", m_pending.size());
+	out.put("batch_size", m_batch_size);
+	out.put("flush_ms", m_flush_ms);
+	out.put("committed_rows", m_committed_rows);
+	out.put("commits", m_commits);
+	out.put("failed_commits", m_failed_commits);
+	out.put("commit_latency_ms.last", m_last_commit_ms);
+	out.put("commit_latency_ms.max", m_max_commit_ms);
+	out.put("commit_latency_ms.avg", m_commits ? m_total_commit_ms / m_commits : 0.0);
+	return out;
+}
+
+void avlog_writer::invoke_handlers(std::vector<insert_handler> handlers, std::vector<long> rowids)
+{
+	for (std::size_t i = 0; i < handlers.size(); i++)
+	{
+		handlers[i](rowids[i]);
+	}
+}
+
+void avlog_writer::writer_thread()
+{
+	// 预编译的语句, 绑定到下面几个变量上, 每条日志只需要改变量然后 execute.
+	avlog_row row;
+	long rowid = 0;
+	std::string tokens;
+
+	boost::scoped_ptr<soci::statement> insert_log;
+	boost::scoped_ptr<soci::statement> insert_index;
+	sqlite_api::sqlite3 * conn = NULL;
+
+	// avlog_fts 不存在或者数据库坏了的时候这里会抛异常, 不能让它结束整个程序.
+	// 准备失败以后每一批都直接失败, handler 收到的 rowid 为 0.
+	try
+	{
+		insert_log.reset(new soci::statement((m_db.prepare <<
+			"insert into avlog (date, protocol, channel, nick, message)"
+			" values (:date, :protocol, :channel, :nick, :message)"
+			, soci::use(row.date)
+			, soci::use(row.protocol)
+			, soci::use(row.channel)
+			, soci::use(row.nick)
+			, soci::use(row.message))));
+
+		// soci 的 sqlite3 后端把参数都绑定为文本, docid 必须转成整数.
+		insert_index.reset(new soci::statement((m_db.prepare <<
+			"insert into avlog_fts (docid, message) values (cast(:docid as integer), :message)"
+			, soci::use(rowid)
+			, soci::use(tokens))));
+
+		conn = dynamic_cast<soci::sqlite3_session_backend*>(m_db.get_backend())->conn_;
+	}
+	catch (const soci::soci_error & e)
+	{
+		AVLOG_ERR << "failed to prepare statements for avlog.db, logs will not be saved: " << e.what();
+		insert_log.reset();
+		insert_index.reset();
+	}
+
+	for (;;)
+	{
+		std::vector<std::pair<avlog_row, insert_handler> > batch;
+		bool quit;
+
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+
+			while (!m_quit && m_pending.empty())
+				m_cond.wait(l);
+
+			// 攒够一批, 或者等到 flush_ms 超时再提交.
+			boost::system_time deadline = boost::get_system_time()
+				+ boost::posix_time::milliseconds(m_flush_ms);
+
+			while (!m_quit && m_pending.size() < m_batch_size)
+			{
+				if (!m_cond.timed_wait(l, deadline))
+					break;
+			}
+
+			std::size_t n = std::min(m_pending.size(), m_batch_size);
+			batch.assign(m_pending.begin(), m_pending.begin() + n);
+			m_pending.erase(m_pending.begin(), m_pending.begin() + n);
+			quit = m_quit;
+		}
+
+		if (batch.empty())
+		{
+			if (quit)
+				return;
+			continue;
+		}
+
+		std::vector<insert_handler> handlers;
+		std::vector<long> rowids(batch.size(), 0);
+		bool failed = false;
+
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+		if (!insert_index)
+		{
+			failed = true;
+		}
+		else
+		{
+			try
+			{
+				soci::transaction tr(m_db);
+
+				for (std::size_t i = 0; i < batch.size(); i++)
+				{
+					row = batch[i].first;
+					insert_log->execute(true);
+
+					rowid = sqlite_api::sqlite3_last_insert_rowid(conn);
+					tokens = avlog_fts_tokenize(row.message);
+					insert_index->execute(true);
+
+					rowids[i] = rowid;
+				}
+
+				tr.commit();
+			}
+			catch (const soci::soci_error & e)
+			{
+				AVLOG_ERR << "failed to write " << batch.size() << " log rows to avlog.db: " << e.what();
+				std::fill(rowids.begin(), rowids.end(), 0);
+				failed = true;
+			}
+		}
+
+		double used_ms = (boost::posix_time::microsec_clock::universal_time() - start)
+			.total_microseconds() / 1000.0;
+
+		for (std::size_t i = 0; i < batch.size(); i++)
+			handlers.push_back(batch[i].second);
+
+		boost::function<void()> done = boost::bind(&avlog_writer::invoke_handlers, handlers, rowids);
+
+		boost::mutex::scoped_lock l(m_mutex);
+
+		if (failed)
+		{
+			m_failed_commits ++;
+		}
+		else
+		{
+			m_commits ++;
+			m_committed_rows += batch.size();
+			m_last_commit_ms = used_ms;
+			m_total_commit_ms += used_ms;
+			m_max_commit_ms = std::max(m_max_commit_ms, used_ms);
+		}
+
+		if (m_quit)
+			m_leftover.push_back(done);
+		else
+			m_io_service.post(done);
+	}
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <session.h>
+
+// avlog 表里的一行.
+struct avlog_row
+{
+	std::string date;
+	std::string protocol;
+	std::string channel;
+	std::string nick;
+	std::string message;
+};
+
+// avlog 数据库的写入器.
+// 日志先进入队列, 由写入线程每 batch_size 条或者每 flush_ms 毫秒一次性在一个事务里提交,
+// 这样突发的消息不会每条都 fsync 一次. 写入后得到的 rowid 通过 io_service 回调给调用者.
+class avlog_writer : boost::noncopyable
+{
+public:
+	typedef boost::function<void (long rowid)> insert_handler;
+
+	// db 在构造之后只由写入线程使用.
+	avlog_writer(boost::asio::io_service & io_service, soci::session & db,
+		std::size_t batch_size = 64, int flush_ms = 200);
+	~avlog_writer();
+
+	// 写入一条日志. 失败的时候 handler 收到的 rowid 为 0.
+	void async_insert(const avlog_row & row, insert_handler handler);
+
+	// 队列长度, 提交耗时等统计.
+	boost::property_tree::ptree status();
+
+private:
+	void writer_thread();
+
+	static void invoke_handlers(std::vector<insert_handler> handlers, std::vector<long> rowids);
+
+private:
+	boost::asio::io_service & m_io_service;
+	soci::session & m_db;
+	std::size_t m_batch_size;
+	int m_flush_ms;
+
+	boost::mutex m_mutex;
+	boost::condition_variable m_cond;
+	std::deque<std::pair<avlog_row, insert_handler> > m_pending;
+	bool m_quit;
+
+	// 退出的时候 io_service 已经停了, 最后一批的回调留给析构函数调用.
+	std::vector<boost::function<void()> > m_leftover;
+
+	// 统计, 由 m_mutex 保护.
+	std::size_t m_committed_rows;
+	std::size_t m_commits;
+	std::size_t m_failed_commits;
+	double m_last_commit_ms;
+	double m_total_commit_ms;
+	double m_max_commit_ms;
+
+	boost::thread m_thread;
+};
@@ -8,6 +8,8 @@
 #include <boost/concept_check.hpp>
 #include <boost/timedcall.hpp>
 
+#include "libavbot/avbot_message.hpp"
+
 class avbot_vc_feed_input : boost::noncopyable
 {
 public:
@@ -42,17 +44,11 @@ public:
 		m_input_wait_handlers.clear();
 	}
 
-	void call_this_to_feed_message(boost::property_tree::ptree message)
+	void call_this_to_feed_message(const avbot_message & message)
 	{
 		// format 后调用 call_this_to_feed_line
-		try{
-			std::string textmessage;
-
-			textmessage = message.get<std::string>("message.text");
-
-			call_this_to_feed_line(textmessage);
-
-		}catch (...){}
+		if (!message.text().empty())
+			call_this_to_feed_line(message.text());
 	}
 
 	void call_this_to_feed_timeout()
@@ -0,0 +1,258 @@
+//
+// connection_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_CONNECTION_POOL_HPP
+#define AVHTTP_CONNECTION_POOL_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <map>
+#include <list>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "avhttp/detail/service_id.hpp"
+
+// 每个主机最多保留的空闲连接数.
+#ifndef AVHTTP_POOL_MAX_PER_HOST
+#define AVHTTP_POOL_MAX_PER_HOST 4
+#endif
+
+// 空闲连接保留的秒数, 大多数服务器的keep-alive超时在15到60秒之间.
+#ifndef AVHTTP_POOL_IDLE_TIMEOUT
+#define AVHTTP_POOL_IDLE_TIMEOUT 15
+#endif
+
+// socket的移动需要c++11, 不支持的编译器上连接池什么也不保存.
+#if defined(BOOST_ASIO_HAS_MOVE)
+# define AVHTTP_ENABLE_CONNECTION_POOL
+#endif
+
+namespace avhttp {
+
+///keep-alive连接池.
+// 每个io_service一个, 通过boost::asio::use_service取得, 按 协议://主机:端口
+// 保存http_stream用完的空闲连接, http_stream在async_open的时候会先从这里取.
+// @备注: 只保存没有代理的http连接, https和代理连接不进池.
+// 和http_stream一样, 只能在io_service的线程里使用.
+// @begin example
+//  avhttp::connection_pool& pool =
+//      boost::asio::use_service<avhttp::connection_pool>(io);
+//  pool.max_per_host(8);
+//  pool.idle_timeout(boost::posix_time::seconds(30));
+// @end example
+class connection_pool
+	: public boost::asio::io_service::service
+	, public detail::service_id<connection_pool>
+{
+	typedef boost::asio::ip::tcp tcp;
+
+	struct idle_connection
+	{
+		boost::shared_ptr<tcp::socket> sock;
+		boost::posix_time::ptime expires;
+	};
+
+	// 新放回的连接在链表尾部, 取的时候也从尾部取, 最老的连接在头部等待超时.
+	typedef std::list<idle_connection> idle_list;
+	typedef std::map<std::string, idle_list> host_map;
+
+public:
+	explicit connection_pool(boost::asio::io_service& io)
+		: boost::asio::io_service::service(io)
+		, m_io_service(io)
+		, m_timer(io)
+		, m_timer_running(false)
+		, m_shutdown(false)
+		, m_max_per_host(AVHTTP_POOL_MAX_PER_HOST)
+		, m_idle_timeout(boost::posix_time::seconds(AVHTTP_POOL_IDLE_TIMEOUT))
+	{}
+
+	///设置每个主机最多保留的空闲连接数, 为0表示不保留连接.
+	void max_per_host(std::size_t n)
+	{
+		m_max_per_host = n;
+		for (host_map::iterator i = m_hosts.begin(); i != m_hosts.end(); ++i)
+		{
+			while (i->second.size() > m_max_per_host)
+				i->second.pop_front();
+		}
+	}
+
+	///设置空闲连接的超时时间, 超过这个时间没有被使用的连接将被关闭.
+	void idle_timeout(boost::posix_time::time_duration t)
+	{
+		m_idle_timeout = t;
+	}
+
+	///返回池中空闲连接的总数.
+	std::size_t size() const
+	{
+		std::size_t n = 0;
+		for (host_map::const_iterator i = m_hosts.begin(); i != m_hosts.end(); ++i)
+			n += i->second.size();
+		return n;
+	}
+
+	///取出一个连接到key的空闲连接, 放到sock里.
+	// @param key 协议://主机:端口.
+	// @param sock 一个没有打开的socket.
+	// @返回是否取到了可用的连接, 取到的连接已经通过了健康检查.
+	bool checkout(const std::string& key, tcp::socket& sock)
+	{
+#ifdef AVHTTP_ENABLE_CONNECTION_POOL
+		host_map::iterator host = m_hosts.find(key);
+		if (host == m_hosts.end())
+			return false;
+
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		idle_list& idle = host->second;
+
+		while (!idle.empty())
+		{
+			idle_connection conn = idle.back();
+			idle.pop_back();
+
+			if (conn.expires > now && healthy(*conn.sock))
+			{
+				sock = std::move(*conn.sock);
+				if (idle.empty())
+					m_hosts.erase(host);
+				return true;
+			}
+		}
+
+		m_hosts.erase(host);
+#endif // AVHTTP_ENABLE_CONNECTION_POOL
+		return false;
+	}
+
+	///把一个读完了响应的keep-alive连接放回池中.
+	// 超过每个主机的连接数时最老的连接会被关闭.
+	// @param key 协议://主机:端口.
+	// @param sock 已经连接的socket, 调用后sock变为未打开状态.
+	void checkin(const std::string& key, tcp::socket& sock)
+	{
+		boost::system::error_code ignore_ec;
+#ifdef AVHTTP_ENABLE_CONNECTION_POOL
+		if (m_max_per_host > 0 && !m_shutdown && sock.is_open())
+		{
+			idle_connection conn;
+			conn.sock.reset(new tcp::socket(m_io_service));
+			*conn.sock = std::move(sock);
+			conn.expires = boost::posix_time::microsec_clock::universal_time() + m_idle_timeout;
+
+			idle_list& idle = m_hosts[key];
+			idle.push_back(conn);
+			if (idle.size() > m_max_per_host)
+				idle.pop_front();
+
+			start_timer();
+			return;
+		}
+#endif // AVHTTP_ENABLE_CONNECTION_POOL
+		sock.close(ignore_ec);
+	}
+
+private:
+
+	// io_service析构时, 还没执行的handler里的http_stream可能在这之后才析构.
+	void shutdown_service()
+	{
+		m_shutdown = true;
+		m_hosts.clear();
+	}
+
+	// 服务器关闭了的连接是可读的(读到eof), 空闲的连接上不应该有数据,
+	// 所以只有在非阻塞peek返回would_block的时候才认为连接是好的.
+	static bool healthy(tcp::socket& sock)
+	{
+		boost::system::error_code ec;
+		char c;
+
+		if (!sock.is_open())
+			return false;
+
+		sock.non_blocking(true, ec);
+		if (ec)
+			return false;
+
+		sock.receive(boost::asio::buffer(&c, 1), tcp::socket::message_peek, ec);
+
+		bool ok = (ec == boost::asio::error::would_block);
+		sock.non_blocking(false, ec);
+		return ok && !ec;
+	}
+
+	void start_timer()
+	{
+		if (m_timer_running)
+			return;
+
+		m_timer_running = true;
+		m_timer.expires_from_now(m_idle_timeout);
+		m_timer.async_wait(boost::bind(&connection_pool::handle_timer,
+			this, boost::asio::placeholders::error));
+	}
+
+	// 关闭超时的空闲连接, 池空了就不再启动定时器.
+	void handle_timer(const boost::system::error_code& ec)
+	{
+		m_timer_running = false;
+		if (ec)
+			return;
+
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		boost::posix_time::ptime next = boost::posix_time::pos_infin;
+
+		for (host_map::iterator i = m_hosts.begin(); i != m_hosts.end();)
+		{
+			idle_list& idle = i->second;
+			while (!idle.empty() && idle.front().expires <= now)
+				idle.pop_front();
+
+			if (idle.empty())
+			{
+				m_hosts.erase(i++);
+				continue;
+			}
+
+			next = (std::min)(next, idle.front().expires);
+			++i;
+		}
+
+		if (m_hosts.empty())
+			return;
+
+		m_timer_running = true;
+		m_timer.expires_at(next);
+		m_timer.async_wait(boost::bind(&connection_pool::handle_timer,
+			this, boost::asio::placeholders::error));
+	}
+
+private:
+	boost::asio::io_service& m_io_service;
+	host_map m_hosts;
+	boost::asio::deadline_timer m_timer;
+	bool m_timer_running;
+	bool m_shutdown;
+	std::size_t m_max_per_host;
+	boost::posix_time::time_duration m_idle_timeout;
+};
+
+} // namespace avhttp
+
+#endif // AVHTTP_CONNECTION_POOL_HPP
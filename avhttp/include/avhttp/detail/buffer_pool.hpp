@@ -0,0 +1,93 @@
+//
+// buffer_pool.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DETAIL_BUFFER_POOL_HPP
+#define AVHTTP_DETAIL_BUFFER_POOL_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "avhttp/detail/service_id.hpp"
+
+// 最多保留的空闲缓冲个数.
+#ifndef AVHTTP_BUFFER_POOL_SIZE
+#define AVHTTP_BUFFER_POOL_SIZE 8
+#endif
+
+namespace avhttp {
+namespace detail {
+
+// 每个io_service一个的缓冲池, http_stream解压时从这里借输入缓冲,
+// 响应读完后还回来, 这样大缓冲不用每个请求都重新分配.
+class buffer_pool
+	: public boost::asio::io_service::service
+	, public service_id<buffer_pool>
+{
+public:
+	typedef boost::shared_ptr<std::vector<char> > buffer_ptr;
+
+	explicit buffer_pool(boost::asio::io_service& io)
+		: boost::asio::io_service::service(io)
+	{}
+
+	// 借一个至少size字节的缓冲.
+	buffer_ptr acquire(std::size_t size)
+	{
+		buffer_ptr buf;
+		{
+			boost::asio::detail::mutex::scoped_lock lock(m_mutex);
+			if (!m_free.empty())
+			{
+				buf = m_free.back();
+				m_free.pop_back();
+			}
+		}
+
+		if (!buf)
+			buf.reset(new std::vector<char>);
+		if (buf->size() < size)
+			buf->resize(size);
+		return buf;
+	}
+
+	// 还回缓冲, 池满了就直接释放.
+	void release(buffer_ptr buf)
+	{
+		if (!buf)
+			return;
+
+		boost::asio::detail::mutex::scoped_lock lock(m_mutex);
+		if (m_free.size() < AVHTTP_BUFFER_POOL_SIZE)
+			m_free.push_back(buf);
+	}
+
+private:
+	void shutdown_service()
+	{
+		boost::asio::detail::mutex::scoped_lock lock(m_mutex);
+		m_free.clear();
+	}
+
+private:
+	boost::asio::detail::mutex m_mutex;
+	std::vector<buffer_ptr> m_free;
+};
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_DETAIL_BUFFER_POOL_HPP
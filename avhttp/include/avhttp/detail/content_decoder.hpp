@@ -0,0 +1,325 @@
+//
+// content_decoder.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DETAIL_CONTENT_DECODER_HPP
+#define AVHTTP_DETAIL_CONTENT_DECODER_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstring>
+#include <algorithm>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/algorithm/string.hpp>
+
+extern "C"
+{
+#include "zlib.h"
+#ifndef z_const
+# define z_const
+#endif
+}
+
+#ifdef AVHTTP_ENABLE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#include "avhttp/detail/buffer_pool.hpp"
+
+namespace avhttp {
+namespace detail {
+
+// 解压http body的Content-Encoding, 支持gzip, deflate, 定义了AVHTTP_ENABLE_BROTLI
+// 时还支持br.
+// 压缩数据先放到输入缓冲里(prepare/commit), 再用decode解压到用户的缓冲.
+class content_decoder
+{
+public:
+	enum coding_type
+	{
+		identity,
+		gzip,
+		deflate,
+		brotli
+	};
+
+	content_decoder()
+		: m_type(identity)
+		, m_zlib_inited(false)
+#ifdef AVHTTP_ENABLE_BROTLI
+		, m_brotli(NULL)
+#endif
+		, m_sniffing(false)
+		, m_finished(false)
+		, m_output_full(false)
+		, m_buffer_size(0)
+		, m_in_pos(0)
+		, m_in_size(0)
+	{
+		std::memset(&m_zstream, 0, sizeof(z_stream));
+	}
+
+	~content_decoder()
+	{
+		end();
+	}
+
+	// 由Content-Encoding得到压缩类型, 不支持的类型返回identity, 不解压.
+	static coding_type parse(const std::string& content_encoding)
+	{
+		std::string encoding = boost::to_lower_copy(boost::trim_copy(content_encoding));
+		if (encoding == "gzip" || encoding == "x-gzip")
+			return gzip;
+		if (encoding == "deflate")
+			return deflate;
+#ifdef AVHTTP_ENABLE_BROTLI
+		if (encoding == "br")
+			return brotli;
+#endif
+		return identity;
+	}
+
+	// 请求时默认的Accept-Encoding, 即所有能解压的类型.
+	static const char* accept_encoding()
+	{
+#ifdef AVHTTP_ENABLE_BROTLI
+		return "gzip, deflate, br";
+#else
+		return "gzip, deflate";
+#endif
+	}
+
+	// 开始解压一个新的body, buf用作压缩数据的输入缓冲, 只用前size个字节.
+	// 缓冲池借出的缓冲可能比要的大, 每次读取的大小还是要按用户设置的来.
+	bool start(coding_type type, buffer_pool::buffer_ptr buf, std::size_t size,
+		boost::system::error_code& ec)
+	{
+		end();
+		m_buffer = buf;
+		m_buffer_size = (std::min)(size, buf->size());
+
+		switch (type)
+		{
+		case gzip:
+			// 32+15表示自动识别gzip和zlib头.
+			if (inflateInit2(&m_zstream, 32 + 15) != Z_OK)
+			{
+				ec = boost::asio::error::operation_not_supported;
+				return false;
+			}
+			m_zlib_inited = true;
+			break;
+		case deflate:
+			// 很多服务器的deflate其实是没有zlib头的raw deflate, 要看到前两个字节才能决定.
+			m_sniffing = true;
+			break;
+#ifdef AVHTTP_ENABLE_BROTLI
+		case brotli:
+			m_brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+			if (!m_brotli)
+			{
+				ec = boost::asio::error::no_memory;
+				return false;
+			}
+			break;
+#endif
+		default:
+			m_buffer.reset();
+			return true;
+		}
+
+		m_type = type;
+		return true;
+	}
+
+	// 结束解压, 返回输入缓冲以便放回缓冲池.
+	buffer_pool::buffer_ptr end()
+	{
+		if (m_zlib_inited)
+			inflateEnd(&m_zstream);
+		std::memset(&m_zstream, 0, sizeof(z_stream));
+		m_zlib_inited = false;
+#ifdef AVHTTP_ENABLE_BROTLI
+		if (m_brotli)
+			BrotliDecoderDestroyInstance(m_brotli);
+		m_brotli = NULL;
+#endif
+		m_type = identity;
+		m_sniffing = false;
+		m_finished = false;
+		m_output_full = false;
+		m_in_pos = m_in_size = 0;
+		m_buffer_size = 0;
+
+		buffer_pool::buffer_ptr buf = m_buffer;
+		m_buffer.reset();
+		return buf;
+	}
+
+	bool active() const
+	{
+		return m_type != identity;
+	}
+
+	// 是否已经解压到了压缩流的结尾.
+	bool finished() const
+	{
+		return m_finished;
+	}
+
+	std::size_t avail_in() const
+	{
+		return m_in_size - m_in_pos;
+	}
+
+	// 不需要更多输入就可能解压出数据.
+	// 上次把输出缓冲写满了的话, 解压器里可能还有没输出的数据.
+	bool pending() const
+	{
+		if (m_finished)
+			return false;
+		return m_output_full || avail_in() >= (m_sniffing ? 2u : 1u);
+	}
+
+	// 返回输入缓冲中可以写入压缩数据的部分, 未解压的数据会先移到缓冲开头.
+	boost::asio::mutable_buffer prepare()
+	{
+		if (!m_buffer)
+			return boost::asio::mutable_buffer();
+
+		if (m_in_pos != 0)
+		{
+			std::memmove(&(*m_buffer)[0], &(*m_buffer)[m_in_pos], avail_in());
+			m_in_size -= m_in_pos;
+			m_in_pos = 0;
+		}
+
+		return boost::asio::buffer(&(*m_buffer)[m_in_size], m_buffer_size - m_in_size);
+	}
+
+	// 提交写入prepare返回的缓冲中的n个字节.
+	void commit(std::size_t n)
+	{
+		m_in_size += n;
+	}
+
+	// 解压数据到out, 返回解压出的字节数.
+	// 返回0并且没有错误表示需要更多的输入, 或者已经解压结束.
+	std::size_t decode(char* out, std::size_t size, boost::system::error_code& ec)
+	{
+		ec = boost::system::error_code();
+
+		if (size == 0 || !active())
+			return 0;
+
+		// 压缩流结束后的数据没有意义, 直接丢掉.
+		if (m_finished)
+		{
+			m_in_pos = m_in_size = 0;
+			return 0;
+		}
+
+		if (m_sniffing)
+		{
+			if (avail_in() < 2)
+				return 0;
+
+			// zlib头: CM为8, 并且前两个字节组成的数是31的倍数.
+			unsigned char cmf = (*m_buffer)[m_in_pos];
+			unsigned char flg = (*m_buffer)[m_in_pos + 1];
+			bool zlib_header = (cmf & 0x0f) == 8 && ((cmf << 8) | flg) % 31 == 0;
+
+			if (inflateInit2(&m_zstream, zlib_header ? 15 : -15) != Z_OK)
+			{
+				ec = boost::asio::error::operation_not_supported;
+				return 0;
+			}
+			m_zlib_inited = true;
+			m_sniffing = false;
+		}
+
+		std::size_t input = avail_in();
+		std::size_t bytes_transferred = 0;
+
+#ifdef AVHTTP_ENABLE_BROTLI
+		if (m_type == brotli)
+		{
+			const uint8_t* next_in = reinterpret_cast<const uint8_t*>(input ? &(*m_buffer)[m_in_pos] : NULL);
+			uint8_t* next_out = reinterpret_cast<uint8_t*>(out);
+			std::size_t avail_out = size;
+
+			BrotliDecoderResult ret = BrotliDecoderDecompressStream(
+				m_brotli, &input, &next_in, &avail_out, &next_out, NULL);
+			if (ret == BROTLI_DECODER_RESULT_ERROR)
+			{
+				ec = boost::asio::error::operation_not_supported;
+				return 0;
+			}
+
+			m_in_pos = m_in_size - input;
+			bytes_transferred = size - avail_out;
+			m_finished = (ret == BROTLI_DECODER_RESULT_SUCCESS);
+			m_output_full = (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+			return bytes_transferred;
+		}
+#endif
+
+		// zlib的avail_in/avail_out是uInt, 超大的缓冲分几次解压.
+		uInt avail_out = static_cast<uInt>((std::min)(size, std::size_t(0x40000000)));
+		m_zstream.next_in = (z_const Bytef*)(input ? &(*m_buffer)[m_in_pos] : NULL);
+		m_zstream.avail_in = static_cast<uInt>((std::min)(input, std::size_t(0x40000000)));
+		m_zstream.next_out = reinterpret_cast<Bytef*>(out);
+		m_zstream.avail_out = avail_out;
+
+		int ret = inflate(&m_zstream, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		{
+			ec = boost::asio::error::operation_not_supported;
+			return 0;
+		}
+
+		m_in_pos += (std::min)(input, std::size_t(0x40000000)) - m_zstream.avail_in;
+		bytes_transferred = avail_out - m_zstream.avail_out;
+		m_finished = (ret == Z_STREAM_END);
+		m_output_full = !m_finished && m_zstream.avail_out == 0;
+		return bytes_transferred;
+	}
+
+private:
+	coding_type m_type;
+
+	z_stream m_zstream;
+	bool m_zlib_inited;
+
+#ifdef AVHTTP_ENABLE_BROTLI
+	BrotliDecoderState* m_brotli;
+#endif
+
+	// deflate还没有确定是否带zlib头.
+	bool m_sniffing;
+
+	bool m_finished;
+	bool m_output_full;
+
+	// 输入缓冲, [m_in_pos, m_in_size)是还没解压的数据.
+	buffer_pool::buffer_ptr m_buffer;
+	// 输入缓冲可以用的大小, 即start时要求的大小.
+	std::size_t m_buffer_size;
+	std::size_t m_in_pos;
+	std::size_t m_in_size;
+};
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_DETAIL_CONTENT_DECODER_HPP
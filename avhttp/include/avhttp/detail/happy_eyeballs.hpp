@@ -0,0 +1,385 @@
+//
+// happy_eyeballs.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DETAIL_HAPPY_EYEBALLS_HPP
+#define AVHTTP_DETAIL_HAPPY_EYEBALLS_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+// 前一个连接这么久还没有结果, 就同时开始连下一个地址 (RFC 8305 建议250毫秒).
+#ifndef AVHTTP_CONNECT_ATTEMPT_DELAY
+#define AVHTTP_CONNECT_ATTEMPT_DELAY 250
+#endif
+
+namespace avhttp {
+namespace detail {
+
+// 按RFC 8305, 保持getaddrinfo给出的第一个地址族在前, 然后ipv6和ipv4交替排列,
+// 这样某一种地址整个不通的时候, 第二次尝试就换成另一种地址.
+inline std::vector<boost::asio::ip::tcp::endpoint> interleave_address_families(
+	const std::vector<boost::asio::ip::tcp::endpoint>& endpoints)
+{
+	typedef boost::asio::ip::tcp::endpoint endpoint;
+
+	if (endpoints.empty())
+		return endpoints;
+
+	bool first_v6 = endpoints.front().address().is_v6();
+	std::vector<endpoint> primary, secondary, result;
+
+	for (std::size_t i = 0; i < endpoints.size(); i++)
+	{
+		if (endpoints[i].address().is_v6() == first_v6)
+			primary.push_back(endpoints[i]);
+		else
+			secondary.push_back(endpoints[i]);
+	}
+
+	for (std::size_t i = 0; i < primary.size() || i < secondary.size(); i++)
+	{
+		if (i < primary.size())
+			result.push_back(primary[i]);
+		if (i < secondary.size())
+			result.push_back(secondary[i]);
+	}
+
+	return result;
+}
+
+///正在进行的async_connect_racing.
+// async_connect_racing返回它的weak_ptr, 连接完成之前可以用来取消.
+class racing_connect
+{
+public:
+	virtual ~racing_connect() {}
+
+	///关闭所有正在进行的连接尝试, handler以operation_aborted回调.
+	// 已经回调过handler的时候什么也不做.
+	virtual void cancel() = 0;
+};
+
+#if defined(BOOST_ASIO_HAS_MOVE)
+
+// 同时对多个地址发起连接, 最先连上的socket移到用户的socket里, 其它的关闭.
+// 连接的过程中用户的socket是打开的, 和普通的async_connect一样, 用户关闭了它
+// (比如http_stream::close)就放弃所有的尝试, 不会把连上的socket放进一个已经关闭的socket里.
+template <typename Handler>
+class happy_eyeballs_op
+	: public racing_connect
+	, public boost::enable_shared_from_this<happy_eyeballs_op<Handler> >
+{
+	typedef boost::asio::ip::tcp tcp;
+
+public:
+	happy_eyeballs_op(tcp::socket& socket,
+		const std::vector<tcp::endpoint>& endpoints, Handler handler)
+		: m_socket(socket)
+		, m_endpoints(interleave_address_families(endpoints))
+		, m_next(0)
+		, m_pending(0)
+		, m_done(false)
+		, m_aborted(false)
+		, m_timer(socket.get_io_service())
+		, m_handler(handler)
+	{}
+
+	void start()
+	{
+		boost::system::error_code ec = boost::asio::error::host_not_found;
+
+		if (!m_endpoints.empty())
+		{
+			m_socket.close(ec);
+			m_socket.open(m_endpoints.front().protocol(), ec);
+		}
+
+		if (ec)
+		{
+			m_done = true;
+			m_socket.get_io_service().post(boost::asio::detail::bind_handler(m_handler, ec));
+			return;
+		}
+
+		m_watched = m_socket.native_handle();
+		start_next();
+	}
+
+	// 只关闭临时的socket, 用户的socket由调用者处理.
+	void cancel()
+	{
+		if (m_done || m_aborted)
+			return;
+
+		abort();
+	}
+
+private:
+	void start_next()
+	{
+		boost::shared_ptr<tcp::socket> sock(new tcp::socket(m_socket.get_io_service()));
+		m_attempts.push_back(sock);
+		m_pending++;
+
+		sock->async_connect(m_endpoints[m_next++],
+			boost::bind(&happy_eyeballs_op::handle_connect,
+				this->shared_from_this(), sock,
+				boost::asio::placeholders::error
+			)
+		);
+
+		start_timer();
+	}
+
+	// 还有地址的时候到时间开始下一个, 没有了也继续定时检查用户的socket是不是被关闭了.
+	void start_timer()
+	{
+		m_timer.expires_from_now(boost::posix_time::milliseconds(AVHTTP_CONNECT_ATTEMPT_DELAY));
+		m_timer.async_wait(
+			boost::bind(&happy_eyeballs_op::handle_timer,
+				this->shared_from_this(), m_next,
+				boost::asio::placeholders::error
+			)
+		);
+	}
+
+	// next用来忽略已经被handle_connect抢先处理了的定时器.
+	void handle_timer(std::size_t next, const boost::system::error_code& ec)
+	{
+		if (ec || m_done || m_aborted || next != m_next)
+			return;
+
+		if (target_closed())
+		{
+			abort();
+			return;
+		}
+
+		if (m_next < m_endpoints.size())
+			start_next();
+		else
+			start_timer();
+	}
+
+	// 用户关闭了socket, 或者关闭以后又打开了一个新的.
+	bool target_closed() const
+	{
+		return !m_socket.is_open() || m_socket.native_handle() != m_watched;
+	}
+
+	// 关闭所有的尝试, 最后一个handle_connect回调用户.
+	void abort()
+	{
+		boost::system::error_code ignore_ec;
+
+		m_aborted = true;
+		m_timer.cancel(ignore_ec);
+
+		for (std::size_t i = 0; i < m_attempts.size(); i++)
+			m_attempts[i]->close(ignore_ec);
+	}
+
+	void handle_connect(boost::shared_ptr<tcp::socket> sock, const boost::system::error_code& ec)
+	{
+		m_pending--;
+
+		if (m_done)
+			return;
+
+		boost::system::error_code ignore_ec;
+
+		if (!m_aborted && target_closed())
+			abort();
+
+		if (m_aborted)
+		{
+			sock->close(ignore_ec);
+			if (m_pending == 0)
+			{
+				m_done = true;
+				m_handler(boost::asio::error::operation_aborted);
+			}
+			return;
+		}
+
+		if (!ec)
+		{
+			m_done = true;
+			m_timer.cancel(ignore_ec);
+
+			for (std::size_t i = 0; i < m_attempts.size(); i++)
+			{
+				if (m_attempts[i] != sock)
+					m_attempts[i]->close(ignore_ec);
+			}
+
+			m_socket.close(ignore_ec);
+			m_socket = std::move(*sock);
+			m_handler(ec);
+			return;
+		}
+
+		m_last_error = ec;
+		sock->close(ignore_ec);
+
+		// 连接失败不用等定时器, 马上试下一个地址.
+		if (m_next < m_endpoints.size())
+		{
+			m_timer.cancel(ignore_ec);
+			start_next();
+			return;
+		}
+
+		// 都失败了, 用户的socket和连接失败的时候一样是关闭的.
+		if (m_pending == 0)
+		{
+			m_done = true;
+			m_timer.cancel(ignore_ec);
+			m_socket.close(ignore_ec);
+			m_handler(m_last_error);
+		}
+	}
+
+private:
+	tcp::socket& m_socket;
+	tcp::socket::native_handle_type m_watched;
+	std::vector<tcp::endpoint> m_endpoints;
+	std::size_t m_next;
+	int m_pending;
+	bool m_done;
+	bool m_aborted;
+	boost::asio::deadline_timer m_timer;
+	std::vector<boost::shared_ptr<tcp::socket> > m_attempts;
+	boost::system::error_code m_last_error;
+	Handler m_handler;
+};
+
+#else // !defined(BOOST_ASIO_HAS_MOVE)
+
+// 不能移动socket的时候, 只能在用户的socket上按顺序一个一个地址连接.
+// 用户关闭socket的时候正在进行的连接以operation_aborted返回, 不再试后面的地址.
+template <typename Handler>
+class happy_eyeballs_op
+	: public racing_connect
+	, public boost::enable_shared_from_this<happy_eyeballs_op<Handler> >
+{
+	typedef boost::asio::ip::tcp tcp;
+
+public:
+	happy_eyeballs_op(tcp::socket& socket,
+		const std::vector<tcp::endpoint>& endpoints, Handler handler)
+		: m_socket(socket)
+		, m_endpoints(interleave_address_families(endpoints))
+		, m_next(0)
+		, m_done(false)
+		, m_aborted(false)
+		, m_handler(handler)
+	{}
+
+	void start()
+	{
+		handle_connect(boost::asio::error::host_not_found);
+	}
+
+	// 连接就在用户的socket上, 只能关闭它.
+	void cancel()
+	{
+		if (m_done || m_aborted)
+			return;
+
+		boost::system::error_code ignore_ec;
+		m_aborted = true;
+		m_socket.close(ignore_ec);
+	}
+
+private:
+	void handle_connect(const boost::system::error_code& ec)
+	{
+		if (m_next > 0 && (m_aborted || ec == boost::asio::error::operation_aborted))
+		{
+			m_done = true;
+			m_handler(boost::asio::error::operation_aborted);
+			return;
+		}
+
+		if (!ec && m_next > 0)
+		{
+			m_done = true;
+			m_handler(ec);
+			return;
+		}
+
+		if (m_next == m_endpoints.size())
+		{
+			m_done = true;
+			m_socket.get_io_service().post(boost::asio::detail::bind_handler(m_handler, ec));
+			return;
+		}
+
+		boost::system::error_code ignore_ec;
+		m_socket.close(ignore_ec);
+		m_socket.async_connect(m_endpoints[m_next++],
+			boost::bind(&happy_eyeballs_op::handle_connect,
+				this->shared_from_this(),
+				boost::asio::placeholders::error
+			)
+		);
+	}
+
+private:
+	tcp::socket& m_socket;
+	std::vector<tcp::endpoint> m_endpoints;
+	std::size_t m_next;
+	bool m_done;
+	bool m_aborted;
+	Handler m_handler;
+};
+
+#endif // defined(BOOST_ASIO_HAS_MOVE)
+
+///按happy eyeballs的方式连接一组地址.
+// 第一个地址AVHTTP_CONNECT_ATTEMPT_DELAY毫秒内没有连上就同时连下一个,
+// 一个地址连接失败马上开始下一个, 最先连上的那个放到socket里.
+// 连接过程中socket是打开的, 关闭socket或者调用返回值的cancel都会放弃连接,
+// 关闭socket以后最多AVHTTP_CONNECT_ATTEMPT_DELAY毫秒才能发现, cancel马上关闭所有的尝试.
+// @param socket 一个tcp socket, 操作完成前必须保持有效.
+// @param endpoints 要连接的地址, 一般是dns_cache解析的结果.
+// @param handler 连接完成或者所有地址都失败后回调, 满足以下条件:
+// @begin code
+//  void handler(
+//    const boost::system::error_code& ec	// 所有地址都失败时为最后一个错误,
+//                                          // 被取消时为operation_aborted.
+//  );
+// @end code
+// @返回可以用来取消连接的racing_connect, 完成以后cancel什么也不做.
+template <typename Handler>
+boost::weak_ptr<racing_connect> async_connect_racing(boost::asio::ip::tcp::socket& socket,
+	const std::vector<boost::asio::ip::tcp::endpoint>& endpoints, Handler handler)
+{
+	boost::shared_ptr<happy_eyeballs_op<Handler> > op(
+		new happy_eyeballs_op<Handler>(socket, endpoints, handler));
+	op->start();
+	return op;
+}
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_DETAIL_HAPPY_EYEBALLS_HPP
@@ -0,0 +1,37 @@
+//
+// service_id.hpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DETAIL_SERVICE_ID_HPP
+#define AVHTTP_DETAIL_SERVICE_ID_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <boost/asio/io_service.hpp>
+
+namespace avhttp {
+namespace detail {
+
+// io_service::service要求有一个静态的id成员, 放在模板里以便只用头文件.
+template <typename Service>
+class service_id
+{
+public:
+	static boost::asio::io_service::id id;
+};
+
+template <typename Service>
+boost::asio::io_service::id service_id<Service>::id;
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_DETAIL_SERVICE_ID_HPP
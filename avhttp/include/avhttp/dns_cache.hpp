@@ -0,0 +1,312 @@
+//
+// dns_cache.hpp
+// ~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DNS_CACHE_HPP
+#define AVHTTP_DNS_CACHE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <map>
+#include <vector>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "avhttp/detail/service_id.hpp"
+
+// 解析成功的结果缓存的秒数.
+// getaddrinfo不返回记录的TTL, 所以这里用一个固定的值.
+#ifndef AVHTTP_DNS_CACHE_TTL
+#define AVHTTP_DNS_CACHE_TTL 300
+#endif
+
+// 解析失败的结果缓存的秒数, 避免断网重连的时候反复查询.
+#ifndef AVHTTP_DNS_NEGATIVE_TTL
+#define AVHTTP_DNS_NEGATIVE_TTL 10
+#endif
+
+// 最多缓存的主机数, 超过以后清理过期的记录.
+#ifndef AVHTTP_DNS_CACHE_SIZE
+#define AVHTTP_DNS_CACHE_SIZE 256
+#endif
+
+namespace avhttp {
+
+///带超时的异步DNS缓存.
+// 每个io_service一个, 通过boost::asio::use_service取得, http_stream和avproxy
+// 连接之前都从这里解析主机名.
+// 同一个主机同时只有一个查询在进行, 其它请求等这个查询完成后一起回调.
+// 解析失败的结果也会缓存一小段时间, 如果这时还有没过期太久的成功结果,
+// 就先用旧的结果, 网络抖动的时候不会让所有连接都失败.
+// @备注: 只能在io_service的线程里使用.
+// @begin example
+//  void handler(const boost::system::error_code& ec,
+//      avhttp::dns_cache::endpoints_ptr endpoints)
+//  {
+//      // endpoints在ec为0时至少有一个地址.
+//  }
+//  ...
+//  boost::asio::use_service<avhttp::dns_cache>(io).async_resolve(
+//      "hq.sinajs.cn", "80", handler);
+// @end example
+class dns_cache
+	: public boost::asio::io_service::service
+	, public detail::service_id<dns_cache>
+{
+	typedef boost::asio::ip::tcp tcp;
+
+public:
+	typedef std::vector<tcp::endpoint> endpoint_list;
+	typedef boost::shared_ptr<const endpoint_list> endpoints_ptr;
+	typedef boost::function<void (const boost::system::error_code&, endpoints_ptr)> resolve_handler;
+
+private:
+	struct entry
+	{
+		entry()
+			: expires(boost::posix_time::neg_infin)
+			, resolved(boost::posix_time::neg_infin)
+			, resolving(false)
+		{}
+
+		// 最后一次成功的结果, 失败以后也保留着.
+		endpoints_ptr endpoints;
+		boost::posix_time::ptime expires;
+
+		// 最后一次成功解析的时间, 失败的查询会推后expires, 旧结果能用多久要按这个算.
+		boost::posix_time::ptime resolved;
+
+		// 最后一次查询的错误, 在expires之前直接返回这个错误.
+		boost::system::error_code ec;
+
+		bool resolving;
+		std::vector<resolve_handler> waiters;
+	};
+
+	typedef std::map<std::string, entry> entry_map;
+
+public:
+	explicit dns_cache(boost::asio::io_service& io)
+		: boost::asio::io_service::service(io)
+		, m_io_service(io)
+		, m_resolver(io)
+		, m_ttl(boost::posix_time::seconds(AVHTTP_DNS_CACHE_TTL))
+		, m_negative_ttl(boost::posix_time::seconds(AVHTTP_DNS_NEGATIVE_TTL))
+	{}
+
+	///设置解析成功的结果的缓存时间.
+	void ttl(boost::posix_time::time_duration t)
+	{
+		m_ttl = t;
+	}
+
+	///设置解析失败的结果的缓存时间.
+	void negative_ttl(boost::posix_time::time_duration t)
+	{
+		m_negative_ttl = t;
+	}
+
+	///清空缓存, 正在进行的查询不受影响.
+	void clear()
+	{
+		for (entry_map::iterator i = m_entries.begin(); i != m_entries.end();)
+		{
+			if (i->second.resolving)
+			{
+				i->second.expires = boost::posix_time::neg_infin;
+				++i;
+			}
+			else
+			{
+				m_entries.erase(i++);
+			}
+		}
+	}
+
+	///异步解析主机名.
+	// @param host 主机名或者ip地址.
+	// @param port 端口或者服务名.
+	// @param handler 解析完成后回调, 满足以下条件:
+	// @begin code
+	//  void handler(
+	//    const boost::system::error_code& ec,		// 用于返回操作状态.
+	//    avhttp::dns_cache::endpoints_ptr endpoints	// 解析到的地址, 出错时为空.
+	//  );
+	// @end code
+	// 和asio的异步操作一样, handler不会在async_resolve里面直接调用.
+	void async_resolve(const std::string& host, const std::string& port, resolve_handler handler)
+	{
+		boost::system::error_code ec;
+
+		// ip地址不需要查询, 也不需要缓存.
+		boost::asio::ip::address addr = boost::asio::ip::address::from_string(host, ec);
+		if (!ec)
+		{
+			unsigned short port_number = 0;
+			if (parse_port(port, port_number))
+			{
+				boost::shared_ptr<endpoint_list> endpoints(new endpoint_list);
+				endpoints->push_back(tcp::endpoint(addr, port_number));
+				m_io_service.post(boost::bind(handler, boost::system::error_code(), endpoints_ptr(endpoints)));
+				return;
+			}
+		}
+
+		std::string key = host + ":" + port;
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+		entry_map::iterator i = m_entries.find(key);
+		if (i == m_entries.end())
+		{
+			if (m_entries.size() >= AVHTTP_DNS_CACHE_SIZE)
+				purge(now);
+			i = m_entries.insert(std::make_pair(key, entry())).first;
+		}
+
+		entry& e = i->second;
+
+		if (e.resolving)
+		{
+			e.waiters.push_back(handler);
+			return;
+		}
+
+		if (now < e.expires)
+		{
+			if (e.ec)
+				m_io_service.post(boost::bind(handler, e.ec, endpoints_ptr()));
+			else
+				m_io_service.post(boost::bind(handler, boost::system::error_code(), e.endpoints));
+			return;
+		}
+
+		e.resolving = true;
+		e.waiters.push_back(handler);
+
+		tcp::resolver::query query(host, port);
+		m_resolver.async_resolve(query,
+			boost::bind(&dns_cache::handle_resolve, this, key,
+				boost::asio::placeholders::error,
+				boost::asio::placeholders::iterator
+			)
+		);
+	}
+
+private:
+
+	void shutdown_service()
+	{
+		m_entries.clear();
+	}
+
+	static bool parse_port(const std::string& port, unsigned short& out)
+	{
+		if (port.empty() || port.size() > 5)
+			return false;
+
+		unsigned long n = 0;
+		for (std::size_t i = 0; i < port.size(); i++)
+		{
+			if (port[i] < '0' || port[i] > '9')
+				return false;
+			n = n * 10 + (port[i] - '0');
+		}
+
+		if (n > 65535)
+			return false;
+
+		out = static_cast<unsigned short>(n);
+		return true;
+	}
+
+	// 删掉过期并且没有在查询的记录.
+	void purge(boost::posix_time::ptime now)
+	{
+		for (entry_map::iterator i = m_entries.begin(); i != m_entries.end();)
+		{
+			if (!i->second.resolving && i->second.expires <= now)
+				m_entries.erase(i++);
+			else
+				++i;
+		}
+	}
+
+	void handle_resolve(const std::string& key,
+		const boost::system::error_code& err, tcp::resolver::iterator iter)
+	{
+		entry_map::iterator i = m_entries.find(key);
+		if (i == m_entries.end())
+			return;
+
+		entry& e = i->second;
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		boost::posix_time::ptime stale_until = e.resolved + m_ttl + m_ttl;
+
+		boost::system::error_code ec = err;
+		if (!ec && iter == tcp::resolver::iterator())
+			ec = boost::asio::error::host_not_found;
+
+		if (!ec)
+		{
+			boost::shared_ptr<endpoint_list> endpoints(new endpoint_list);
+			for (; iter != tcp::resolver::iterator(); ++iter)
+				endpoints->push_back(iter->endpoint());
+
+			e.endpoints = endpoints;
+			e.ec = boost::system::error_code();
+			e.expires = now + m_ttl;
+			e.resolved = now;
+		}
+		else if (ec != boost::asio::error::operation_aborted)
+		{
+			e.expires = now + m_negative_ttl;
+
+			if (e.endpoints && now < stale_until)
+			{
+				// 上次成功的结果过期不久, 比直接失败好, 先继续用着.
+				ec = boost::system::error_code();
+			}
+			else
+			{
+				e.ec = ec;
+				e.endpoints.reset();
+			}
+		}
+
+		e.resolving = false;
+
+		std::vector<resolve_handler> waiters;
+		waiters.swap(e.waiters);
+
+		endpoints_ptr endpoints;
+		if (!ec)
+			endpoints = e.endpoints;
+
+		for (std::size_t n = 0; n < waiters.size(); n++)
+			waiters[n](ec, endpoints);
+	}
+
+private:
+	boost::asio::io_service& m_io_service;
+	tcp::resolver m_resolver;
+	entry_map m_entries;
+	boost::posix_time::time_duration m_ttl;
+	boost::posix_time::time_duration m_negative_ttl;
+};
+
+} // namespace avhttp
+
+#endif // AVHTTP_DNS_CACHE_HPP
@@ -32,17 +32,14 @@
 #include "avhttp/detail/ssl_stream.hpp"
 #endif
 #ifdef AVHTTP_ENABLE_ZLIB
-extern "C"
-{
-#include "zlib.h"
-#ifndef z_const
-# define z_const
-#endif
-}
+#include "avhttp/detail/content_decoder.hpp"
 #endif
 
 #include "avhttp/detail/socket_type.hpp"
 #include "avhttp/detail/utf8.hpp"
+#include "avhttp/connection_pool.hpp"
+#include "avhttp/dns_cache.hpp"
+#include "avhttp/detail/happy_eyeballs.hpp"
 
 
 namespace avhttp {
@@ -566,6 +563,19 @@ public:
 	// @param filename指定的证书文件名.
 	AVHTTP_DECL void load_verify_file(const std::string& filename);
 
+	///设置是否使用io_service上的keep-alive连接池.
+	// @param enable 默认为true, 这时没有代理的http请求默认发送Connection: keep-alive,
+	// async_open优先复用池中到同一主机的空闲连接, 读完响应的连接在close或析构时放回池中.
+	// 如果用户自己指定了Connection: close, 则连接不会放回池中.
+	AVHTTP_DECL void use_connection_pool(bool enable);
+
+	///设置解压缓冲的大小.
+	// @param size 每次从socket读取并交给解压器的压缩数据的最大字节数, 默认为
+	// AVHTTP_DECOMPRESS_BUFFER_SIZE, 最小为1024. 解压缓冲在响应开始时从io_service
+	// 上的缓冲池中取得, 响应结束后放回.
+	// @备注: 只在定义了AVHTTP_ENABLE_ZLIB时有作用.
+	AVHTTP_DECL void decompress_buffer_size(std::size_t size);
+
 
 protected:
 
@@ -579,15 +589,48 @@ protected:
 
 	template <typename Handler>
 	void handle_resolve(const boost::system::error_code& err,
-		tcp::resolver::iterator endpoint_iterator, Handler handler);
+		dns_cache::endpoints_ptr endpoints, Handler handler);
 
+	// index为endpoints中正在连接的地址, happy eyeballs连接时为endpoints->size().
 	template <typename Handler>
-	void handle_connect(Handler handler,
-		tcp::resolver::iterator endpoint_iterator, const boost::system::error_code& err);
+	void handle_connect(Handler handler, dns_cache::endpoints_ptr endpoints,
+		std::size_t index, const boost::system::error_code& err);
 
 	template <typename Handler>
 	void handle_request(Handler handler, const boost::system::error_code& err);
 
+	// 复用的连接可能已经被服务器关闭, 这时重新建立连接再请求一次.
+	template <typename Handler>
+	void handle_pooled_open(Handler handler, const boost::system::error_code& err);
+
+	// 关闭还在进行的happy eyeballs连接, handler以operation_aborted回调.
+	AVHTTP_DECL void cancel_racing_connect();
+
+	// 当前请求是否可以使用连接池.
+	AVHTTP_DECL bool pool_enabled() const;
+
+	// 连接池中区分连接的key, 协议://主机:端口.
+	AVHTTP_DECL std::string pool_key() const;
+
+	// 如果当前响应已经读完并且连接可以保持, 把连接放回连接池.
+	AVHTTP_DECL void release_connection();
+
+#ifdef AVHTTP_ENABLE_ZLIB
+	// 根据Content-Encoding初始化解压器, 并从缓冲池取得解压缓冲.
+	AVHTTP_DECL void init_decompress(boost::system::error_code& ec);
+
+	// 释放解压器, 解压缓冲放回缓冲池.
+	AVHTTP_DECL void end_decompress();
+
+	// 读取压缩数据到解压缓冲, 不超过当前chunk或者body的剩余长度.
+	AVHTTP_DECL std::size_t fill_decompress_buffer(boost::system::error_code& ec);
+
+	// 解压数据到用户的缓冲, 解压缓冲空了时只用m_response中的数据补充.
+	template <typename MutableBufferSequence>
+	std::size_t decompress_some(const MutableBufferSequence& buffers,
+		boost::system::error_code& ec);
+#endif
+
 	template <typename Handler>
 	void handle_status(Handler handler, const boost::system::error_code& err);
 
@@ -766,6 +809,18 @@ private:
 	// 获得connection选项, 同时受m_response_opts影响.
 	bool m_keep_alive;
 
+	// 是否使用连接池.
+	bool m_use_pool;
+
+	// 当前连接是否从连接池中取得.
+	bool m_pooled;
+
+	// 复用连接失败后重新连接时, 不再从连接池中取连接.
+	bool m_skip_pool;
+
+	// 正在同时连接多个地址时, close用它关闭所有的尝试.
+	boost::weak_ptr<detail::racing_connect> m_racing_connect;
+
 	// http返回状态码.
 	int m_status_code;
 
@@ -796,19 +851,13 @@ private:
 	boost::asio::streambuf m_response;
 
 #ifdef AVHTTP_ENABLE_ZLIB
-	// zlib支持.
-	z_stream m_stream;
-
-	// 解压缓冲.
-	char m_zlib_buffer[1024];
-
-	// 输入的字节数.
-	std::size_t m_zlib_buffer_size;
-
-	// 是否使用gz.
-	bool m_is_gzip;
+	// 解压gzip/deflate/br编码的body.
+	detail::content_decoder m_decoder;
 #endif
 
+	// 解压缓冲的大小.
+	std::size_t m_decompress_buffer_size;
+
 	// 是否使用chunked编码.
 	bool m_is_chunked;
 
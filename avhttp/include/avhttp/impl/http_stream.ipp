@@ -29,29 +29,28 @@ http_stream::http_stream(boost::asio::io_service& io)
 	, m_nossl_socket(io)
 	, m_check_certificate(true)
 	, m_keep_alive(true)
+	, m_use_pool(true)
+	, m_pooled(false)
+	, m_skip_pool(false)
 	, m_status_code(-1)
 	, m_redirects(0)
 	, m_max_redirects(AVHTTP_MAX_REDIRECTS)
 	, m_content_length(0)
 	, m_body_size(0)
-#ifdef AVHTTP_ENABLE_ZLIB
-	, m_is_gzip(false)
-#endif
+	, m_decompress_buffer_size(AVHTTP_DECOMPRESS_BUFFER_SIZE)
 	, m_is_chunked(false)
 	, m_skip_crlf(true)
 	, m_chunked_size(0)
 {
-#ifdef AVHTTP_ENABLE_ZLIB
-	memset(&m_stream, 0, sizeof(z_stream));
-#endif
 	m_proxy.type = proxy_settings::none;
 }
 
 http_stream::~http_stream()
 {
+	release_connection();
+
 #ifdef AVHTTP_ENABLE_ZLIB
-	if (m_stream.zalloc)
-		inflateEnd(&m_stream);
+	end_decompress();
 #endif
 }
 
@@ -365,6 +364,12 @@ void http_stream::async_open(const url& u, BOOST_ASIO_MOVE_ARG(Handler) handler)
 
 	boost::system::error_code ec;
 
+	// 上一个请求的连接如果还能用, 先放回连接池.
+	release_connection();
+	bool skip_pool = m_skip_pool;
+	m_skip_pool = false;
+	m_pooled = false;
+
 	// 保存url相关的信息.
 	if (m_url.to_string() == "")
 	{
@@ -461,6 +466,26 @@ void http_stream::async_open(const url& u, BOOST_ASIO_MOVE_ARG(Handler) handler)
 		return;
 	}
 
+	// 连接池中有到这个主机的空闲连接, 直接发送请求.
+	if (pool_enabled() && !skip_pool)
+	{
+		connection_pool& pool = boost::asio::use_service<connection_pool>(m_io_service);
+		if (pool.checkout(pool_key(), *m_sock.get<nossl_socket>()))
+		{
+			AVHTTP_LOG_DBG << "Reuse pooled connection to \'" << m_url.host() << "\'.";
+			m_pooled = true;
+			typedef boost::function<void (boost::system::error_code)> HandlerWrapper;
+			HandlerWrapper h = handler;
+			async_request(m_request_opts_priv,
+				boost::bind(&http_stream::handle_pooled_open<HandlerWrapper>,
+					this, h,
+					boost::asio::placeholders::error
+				)
+			);
+			return;
+		}
+	}
+
 	// 异步socks代理功能处理.
 	if (m_proxy.type == proxy_settings::socks4 || m_proxy.type == proxy_settings::socks5
 		|| m_proxy.type == proxy_settings::socks5_pw)
@@ -504,17 +529,14 @@ void http_stream::async_open(const url& u, BOOST_ASIO_MOVE_ARG(Handler) handler)
 		port_string << m_url.port();
 	}
 
-	// 构造异步查询HOST.
-	tcp::resolver::query query(host, port_string.str());
-
-	// 开始异步查询HOST信息.
+	// 开始异步查询HOST信息, 同一个io_service上的查询结果会被缓存.
 	typedef boost::function<void (boost::system::error_code)> HandlerWrapper;
 	HandlerWrapper h = handler;
-	m_resolver.async_resolve(query,
+	boost::asio::use_service<dns_cache>(m_io_service).async_resolve(host, port_string.str(),
 		boost::bind(&http_stream::handle_resolve<HandlerWrapper>,
 			this,
 			boost::asio::placeholders::error,
-			boost::asio::placeholders::iterator,
+			_2,
 			h
 		)
 	);
@@ -543,7 +565,7 @@ std::size_t http_stream::read_some(const MutableBufferSequence& buffers,
 		// chunked_size大小为0, 读取下一个块头大小.
 		if (m_chunked_size == 0
 #ifdef AVHTTP_ENABLE_ZLIB
-			&& m_stream.avail_in == 0
+			&& !m_decoder.pending()
 #endif
 			)
 		{
@@ -608,20 +630,9 @@ std::size_t http_stream::read_some(const MutableBufferSequence& buffers,
 			m_skip_crlf = false;
 		}
 
-#ifdef AVHTTP_ENABLE_ZLIB
-		if (m_chunked_size == 0 && m_is_gzip)
-		{
-			if (m_stream.avail_in == 0)
-			{
-				if (!m_keep_alive)
-					ec = boost::asio::error::eof;
-				return 0;
-			}
-		}
-#endif
 		if (m_chunked_size != 0
 #ifdef AVHTTP_ENABLE_ZLIB
-			|| m_stream.avail_in != 0
+			|| m_decoder.pending()
 #endif
 			)	// 开始读取chunked中的数据, 如果是压缩, 则解压到用户接受缓冲.
 		{
@@ -640,61 +651,35 @@ std::size_t http_stream::read_some(const MutableBufferSequence& buffers,
 			}
 
 #ifdef AVHTTP_ENABLE_ZLIB
-			if (!m_is_gzip)	// 如果没有启用gzip, 则直接读取数据后返回.
+			if (!m_decoder.active())	// 如果没有启用gzip, 则直接读取数据后返回.
 #endif
 			{
-				bytes_transferred = read_some_impl(boost::asio::buffer(buffers, max_length), ec);
+				// boost::asio::buffer(buffers, n)对多个缓冲会指向缓冲序列本身, 只读到第一个缓冲.
+				boost::asio::mutable_buffer first(*buffers.begin());
+				bytes_transferred = read_some_impl(boost::asio::buffer(first, max_length), ec);
 				m_chunked_size -= bytes_transferred;
 				return bytes_transferred;
 			}
 #ifdef AVHTTP_ENABLE_ZLIB
 			else					// 否则读取数据到解压缓冲中.
 			{
-				if (m_stream.avail_in == 0)
+				if (!m_decoder.pending())
 				{
-					std::size_t buf_size = (std::min)(m_chunked_size, std::size_t(1024));
-					bytes_transferred = read_some_impl(boost::asio::buffer(m_zlib_buffer, buf_size), ec);
-					m_chunked_size -= bytes_transferred;
-					m_zlib_buffer_size = bytes_transferred;
-					m_stream.avail_in = (uInt)m_zlib_buffer_size;
-					m_stream.next_in = (z_const Bytef *)&m_zlib_buffer[0];
+					fill_decompress_buffer(ec);
+					if (ec)
+					{
+						return 0;
+					}
 				}
 
-				bytes_transferred = 0;
-				std::size_t buffer_size = 0;
-
+				bytes_transferred = decompress_some(buffers, ec);
+				if (ec)
 				{
-					typename MutableBufferSequence::const_iterator iter = buffers.begin();
-					typename MutableBufferSequence::const_iterator end = buffers.end();
-					// 计算得到用户buffer_size总大小.
-					for (; iter != end; ++iter)
-					{
-						boost::asio::mutable_buffer buffer(*iter);
-						m_stream.next_in = (z_const Bytef *)(&m_zlib_buffer[0] + m_zlib_buffer_size - m_stream.avail_in);
-						m_stream.avail_out = boost::asio::buffer_size(buffer);
-						if (m_stream.avail_out == 0)
-						{
-							break; // 如果用户提供的缓冲大小为0, 则直接返回.
-						}
-						buffer_size += m_stream.avail_out;
-						m_stream.next_out = boost::asio::buffer_cast<Bytef*>(buffer);
-						int ret = inflate(&m_stream, Z_SYNC_FLUSH);
-						if (ret < 0)
-						{
-							ec = boost::asio::error::operation_not_supported;
-							return 0;
-						}
-
-						bytes_transferred += (boost::asio::buffer_size(buffer) - m_stream.avail_out);
-						if (bytes_transferred != boost::asio::buffer_size(buffer))
-						{
-							break;
-						}
-					}
+					return 0;
 				}
 
-				// 没有解压出数据, 说明解压缓冲太小, 继续读取数据, 以保证有数据返回.
-				if (buffer_size != 0 && bytes_transferred == 0)
+				// 没有解压出数据, 说明压缩数据不够, 继续读取数据, 以保证有数据返回.
+				if (bytes_transferred == 0 && boost::asio::buffer_size(buffers) != 0)
 				{
 					return read_some(buffers, ec);
 				}
@@ -707,12 +692,8 @@ std::size_t http_stream::read_some(const MutableBufferSequence& buffers,
 		if (m_chunked_size == 0)
 		{
 			m_is_chunked_end = true;
-#ifdef AVHTTP_ENABLE_ZLIB	// 如果遇到chunk结尾, 则释放m_stream, 因为下一个chunked块需要重新初始化.
-			if (m_stream.zalloc)
-			{
-				inflateEnd(&m_stream);
-				m_stream.zalloc = NULL;
-			}
+#ifdef AVHTTP_ENABLE_ZLIB	// 遇到chunk结尾, 释放解压器并归还解压缓冲.
+			end_decompress();
 #endif
 			if (!m_keep_alive)
 			{
@@ -725,60 +706,34 @@ std::size_t http_stream::read_some(const MutableBufferSequence& buffers,
 
 	// 如果没有启用chunked.
 #ifdef AVHTTP_ENABLE_ZLIB
-	if (m_is_gzip && !m_is_chunked)
+	if (m_decoder.active() && !m_is_chunked)
 	{
-		if (m_stream.avail_in == 0)	// 上一块解压完成.
+		if (!m_decoder.pending())	// 上一块解压完成.
 		{
-			if (m_keep_alive)
+			// 压缩流已经结束, 或者body已经读取完整.
+			if (m_decoder.finished()
+				|| (m_content_length != -1 && m_body_size == m_content_length))
 			{
-				if (m_content_length != -1 && m_body_size == m_content_length)
-				{
-					return 0;
-				}
+				if (!m_keep_alive)
+					ec = boost::asio::error::eof;
+				return 0;
 			}
 
-			bytes_transferred = read_some_impl(boost::asio::buffer(m_zlib_buffer, 1024), ec);
-			m_body_size += bytes_transferred;
-			m_zlib_buffer_size = bytes_transferred;
-			m_stream.avail_in = (uInt)m_zlib_buffer_size;
-			m_stream.next_in = (z_const Bytef *)&m_zlib_buffer[0];
+			fill_decompress_buffer(ec);
+			if (ec)
+			{
+				return 0;
+			}
 		}
 
-		bytes_transferred = 0;
-		std::size_t buffer_size = 0;
-
+		bytes_transferred = decompress_some(buffers, ec);
+		if (ec)
 		{
-			typename MutableBufferSequence::const_iterator iter = buffers.begin();
-			typename MutableBufferSequence::const_iterator end = buffers.end();
-			// 计算得到用户buffer_size总大小.
-			for (; iter != end; ++iter)
-			{
-				boost::asio::mutable_buffer buffer(*iter);
-				m_stream.next_in = (z_const Bytef *)(&m_zlib_buffer[0] + m_zlib_buffer_size - m_stream.avail_in);
-				m_stream.avail_out = boost::asio::buffer_size(buffer);
-				if (m_stream.avail_out == 0)
-				{
-					break; // 如果用户提供的缓冲大小为0, 则直接返回.
-				}
-				buffer_size += m_stream.avail_out;
-				m_stream.next_out = boost::asio::buffer_cast<Bytef*>(buffer);
-				int ret = inflate(&m_stream, Z_SYNC_FLUSH);
-				if (ret < 0)
-				{
-					ec = boost::asio::error::operation_not_supported;
-					return 0;
-				}
-
-				bytes_transferred += (boost::asio::buffer_size(buffer) - m_stream.avail_out);
-				if (bytes_transferred != boost::asio::buffer_size(buffer))
-				{
-					break;
-				}
-			}
+			return 0;
 		}
 
-		// 没有解压出数据, 说明解压缓冲太小, 继续读取数据, 以保证有数据返回.
-		if (buffer_size != 0 && bytes_transferred == 0)
+		// 没有解压出数据, 说明压缩数据不够, 继续读取数据, 以保证有数据返回.
+		if (bytes_transferred == 0 && boost::asio::buffer_size(buffers) != 0)
 		{
 			return read_some(buffers, ec);
 		}
@@ -817,7 +772,7 @@ void http_stream::async_read_some(const MutableBufferSequence& buffers, BOOST_AS
 		// 读取下一个chunk头.
 		if (m_chunked_size == 0
 #ifdef AVHTTP_ENABLE_ZLIB
-			&& m_stream.avail_in == 0
+			&& !m_decoder.pending()
 #endif
 			)
 		{
@@ -903,6 +858,26 @@ void http_stream::async_read_some(const MutableBufferSequence& buffers, BOOST_AS
 		}
 		else
 		{
+#ifdef AVHTTP_ENABLE_ZLIB
+			// 解压器或m_response中还有数据, 直接解压给用户, 不需要等socket.
+			if (m_decoder.active() && (m_decoder.pending() || m_response.size() != 0))
+			{
+				std::size_t bytes_transferred = decompress_some(buffers, ec);
+				if (ec || bytes_transferred != 0 || boost::asio::buffer_size(buffers) == 0)
+				{
+					m_io_service.post(
+						boost::asio::detail::bind_handler(handler, ec, bytes_transferred));
+					return;
+				}
+
+				// 当前chunk的数据已经用完, 开始读取下一个chunk.
+				if (m_chunked_size == 0)
+				{
+					async_read_some(buffers, handler);
+					return;
+				}
+			}
+#endif
 			std::size_t max_length = 0;
 
 			// 这里为0是直接读取m_response中的数据, 而不再从socket读取数据, 避免
@@ -919,6 +894,11 @@ void http_stream::async_read_some(const MutableBufferSequence& buffers, BOOST_AS
 					boost::asio::mutable_buffer buffer(*iter);
 					max_length += boost::asio::buffer_size(buffer);
 				}
+#ifdef AVHTTP_ENABLE_ZLIB
+				// 压缩的数据按解压缓冲的大小读取.
+				if (m_decoder.active())
+					max_length = m_decompress_buffer_size;
+#endif
 				// 得到合适的缓冲大小.
 				max_length = (std::min)(max_length, m_chunked_size);
 			}
@@ -938,6 +918,20 @@ void http_stream::async_read_some(const MutableBufferSequence& buffers, BOOST_AS
 		}
 	}
 
+#ifdef AVHTTP_ENABLE_ZLIB
+	// 解压器或m_response中还有数据, 直接解压给用户, 不需要等socket.
+	if (m_decoder.active() && (m_decoder.pending() || m_response.size() > 0))
+	{
+		std::size_t bytes_transferred = decompress_some(buffers, ec);
+		if (ec || bytes_transferred != 0 || boost::asio::buffer_size(buffers) == 0)
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(handler, ec, bytes_transferred));
+			return;
+		}
+	}
+#endif // AVHTTP_ENABLE_ZLIB
+
 	if (m_response.size() > 0)
 	{
 		std::size_t bytes_transferred = read_some(buffers, ec);
@@ -948,19 +942,27 @@ void http_stream::async_read_some(const MutableBufferSequence& buffers, BOOST_AS
 
 	{
 #ifdef AVHTTP_ENABLE_ZLIB
-		// 如果没有启用gzip, 则判断在keep-alive模式下, 用户读取是否
-		// 完整了, 如果读取完整了, 则回调长度为0, 并保持连接.
-		if (!m_is_gzip)
+		// 压缩流已经结束, 或者压缩的body已经读取完整, 不再从socket读取.
+		if (m_decoder.active() && (m_decoder.finished()
+			|| (m_content_length != -1 && m_body_size == m_content_length)))
+		{
+			if (!m_keep_alive)
+				ec = boost::asio::error::eof;
+			m_io_service.post(
+				boost::asio::detail::bind_handler(handler, ec, 0));
+			return;
+		}
 #endif // AVHTTP_ENABLE_ZLIB
+
+		// 判断在keep-alive模式下, 用户读取是否完整了, 如果读取完整了, 则回调长度为0,
+		// 并保持连接.
+		if (m_keep_alive)
 		{
-			if (m_keep_alive)
+			if (m_content_length != -1 && m_body_size == m_content_length)
 			{
-				if (m_content_length != -1 && m_body_size == m_content_length)
-				{
-					m_io_service.post(
-						boost::asio::detail::bind_handler(handler, ec, 0));
-					return;
-				}
+				m_io_service.post(
+					boost::asio::detail::bind_handler(handler, ec, 0));
+				return;
 			}
 		}
 
@@ -970,6 +972,16 @@ void http_stream::async_read_some(const MutableBufferSequence& buffers, BOOST_AS
 		// 读取数据到尾部的时候, 发生长时间等待的情况.
 		if (m_response.size() != 0)
 			max_length = 0;
+#ifdef AVHTTP_ENABLE_ZLIB
+		else if (m_decoder.active())
+		{
+			// 压缩的数据按解压缓冲的大小读取, 但不超过body剩下的长度.
+			max_length = m_decompress_buffer_size;
+			if (m_content_length != -1)
+				max_length = (std::min)((boost::int64_t)max_length,
+					m_content_length - (boost::int64_t)m_body_size);
+		}
+#endif // AVHTTP_ENABLE_ZLIB
 		else
 		{
 			typename MutableBufferSequence::const_iterator iter = buffers.begin();
@@ -1058,6 +1070,9 @@ void http_stream::request(request_opts& opt, boost::system::error_code& ec)
 	m_is_chunked = false;
 	m_keep_alive = true;
 	m_body_size = 0;
+#ifdef AVHTTP_ENABLE_ZLIB
+	end_decompress();
+#endif
 
 	// 得到url选项.
 	std::string new_url;
@@ -1101,6 +1116,18 @@ void http_stream::request(request_opts& opt, boost::system::error_code& ec)
 		opts.remove(http_options::user_agent);	// 删除处理过的选项.
 	m_request_opts.insert(http_options::user_agent, user_agent);
 
+	// 添加Accept-Encoding, 默认为所有能解压的编码. 带Range的请求不默认添加,
+	// 因为压缩后数据的偏移没有意义. 用户指定为空串时不发送.
+	std::string accept_encoding;
+#ifdef AVHTTP_ENABLE_ZLIB
+	if (opts.find(http_options::range).empty())
+		accept_encoding = detail::content_decoder::accept_encoding();
+	if (opts.find(http_options::accept_encoding, accept_encoding))
+		opts.remove(http_options::accept_encoding);	// 删除处理过的选项.
+	if (!accept_encoding.empty())
+		m_request_opts.insert(http_options::accept_encoding, accept_encoding);
+#endif
+
 	// 添加cookies.
 	std::string cookie = m_cookies.get_cookie_line(m_protocol == "https");
 
@@ -1122,8 +1149,8 @@ void http_stream::request(request_opts& opt, boost::system::error_code& ec)
 		}
 	}
 
-	// 默认添加close.
-	std::string connection = "close";
+	// 使用连接池时默认keep-alive, 否则默认添加close.
+	std::string connection = pool_enabled() ? "keep-alive" : "close";
 	if ((m_proxy.type == proxy_settings::http_pw || m_proxy.type == proxy_settings::http)
 		&& m_protocol != "https")
 	{
@@ -1182,6 +1209,10 @@ void http_stream::request(request_opts& opt, boost::system::error_code& ec)
 	request_stream << "Host: " << host << "\r\n";
 	request_stream << "Accept: " << accept << "\r\n";
 	request_stream << "User-Agent: " << user_agent << "\r\n";
+	if (!accept_encoding.empty())
+	{
+		request_stream << "Accept-Encoding: " << accept_encoding << "\r\n";
+	}
 	if (!cookie.empty())
 	{
 		request_stream << "Cookie: " << cookie << "\r\n";
@@ -1260,6 +1291,9 @@ void http_stream::async_request(const request_opts& opt, BOOST_ASIO_MOVE_ARG(Han
 	m_is_chunked_end = false;
 	m_keep_alive = true;
 	m_body_size = 0;
+#ifdef AVHTTP_ENABLE_ZLIB
+	end_decompress();
+#endif
 
 	// 得到url选项.
 	std::string new_url;
@@ -1303,6 +1337,18 @@ void http_stream::async_request(const request_opts& opt, BOOST_ASIO_MOVE_ARG(Han
 		opts.remove(http_options::user_agent);	// 删除处理过的选项.
 	m_request_opts.insert(http_options::user_agent, user_agent);
 
+	// 添加Accept-Encoding, 默认为所有能解压的编码. 带Range的请求不默认添加,
+	// 因为压缩后数据的偏移没有意义. 用户指定为空串时不发送.
+	std::string accept_encoding;
+#ifdef AVHTTP_ENABLE_ZLIB
+	if (opts.find(http_options::range).empty())
+		accept_encoding = detail::content_decoder::accept_encoding();
+	if (opts.find(http_options::accept_encoding, accept_encoding))
+		opts.remove(http_options::accept_encoding);	// 删除处理过的选项.
+	if (!accept_encoding.empty())
+		m_request_opts.insert(http_options::accept_encoding, accept_encoding);
+#endif
+
 	// 添加cookies.
 	std::string cookie = m_cookies.get_cookie_line(m_protocol == "https");
 
@@ -1324,8 +1370,8 @@ void http_stream::async_request(const request_opts& opt, BOOST_ASIO_MOVE_ARG(Han
 		}
 	}
 
-	// 默认添加close.
-	std::string connection = "close";
+	// 使用连接池时默认keep-alive, 否则默认添加close.
+	std::string connection = pool_enabled() ? "keep-alive" : "close";
 	if ((m_proxy.type == proxy_settings::http_pw || m_proxy.type == proxy_settings::http)
 		&& m_protocol != "https")
 	{
@@ -1390,6 +1436,10 @@ void http_stream::async_request(const request_opts& opt, BOOST_ASIO_MOVE_ARG(Han
 		request_stream << "Proxy-Authorization: " << auth << "\r\n";
 	}
 	request_stream << "User-Agent: " << user_agent << "\r\n";
+	if (!accept_encoding.empty())
+	{
+		request_stream << "Accept-Encoding: " << accept_encoding << "\r\n";
+	}
 	if (!cookie.empty())
 	{
 		request_stream << "Cookie: " << cookie << "\r\n";
@@ -1584,25 +1634,19 @@ void http_stream::receive_header(boost::system::error_code& ec)
 		}
 	}
 
-	// 解析是否启用了gz压缩.
-	std::string opt_str = m_response_opts.find(http_options::content_encoding);
+	// 解析是否启用了压缩.
 #ifdef AVHTTP_ENABLE_ZLIB
-	if (opt_str == "gzip" || opt_str == "x-gzip")
+	boost::system::error_code decompress_ec;
+	init_decompress(decompress_ec);
+	if (decompress_ec)
 	{
-		m_is_gzip = true;
-		if (!m_stream.zalloc)	// 初始化ZLIB库, 每次解压每个chunked的时候, 不需要重新初始化.
-		{
-			if (inflateInit2(&m_stream, 32+15 ) != Z_OK)
-			{
-				ec = boost::asio::error::operation_not_supported;
-				AVHTTP_LOG_ERR << "Init zlib invalid, error message: \'" << ec.message() << "\'";
-				return;
-			}
-		}
+		ec = decompress_ec;
+		AVHTTP_LOG_ERR << "Init decompress invalid, error message: \'" << ec.message() << "\'";
+		return;
 	}
 #endif
 	// 是否启用了chunked.
-	opt_str = m_response_opts.find(http_options::transfer_encoding);
+	std::string opt_str = m_response_opts.find(http_options::transfer_encoding);
 	if (opt_str == "chunked")
 		m_is_chunked = true;
 	// 是否在请求完成后关闭socket.
@@ -1659,6 +1703,16 @@ void http_stream::close(boost::system::error_code& ec)
 {
 	ec = boost::system::error_code();
 
+	// 还在连接的时候, 临时的socket不能留到连接完成再放进已经关闭的m_sock.
+	cancel_racing_connect();
+
+	// 响应已经读完的连接放回连接池, 而不是关闭.
+	release_connection();
+
+#ifdef AVHTTP_ENABLE_ZLIB
+	end_decompress();
+#endif
+
 	if (is_open())
 	{
 		// 关闭socket.
@@ -1737,6 +1791,11 @@ const std::string http_stream::entry_url() const
 
 boost::int64_t http_stream::content_length()
 {
+#ifdef AVHTTP_ENABLE_ZLIB
+	// Content-Length是压缩后的长度, 解压后的长度事先不知道.
+	if (m_decoder.active())
+		return -1;
+#endif
 	return m_content_length;
 }
 
@@ -1759,6 +1818,16 @@ void http_stream::load_verify_file(const std::string& filename)
 	return;
 }
 
+void http_stream::use_connection_pool(bool enable)
+{
+	m_use_pool = enable;
+}
+
+void http_stream::decompress_buffer_size(std::size_t size)
+{
+	m_decompress_buffer_size = (std::max)(size, std::size_t(1024));
+}
+
 
 // 以下为内部相关实现, 非接口.
 
@@ -1793,19 +1862,77 @@ std::size_t http_stream::read_some_impl(const MutableBufferSequence& buffers,
 	return bytes_transferred;
 }
 
+#ifdef AVHTTP_ENABLE_ZLIB
+
+template <typename MutableBufferSequence>
+std::size_t http_stream::decompress_some(const MutableBufferSequence& buffers,
+	boost::system::error_code& ec)
+{
+	std::size_t bytes_transferred = 0;
+	typename MutableBufferSequence::const_iterator iter = buffers.begin();
+	typename MutableBufferSequence::const_iterator end = buffers.end();
+
+	// 依次填满用户的每一个缓冲, 一次调用尽量多解压一些数据.
+	for (; iter != end; ++iter)
+	{
+		boost::asio::mutable_buffer buffer(*iter);
+		char* out = boost::asio::buffer_cast<char*>(buffer);
+		std::size_t size = boost::asio::buffer_size(buffer);
+
+		while (size > 0)
+		{
+			std::size_t length = m_decoder.decode(out, size, ec);
+			if (ec)
+			{
+				return 0;
+			}
+
+			out += length;
+			size -= length;
+			bytes_transferred += length;
+
+			// 解压器需要更多的输入, 只用m_response中已经收到的数据补充, 不在这里等待socket.
+			if (length == 0)
+			{
+				if (m_response.size() == 0 || fill_decompress_buffer(ec) == 0)
+					break;
+			}
+		}
+
+		if (size != 0)
+			break;
+	}
+
+	return bytes_transferred;
+}
+
+#endif // AVHTTP_ENABLE_ZLIB
+
 template <typename Handler>
 void http_stream::handle_resolve(const boost::system::error_code& err,
-	tcp::resolver::iterator endpoint_iterator, Handler handler)
+	dns_cache::endpoints_ptr endpoints, Handler handler)
 {
 	if (!err)
 	{
+		// 普通的http连接同时尝试多个地址, 哪个先连上用哪个, ipv6不通的时候不用等超时.
+		if (m_protocol == "http")
+		{
+			m_racing_connect = detail::async_connect_racing(*m_sock.get<nossl_socket>(), *endpoints,
+				boost::bind(&http_stream::handle_connect<Handler>,
+					this, handler, endpoints, endpoints->size(),
+					boost::asio::placeholders::error
+				)
+			);
+			return;
+		}
+
 		// 发起异步连接.
 		// !!!备注: 由于m_sock可能是ssl, 那么连接的握手相关实现被封装到ssl_stream
 		// 了, 所以, 如果需要使用boost::asio::async_connect的话, 需要在http_stream
 		// 中实现握手操作, 否则将会得到一个错误.
-		m_sock.async_connect(tcp::endpoint(*endpoint_iterator),
+		m_sock.async_connect(endpoints->front(),
 			boost::bind(&http_stream::handle_connect<Handler>,
-				this, handler, endpoint_iterator,
+				this, handler, endpoints, 0,
 				boost::asio::placeholders::error
 			)
 		);
@@ -1821,7 +1948,7 @@ void http_stream::handle_resolve(const boost::system::error_code& err,
 
 template <typename Handler>
 void http_stream::handle_connect(Handler handler,
-	tcp::resolver::iterator endpoint_iterator, const boost::system::error_code& err)
+	dns_cache::endpoints_ptr endpoints, std::size_t index, const boost::system::error_code& err)
 {
 	if (!err)
 	{
@@ -1832,7 +1959,7 @@ void http_stream::handle_connect(Handler handler,
 	else
 	{
 		// 检查是否已经尝试了endpoint列表中的所有endpoint.
-		if (++endpoint_iterator == tcp::resolver::iterator())
+		if (++index >= endpoints->size())
 		{
 			AVHTTP_LOG_ERR << "Connect to \'" << m_url.host() <<
 				"\', error message \'" << err.message() << "\'";
@@ -1841,12 +1968,9 @@ void http_stream::handle_connect(Handler handler,
 		else
 		{
 			// 继续发起异步连接.
-			// !!!备注: 由于m_sock可能是ssl, 那么连接的握手相关实现被封装到ssl_stream
-			// 了, 所以, 如果需要使用boost::asio::async_connect的话, 需要在http_stream
-			// 中实现握手操作, 否则将会得到一个错误.
-			m_sock.async_connect(tcp::endpoint(*endpoint_iterator),
+			m_sock.async_connect((*endpoints)[index],
 				boost::bind(&http_stream::handle_connect<Handler>,
-					this, handler, endpoint_iterator,
+					this, handler, endpoints, index,
 					boost::asio::placeholders::error
 				)
 			);
@@ -1884,6 +2008,148 @@ void http_stream::handle_request(Handler handler, const boost::system::error_cod
 	);
 }
 
+template <typename Handler>
+void http_stream::handle_pooled_open(Handler handler, const boost::system::error_code& err)
+{
+	// 还没有收到状态行连接就断开了, 说明服务器在连接空闲时关闭了它.
+	// POST之类的请求不能确定服务器没有处理过, 不自动重试.
+	if (err && m_pooled && m_status_code == 0 &&
+		(err == boost::asio::error::eof ||
+		err == boost::asio::error::connection_reset ||
+		err == boost::asio::error::connection_aborted ||
+		err == boost::asio::error::broken_pipe))
+	{
+		std::string request_method = m_request_opts.find(http_options::request_method);
+		if (request_method == "GET" || request_method == "HEAD")
+		{
+			AVHTTP_LOG_WARN << "Pooled connection to \'" << m_url.host() <<
+				"\' closed by server, reconnect.";
+			boost::system::error_code ignore_ec;
+			m_sock.close(ignore_ec);
+			m_pooled = false;
+			m_skip_pool = true;
+			async_open(m_url, handler);
+			return;
+		}
+	}
+
+	handler(err);
+}
+
+void http_stream::cancel_racing_connect()
+{
+	boost::shared_ptr<detail::racing_connect> op = m_racing_connect.lock();
+	m_racing_connect.reset();
+	if (op)
+		op->cancel();
+}
+
+bool http_stream::pool_enabled() const
+{
+	return m_use_pool && m_protocol == "http" && m_proxy.type == proxy_settings::none;
+}
+
+std::string http_stream::pool_key() const
+{
+	return boost::str(boost::format("%s://%s:%d") % m_protocol % m_url.host() % m_url.port());
+}
+
+void http_stream::release_connection()
+{
+	if (!pool_enabled() || !m_keep_alive || !m_sock.instantiated() || !m_sock.is_open())
+		return;
+
+	nossl_socket* sock = m_sock.get<nossl_socket>();
+	if (!sock || m_status_code < 200)
+		return;
+
+	// 只有完整读完了响应的连接才能给下一个请求使用.
+	bool complete = false;
+	if (m_is_chunked)
+	{
+		// 最后一个chunk后面的CRLF一般和它一起到达, 在m_response里.
+		if (m_is_chunked_end && m_response.size() == 2)
+		{
+			const char* crlf = boost::asio::buffer_cast<const char*>(*m_response.data().begin());
+			if (boost::asio::buffer_size(*m_response.data().begin()) == 2 &&
+				crlf[0] == '\r' && crlf[1] == '\n')
+			{
+				m_response.consume(2);
+			}
+		}
+		complete = m_is_chunked_end;
+	}
+	else if (m_content_length != -1)
+	{
+		complete = (m_body_size == m_content_length);
+	}
+	else
+	{
+		complete = (m_status_code == 204 || m_status_code == 304);
+	}
+#ifdef AVHTTP_ENABLE_ZLIB
+	if (m_decoder.pending())
+		complete = false;
+#endif
+
+	if (!complete || m_response.size() != 0)
+		return;
+
+	AVHTTP_LOG_DBG << "Release connection to \'" << m_url.host() << "\' into pool.";
+	m_pooled = false;
+	boost::asio::use_service<connection_pool>(m_io_service).checkin(pool_key(), *sock);
+}
+
+#ifdef AVHTTP_ENABLE_ZLIB
+
+void http_stream::init_decompress(boost::system::error_code& ec)
+{
+	end_decompress();
+
+	detail::content_decoder::coding_type type = detail::content_decoder::parse(
+		m_response_opts.find(http_options::content_encoding));
+	if (type == detail::content_decoder::identity)
+		return;
+
+	detail::buffer_pool& pool = boost::asio::use_service<detail::buffer_pool>(m_io_service);
+	m_decoder.start(type, pool.acquire(m_decompress_buffer_size), m_decompress_buffer_size, ec);
+}
+
+void http_stream::end_decompress()
+{
+	if (m_decoder.active())
+		boost::asio::use_service<detail::buffer_pool>(m_io_service).release(m_decoder.end());
+}
+
+std::size_t http_stream::fill_decompress_buffer(boost::system::error_code& ec)
+{
+	boost::asio::mutable_buffer buffer = m_decoder.prepare();
+	std::size_t max_length = boost::asio::buffer_size(buffer);
+
+	// 不能读到当前chunk或者body以外的数据.
+	if (m_is_chunked)
+		max_length = (std::min)(max_length, m_chunked_size);
+	else if (m_content_length != -1)
+		max_length = (std::min)((boost::int64_t)max_length,
+			m_content_length - (boost::int64_t)m_body_size);
+
+	if (max_length == 0)
+		return 0;
+
+	std::size_t bytes_transferred = read_some_impl(boost::asio::buffer(buffer, max_length), ec);
+	m_decoder.commit(bytes_transferred);
+
+	// 统计的是压缩数据的字节数.
+	if (m_is_chunked)
+		m_chunked_size -= bytes_transferred;
+	else
+		m_body_size += bytes_transferred;
+
+	return bytes_transferred;
+}
+
+#endif // AVHTTP_ENABLE_ZLIB
+
 template <typename Handler>
 void http_stream::handle_status(Handler handler, const boost::system::error_code& err)
 {
@@ -2069,26 +2335,19 @@ void http_stream::handle_header(Handler handler,
 	if (m_status_code != errc::ok && m_status_code != errc::partial_content)
 		ec = make_error_code(static_cast<errc::errc_t>(m_status_code));
 
-	// 解析是否启用了gz压缩.
-	std::string opt_str = m_response_opts.find(http_options::content_encoding);
+	// 解析是否启用了压缩.
 #ifdef AVHTTP_ENABLE_ZLIB
-	if (opt_str == "gzip" || opt_str == "x-gzip")
+	boost::system::error_code decompress_ec;
+	init_decompress(decompress_ec);
+	if (decompress_ec)
 	{
-		m_is_gzip = true;
-		if (!m_stream.zalloc)
-		{
-			if (inflateInit2(&m_stream, 32+15 ) != Z_OK)	// 初始化ZLIB库, 每次解压每个chunked的时候, 不需要重新初始化.
-			{
-				ec = boost::asio::error::operation_not_supported;
-				AVHTTP_LOG_ERR << "Init zlib invalid, error message: \'" << ec.message() << "\'";
-				handler(ec);
-				return;
-			}
-		}
+		AVHTTP_LOG_ERR << "Init decompress invalid, error message: \'" << decompress_ec.message() << "\'";
+		handler(decompress_ec);
+		return;
 	}
 #endif
 	// 是否启用了chunked.
-	opt_str = m_response_opts.find(http_options::transfer_encoding);
+	std::string opt_str = m_response_opts.find(http_options::transfer_encoding);
 	if (opt_str == "chunked")
 		m_is_chunked = true;
 	// 是否在请求完成后关闭socket.
@@ -2121,7 +2380,7 @@ void http_stream::handle_read(const MutableBufferSequence& buffers, Handler hand
 	boost::system::error_code err;
 	if (!ec || m_response.size() > 0
 #ifdef AVHTTP_ENABLE_ZLIB
-		|| (m_is_gzip && m_stream.avail_in > 0)	// 启用了压缩并未解压完缓冲区中的数据.
+		|| m_decoder.pending()	// 启用了压缩并未解压完缓冲区中的数据.
 #endif
 		)
 	{
@@ -2129,7 +2388,7 @@ void http_stream::handle_read(const MutableBufferSequence& buffers, Handler hand
 		m_response.commit(bytes_transferred);
 
 #ifdef AVHTTP_ENABLE_ZLIB
-		if (!m_is_gzip)	// 如果没有启用gzip, 则直接读取数据后返回.
+		if (!m_decoder.active())	// 如果没有启用压缩, 则直接读取数据后返回.
 #endif
 		{
 			if (bytes_transferred <= 0 && m_response.size() == 0)
@@ -2147,77 +2406,28 @@ void http_stream::handle_read(const MutableBufferSequence& buffers, Handler hand
 			}
 		}
 #ifdef AVHTTP_ENABLE_ZLIB
-		else					// 否则读取数据到解压缓冲中.
+		else					// 否则从m_response补充解压缓冲, 解压到用户缓冲中.
 		{
-			if (m_stream.avail_in == 0)
+			bytes_transferred = decompress_some(buffers, err);
+			if (err)
 			{
-				if (bytes_transferred <= 0 && m_response.size() == 0)
-				{
-					handler(ec, bytes_transferred);
-					return;
-				}
-				else
-				{
-					bytes_transferred = read_some_impl(boost::asio::buffer(m_zlib_buffer, 1024), err);
-
-					// 统计读取body的字节数, 但这个是压缩的数据, 目前还不能完全确定
-					// 未解压的数据长度就是content_length, 因为大多数情况下, 压缩数据
-					// 都是以chunked形式发送.
-					m_body_size += bytes_transferred;
-
-					m_zlib_buffer_size = bytes_transferred;
-					m_stream.avail_in = (uInt)m_zlib_buffer_size;
-					m_stream.next_in = (z_const Bytef *)&m_zlib_buffer[0];
-				}
+				// 解压发生错误, 通知用户并放弃处理.
+				handler(err, 0);
+				return;
 			}
 
-			bytes_transferred = 0;
-			std::size_t buffer_size = 0;
-
+			// 没有解压出东西, 说明压缩数据过少, 继续读取, 以保证能够解压.
+			if (bytes_transferred == 0 && boost::asio::buffer_size(buffers) != 0)
 			{
-				typename MutableBufferSequence::const_iterator iter = buffers.begin();
-				typename MutableBufferSequence::const_iterator end = buffers.end();
-				// 计算得到用户buffer_size总大小.
-				for (; iter != end; ++iter)
+				if (ec)
 				{
-					boost::asio::mutable_buffer buffer(*iter);
-					m_stream.next_in = (z_const Bytef *)(&m_zlib_buffer[0] + m_zlib_buffer_size - m_stream.avail_in);
-					m_stream.avail_out = boost::asio::buffer_size(buffer);
-					if (m_stream.avail_out == 0)
-					{
-						break; // 如果用户提供的缓冲大小为0, 则直接返回.
-					}
-					buffer_size += m_stream.avail_out;
-					m_stream.next_out = boost::asio::buffer_cast<Bytef*>(buffer);
-					int ret = inflate(&m_stream, Z_SYNC_FLUSH);
-					if (ret < 0)
-					{
-						err = boost::asio::error::operation_not_supported;
-						// 解压发生错误, 通知用户并放弃处理.
-						handler(err, 0);
-						return;
-					}
-
-					bytes_transferred += (boost::asio::buffer_size(buffer) - m_stream.avail_out);
-					if (bytes_transferred != boost::asio::buffer_size(buffer))
-					{
-						break;
-					}
+					handler(ec, 0);
+					return;
 				}
-			}
-
-			// 没有解压出东西, 说明压缩数据过少, 继续读取, 以保证能够解压.
-			if (buffer_size != 0 && bytes_transferred == 0)
-			{
 				async_read_some(buffers, handler);
 				return;
 			}
 
-			if (m_stream.avail_in == 0)
-			{
-				err = ec;	// FIXME!!!
-			}
-
 			handler(err, bytes_transferred);
 			return;
 		}
@@ -2286,74 +2496,38 @@ void http_stream::handle_async_read(const MutableBufferSequence& buffers,
 		m_response.commit(bytes_transferred);
 
 #ifdef AVHTTP_ENABLE_ZLIB
-		if (!m_is_gzip)	// 如果没有启用gzip, 则直接读取数据后返回.
+		if (!m_decoder.active())	// 如果没有启用压缩, 则直接读取数据后返回.
 #endif
 		{
-			bytes_transferred = read_some_impl(boost::asio::buffer(buffers, m_chunked_size), err);
+			boost::asio::mutable_buffer first(*buffers.begin());
+			bytes_transferred = read_some_impl(boost::asio::buffer(first, m_chunked_size), err);
 			m_chunked_size -= bytes_transferred;
 			handler(err, bytes_transferred);
 			return;
 		}
 #ifdef AVHTTP_ENABLE_ZLIB
-		else					// 否则读取数据到解压缓冲中.
+		else					// 否则从m_response补充解压缓冲, 解压到用户缓冲中.
 		{
-			if (m_stream.avail_in == 0)
+			bytes_transferred = decompress_some(buffers, err);
+			if (err)
 			{
-				std::size_t buf_size = (std::min)(m_chunked_size, std::size_t(1024));
-				bytes_transferred = read_some_impl(boost::asio::buffer(m_zlib_buffer, buf_size), err);
-				m_chunked_size -= bytes_transferred;
-				m_zlib_buffer_size = bytes_transferred;
-				m_stream.avail_in = (uInt)m_zlib_buffer_size;
-				m_stream.next_in = (z_const Bytef *)&m_zlib_buffer[0];
+				// 解压发生错误, 通知用户并放弃处理.
+				handler(err, 0);
+				return;
 			}
 
-			bytes_transferred = 0;
-			std::size_t buffer_size = 0;
-
+			// 如果用户缓冲区空间不为空, 但没解压出数据, 则继续发起异步读取数据, 以保证能正确返回数据给用户.
+			if (bytes_transferred == 0 && boost::asio::buffer_size(buffers) != 0)
 			{
-				typename MutableBufferSequence::const_iterator iter = buffers.begin();
-				typename MutableBufferSequence::const_iterator end = buffers.end();
-				// 计算得到用户buffer_size总大小.
-				for (; iter != end; ++iter)
+				if (ec)
 				{
-					boost::asio::mutable_buffer buffer(*iter);
-					m_stream.next_in = (z_const Bytef *)(&m_zlib_buffer[0] + m_zlib_buffer_size - m_stream.avail_in);
-					m_stream.avail_out = boost::asio::buffer_size(buffer);
-					if (m_stream.avail_out == 0)
-					{
-						break; // 如果用户提供的缓冲大小为0, 则直接返回.
-					}
-					buffer_size += m_stream.avail_out;
-					m_stream.next_out = boost::asio::buffer_cast<Bytef*>(buffer);
-					int ret = inflate(&m_stream, Z_SYNC_FLUSH);
-					if (ret < 0)
-					{
-						err = boost::asio::error::operation_not_supported;
-						// 解压发生错误, 通知用户并放弃处理.
-						handler(err, 0);
-						return;
-					}
-
-					bytes_transferred += (boost::asio::buffer_size(buffer) - m_stream.avail_out);
-					if (bytes_transferred != boost::asio::buffer_size(buffer))
-					{
-						break;
-					}
+					handler(ec, 0);
+					return;
 				}
-			}
-
-			// 如果用户缓冲区空间不为空, 但没解压出数据, 则继续发起异步读取数据, 以保证能正确返回数据给用户.
-			if (buffer_size != 0 && bytes_transferred == 0)
-			{
 				async_read_some(buffers, handler);
 				return;
 			}
 
-			if (m_chunked_size == 0 && m_stream.avail_in == 0)
-			{
-				err = ec;	// FIXME!!!
-			}
-
 			handler(err, bytes_transferred);
 			return;
 		}
@@ -2395,19 +2569,6 @@ void http_stream::handle_chunked_size(const MutableBufferSequence& buffers,
 		ss << std::hex << hex_chunked_size;
 		ss >> m_chunked_size;
 
-#ifdef AVHTTP_ENABLE_ZLIB
-		if (m_chunked_size == 0 && m_is_gzip)
-		{
-			if (m_stream.avail_in == 0)
-			{
-				boost::system::error_code err;
-				if (!m_keep_alive)
-					err = boost::asio::error::eof;
-				handler(err, 0);
-				return;
-			}
-		}
-#endif
 		// chunked_size不包括数据尾的crlf, 所以置数据尾的crlf为false状态.
 		m_skip_crlf = false;
 
@@ -2428,6 +2589,11 @@ void http_stream::handle_chunked_size(const MutableBufferSequence& buffers,
 					boost::asio::mutable_buffer buffer(*iter);
 					max_length += boost::asio::buffer_size(buffer);
 				}
+#ifdef AVHTTP_ENABLE_ZLIB
+				// 压缩的数据按解压缓冲的大小读取.
+				if (m_decoder.active())
+					max_length = m_decompress_buffer_size;
+#endif
 				// 得到合适的缓冲大小.
 				max_length = (std::min)(max_length, m_chunked_size);
 			}
@@ -2451,11 +2617,7 @@ void http_stream::handle_chunked_size(const MutableBufferSequence& buffers,
 			boost::system::error_code err;
 			m_is_chunked_end = true;
 #ifdef AVHTTP_ENABLE_ZLIB
-					if (m_stream.zalloc)
-					{
-						inflateEnd(&m_stream);
-						m_stream.zalloc = NULL;
-					}
+			end_decompress();
 #endif
 			if (!m_keep_alive)
 				err = boost::asio::error::eof;
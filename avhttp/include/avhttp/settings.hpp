@@ -31,6 +31,11 @@ namespace avhttp {
 #define AVHTTP_MAX_REDIRECTS 5
 #endif
 
+// 解压时每次读取压缩数据的缓冲大小.
+#ifndef AVHTTP_DECOMPRESS_BUFFER_SIZE
+#define AVHTTP_DECOMPRESS_BUFFER_SIZE 65536
+#endif
+
 // 常用有以下http选项.
 namespace http_options {
 
@@ -0,0 +1,238 @@
+//
+// connection_pool_test.cpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// 在本机起一个支持keep-alive的http服务器, 检查http_stream通过连接池复用连接:
+// 服务器在请求到达时关闭了空闲连接, GET要在新连接上重试, POST不能重试;
+// 在池里等待时已经被服务器关闭的连接, 取出的时候要被健康检查丢掉.
+//
+// 用法: connection_pool_test
+//
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <utility>
+#include <iostream>
+#include <boost/assert.hpp>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "avhttp.hpp"
+
+using boost::asio::ip::tcp;
+
+// 每个连接一个线程, 一个连接上可以处理多个请求, 根据path决定怎么处理.
+//  /keep   正常返回, 保持连接.
+//  /close  返回以后马上关闭连接, 连接在客户端的池里等待的时候就已经断开了.
+//  /drop   连接上的第一个请求正常返回, 之后的请求读完就关闭连接不返回,
+//          相当于服务器在请求到达的同时关闭了空闲连接.
+class test_server
+{
+public:
+	test_server()
+		: m_acceptor(m_io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+		, m_connections(0)
+		, m_stopped(false)
+		, m_thread(boost::bind(&test_server::run, this))
+	{}
+
+	~test_server()
+	{
+		// 阻塞的accept不会因为关闭acceptor而返回, 连一次让它醒来.
+		m_stopped = true;
+		boost::system::error_code ignore_ec;
+		tcp::socket sock(m_io);
+		sock.connect(m_acceptor.local_endpoint(), ignore_ec);
+		m_thread.join();
+		m_workers.join_all();
+	}
+
+	std::string url(const std::string& path) const
+	{
+		return "http://127.0.0.1:" + boost::lexical_cast<std::string>(
+			m_acceptor.local_endpoint().port()) + path;
+	}
+
+	int connections()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		return m_connections;
+	}
+
+	// 最后一个请求的连接编号和请求行.
+	std::pair<int, std::string> last_request()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		return m_requests.back();
+	}
+
+	std::size_t requests()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		return m_requests.size();
+	}
+
+private:
+	void run()
+	{
+		boost::system::error_code ec;
+		while (!ec)
+		{
+			boost::shared_ptr<tcp::socket> sock(new tcp::socket(m_io));
+			m_acceptor.accept(*sock, ec);
+			if (m_stopped)
+				break;
+			if (!ec)
+			{
+				boost::mutex::scoped_lock l(m_mutex);
+				m_workers.create_thread(boost::bind(&test_server::serve, this, sock, ++m_connections));
+			}
+		}
+	}
+
+	void serve(boost::shared_ptr<tcp::socket> sock, int id)
+	{
+		boost::system::error_code ec;
+		boost::asio::streambuf request;
+
+		for (int n = 1; ; n++)
+		{
+			std::size_t header_size = boost::asio::read_until(*sock, request, "\r\n\r\n", ec);
+			if (ec)
+				return;
+
+			std::string header(boost::asio::buffer_cast<const char*>(request.data()), header_size);
+			request.consume(header_size);
+
+			std::string line = header.substr(0, header.find("\r\n"));
+			std::string path = line.substr(line.find(' ') + 1);
+			path = path.substr(0, path.find(' '));
+
+			// 读掉POST的body.
+			std::string::size_type pos = header.find("Content-Length: ");
+			if (pos != std::string::npos)
+			{
+				std::size_t length = std::atoi(header.c_str() + pos + 16);
+				if (request.size() < length)
+					boost::asio::read(*sock, request, boost::asio::transfer_exactly(length - request.size()), ec);
+				request.consume(length);
+			}
+
+			{
+				boost::mutex::scoped_lock l(m_mutex);
+				m_requests.push_back(std::make_pair(id, line));
+			}
+
+			if (path == "/drop" && n > 1)
+			{
+				sock->close(ec);
+				return;
+			}
+
+			std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: keep-alive\r\n\r\nok";
+			boost::asio::write(*sock, boost::asio::buffer(response), ec);
+
+			if (ec || path == "/close")
+			{
+				sock->shutdown(tcp::socket::shutdown_both, ec);
+				sock->close(ec);
+				return;
+			}
+		}
+	}
+
+private:
+	boost::asio::io_service m_io;
+	tcp::acceptor m_acceptor;
+	boost::mutex m_mutex;
+	int m_connections;
+	std::vector<std::pair<int, std::string> > m_requests;
+	volatile bool m_stopped;
+	boost::thread_group m_workers;
+	boost::thread m_thread;
+};
+
+static void handle_open(boost::system::error_code* result, bool* done, const boost::system::error_code& ec)
+{
+	*result = ec;
+	*done = true;
+}
+
+// 用同一个io_service发一个请求并读完响应, 然后关闭http_stream, 连接放回池里.
+static boost::system::error_code fetch(boost::asio::io_service& io, const std::string& url,
+	const std::string& method = "GET")
+{
+	avhttp::http_stream h(io);
+
+	avhttp::request_opts opts;
+	opts.insert(avhttp::http_options::request_method, method);
+	if (method == "POST")
+	{
+		opts.insert(avhttp::http_options::request_body, "a=1");
+		opts.insert(avhttp::http_options::content_length, "3");
+	}
+	h.request_options(opts);
+
+	// 池里有空闲连接的时候它的超时定时器一直在等待, io.run()不会返回, 只运行到open完成.
+	boost::system::error_code ec;
+	bool done = false;
+	h.async_open(url, boost::bind(&handle_open, &ec, &done, boost::asio::placeholders::error));
+	io.reset();
+	while (!done)
+		io.run_one();
+
+	if (ec)
+		return ec;
+
+	std::string body;
+	boost::system::error_code read_ec;
+	char buf[64];
+	while (!read_ec)
+	{
+		std::size_t bytes_transferred = h.read_some(boost::asio::buffer(buf), read_ec);
+		body.append(buf, bytes_transferred);
+		if (!read_ec && bytes_transferred == 0)
+			break;
+	}
+	BOOST_ASSERT(body == "ok");
+
+	h.close(read_ec);
+	return ec;
+}
+
+int main()
+{
+	test_server server;
+	boost::asio::io_service io;
+	avhttp::connection_pool& pool = boost::asio::use_service<avhttp::connection_pool>(io);
+
+	// 第二个请求复用第一个请求的连接.
+	BOOST_ASSERT(!fetch(io, server.url("/keep")));
+	BOOST_ASSERT(pool.size() == 1);
+	BOOST_ASSERT(!fetch(io, server.url("/keep")));
+	BOOST_ASSERT(server.connections() == 1);
+
+	// 池里的连接通过了健康检查, 但是服务器读完请求就关闭了, GET在新连接上重试.
+	BOOST_ASSERT(!fetch(io, server.url("/drop")));
+	BOOST_ASSERT(server.connections() == 2);
+	BOOST_ASSERT(server.requests() == 4);
+	BOOST_ASSERT(server.last_request() == std::make_pair(2, std::string("GET /drop HTTP/1.1")));
+
+	// 连接在池里的时候被服务器关闭了, 取出的时候被健康检查丢掉, 请求不会发到这个连接上.
+	BOOST_ASSERT(!fetch(io, server.url("/close")));
+	BOOST_ASSERT(pool.size() == 1);
+	boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+	BOOST_ASSERT(!fetch(io, server.url("/keep")));
+	BOOST_ASSERT(server.connections() == 3);
+	BOOST_ASSERT(server.last_request() == std::make_pair(3, std::string("GET /keep HTTP/1.1")));
+
+	// POST不知道服务器有没有处理过, 不重试, 把错误交给调用者.
+	BOOST_ASSERT(fetch(io, server.url("/drop"), "POST"));
+	BOOST_ASSERT(server.connections() == 3);
+	BOOST_ASSERT(server.last_request() == std::make_pair(3, std::string("POST /drop HTTP/1.1")));
+
+	std::cout << "connection_pool_test passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,290 @@
+//
+// gzip_test.cpp
+// ~~~~~~~~~~~~~
+//
+// 在本机起一个简单的http服务器, 分别用gzip, chunked的gzip和deflate返回同一份
+// 数据, 检查http_stream同步和异步读取解压后的内容是否正确, 并打印不同解压缓冲
+// 大小时的吞吐量.
+//
+// 用法: gzip_test [body_size_in_kb] [rounds]
+//
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+#include <boost/assert.hpp>
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "avhttp.hpp"
+
+#ifndef AVHTTP_ENABLE_ZLIB
+# error "gzip_test needs AVHTTP_ENABLE_ZLIB"
+#endif
+
+using boost::asio::ip::tcp;
+
+static std::string make_body(std::size_t size)
+{
+	std::string body;
+	body.reserve(size + 256);
+	for (int i = 0; body.size() < size; i++)
+	{
+		body += "<tr><td class=\"joke\">" + boost::lexical_cast<std::string>(i * 7919 % 100003)
+			+ "</td><td>" + std::string(i % 13 + 3, char('a' + i % 26)) + "</td></tr>\n";
+	}
+	body.resize(size);
+	return body;
+}
+
+static std::string compress(const std::string& data, int window_bits)
+{
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+	deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+
+	std::string out(deflateBound(&stream, data.size()), '\0');
+	stream.next_in = (Bytef*)data.data();
+	stream.avail_in = (uInt)data.size();
+	stream.next_out = (Bytef*)&out[0];
+	stream.avail_out = (uInt)out.size();
+	deflate(&stream, Z_FINISH);
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	return out;
+}
+
+// 每个连接只处理一个请求, 根据path决定返回的编码.
+class test_server
+{
+public:
+	test_server(const std::string& body)
+		: m_acceptor(m_io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+		, m_gzip(compress(body, 15 + 16))
+		, m_deflate(compress(body, -15))
+		, m_stopped(false)
+		, m_thread(boost::bind(&test_server::run, this))
+	{}
+
+	~test_server()
+	{
+		// 阻塞的accept不会因为关闭acceptor而返回, 连一次让它醒来.
+		m_stopped = true;
+		boost::system::error_code ignore_ec;
+		tcp::socket sock(m_io);
+		sock.connect(m_acceptor.local_endpoint(), ignore_ec);
+		m_thread.join();
+	}
+
+	std::string url(const std::string& path) const
+	{
+		return "http://127.0.0.1:" + boost::lexical_cast<std::string>(
+			m_acceptor.local_endpoint().port()) + path;
+	}
+
+	std::size_t gzip_size() const
+	{
+		return m_gzip.size();
+	}
+
+private:
+	void run()
+	{
+		boost::system::error_code ec;
+		while (!ec)
+		{
+			tcp::socket sock(m_io);
+			m_acceptor.accept(sock, ec);
+			if (m_stopped)
+				break;
+			if (!ec)
+				serve(sock);
+		}
+	}
+
+	void serve(tcp::socket& sock)
+	{
+		boost::system::error_code ec;
+		boost::asio::streambuf request;
+		boost::asio::read_until(sock, request, "\r\n\r\n", ec);
+		if (ec)
+			return;
+
+		std::string line;
+		std::istream is(&request);
+		std::getline(is, line);
+
+		std::string header = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nConnection: close\r\n";
+		std::string body;
+
+		if (line.find("/deflate") != std::string::npos)
+		{
+			body = m_deflate;
+			header += "Content-Encoding: deflate\r\nContent-Length: "
+				+ boost::lexical_cast<std::string>(body.size()) + "\r\n\r\n";
+		}
+		else if (line.find("/chunked") != std::string::npos)
+		{
+			// 分成大小不一的chunk, 让chunk的边界落在压缩数据的任意位置.
+			for (std::size_t pos = 0, n = 1; pos < m_gzip.size(); pos += n, n = n * 3 % 8191 + 1)
+			{
+				std::string chunk = m_gzip.substr(pos, n);
+				std::ostringstream size;
+				size << std::hex << chunk.size();
+				body += size.str() + "\r\n" + chunk + "\r\n";
+			}
+			body += "0\r\n\r\n";
+			header += "Content-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n";
+		}
+		else
+		{
+			body = m_gzip;
+			header += "Content-Encoding: gzip\r\nContent-Length: "
+				+ boost::lexical_cast<std::string>(body.size()) + "\r\n\r\n";
+		}
+
+		boost::asio::write(sock, boost::asio::buffer(header + body), ec);
+		sock.shutdown(tcp::socket::shutdown_both, ec);
+	}
+
+private:
+	boost::asio::io_service m_io;
+	tcp::acceptor m_acceptor;
+	std::string m_gzip;
+	std::string m_deflate;
+	volatile bool m_stopped;
+	boost::thread m_thread;
+};
+
+static std::string sync_get(const std::string& url, std::size_t buffer_size)
+{
+	boost::asio::io_service io;
+	avhttp::http_stream h(io);
+	h.decompress_buffer_size(buffer_size);
+	h.open(url);
+
+	BOOST_ASSERT(h.content_length() == -1);
+
+	std::string body;
+	boost::system::error_code ec;
+	std::vector<char> buf(16 * 1024);
+	while (!ec)
+	{
+		std::size_t bytes_transferred = h.read_some(boost::asio::buffer(buf), ec);
+		body.append(&buf[0], bytes_transferred);
+		if (!ec && bytes_transferred == 0)
+			break;
+	}
+
+	return body;
+}
+
+// 用两个缓冲读取, 检查一次解压可以填满多个用户缓冲.
+class async_get
+{
+public:
+	async_get(boost::asio::io_service& io, const std::string& url, std::size_t buffer_size)
+		: m_stream(io)
+		, m_first(1000)
+		, m_second(15000)
+	{
+		m_stream.decompress_buffer_size(buffer_size);
+		m_stream.async_open(url, boost::bind(&async_get::handle_open, this,
+			boost::asio::placeholders::error));
+	}
+
+	const std::string& body() const
+	{
+		return m_body;
+	}
+
+private:
+	void handle_open(const boost::system::error_code& ec)
+	{
+		BOOST_ASSERT(!ec);
+		read();
+	}
+
+	void read()
+	{
+		std::vector<boost::asio::mutable_buffer> buffers;
+		buffers.push_back(boost::asio::buffer(m_first));
+		buffers.push_back(boost::asio::buffer(m_second));
+		m_stream.async_read_some(buffers, boost::bind(&async_get::handle_read, this,
+			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+	}
+
+	void handle_read(const boost::system::error_code& ec, std::size_t bytes_transferred)
+	{
+		std::size_t first = (std::min)(bytes_transferred, m_first.size());
+		m_body.append(&m_first[0], first);
+		m_body.append(&m_second[0], bytes_transferred - first);
+
+		if (!ec && bytes_transferred != 0)
+			read();
+	}
+
+private:
+	avhttp::http_stream m_stream;
+	std::vector<char> m_first;
+	std::vector<char> m_second;
+	std::string m_body;
+};
+
+int main(int argc, char** argv)
+{
+	std::size_t body_size = (argc > 1 ? std::atoi(argv[1]) : 4096) * 1024;
+	int rounds = argc > 2 ? std::atoi(argv[2]) : 10;
+
+	std::string body = make_body(body_size);
+	test_server server(body);
+
+	std::cout << "body " << body.size() << " bytes, gzip " << server.gzip_size()
+		<< " bytes, " << rounds << " rounds" << std::endl;
+
+	const char* paths[] = { "/gzip", "/chunked", "/deflate" };
+	std::size_t buffer_sizes[] = { 1024, AVHTTP_DECOMPRESS_BUFFER_SIZE };
+
+	for (int p = 0; p < 3; p++)
+	{
+		// 正确性.
+		std::string sync_body = sync_get(server.url(paths[p]), 1024);
+		BOOST_ASSERT(sync_body == body);
+		{
+			boost::asio::io_service io;
+			async_get get(io, server.url(paths[p]), 4096);
+			io.run();
+			BOOST_ASSERT(get.body() == body);
+		}
+
+		// 吞吐量.
+		for (int b = 0; b < 2; b++)
+		{
+			boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+			std::size_t total = 0;
+
+			for (int i = 0; i < rounds; i++)
+			{
+				boost::asio::io_service io;
+				async_get get(io, server.url(paths[p]), buffer_sizes[b]);
+				io.run();
+				total += get.body().size();
+			}
+
+			boost::posix_time::time_duration used =
+				boost::posix_time::microsec_clock::universal_time() - start;
+			double mb = total / (1024.0 * 1024.0);
+			double seconds = (std::max)(used.total_microseconds(), boost::int64_t(1)) / 1000000.0;
+
+			std::cout << paths[p] << " buffer " << buffer_sizes[b] << ": "
+				<< used.total_milliseconds() << " ms, " << mb / seconds << " MB/s" << std::endl;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,155 @@
+
+// 比较 async_read_request 以前用的 regex 逐行解析和现在的 request_parser.
+// 以前的做法: 每行 read_until("\r\n"), 拷贝成 std::string, 再现构造 boost::regex 匹配.
+// 这里不走 socket, 两边都从 streambuf 里解析同样的请求并填好 request_opts.
+//
+// 用法: parser_bench [rounds]
+
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/regex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <avhttpd/settings.hpp>
+#include <avhttpd/request_parser.hpp>
+
+// 数据都已经在 streambuf 里时 read_until("\r\n") 做的事情, 返回到 "\r\n" 为止的长度.
+static std::size_t read_until_crlf(boost::asio::streambuf & streambuf)
+{
+	typedef boost::asio::buffers_iterator<boost::asio::streambuf::const_buffers_type> iterator;
+	const char crlf[] = "\r\n";
+
+	iterator begin = iterator::begin(streambuf.data());
+	iterator end = iterator::end(streambuf.data());
+	iterator pos = std::search(begin, end, crlf, crlf + 2);
+	return pos == end ? 0 : pos - begin + 2;
+}
+
+// 以前 async_read_request_op 的解析过程, 去掉了异步读取.
+static bool regex_parse(boost::asio::streambuf & streambuf, avhttpd::request_opts & opts)
+{
+	std::string request_line;
+	std::string one_header_line;
+	boost::smatch what;
+
+	std::size_t bytes_transferred = read_until_crlf(streambuf);
+	request_line.resize(bytes_transferred);
+	streambuf.sgetn(&request_line[0], bytes_transferred);
+	request_line.resize(bytes_transferred - 2);
+
+	if (!boost::regex_match(request_line, what,
+			boost::regex("([a-zA-Z]+)[ ]+([^ ]+)([ ]+(.*))?")))
+		return false;
+
+	opts(avhttpd::http_options::request_method, boost::to_upper_copy(std::string(what[1])));
+	opts(avhttpd::http_options::request_uri, what[2]);
+	if (what[3].matched)
+		opts(avhttpd::http_options::http_version,
+			boost::to_upper_copy(boost::trim_left_copy(std::string(what[3]))));
+	else
+		opts(avhttpd::http_options::http_version, "HTTP/1.0");
+
+	while ((bytes_transferred = read_until_crlf(streambuf)) > 2)
+	{
+		one_header_line.resize(bytes_transferred);
+		streambuf.sgetn(&one_header_line[0], bytes_transferred);
+		one_header_line.resize(bytes_transferred - 2);
+
+		if (!boost::regex_match(one_header_line, what, boost::regex("^([^:]*): *(.*)$")))
+			return false;
+		opts(what[1], what[2]);
+	}
+	streambuf.consume(2);
+
+	return true;
+}
+
+static bool pico_parse(boost::asio::streambuf & streambuf, avhttpd::request_opts & opts)
+{
+	avhttpd::detail::request_parser parser;
+	int header_size = parser.parse(
+		boost::asio::buffer_cast<const char*>(streambuf.data()), streambuf.size());
+	if (header_size < 0)
+		return false;
+
+	opts(avhttpd::http_options::request_method, boost::to_upper_copy(parser.method().to_string()));
+	opts(avhttpd::http_options::request_uri, parser.uri().to_string());
+	opts(avhttpd::http_options::http_version, parser.version().empty()
+		? std::string("HTTP/1.0") : boost::to_upper_copy(parser.version().to_string()));
+	for (std::size_t i = 0; i < parser.num_headers(); i++)
+		opts(parser.header(i).name.to_string(), parser.header(i).value.to_string());
+
+	streambuf.consume(header_size);
+	return true;
+}
+
+template <class Parser>
+static double bench(Parser parse, const std::string & request, int rounds, std::string & header_string)
+{
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	for (int i = 0; i < rounds; i++)
+	{
+		boost::asio::streambuf streambuf;
+		std::size_t n = boost::asio::buffer_copy(streambuf.prepare(request.size()), boost::asio::buffer(request));
+		streambuf.commit(n);
+
+		avhttpd::request_opts opts;
+		if (!parse(streambuf, opts))
+		{
+			std::cerr << "parse failed" << std::endl;
+			std::exit(1);
+		}
+		header_string = opts.header_string() + opts.find(avhttpd::http_options::request_uri);
+	}
+
+	boost::posix_time::time_duration used = boost::posix_time::microsec_clock::universal_time() - start;
+	return used.total_nanoseconds() / double(rounds);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? std::atoi(argv[1]) : 20000;
+
+	const char * names[] = { "curl", "browser" };
+	std::string requests[] = {
+		"GET /index.html HTTP/1.1\r\n"
+		"User-Agent: curl/7.32.0\r\n"
+		"Host: 127.0.0.1:4000\r\n"
+		"Accept: */*\r\n"
+		"\r\n",
+
+		"GET /search?channel=avplayer&q=avhttpd HTTP/1.1\r\n"
+		"Host: www.avplayer.org\r\n"
+		"Connection: keep-alive\r\n"
+		"Cache-Control: max-age=0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/30.0.1599.101 Safari/537.36\r\n"
+		"Referer: http://www.avplayer.org/\r\n"
+		"Accept-Encoding: gzip,deflate,sdch\r\n"
+		"Accept-Language: zh-CN,zh;q=0.8,en;q=0.6\r\n"
+		"Cookie: __utma=12345678.1234567890.1380000000.1380000000.1380000000.1; __utmz=12345678.1380000000.1.1.utmcsr=(direct)\r\n"
+		"If-Modified-Since: Mon, 21 Oct 2013 08:00:00 GMT\r\n"
+		"\r\n",
+	};
+
+	for (int i = 0; i < 2; i++)
+	{
+		std::string regex_result, pico_result;
+		double regex_ns = bench(regex_parse, requests[i], rounds, regex_result);
+		double pico_ns = bench(pico_parse, requests[i], rounds, pico_result);
+
+		if (regex_result != pico_result)
+		{
+			std::cerr << names[i] << ": results differ" << std::endl;
+			return 1;
+		}
+
+		std::cout << names[i] << " (" << requests[i].size() << " bytes): regex "
+			<< regex_ns << " ns, request_parser " << pico_ns << " ns, "
+			<< regex_ns / pico_ns << "x" << std::endl;
+	}
+
+	return 0;
+}
@@ -4,10 +4,11 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
-#include <boost/regex.hpp>
+#include <boost/algorithm/string.hpp>
 
 #include "error_code.hpp"
 #include "settings.hpp"
+#include "request_parser.hpp"
 
 namespace avhttpd {
 namespace detail {
@@ -23,97 +24,117 @@ public:
 		, m_strembuf(streambuf)
 		, m_opts(opts)
 		, m_handler(handler)
+		, m_last_size(0)
 	{
-		boost::asio::async_read_until(m_stream, m_strembuf, std::string("\r\n"), *this);
+		// streambuf 里可能已经有完整的请求头了(比如 keep-alive 的下一个请求), 先解析再读.
+		(*this)(boost::system::error_code(), 0);
 	};
 
 	void operator()(boost::system::error_code ec, std::size_t bytes_transferred)
 	{
-		std::string request_line;
-		std::string one_header_line;
-		boost::smatch what;
-
 		BOOST_ASIO_CORO_REENTER(this)
 		{
-			if (ec)
+			// 每次收到数据只在新数据里找请求头的结尾, 完整了才一次解析整个请求头.
+			while (!parse_request(ec))
 			{
-				return invoke_handler(ec);
+				BOOST_ASIO_CORO_YIELD m_stream.async_read_some(
+					m_strembuf.prepare(max_header_size() - m_strembuf.size()), *this);
+
+				if (ec)
+				{
+					return invoke_handler(ec);
+				}
+				m_strembuf.commit(bytes_transferred);
 			}
 
-			// 完成 REQUEST LINE 的读取，用 boost::regex 处理
-			request_line.resize(bytes_transferred);
-			m_strembuf.sgetn(&request_line[0], bytes_transferred);
-			request_line.resize(bytes_transferred-2);
+			invoke_handler(ec);
+		}
+	}
+private:
+	std::size_t max_header_size() const
+	{
+		return (std::min)(std::size_t(AVHTTPD_MAX_HEADER_SIZE), m_strembuf.max_size());
+	}
 
-			if (!boost::regex_match(request_line, what,
-					boost::regex("([a-zA-Z]+)[ ]+([^ ]+)([ ]+(.*))?")))
-			{
-				return invoke_handler(
-					errc::make_error_code(errc::malformed_request_line));
-			};
+	// 解析 streambuf 里的请求头, 解析完成或者出错的时候返回 true, 需要更多数据返回 false.
+	bool parse_request(boost::system::error_code & ec)
+	{
+		const char * data = boost::asio::buffer_cast<const char*>(m_strembuf.data());
+		std::size_t size = m_strembuf.size();
 
-			m_opts(avhttpd::http_options::request_method,
-				boost::to_upper_copy(std::string(what[1])));
+		request_parser parser;
+		int header_size = parser.parse(data, size, m_last_size);
+		m_last_size = size;
 
-			m_opts(avhttpd::http_options::request_uri, what[2]);
+		switch (header_size)
+		{
+		case request_parser::incomplete:
+			if (size < max_header_size())
+				return false;
+			// 缓冲满了还没有读到完整的请求头.
+			ec = errc::make_error_code(errc::header_too_large);
+			return true;
+		case request_parser::too_many_headers:
+			ec = errc::make_error_code(errc::header_too_large);
+			return true;
+		case request_parser::bad_request_line:
+			ec = errc::make_error_code(errc::malformed_request_line);
+			return true;
+		case request_parser::bad_header:
+			ec = errc::make_error_code(errc::malformed_request_headers);
+			return true;
+		}
 
-			if (what[3].matched)
-			{
-				std::string http_version =
-					boost::to_upper_copy(boost::trim_left_copy(std::string(what[3])));
-				m_opts(http_options::http_version, http_version);
-				if ( (http_version != "HTTP/1.1") && (http_version != "HTTP/1.0") )
-				{	return invoke_handler(errc::make_error_code(
-									errc::version_not_supported));
-				}
-			}else{
-				m_opts(http_options::http_version, "HTTP/1.0");
-			}
+		if (std::size_t(header_size) > max_header_size())
+		{
+			ec = errc::make_error_code(errc::header_too_large);
+			return true;
+		}
 
-			// 读取 余下的.
-			BOOST_ASIO_CORO_YIELD boost::asio::async_read_until(
-						m_stream, m_strembuf, std::string("\r\n"), *this);
+		m_opts(http_options::request_method,
+			boost::to_upper_copy(parser.method().to_string()));
 
+		m_opts(http_options::request_uri, parser.uri().to_string());
 
-			while((bytes_transferred > 2) && !ec)
+		if (!parser.version().empty())
+		{
+			std::string http_version = boost::to_upper_copy(parser.version().to_string());
+			m_opts(http_options::http_version, http_version);
+			if ( (http_version != "HTTP/1.1") && (http_version != "HTTP/1.0") )
 			{
-				one_header_line.resize(bytes_transferred);
-				m_strembuf.sgetn(&one_header_line[0], bytes_transferred);
-				one_header_line.resize(bytes_transferred-2);
-
-				if(!boost::regex_match(one_header_line, what,
-									   boost::regex("^([^:]*): *(.*)$")))
-				{
-					return invoke_handler(errc::make_error_code(
-								errc::malformed_request_headers));
-				}
-				m_opts(what[1], what[2]);
-				BOOST_ASIO_CORO_YIELD boost::asio::async_read_until(
-							m_stream, m_strembuf, std::string("\r\n"), *this);
+				ec = errc::make_error_code(errc::version_not_supported);
+				return true;
 			}
+		}else{
+			m_opts(http_options::http_version, "HTTP/1.0");
+		}
 
-			if (bytes_transferred == 2){
-				one_header_line.resize(bytes_transferred);
-				m_strembuf.sgetn(&one_header_line[0], bytes_transferred);
-				BOOST_ASSERT( one_header_line == "\r\n");
-			}
+		for (std::size_t i = 0; i < parser.num_headers(); i++)
+		{
+			const request_header & header = parser.header(i);
+			m_opts(header.name.to_string(), header.value.to_string());
+		}
 
-			if (m_opts.find(http_options::http_version) == "HTTP/1.1"
-				&& m_opts.find(http_options::host).empty())
-			{
-				return invoke_handler(errc::make_error_code(errc::header_missing_host));
-			}
+		// 只消费请求头, body 留在 streambuf 里.
+		m_strembuf.consume(header_size);
 
-			if (m_opts.find(http_options::request_method) == "POST"
-				&& m_opts.find(http_options::content_length).empty())
-			{
-				return invoke_handler(errc::make_error_code(errc::post_without_content));
-			}
+		if (m_opts.find(http_options::http_version) == "HTTP/1.1"
+			&& m_opts.find(http_options::host).empty())
+		{
+			ec = errc::make_error_code(errc::header_missing_host);
+			return true;
+		}
 
-			invoke_handler(ec);
+		if (m_opts.find(http_options::request_method) == "POST"
+			&& m_opts.find(http_options::content_length).empty())
+		{
+			ec = errc::make_error_code(errc::post_without_content);
+			return true;
 		}
+
+		return true;
 	}
-private:
+
 	template<class EC>
 	inline void invoke_handler(const EC &ec)
 	{
@@ -129,7 +150,8 @@ private:
 	Handler m_handler;
 
 	// 这里是协程用到的变量.
-
+	// 上次解析时 streambuf 里的数据长度, 之前的数据里已经确认没有请求头的结尾.
+	std::size_t m_last_size;
 };
 
 template<class Stream, class Allocator, class Handler>
@@ -0,0 +1,211 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <boost/utility/string_ref.hpp>
+
+#include "settings.hpp"
+
+namespace avhttpd {
+namespace detail {
+
+// 一行 header 的 name 和 value, 直接指向接收缓冲, 不做拷贝.
+struct request_header
+{
+	boost::string_ref name;
+	boost::string_ref value;
+};
+
+// 仿照 picohttpparser 写的请求头解析器, 不用 regex, 也不拷贝数据.
+// 数据不完整的时候传入上次解析过的长度 last_len, 只在新收到的数据里找请求头的
+// 结尾, 找到以后才把整个请求头从头到尾扫一遍.
+// 解析出来的 method/uri/header 都指向传入的 buf, buf 里的数据被消费之前有效.
+class request_parser
+{
+public:
+	enum
+	{
+		bad_request_line = -1,	// 请求行格式错误.
+		bad_header = -2,		// header 行格式错误.
+		incomplete = -3,		// 还没有收到完整的请求头.
+		too_many_headers = -4,	// header 超过 AVHTTPD_MAX_HEADERS 行.
+	};
+
+	request_parser()
+		: m_num_headers(0)
+	{}
+
+	// 解析 [buf, buf + len), 返回请求头(包括结尾的空行)的长度, 或者上面的错误值.
+	int parse(const char * buf, std::size_t len, std::size_t last_len = 0)
+	{
+		const char * buf_end = buf + len;
+		const char * p = buf;
+
+		m_num_headers = 0;
+
+		// 请求行前面的空行要忽略, 比如 POST 的 body 后面多发的 CRLF.
+		while (p != buf_end && (*p == '\r' || *p == '\n'))
+			++p;
+
+		// 先确认请求头完整了再解析, 下面的扫描都以 '\n' 结束, 不会越过 end.
+		const char * end = find_header_end(p, buf_end, buf + (last_len > 3 ? last_len - 3 : 0));
+		if (!end)
+			return incomplete;
+
+		// 请求行: METHOD SP URI [SP VERSION]
+		const char * tok = p;
+		while (is_alpha(*p))
+			++p;
+		if (p == tok || *p != ' ')
+			return bad_request_line;
+		m_method = boost::string_ref(tok, p - tok);
+
+		while (*p == ' ')
+			++p;
+		tok = p;
+		while (is_uri_char(*p))
+			++p;
+		if (p == tok)
+			return bad_request_line;
+		m_uri = boost::string_ref(tok, p - tok);
+
+		while (*p == ' ')
+			++p;
+		tok = p;
+		while (*p != '\r' && *p != '\n')
+		{
+			if (is_ctl(*p))
+				return bad_request_line;
+			++p;
+		}
+		m_version = boost::string_ref(tok, p - tok);
+		if (!skip_eol(p))
+			return bad_request_line;
+
+		// header: NAME ":" *SP VALUE, 一直到空行.
+		while (*p != '\r' && *p != '\n')
+		{
+			if (m_num_headers == AVHTTPD_MAX_HEADERS)
+				return too_many_headers;
+
+			tok = p;
+			while (is_token_char(*p))
+				++p;
+			if (p == tok || *p != ':')
+				return bad_header;
+			m_headers[m_num_headers].name = boost::string_ref(tok, p - tok);
+
+			++p;
+			while (*p == ' ' || *p == '\t')
+				++p;
+			tok = p;
+
+			// value 末尾的空白不算.
+			const char * value_end = p;
+			while (*p != '\r' && *p != '\n')
+			{
+				char c = *p++;
+				if (c != '\t' && is_ctl(c))
+					return bad_header;
+				if (c != ' ' && c != '\t')
+					value_end = p;
+			}
+			m_headers[m_num_headers].value = boost::string_ref(tok, value_end - tok);
+			if (!skip_eol(p))
+				return bad_header;
+
+			m_num_headers++;
+		}
+
+		if (!skip_eol(p))
+			return bad_header;
+
+		return p - buf;
+	}
+
+	boost::string_ref method() const
+	{
+		return m_method;
+	}
+
+	boost::string_ref uri() const
+	{
+		return m_uri;
+	}
+
+	// 请求行里没有版本的时候为空.
+	boost::string_ref version() const
+	{
+		return m_version;
+	}
+
+	std::size_t num_headers() const
+	{
+		return m_num_headers;
+	}
+
+	const request_header & header(std::size_t i) const
+	{
+		return m_headers[i];
+	}
+
+private:
+	// 从 from 开始找一个空行, 返回空行之后的位置, 没找到返回 NULL.
+	static const char * find_header_end(const char * begin, const char * end, const char * from)
+	{
+		const char * p = from < begin ? begin : from;
+		for (; p != end; ++p)
+		{
+			if (*p != '\n')
+				continue;
+			if (p + 1 != end && p[1] == '\n')
+				return p + 2;
+			if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+				return p + 3;
+		}
+		return NULL;
+	}
+
+	static bool skip_eol(const char *& p)
+	{
+		if (*p == '\r')
+			++p;
+		if (*p != '\n')
+			return false;
+		++p;
+		return true;
+	}
+
+	static bool is_ctl(char c)
+	{
+		return (unsigned char)c < 0x20 || c == 0x7f;
+	}
+
+	static bool is_alpha(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+	}
+
+	static bool is_uri_char(char c)
+	{
+		return (unsigned char)c > 0x20 && c != 0x7f;
+	}
+
+	// RFC 7230 的 tchar.
+	static bool is_token_char(char c)
+	{
+		return is_alpha(c) || (c >= '0' && c <= '9')
+			|| (c != 0 && std::strchr("!#$%&'*+-.^_`|~", c) != NULL);
+	}
+
+private:
+	boost::string_ref m_method;
+	boost::string_ref m_uri;
+	boost::string_ref m_version;
+	request_header m_headers[AVHTTPD_MAX_HEADERS];
+	std::size_t m_num_headers;
+};
+
+} // namespace detail
+} // namespace avhttpd
@@ -22,6 +22,16 @@
 #include <boost/filesystem.hpp>
 #include <boost/date_time.hpp>
 
+// 请求头最多允许的字节数, 超过时async_read_request返回errc::header_too_large.
+#ifndef AVHTTPD_MAX_HEADER_SIZE
+#define AVHTTPD_MAX_HEADER_SIZE 8192
+#endif
+
+// 请求头最多允许的header行数, 超过时同样返回errc::header_too_large.
+#ifndef AVHTTPD_MAX_HEADERS
+#define AVHTTPD_MAX_HEADERS 64
+#endif
+
 namespace avhttpd {
 
 // 常用有以下http选项.
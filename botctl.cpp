@@ -161,38 +161,31 @@ struct mail_recoder
 	boost::function<void(std::string)> sendmsg;
 
 	// 由 avbot 的 on_message 调用.
-	void operator()(avbot::av_message_tree jsonmessage, const boost::signals2::connection & con)
+	void operator()(const avbot_message & jsonmessage, const boost::signals2::connection & con)
 	{
 		static boost::regex ex(".qqbot mail subject \"?(.*)\"?");
 		boost::cmatch what;
 
-		try
-		{
-			if (jsonmessage.get<std::string>("channel") != channel)
-				return;
+		if (jsonmessage.channel.get() != channel)
+			return;
 
-			std::string tmsg = boost::trim_copy(jsonmessage.get<std::string>("message.text"));
+		std::string tmsg = boost::trim_copy(jsonmessage.text());
 
-			if (tmsg != ".qqbot end mail" && tmsg != ".qqbot mail end")
+		if (tmsg != ".qqbot end mail" && tmsg != ".qqbot mail end")
+		{
+			if (boost::regex_match(tmsg.c_str(), what, ex))
 			{
-				if (boost::regex_match(tmsg.c_str(), what, ex))
-				{
-					pimf->header["subject"] = what[1];
-				}
-				else
-				{
-					boost::get<std::string>(pimf->body) += mybot->format_message(jsonmessage);
-				}
+				pimf->header["subject"] = what[1];
 			}
 			else
 			{
-				mybot->get_mx()->async_send_mail(*pimf, *this);
-				con.disconnect();
+				boost::get<std::string>(pimf->body) += mybot->format_message(jsonmessage);
 			}
 		}
-		catch (...)
+		else
 		{
-			boost::get<std::string>(pimf->body) += mybot->format_message(jsonmessage);
+			mybot->get_mx()->async_send_mail(*pimf, *this);
+			con.disconnect();
 		}
 	}
 
@@ -210,23 +203,25 @@ struct mail_recoder
 
 // 命令控制, 所有的协议都能享受的命令控制在这里实现.
 // msg_sender 是一个函数, on_command 用/*它发送消息.
-void on_bot_command(avbot::av_message_tree jsonmessage, avbot & mybot)
+void on_bot_command(const avbot_message & jsonmessage, avbot & mybot)
 {
 
 	boost::regex ex;
 	boost::smatch what;
 	webqq::qqGroup_ptr  group;
+	const std::string & channel = jsonmessage.channel;
+
 	boost::function<void(std::string)> msg_sender = boost::bind(
 		&avbot::broadcast_message, &mybot,
-		jsonmessage.get<std::string>("channel"), _1
+		channel, _1
 	);
 
 	boost::function<void(std::string)> sendmsg = mybot.get_io_service().wrap(
 		boost::bind(iopost_msg, boost::ref(mybot.get_io_service()),
-			msg_sender, _1, jsonmessage.get<std::string>("channel"))
+			msg_sender, _1, channel)
 	);
 
-	std::string message = boost::trim_copy(jsonmessage.get<std::string>("message.text"));
+	std::string message = boost::trim_copy(jsonmessage.text());
 
 	if (message == ".qqbot help")
 	{
@@ -277,7 +272,7 @@ void on_bot_command(avbot::av_message_tree jsonmessage, avbot & mybot)
 		mrecoder.pimf->header["to"] = what[1];
 		mrecoder.pimf->header["subject"] = "send by avbot";
 		mrecoder.pimf->body = std::string("");
-		mrecoder.channel = jsonmessage.get<std::string>("channel");
+		mrecoder.channel = channel;
 		mrecoder.mybot = & mybot;
 		mrecoder.sendmsg = msg_sender;
 
@@ -321,7 +316,7 @@ void on_bot_command(avbot::av_message_tree jsonmessage, avbot & mybot)
 		list.push_back(nick);
 
 		auto_welcome question(
-			jsonmessage.get<std::string>("channel") +
+			channel +
 			"/welcome.txt"
 		);
 
@@ -338,8 +333,7 @@ void on_bot_command(avbot::av_message_tree jsonmessage, avbot & mybot)
 		std::string uin =  what[1];
 		std::string nick = what[2];
 
-		std::string channelname =  jsonmessage.get<std::string>("channel");
-		webqq::qqGroup_ptr groupptr =  mybot.get_qq()->get_Group_by_qq(channelname);
+		webqq::qqGroup_ptr groupptr =  mybot.get_qq()->get_Group_by_qq(channel);
 
 		if (groupptr)
 		{
@@ -353,7 +347,7 @@ void on_bot_command(avbot::av_message_tree jsonmessage, avbot & mybot)
 
 	}
 
-	if (jsonmessage.get<int>("op") != 1)
+	if (!jsonmessage.op.get_value_or(false))
 		return;
 
 	// 开始讲座记录.
@@ -365,7 +359,7 @@ void on_bot_command(avbot::av_message_tree jsonmessage, avbot & mybot)
 
 		if (title.empty()) return ;
 
-		group = mybot.get_qq()->get_Group_by_qq(jsonmessage.get<std::string>("channel"));
+		group = mybot.get_qq()->get_Group_by_qq(channel);
 
 		if (group &&  !logfile.begin_lecture(group->qqnum, title))
 		{
@@ -405,7 +399,7 @@ void on_bot_command(avbot::av_message_tree jsonmessage, avbot & mybot)
 	// 重新加载群成员列表.
 	if (message == ".qqbot reload")
 	{
-		group = mybot.get_qq()->get_Group_by_qq(jsonmessage.get<std::string>("channel"));
+		group = mybot.get_qq()->get_Group_by_qq(channel);
 
 		if (group)
 			mybot.get_io_service().post(
@@ -4,7 +4,7 @@
 
 // 命令控制, 所有的协议都能享受的命令控制在这里实现.
 // msg_sender 是一个函数, on_command 用它发送消息.
-void on_bot_command(avbot::av_message_tree message, avbot & mybot);
+void on_bot_command(const avbot_message & message, avbot & mybot);
 
 void set_do_vc(boost::function<void(std::string)>);
 void set_do_vc();
\ No newline at end of file
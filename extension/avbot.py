@@ -1,12 +1,10 @@
 # coding: UTF-8
-import json
-decoder = json.JSONDecoder()
-
 # MessageHandler.send_message 将在cpp里面设置
 class MessageHandler:
 
-	def on_message(self, str):
-		msg = decoder.decode(str)
+	# msg 是 dict, 字段和 avbot 的 json 消息格式一样.
+	# 在单独的 python 线程里调用, send_message 不会等待发送完成.
+	def on_message(self, msg):
 		if msg["who"]["name"] == "hyq":
 			self.send_message("hyq 你好")
 
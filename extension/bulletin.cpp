@@ -1,158 +1,395 @@
 ﻿
 #include <ctime>
+#include <cstdlib>
+#include <map>
+#include <fstream>
 #include <boost/date_time.hpp>
-#include "boost/date_time/c_local_time_adjustor.hpp"
 #include <boost/foreach.hpp>
-#include <boost/regex.hpp>
-#include <boost/lexical_cast.hpp>
-#include <boost/timedcall.hpp>
+#include <boost/bind.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/algorithm/string.hpp>
 
 #include "bulletin.hpp"
 #include <libavlog/avlog.hpp>
 
-void bulletin::load_settings()
-{
-	boost::filesystem::path settingsfile = boost::filesystem::current_path() / m_channel_name / "bulletin_setting" ;
-
-	m_settings->clear();
+namespace detail {
 
-	if( boost::filesystem::exists( settingsfile ) )
+struct bulletin_channel
+{
+	bulletin_channel()
+		: mtime(0)
+		, generation(0)
 	{
-		std::ifstream bulletin_setting( settingsfile.string().c_str() );
+	}
 
-		std::string line;
+	std::string channel_name;
+	boost::function<void ( std::string ) > sender;
 
-		while( std::getline( bulletin_setting, line ), !bulletin_setting.eof() )
-		{
-			m_settings->push_back( line );
-		}
+	std::time_t mtime;
+	std::vector<bulletin_rule> rules;
+	// 每次重新读取配置加一, 调度器里属于旧配置的项直接丢掉.
+	unsigned generation;
+};
 
+static bool parse_field(const std::string & field, int min, int max, int & value)
+{
+	if (field == "*")
+	{
+		value = -1;
+		return true;
 	}
+
+	if (field.empty() || field.size() > 4 || field.find_first_not_of("0123456789") != std::string::npos)
+		return false;
+
+	value = std::atoi(field.c_str());
+	return value >= min && value <= max;
 }
 
-static bool is_match(std::string cronline_field, int field)
+bool bulletin_rule::parse(const std::string & line)
 {
-	// 计划通,  呵呵,  检查 "*"
-	if (cronline_field == "*")
-		return true;
-	return (boost::lexical_cast<int>(cronline_field) == field);
+	std::string::size_type end = line.find_first_of(" \t");
+	std::vector<std::string> fields;
+
+	boost::split(fields, line.substr(0, end), boost::is_any_of("-"));
+
+	if (fields.size() != 5
+		|| !parse_field(fields[0], 1400, 9999, year)
+		|| !parse_field(fields[1], 1, 12, month)
+		|| !parse_field(fields[2], 1, 31, day)
+		|| !parse_field(fields[3], 0, 23, hour)
+		|| !parse_field(fields[4], 0, 59, minute))
+	{
+		return false;
+	}
+
+	msgfile = "bulletin.txt";
+
+	if (end != std::string::npos)
+	{
+		std::string::size_type start = line.find_first_not_of(" \t", end);
+
+		if (start != std::string::npos)
+			msgfile = boost::trim_right_copy(line.substr(start));
+	}
+
+	return true;
 }
 
-// 在这里调度一下下一次启动.
-void bulletin::schedule_next() const
+// 从 after 开始, 哪个字段不满足就把它跳到下一个可能的值, 更小的字段归零, 直到全部满足.
+bool bulletin_rule::next_fire(boost::posix_time::ptime after, boost::posix_time::ptime & out) const
 {
-	// 获取当前时间,  以 分为单位步进
-	// 直到获得一个能满足要求的时间值
-	// 或则超过 24h
-	// 如果这样就直接设定一天以后再重新跑
-	// 避免 cpu 无限下去.
-	boost::posix_time::ptime now =  boost::posix_time::second_clock::local_time();
-
-	boost::posix_time::ptime end = now  + boost::posix_time::hours(2);
-
-	// 比对 年月日.
-	boost::posix_time::ptime::date_type date = now.date();
-
-	boost::regex ex1("([0-9\\*]+)\\-([0-9\\*]+)\\-([0-9\\*]+)\\-([0-9\\*]+)\\-([0-9\\*]+)[ \t]+(.*)");
-	boost::regex ex2("([0-9\\*]+)\\-([0-9\\*]+)\\-([0-9\\*]+)\\-([0-9\\*]+)\\-([0-9\\*]+)");
-	boost::cmatch what;
-
-	// 以一分钟为步进.
-	for (	boost::posix_time::time_iterator titr(now + boost::posix_time::seconds(45), boost::posix_time::minutes(1));
-			titr < end;
-			++ titr )
+	int y = after.date().year();
+	int mo = after.date().month();
+	int d = after.date().day();
+	int h = after.time_of_day().hours();
+	int mi = after.time_of_day().minutes();
+
+	// 2 月 29 日这样的规则最多要等 8 年.
+	int last_year = year >= 0 ? year : y + 8;
+
+	while (y <= last_year)
 	{
-		BOOST_FOREACH(std::string cronline, *m_settings)
+		int days = boost::gregorian::gregorian_calendar::end_of_month_day(y, mo);
+
+		if (year >= 0 && y != year)
+		{
+			if (y > year)
+				return false;
+			y = year; mo = 1; d = 1; h = 0; mi = 0;
+		}
+		else if (month >= 0 && mo != month)
+		{
+			if (mo > month)
+				y++;
+			mo = month; d = 1; h = 0; mi = 0;
+		}
+		else if (day >= 0 && d != day)
+		{
+			if (d > day || day > days)
+			{
+				// 下个月
+				if (++mo > 12)
+				{
+					mo = 1;
+					y++;
+				}
+				d = 1;
+			}
+			else
+			{
+				d = day;
+			}
+			h = 0; mi = 0;
+		}
+		else if (hour >= 0 && h != hour)
 		{
-			// 使用 regex 提取 *-*-*-*-* 的各个数字.
-			if (boost::regex_match(cronline.c_str(), what, ex1))
+			if (h > hour)
 			{
-				// 然后为各个 filed 执行比较吧.
-				if( is_match( what[1], titr->date().year())
-					&& is_match( what[2], titr->date().month())
-					&& is_match( what[3], titr->date().day())
-					&& is_match( what[4], titr->time_of_day().hours())
-					&& is_match( what[5], titr->time_of_day().minutes())
-				)
+				// 明天
+				h = 0;
+				if (++d > days)
 				{
-					// 设定 expires
-					m_timer->expires_from_now(*titr - now + boost::posix_time::seconds( std::rand() % 30 +15 ));
-					m_timer->async_wait(boost::bind<void>(*this, _1, std::string(what[6])));
-					return;
+					d = 1;
+					if (++mo > 12)
+					{
+						mo = 1;
+						y++;
+					}
 				}
-			}else if (boost::regex_match(cronline.c_str(), what, ex2)){
-				if( is_match( what[1], titr->date().year())
-					&& is_match( what[2], titr->date().month())
-					&& is_match( what[3], titr->date().day())
-					&& is_match( what[4], titr->time_of_day().hours())
-					&& is_match( what[5], titr->time_of_day().minutes())
-				)
+			}
+			else
+			{
+				h = hour;
+			}
+			mi = 0;
+		}
+		else if (minute >= 0 && mi != minute)
+		{
+			if (mi > minute)
+			{
+				// 下一个小时
+				mi = 0;
+				if (++h > 23)
 				{
-					// 设定 expires
-					m_timer->expires_from_now(*titr - now + boost::posix_time::seconds( std::rand() % 30 + 15 ));
-					m_timer->async_wait(boost::bind<void>(*this, _1, std::string("bulletin.txt")));
-					return;
+					h = 0;
+					if (++d > days)
+					{
+						d = 1;
+						if (++mo > 12)
+						{
+							mo = 1;
+							y++;
+						}
+					}
 				}
 			}
+			else
+			{
+				mi = minute;
+			}
+		}
+		else
+		{
+			out = boost::posix_time::ptime(boost::gregorian::date(y, mo, d),
+				boost::posix_time::hours(h) + boost::posix_time::minutes(mi));
+			return true;
 		}
 	}
 
-	//
-
-	// 设定下次的 expires
-
-	// 设定 expires
-	m_timer->expires_from_now(boost::posix_time::hours(1));
-	m_timer->async_wait(*this);
-	return;
+	return false;
 }
 
-void bulletin::operator()( boost::property_tree::ptree message ) const
+} // namespace detail
+
+// 所有频道的公告共用一个定时器.
+// 待发送的公告按时间排在一个 multimap 里, 定时器总是设到最早的一个, 最多一分钟,
+// 每次醒来顺便检查各频道的 bulletin_setting 有没有修改.
+class bulletin_scheduler
+	: boost::noncopyable
+	, public boost::enable_shared_from_this<bulletin_scheduler>
 {
-	// 其实主要是为了响应 .qqbot bulletin 命令.
+	struct entry
+	{
+		boost::weak_ptr<detail::bulletin_channel> channel;
+		unsigned generation;
+		std::size_t rule;
+		// 规则匹配的那一分钟, 实际发送时间会加上 15 到 45 秒的随机延迟.
+		boost::posix_time::ptime minute;
+	};
 
-}
+	typedef std::multimap<boost::posix_time::ptime, entry> queue_type;
 
-void bulletin::operator()( boost::system::error_code ec, std::string msgfile )
-{
-	if (ec)
-		return;
-	load_settings();
-	schedule_next();
+public:
+	bulletin_scheduler(boost::asio::io_service & io_service)
+		: m_timer(io_service)
+		, m_stopped(false)
+	{
+	}
+
+	void stop()
+	{
+		boost::system::error_code ec;
+		m_stopped = true;
+		m_timer.cancel(ec);
+	}
+
+	void add(boost::shared_ptr<detail::bulletin_channel> channel)
+	{
+		m_channels.push_back(channel);
+
+		boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+
+		reload(channel, now);
+		reset_timer(now);
+	}
+
+private:
+	static boost::filesystem::path settings_file(const detail::bulletin_channel & channel)
+	{
+		return boost::filesystem::current_path() / channel.channel_name / "bulletin_setting";
+	}
+
+	// 配置文件修改过 (或者被删除) 就重新读取并安排所有规则, 没有变化返回 false.
+	bool reload(boost::shared_ptr<detail::bulletin_channel> channel, boost::posix_time::ptime now)
+	{
+		boost::filesystem::path settingsfile = settings_file(*channel);
+		boost::system::error_code ec;
+		std::time_t mtime = boost::filesystem::last_write_time(settingsfile, ec);
+
+		if (ec)
+			mtime = 0;
+
+		if (mtime == channel->mtime && channel->generation)
+			return false;
+
+		channel->mtime = mtime;
+		channel->generation++;
+		channel->rules.clear();
+
+		if (mtime)
+		{
+			std::ifstream bulletin_setting( settingsfile.string().c_str() );
+			std::string line;
+
+			while (std::getline(bulletin_setting, line))
+			{
+				detail::bulletin_rule rule;
+
+				if (rule.parse(boost::trim_copy(line)))
+					channel->rules.push_back(rule);
+			}
+		}
+
+		for (std::size_t i = 0; i < channel->rules.size(); i++)
+			schedule(channel, i, now + boost::posix_time::seconds(45));
+
+		return true;
+	}
+
+	void schedule(boost::shared_ptr<detail::bulletin_channel> channel, std::size_t rule, boost::posix_time::ptime after)
+	{
+		entry e;
+
+		if (!channel->rules[rule].next_fire(after, e.minute))
+			return;
+
+		e.channel = channel;
+		e.generation = channel->generation;
+		e.rule = rule;
+
+		m_queue.insert(std::make_pair(e.minute + boost::posix_time::seconds(std::rand() % 30 + 15), e));
+	}
+
+	void reset_timer(boost::posix_time::ptime now)
+	{
+		boost::posix_time::ptime next = now + boost::posix_time::minutes(1);
+
+		if (!m_queue.empty() && m_queue.begin()->first < next)
+			next = m_queue.begin()->first;
+
+		m_timer.expires_from_now(next - now);
+		m_timer.async_wait(boost::bind(&bulletin_scheduler::on_timer, shared_from_this(), _1));
+	}
+
+	void on_timer(boost::system::error_code ec)
+	{
+		if (ec || m_stopped)
+			return;
+
+		boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+
+		// 检查配置有没有修改, 顺便清理已经不存在的频道.
+		for (std::size_t i = 0; i < m_channels.size();)
+		{
+			boost::shared_ptr<detail::bulletin_channel> channel = m_channels[i].lock();
+
+			if (!channel)
+			{
+				m_channels.erase(m_channels.begin() + i);
+				continue;
+			}
+
+			reload(channel, now);
+			i++;
+		}
+
+		while (!m_queue.empty() && m_queue.begin()->first <= now)
+		{
+			entry e = m_queue.begin()->second;
+			m_queue.erase(m_queue.begin());
+
+			boost::shared_ptr<detail::bulletin_channel> channel = e.channel.lock();
+
+			if (!channel || channel->generation != e.generation)
+				continue;
+
+			send_msg_file(*channel, channel->rules[e.rule].msgfile);
+			schedule(channel, e.rule, e.minute + boost::posix_time::minutes(1));
+		}
+
+		reset_timer(now);
+	}
 
 	// 打开 bulletin 文件然后发送文件内容.
 	// 就是这么回事.
-	send_msg_file(msgfile);
+	static void send_msg_file(const detail::bulletin_channel & channel, std::string msgfile)
+	{
+		std::string bulletinmsg;
+		fs::path msgfilepath =  fs::current_path() / channel.channel_name / msgfile ;
+
+		try
+		{
+			boost::uintmax_t fsize = fs::file_size(msgfilepath);
+			std::ifstream msgstream( msgfilepath.string().c_str() );
+			bulletinmsg.resize(fsize);
+			msgstream.read(&bulletinmsg[0], fsize);
+		}
+		catch( std::runtime_error )
+		{
+			// 文件无法打开 ...
+			bulletinmsg = "无法打开 [logdir]/";
+			bulletinmsg += "/";
+			bulletinmsg += channel.channel_name;
+			bulletinmsg += "/";
+			bulletinmsg += msgfile;
+			bulletinmsg += " 请检查文件是否存在.";
+		}
+
+		channel.sender(bulletinmsg);
+	}
+
+private:
+	boost::asio::deadline_timer m_timer;
+	queue_type m_queue;
+	std::vector<boost::weak_ptr<detail::bulletin_channel> > m_channels;
+	bool m_stopped;
+};
+
+boost::shared_ptr<bulletin_scheduler> make_bulletin_scheduler(boost::asio::io_service & io_service)
+{
+	return boost::make_shared<bulletin_scheduler>(boost::ref(io_service));
 }
 
-void bulletin::operator()( boost::system::error_code)
+void stop_bulletin_scheduler(bulletin_scheduler & scheduler)
 {
-	load_settings();
-	schedule_next();
+	scheduler.stop();
 }
 
-void bulletin::send_msg_file( std::string msgfile ) const
+void bulletin::start(bulletin_scheduler & scheduler, boost::function<void ( std::string ) > sender, std::string channel_name)
 {
-	std::string bulletinmsg;
-	fs::path msgfilepath =  fs::current_path() / m_channel_name / msgfile ;
+	m_channel.reset(new detail::bulletin_channel);
+	m_channel->channel_name = channel_name;
+	m_channel->sender = sender;
 
-	try
-	{
-		boost::uintmax_t fsize = fs::file_size(msgfilepath);
-		std::ifstream msgstream( msgfilepath.string().c_str() );
-		bulletinmsg.resize(fsize);
-		msgstream.read(&bulletinmsg[0], fsize);
-	}
-	catch( std::runtime_error )
-	{
-		// 文件无法打开 ...
-		bulletinmsg = "无法打开 [logdir]/";
-		bulletinmsg += "/";
-		bulletinmsg += m_channel_name;
-		bulletinmsg += "/";
-		bulletinmsg += msgfile;
-		bulletinmsg += " 请检查文件是否存在.";
-	}
+	scheduler.add(m_channel);
+}
+
+void bulletin::operator()( const avbot_message & message ) const
+{
+	// 其实主要是为了响应 .qqbot bulletin 命令.
 
-	m_sender(bulletinmsg);
 }
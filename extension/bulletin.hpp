@@ -9,28 +9,46 @@
 #include <boost/asio.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include "extension.hpp"
 
+namespace detail {
+
+// bulletin_setting 里的一行, 编译成数字, -1 表示 *.
+struct bulletin_rule
+{
+	int year, month, day, hour, minute;
+	std::string msgfile;
+
+	// 解析 YY-MM-DD-HH-MM [文件名], 格式不对返回 false.
+	bool parse(const std::string & line);
+
+	// 计算 after 之后 (包括 after 所在的这一分钟) 第一个满足规则的整分钟.
+	// 永远不会满足的规则 (比如 2 月 30 日, 或者过去的年份) 返回 false.
+	bool next_fire(boost::posix_time::ptime after, boost::posix_time::ptime & out) const;
+};
+
+struct bulletin_channel;
+
+} // namespace detail
+
+// 所有频道的公告共用一个调度器, 由 avbot_extensions 持有.
+class bulletin_scheduler;
+
+boost::shared_ptr<bulletin_scheduler> make_bulletin_scheduler(boost::asio::io_service & io_service);
+// 停止调度器的定时器, 必须在 io_service 析构之前调用.
+void stop_bulletin_scheduler(bulletin_scheduler & scheduler);
+
 class bulletin
 {
-	boost::asio::io_service &io_service;
-	boost::function<void ( std::string ) > m_sender;
-	boost::shared_ptr<boost::asio::deadline_timer> m_timer;
-	boost::shared_ptr<std::vector<std::string> > m_settings;
-	std::string m_channel_name;
-	void load_settings();
-	void schedule_next() const;
-	void send_msg_file( std::string msgfile)const;
+	boost::shared_ptr<detail::bulletin_channel> m_channel;
+
+	void start(bulletin_scheduler & scheduler, boost::function<void ( std::string ) > sender, std::string channel_name);
 public:
 
 	template<class MsgSender>
-	bulletin( boost::asio::io_service &_io_service,  MsgSender sender, std::string channel_name )
-	  : m_sender(sender)
-	  , m_settings(new std::vector<std::string>)
-	  , m_channel_name(channel_name)
-	  , m_timer(new boost::asio::deadline_timer(_io_service))
-	  , io_service(_io_service)
+	bulletin( bulletin_scheduler & scheduler,  MsgSender sender, std::string channel_name )
 	{
 		// 读取公告配置.
 		// 公告配置分两个部分, 一个是公告文件  $qqlog/$channel_name/bulletin.txt
@@ -41,19 +59,10 @@ public:
 		// 留 * 表示 每
 		// 比如 *-*-*-08-00 表示每天早上 8 点
 		// 保存在  $qqlog/$channel_name/bulletin_setting
-
-		// 那么, 读取公告设置吧!
-		try{
-			load_settings();
-		}catch (std::runtime_error){}
-
-		schedule_next();
+		// 配置只在文件修改以后才重新读取, 所有频道由同一个定时器调度.
+		start(scheduler, sender, channel_name);
 	}
 
 	// on_message 回调.
-	void operator()( boost::property_tree::ptree message ) const;
-	// 超时的回调 - 重算调度.
-	void operator()( boost::system::error_code);
-	// 超时的回调 - 回显.
-	void operator()( boost::system::error_code, std::string );
+	void operator()( const avbot_message & message ) const;
 };
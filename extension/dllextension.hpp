@@ -49,9 +49,12 @@ public:
 
 	typedef void (*avbot_on_message_t)(const char * message, const char * channel, message_sender_t sender, void* _apitag);
 
-	void operator()(boost::property_tree::ptree msg)
+	void operator()(const avbot_message & msg)
 	{
-		std::string textmsg = boost::trim_copy(msg.get<std::string>("message.text"));
+		std::string textmsg = boost::trim_copy(msg.text());
+
+		if (textmsg.empty())
+			return;
 
 		boost::thread t(boost::bind(&dllextention_caller<MsgSender>::call_dll_message, this, textmsg, m_channel, m_sender));
 		t.detach();
@@ -1,4 +1,7 @@
 
+#include <cstring>
+#include <vector>
+#include <ostream>
 #include <boost/asio.hpp>
 #ifdef HAVE_ZLIB
 #include <zlib.h>
@@ -47,132 +50,210 @@ static void sender(avbot & mybot,std::string channel_name, std::string txt, bool
 	}
 }
 
-void new_channel_set_extension(boost::asio::io_service &io_service, avbot & mybot , std::string channel_name)
+// 把 qqwry.rar 解压写入文件, 每次只解压 64k, 不需要把整个 qqwry.dat 放在内存里.
+static bool inflate_qqwry(const char* data, std::size_t size, std::ostream& out)
 {
-	mybot.on_message.connect(
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+
+	if (inflateInit(&stream) != Z_OK)
+		return false;
+
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = size;
+
+	std::vector<char> buf(64 * 1024);
+	int ret;
+
+	do
+	{
+		stream.next_out = (Bytef*)&buf[0];
+		stream.avail_out = buf.size();
+
+		ret = inflate(&stream, Z_NO_FLUSH);
+
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			break;
+
+		out.write(&buf[0], buf.size() - stream.avail_out);
+	} while (ret != Z_STREAM_END && out);
+
+	inflateEnd(&stream);
+	return ret == Z_STREAM_END && out;
+}
+
+avbot_extensions::avbot_extensions(boost::asio::io_service & io_service, avbot & mybot)
+	: m_io_service(io_service)
+	, m_mybot(mybot)
+	, m_dispatcher(new avbot_extension_dispatcher)
+{
+	// 所有频道的扩展共用一个分发器, 只连接一次 on_message.
+	m_on_message = mybot.on_message.connect(
+		boost::bind(&avbot_extension_dispatcher::operator(), m_dispatcher, _1)
+	);
+
+#ifdef ENABLE_ZMQ
+	// zmq 发布所有频道的消息, 不需要每个频道一个.
+	m_zmq_publisher = make_zmq_publisher();
+	m_on_message_zmq = mybot.on_message.connect(
+		boost::bind(&zmq_publish, m_zmq_publisher, _1)
+	);
+#endif
+
+	m_urlpreview_service = make_urlpreview_service(io_service);
+	m_bulletin_scheduler = make_bulletin_scheduler(io_service);
+
+	// 找 qqwry.dat, 找不到就下载, 然后在后台建表.
+	m_ipdb_mgr.reset(new iplocationdetail::ipdb_mgr(io_service, inflate_qqwry));
+	m_ipdb_mgr->search_and_build_db();
+
+	m_static_rules = make_static_rule_cache(io_service);
+
+#ifdef ENABLE_PYTHON
+	m_python_thread = make_python_thread(io_service);
+#endif
+
+	m_on_new_channel = mybot.signal_new_channel.connect(
+		boost::bind(&avbot_extensions::new_channel, this, _1)
+	);
+}
+
+avbot_extensions::~avbot_extensions()
+{
+	m_on_new_channel.disconnect();
+	m_on_message.disconnect();
+	m_on_message_zmq.disconnect();
+
+	stop_urlpreview_service(*m_urlpreview_service);
+	stop_bulletin_scheduler(*m_bulletin_scheduler);
+	m_ipdb_mgr->stop();
+	stop_static_rule_cache(*m_static_rules);
+
+#ifdef ENABLE_PYTHON
+	stop_python_thread(*m_python_thread);
+#endif
+
+#ifdef ENABLE_ZMQ
+	stop_zmq_publisher(*m_zmq_publisher);
+#endif
+}
+
+void avbot_extensions::new_channel(std::string channel_name)
+{
+	m_dispatcher->add_extension(
 		avbot_extension(
 			channel_name,
 			joke(
-				io_service,
-				io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 0)),
+				m_io_service,
+				m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 0)),
 				channel_name,
 				boost::posix_time::seconds(600)
 			)
 		)
 	);
 
-	mybot.on_message.connect(
+	m_dispatcher->add_extension(
 		avbot_extension(
 			channel_name,
-			urlpreview(io_service,
-				io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 1))
+			urlpreview(m_io_service,
+				m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 1)),
+				m_urlpreview_service
 			)
 		)
 	);
 #ifdef ENABLE_LUA
-	mybot.on_message.connect(
+	m_dispatcher->add_extension(
 		make_luascript(
 			channel_name,
-			io_service,
-			io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 1))
+			m_io_service,
+			m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 1))
 		)
 	);
 #endif
-	mybot.on_message.connect (
+	m_dispatcher->add_extension(
 		avbot_extension(
 			channel_name,
 			::bulletin(
-				io_service,
-				io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 1)),
+				*m_bulletin_scheduler,
+				m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 1)),
 				channel_name
 			)
 		)
 	);
-	mybot.on_message.connect (
+	m_dispatcher->add_extension(
 		avbot_extension(
 			channel_name,
 			make_metalprice(
-				io_service,
-				io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 1))
+				m_io_service,
+				m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 1))
 			)
 		)
 	);
-	mybot.on_message.connect (
+	m_dispatcher->add_extension(
 		avbot_extension(
 			channel_name,
 			make_stockprice(
-				io_service,
-				io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 1))
+				m_io_service,
+				m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 1))
 			)
 		)
 	);
-	mybot.on_message.connect (
+	m_dispatcher->add_extension(
 		avbot_extension(
 			channel_name,
 			::exchangerate(
-				io_service,
-				io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 1))
+				m_io_service,
+				m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 1))
 			)
 		)
 	);
 
-	static boost::shared_ptr<iplocationdetail::ipdb_mgr> ipdb_mgr;
-
-	if (!ipdb_mgr)
-	{
-		// check for file "qqwry.dat"
-		// if not exist, then download that file
-		// after download that file, construct ipdb
-		ipdb_mgr.reset(new  iplocationdetail::ipdb_mgr(mybot.get_io_service(), uncompress));
-		ipdb_mgr->search_and_build_db();
-	}
-
-	mybot.on_message.connect(
+	m_dispatcher->add_extension(
 		avbot_extension(
 			channel_name,
 			make_iplocation(
-				io_service,
-				io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 0)),
-				ipdb_mgr
+				m_io_service,
+				m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 0)),
+				m_ipdb_mgr
 			)
 		)
 	);
 
-	mybot.on_message.connect(
+	m_dispatcher->add_extension(
 		make_static_content(
-			io_service,
+			m_static_rules,
 			channel_name,
-			io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 0))
+			m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 0))
 		)
 	);
 
 #ifdef ENABLE_PYTHON
-	mybot.on_message.connect(
+	m_dispatcher->add_extension(
 		make_python_script_engine(
-			io_service,
+			m_python_thread,
+			m_io_service,
 			channel_name,
-			io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 0))
+			m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 0))
 		)
 	);
 #endif
 
-#ifdef ENABLE_ZMQ
-	mybot.on_message.connect(
-		make_zmq_publisher(
-			io_service,
-			channel_name,
-			io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 0))
-		)
-	);
-#endif 
-
 #ifdef _WIN32
-	mybot.on_message.connect(
+	m_dispatcher->add_extension(
 		make_dllextention(
-			io_service,
+			m_io_service,
 			channel_name,
-			io_service.wrap(boost::bind(sender, boost::ref(mybot), channel_name, _1, 0))
+			m_io_service.wrap(boost::bind(sender, boost::ref(m_mybot), channel_name, _1, 0))
 		)
 	);
 #endif
 }
+
+boost::property_tree::ptree avbot_extensions::status() const
+{
+	boost::property_tree::ptree out;
+#ifdef ENABLE_ZMQ
+	out.put_child("zmq", zmq_publisher_status(*m_zmq_publisher));
+#endif
+	return out;
+}
@@ -2,28 +2,38 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <boost/function.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/signals2.hpp>
 
 #include "libavbot/avbot.hpp"
 #include "boost/stringencodings.hpp"
 
 class avbot_extension;
+class PythonThread;
+class ZmqPublisher;
+class static_rule_cache;
+class bulletin_scheduler;
+class urlpreview_service;
+namespace iplocationdetail { struct ipdb_mgr; }
 
 namespace detail{
 class avbotexteison_interface
 {
 public:
-	virtual void operator()(const boost::property_tree::ptree & msg) = 0;
+	virtual void operator()(const avbot_message & msg) = 0;
 };
 
 template<class ExtensionType>
 class avbotexteison_adapter : public avbotexteison_interface
 {
 	ExtensionType m_pextension;
-	void operator()(const boost::property_tree::ptree & msg)
+	void operator()(const avbot_message & msg)
 	{
 		(m_pextension)(msg);
 	}
@@ -46,7 +56,7 @@ public:
 class avbot_extension
 {
 	boost::shared_ptr<detail::avbotexteison_interface> m_exteison_obj;
-	std::string m_channel_name;
+	avbot_interned_string m_channel_name;
 
 public:
 
@@ -90,20 +100,100 @@ public:
 		return *this;
 	}
 
-	void operator()(const boost::property_tree::ptree & msg)
+	void operator()(const avbot_message & msg)
 	{
-		try{
-			if (msg.get<std::string>("channel") != m_channel_name)
-				return;
-			// 调用实际的函数
-			(*m_exteison_obj)(msg);
-		}catch (const boost::property_tree::ptree_error&)
+		if (msg.channel != m_channel_name)
+			return;
+		// 调用实际的函数
+		(*m_exteison_obj)(msg);
+	}
+	typedef void result_type;
+
+	const avbot_interned_string & channel_name() const
+	{
+		return m_channel_name;
+	}
+};
+
+// 按频道分发消息给扩展.
+// 只有它连接到 avbot::on_message, 每条消息只查一次表, 然后调用这个频道的扩展,
+// 而不是每个频道的每个扩展都收到所有的消息再自己丢弃不是本频道的.
+class avbot_extension_dispatcher : boost::noncopyable
+{
+	// 频道名是 flyweight, 同名的频道地址相同, 直接用地址做 hash.
+	struct channel_hash
+	{
+		std::size_t operator()(const avbot_interned_string & channel) const
 		{
-            // error access the ptree
-            // ignore it
-        }
+			return boost::hash<const std::string *>()(&channel.get());
+		}
+	};
+
+	typedef boost::unordered_map<
+		avbot_interned_string, std::vector<avbot_extension>, channel_hash
+	> extension_map;
+
+	extension_map m_extensions;
+
+public:
+	void add_extension(const avbot_extension & extension)
+	{
+		m_extensions[extension.channel_name()].push_back(extension);
+	}
+
+	void operator()(const avbot_message & msg)
+	{
+		extension_map::iterator it = m_extensions.find(msg.channel);
+
+		if (it == m_extensions.end())
+			return;
+
+		// 扩展在处理消息的时候可能会创建新频道, 所以不用迭代器.
+		std::vector<avbot_extension> & extensions = it->second;
+
+		for (std::size_t i = 0; i < extensions.size(); i++)
+			extensions[i](msg);
 	}
 	typedef void result_type;
 };
 
-void new_channel_set_extension(boost::asio::io_service &io_service, avbot & mybot , std::string channel_name);
+// 一个 avbot 的所有扩展.
+// 由创建 avbot 的代码持有, 每个 avbot 一个, 析构的时候断开和 avbot 的连接, 扩展随之销毁.
+// 必须在 io_service 之前析构.
+class avbot_extensions : boost::noncopyable
+{
+public:
+	avbot_extensions(boost::asio::io_service & io_service, avbot & mybot);
+	// 停止扩展的后台线程.
+	~avbot_extensions();
+
+	// 为新频道创建扩展, avbot::signal_new_channel 激发时调用.
+	void new_channel(std::string channel_name);
+
+	// 扩展的运行统计, 给 RPC 的 /status 用.
+	boost::property_tree::ptree status() const;
+
+private:
+	boost::asio::io_service & m_io_service;
+	avbot & m_mybot;
+
+	boost::shared_ptr<avbot_extension_dispatcher> m_dispatcher;
+
+	// 所有频道共用的 url 预览缓存.
+	boost::shared_ptr<urlpreview_service> m_urlpreview_service;
+	// 所有频道的公告共用一个定时器.
+	boost::shared_ptr<bulletin_scheduler> m_bulletin_scheduler;
+	// 所有频道共用的 qqwry.dat.
+	boost::shared_ptr<iplocationdetail::ipdb_mgr> m_ipdb_mgr;
+	// 所有频道共用的 static.xml 规则.
+	boost::shared_ptr<static_rule_cache> m_static_rules;
+	// 所有频道共用的 python 线程, 没有启用 python 的时候为空.
+	boost::shared_ptr<PythonThread> m_python_thread;
+	// 发布所有频道的消息, 没有启用 zmq 的时候为空.
+	boost::shared_ptr<ZmqPublisher> m_zmq_publisher;
+
+	boost::signals2::scoped_connection m_on_message;
+	boost::signals2::scoped_connection m_on_message_zmq;
+	boost::signals2::scoped_connection m_on_new_channel;
+};
+
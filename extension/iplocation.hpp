@@ -2,10 +2,15 @@
 #ifndef iplocation_h__
 #define iplocation_h__
 
+#include <ctime>
+#include <fstream>
 #include <boost/regex.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/type_traits/remove_reference.hpp>
 
@@ -14,31 +19,44 @@
 
 #include "boost/stringencodings.hpp"
 #include "qqwry/ipdb.hpp"
+#include "qqwry/iptable.hpp"
+#include "libavbot/avbot_message.hpp"
 
 namespace iplocationdetail{
 
-// download qqwy.dat file and decode it and return decoded data.
-// so the user can decide to write to file or just pass it to the constructor
-template<class uncompressfunc, class Handler>
+// download copywrite.rar and qqwry.rar, the handler gets both files undecoded
+// together with the Last-Modified header, so the heavy decoding can be done elsewhere.
+// if if_modified_since is given and the server has nothing newer,
+// the handler gets avhttp::errc::not_modified.
+template<class Handler>
 struct download_qqwry_dat_op : boost::asio::coroutine
 {
 	boost::asio::io_service& m_io_service;
 
-	uncompressfunc m_uncompress;
 	Handler m_handler;
 
 	boost::shared_ptr<avhttp::http_stream> m_http_stream;
 	boost::shared_ptr<boost::asio::streambuf> m_buf_copywrite_rar;
 	boost::shared_ptr<boost::asio::streambuf> m_buf_qqwry_rar;
+	boost::shared_ptr<std::string> m_last_modified;
 
-	download_qqwry_dat_op(boost::asio::io_service& _io_service, uncompressfunc uncompress, Handler handler)
+	download_qqwry_dat_op(boost::asio::io_service& _io_service, const std::string& if_modified_since, Handler handler)
 		: m_io_service(_io_service)
-		, m_uncompress(uncompress)
 		, m_handler(handler)
+		, m_last_modified(new std::string)
 	{
 		// start downloading copyrite.rar
 		m_http_stream.reset(new avhttp::http_stream(m_io_service));
 		m_buf_copywrite_rar.reset(new boost::asio::streambuf);
+
+		if (!if_modified_since.empty())
+		{
+			m_http_stream->request_options(
+				avhttp::request_opts()
+				("If-Modified-Since", if_modified_since)
+			);
+		}
+
 		avhttp::async_read_body(*m_http_stream, "http://update.cz88.net/ip/copywrite.rar", *m_buf_copywrite_rar, *this);
 	}
 
@@ -46,6 +64,14 @@ struct download_qqwry_dat_op : boost::asio::coroutine
 	{
 		BOOST_ASIO_CORO_REENTER(this)
 		{
+			if (ec)
+			{
+				m_handler(ec, std::string(), std::string(), std::string());
+				return;
+			}
+
+			m_http_stream->response_options().find("Last-Modified", *m_last_modified);
+
 			// 然后下 qqwry.dat
 			m_http_stream.reset(new avhttp::http_stream(m_io_service));
 			m_buf_qqwry_rar.reset(new boost::asio::streambuf);
@@ -57,67 +83,130 @@ struct download_qqwry_dat_op : boost::asio::coroutine
 				*this
 			);
 
-			// 解码
+			if (ec)
+			{
+				m_handler(ec, std::string(), std::string(), std::string());
+				return;
+			}
+
 			{
 				std::string copywrite, qqwry;
 				copywrite.resize(boost::asio::buffer_size(m_buf_copywrite_rar->data()));
 				m_buf_copywrite_rar->sgetn(&copywrite[0], copywrite.size());
-				qqwry.resize(bytes_transfered);
-				m_buf_qqwry_rar->sgetn(&qqwry[0], bytes_transfered);
-
-				std::string m_decoded = QQWry::decodeQQWryDat(copywrite, qqwry, m_uncompress);
+				qqwry.resize(boost::asio::buffer_size(m_buf_qqwry_rar->data()));
+				m_buf_qqwry_rar->sgetn(&qqwry[0], qqwry.size());
 
 				// callback
-				m_handler(m_decoded);
+				m_handler(ec, copywrite, qqwry, *m_last_modified);
 			}
 		}
 	}
 };
 
-template<class uncompressfunc, class Handler>
-void download_qqwry_dat(boost::asio::io_service& io_service, uncompressfunc uncompress, Handler handler)
+template<class Handler>
+void download_qqwry_dat(boost::asio::io_service& io_service, const std::string& if_modified_since, Handler handler)
 {
-	download_qqwry_dat_op<uncompressfunc, Handler> op(io_service, uncompress, handler);
+	download_qqwry_dat_op<Handler> op(io_service, if_modified_since, handler);
 }
 
-struct ipdb_mgr
+// 把解密后的 qqwry.rar 解压写入 out, 成功返回 true.
+// 在后台线程里调用.
+typedef boost::function<bool(const char* data, std::size_t size, std::ostream& out)> inflate_function;
+
+// 管理 qqwry.dat, 所有 iplocation 共享, 由 avbot_extensions 持有.
+// 载入, 下载后的解压, 建表都在后台线程里做, 做完了投递回 io_service 替换 table.
+// table 只在 io_service 线程里读写, 正在用旧 table 的查询不受影响.
+struct ipdb_mgr : public boost::enable_shared_from_this<ipdb_mgr>
 {
 private:
 	boost::asio::io_service & m_io_service;
-	boost::function<int(unsigned char *pDest, unsigned long *pDest_len, const unsigned char *pSource, unsigned long source_len)> m_uncompress;
-	std::string decoded_data;
+	inflate_function m_inflate;
+	boost::asio::deadline_timer m_refresh_timer;
+	// 后台正在下载或者载入.
+	bool m_busy;
+	// 当前数据的修改时间, 用于 If-Modified-Since.
+	std::string m_last_modified;
+
+	// 后台线程, 同一时间最多一个.
+	boost::thread m_worker;
+	// stop 之后后台线程不再投递到 io_service.
+	boost::mutex m_stop_mutex;
+	bool m_stopped;
 public:
-	boost::shared_ptr<QQWry::ipdb> db;
+	boost::shared_ptr<const QQWry::iptable> table;
 public:
-	template<typename uncompressfunc>
-	ipdb_mgr(boost::asio::io_service & _io_servcie, uncompressfunc uncompress_)
-		: m_uncompress(uncompress_)
-		, m_io_service(_io_servcie)
+	ipdb_mgr(boost::asio::io_service & _io_servcie, inflate_function inflate)
+		: m_io_service(_io_servcie)
+		, m_inflate(inflate)
+		, m_refresh_timer(_io_servcie)
+		, m_busy(false)
+		, m_stopped(false)
 	{
+	}
 
+	// 停止定时刷新, 等待后台线程退出, 必须在 io_service 析构之前调用.
+	void stop()
+	{
+		{
+			boost::mutex::scoped_lock l(m_stop_mutex);
+			m_stopped = true;
+		}
+
+		boost::system::error_code ec;
+		m_refresh_timer.cancel(ec);
+
+		if (m_worker.joinable())
+			m_worker.join();
 	}
 
 	bool search_and_build_db()
 	{
-		if (boost::filesystem::exists("/tmp/qqwry.dat"))
+		boost::filesystem::path p = find_qqwry_dat();
+
+		if (!p.empty())
 		{
 			// good
-			db.reset(new QQWry::ipdb("/tmp/qqwry.dat"));
+			m_last_modified = http_date(boost::filesystem::last_write_time(p));
+			m_busy = true;
+			start_worker(boost::bind(&ipdb_mgr::load_in_background, shared_from_this(), p, std::string()));
+			schedule_refresh();
 			return true;
 		}
 
-		boost::filesystem::path p;
-		p = "qqwry.dat";
+		// 找不到，得找个机会去 .. 下载
+		start_download();
+		schedule_refresh();
+		return false;
+	}
+
+	bool is_ready() const
+	{
+		return !!table;
+	}
+
+private:
+	static boost::filesystem::path save_path()
+	{
+		// save to /tmp/qqwry.dat or qqwry.dat depend on the OS
+#ifndef _WIN32
+		return "/tmp/qqwry.dat";
+#else
+		return "qqwry.dat";
+#endif
+	}
+
+	static boost::filesystem::path find_qqwry_dat()
+	{
+		if (boost::filesystem::exists("/tmp/qqwry.dat"))
+			return "/tmp/qqwry.dat";
+
 		// find qqwry.dat
-		if (boost::filesystem::exists(p))
-		{
-			db.reset(new QQWry::ipdb("qqwry.dat"));
-			return true;
-			// good
-		}
+		if (boost::filesystem::exists("qqwry.dat"))
+			return "qqwry.dat";
 
 #ifdef _WIN32
 		// find pathof(avbot.exe)/qqwry.dat
+		boost::filesystem::path p;
 		{char exePATH[4096];
 		::GetModuleFileName(NULL, exePATH, sizeof(exePATH));
 		p = exePATH; }
@@ -125,47 +214,141 @@ public:
 		p = p.parent_path() / "qqwry.dat";
 
 		if (boost::filesystem::exists(p))
-		{
-			db.reset(new QQWry::ipdb(p.string().c_str()));
-			return true;
-			// good
-		}			// construct
+			return p;
 #endif // _WIN32
 		// find /var/lib/qqwry.dat
 		if (boost::filesystem::exists("/var/lib/qqwry.dat"))
-		{
-			db.reset(new QQWry::ipdb("/var/lib/qqwry.dat"));
-			return true;
-			// good
-		}
-		// 找不到，得找个机会去 .. 下载
+			return "/var/lib/qqwry.dat";
 
+		return boost::filesystem::path();
+	}
+
+	// Last-Modified 一样的格式.
+	static std::string http_date(std::time_t t)
+	{
+		char buf[64];
+		std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", std::gmtime(&t));
+		return buf;
+	}
+
+	void start_worker(boost::function<void()> job)
+	{
+		// 上一个线程投递完 publish 就退出了, 这里不会等多久.
+		if (m_worker.joinable())
+			m_worker.join();
+
+		m_worker = boost::thread(job);
+	}
+
+	// 每天检查一次有没有新的 qqwry.dat.
+	void schedule_refresh()
+	{
+		m_refresh_timer.expires_from_now(boost::posix_time::hours(24));
+		m_refresh_timer.async_wait(boost::bind(&ipdb_mgr::on_refresh, shared_from_this(), _1));
+	}
+
+	void on_refresh(boost::system::error_code ec)
+	{
+		if (ec || m_stopped)
+			return;
+
+		if (!m_busy)
+			start_download();
+		schedule_refresh();
+	}
+
+	void start_download()
+	{
+		m_busy = true;
 		download_qqwry_dat(
 			m_io_service,
-			m_uncompress,
-			boost::bind(&ipdb_mgr::qqwry_downloaded, this, _1)
+			m_last_modified,
+			boost::bind(&ipdb_mgr::qqwry_downloaded, shared_from_this(), _1, _2, _3, _4)
 		);
-		return false;
 	}
 
-	void qqwry_downloaded(std::string decoded_qqwry_dat)
+	void qqwry_downloaded(boost::system::error_code ec, std::string copywrite, std::string qqwry, std::string last_modified)
 	{
-		decoded_data = boost::move(decoded_qqwry_dat);
-		// save to /tmp/qqwry.dat or qqwry.dat depend on the OS
-		boost::filesystem::path savepath;
-#ifndef _WIN32
-		savepath = "/tmp/qqwry.dat";
-#else
-		savepath = "qqwry.dat";
-#endif
-		std::ofstream qqwrydatfile(savepath.string().c_str(), std::ios::binary);
-		qqwrydatfile.write(decoded_data.data(), decoded_data.size());
-		db.reset(new QQWry::ipdb(decoded_data.data(), decoded_data.length()));
+		if (ec || m_stopped)
+		{
+			// 包括 304, 没有更新.
+			m_busy = false;
+			return;
+		}
+
+		start_worker(boost::bind(&ipdb_mgr::decode_in_background, shared_from_this(), copywrite, qqwry, last_modified));
 	}
 
-	bool is_ready() const
+	// 以下在后台线程里运行.
+
+	void decode_in_background(std::string copywrite, std::string qqwry, std::string last_modified)
+	{
+		boost::filesystem::path savepath = save_path();
+		boost::filesystem::path tmppath = savepath.string() + ".tmp";
+
+		bool ok = QQWry::decryptQQWryRar(copywrite, qqwry);
+
+		if (ok)
+		{
+			// 边解压边写文件, 写完了再改名, 不会留下写了一半的 qqwry.dat.
+			std::ofstream qqwrydatfile(tmppath.string().c_str(), std::ios::binary | std::ios::trunc);
+			ok = m_inflate(qqwry.data(), qqwry.size(), qqwrydatfile);
+			qqwrydatfile.close();
+			ok = ok && !qqwrydatfile.fail();
+		}
+
+		boost::system::error_code ec;
+
+		if (ok)
+			boost::filesystem::rename(tmppath, savepath, ec);
+
+		if (!ok || ec)
+		{
+			boost::filesystem::remove(tmppath, ec);
+			post_publish(boost::shared_ptr<const QQWry::iptable>(), std::string());
+			return;
+		}
+
+		load_in_background(savepath, last_modified);
+	}
+
+	void load_in_background(boost::filesystem::path p, std::string last_modified)
+	{
+		boost::shared_ptr<const QQWry::iptable> newtable;
+
+		try
+		{
+			// 文件只在建表的时候映射, 建好以后 iptable 不再引用它.
+			QQWry::ipdb db(p.string().c_str());
+			newtable.reset(new QQWry::iptable(db));
+		}
+		catch (...)
+		{
+		}
+
+		post_publish(newtable, last_modified);
+	}
+
+	void post_publish(boost::shared_ptr<const QQWry::iptable> newtable, std::string last_modified)
+	{
+		boost::mutex::scoped_lock l(m_stop_mutex);
+
+		if (!m_stopped)
+			m_io_service.post(boost::bind(&ipdb_mgr::publish, shared_from_this(), newtable, last_modified));
+	}
+
+	// 回到 io_service 线程.
+	void publish(boost::shared_ptr<const QQWry::iptable> newtable, std::string last_modified)
 	{
-		return !!db;
+		m_busy = false;
+
+		if (!newtable)
+			return;
+
+		table = newtable;
+
+		if (!last_modified.empty())
+			m_last_modified = last_modified;
 	}
 };
 
@@ -175,9 +358,9 @@ template<typename MsgSender>
 class iplocation
 {
 public:
-	void operator()(boost::property_tree::ptree msg)
+	void operator()(const avbot_message & msg)
 	{
-		std::string textmsg = boost::trim_copy(msg.get<std::string>("message.text"));
+		std::string textmsg = boost::trim_copy(msg.text());
 
 		in_addr ipaddr;
 
@@ -195,7 +378,10 @@ public:
 				)
 			)
 			{
-				if (!m_ipdb_mgr->is_ready())
+				// 后台可能随时替换, 先拿住当前的表.
+				boost::shared_ptr<const QQWry::iptable> table = m_ipdb_mgr->table;
+
+				if (!table)
 				{
 					m_sender(std::string("吼吼，还木有纯真数据库，暂时无法查询"));
 					return;
@@ -205,7 +391,7 @@ public:
 				ipaddr.s_addr = ::inet_addr(matchedip.c_str());
 				// ip 地址是这样查询的 .qqbot locate 8.8.8.8
 				// 或者直接聊天内容就是完整的一个 ip 地址
-				QQWry::IPLocation l = m_ipdb_mgr->db->GetIPLocation(ipaddr);
+				QQWry::IPLocation l = table->GetIPLocation(ipaddr);
 
 				// 找到后，发给聊天窗口.
 
@@ -161,63 +161,56 @@ static bool can_joke(std::string msg)
 	return false;
 }
 
-void joke::operator()( boost::property_tree::ptree msg )
+void joke::operator()( const avbot_message & msg )
 {
-	try
+	// do joke control here
+	std::string textmsg = boost::trim_copy( msg.text() );
+
+	if( textmsg ==  ".qqbot joke off" )
+	{
+		// 其实关闭不掉的, 就是延长到 24 个小时了, 嘻嘻.
+		* m_interval = boost::posix_time::seconds( 3600 * 24 );
+		m_sender("笑话关闭.");
+		save_setting();
+	}
+	else if( textmsg == ".qqbot joke on" )
 	{
-		// do joke control here
-		std::string textmsg = boost::trim_copy( msg.get<std::string>( "message.text" ) );
 
-		if( textmsg ==  ".qqbot joke off" )
-		{
-			// 其实关闭不掉的, 就是延长到 24 个小时了, 嘻嘻.
-			* m_interval = boost::posix_time::seconds( 3600 * 24 );
-			m_sender("笑话关闭.");
-			save_setting();
-		}
-		else if( textmsg == ".qqbot joke on" )
-		{
+		* m_interval = boost::posix_time::seconds( 600 );
 
-			* m_interval = boost::posix_time::seconds( 600 );
+		m_sender("笑话开启.");
+		save_setting();
+	}
+	else if (can_joke(textmsg)){
+		m_timer->expires_from_now(boost::posix_time::seconds(2));
+		m_timer->async_wait(*this);
+		return;
+	}
+	else
+	{
+		// .qqbot joke interval XXX
+		boost::cmatch what;
+		boost::regex ex( "\\.qqbot joke interval (.*)" );
 
-			m_sender("笑话开启.");
-			save_setting();
-		}
-		else if (can_joke(textmsg)){
-			m_timer->expires_from_now(boost::posix_time::seconds(2));
-			m_timer->async_wait(*this);
-			return;
-		}
-		else
+		if( boost::regex_match( textmsg.c_str(), what, ex ) )
 		{
-			// .qqbot joke interval XXX
-			boost::cmatch what;
-			boost::regex ex( "\\.qqbot joke interval (.*)" );
-
-			if( boost::regex_match( textmsg.c_str(), what, ex ) )
+			try
 			{
-				try
+				int sec =  boost::lexical_cast<int>( what[1] );
+
+				if( sec < 10 )
 				{
-					int sec =  boost::lexical_cast<int>( what[1] );
-
-					if( sec < 10 )
-					{
-						m_sender( boost::str( boost::format("混蛋, %d 秒太短了!") % sec ) );
-					}
-					else
-					{
-						* m_interval = boost::posix_time::seconds( sec );
-						m_sender( boost::str( boost::format("笑话间隔为 %d 秒.") % sec ) );
-						save_setting();
-					}
+					m_sender( boost::str( boost::format("混蛋, %d 秒太短了!") % sec ) );
+				}
+				else
+				{
+					* m_interval = boost::posix_time::seconds( sec );
+					m_sender( boost::str( boost::format("笑话间隔为 %d 秒.") % sec ) );
+					save_setting();
 				}
-				catch( const boost::bad_lexical_cast & err ) {}
 			}
+			catch( const boost::bad_lexical_cast & err ) {}
 		}
-	}
-	catch( const boost::property_tree::ptree_error & err )
-	{
-
 	}
 	boost::system::error_code ec;
 	// 如果已经超时了, 只不过是在 fetch 笑话网页, 就不要在这里无意间重启了 timer.
@@ -70,7 +70,7 @@ public:
 	}
 
 	void operator()(const boost::system::error_code& error);
-	void operator()(boost::property_tree::ptree);
+	void operator()(const avbot_message &);
 	void operator()(const boost::system::error_code& error, std::string joke);
 };
 
@@ -5,7 +5,8 @@
 
 -- 每当频道有消息发生, 就调用这个函数.
 -- 注意, 不要在这里阻塞, 会导致整个 avbot 都被卡住
--- 因为 avbot 是单线程程序.
+-- 因为 avbot 是单线程程序. 一次调用超过 200ms 会被中止.
+-- main.lua 只在修改之后重新载入, 全局变量在消息之间保留.
 --[=[examplejson=[[
 {
     "protocol": "qq",
@@ -68,8 +69,8 @@ require"scp"
 --loadfile("luascript\\router.lua")()
 --loadfile("luascript\\rss.lua")()
 
-function channel_message(jsonmsg)
-	msg_table=json.decode(jsonmsg)
+-- 消息直接以 table 传入, 字段和上面的 json 一样.
+function channel_message(msg_table)
 	msg=msg_table.message.text
 	msg_time=os.date("%H:%M:%S")
 	buddy_name=msg_table.who.card
@@ -79,7 +80,6 @@ function channel_message(jsonmsg)
 	say_qun=function (the_msg, qun_num_nouse)
 		send_channel_message(the_msg)
 	end
-	--print(jsonmsg)
 		if msg==nil then return end
 --	escape(msg,msg_time,buddy_name,buddy_num,qun_name,qun_num)
 	--bet(msg,msg_time,buddy_name,buddy_num,qun_name,qun_num)
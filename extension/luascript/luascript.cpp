@@ -7,7 +7,9 @@ extern "C" {
 
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
-#include <boost/property_tree/json_parser.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
 
 #include "luabind/object.hpp"
 #include "luabind/luabind.hpp"
@@ -16,7 +18,6 @@ namespace fs = boost::filesystem;
 
 #include "luascript.hpp"
 
-#include "boost/json_parser_write.hpp"
 #include "boost/stringencodings.hpp"
 
 #include <setjmp.h>
@@ -44,73 +45,270 @@ struct lua_sender
 	}
 };
 
-callluascript::callluascript(boost::asio::io_service &_io_service, boost::function<void(std::string)> sender)
-	: io_service(_io_service)
-	, m_sender(sender)
+// 每次调用脚本最多能用多长时间, 超过就中止, 免得卡住 io_service.
+static const int lua_time_budget_ms = 200;
+// 每执行这么多条指令检查一次时间.
+// 注意 LuaJIT 编译过的代码不会调用钩子, 只有解释执行的部分受限制.
+static const int lua_hook_instructions = 10000;
+// 每隔几秒检查 main.lua 的修改时间.
+static const int lua_watch_interval = 3;
+
+// 钩子通过注册表里的这个 key 找到所属的 luascript_state.
+static char lua_state_registry_key;
+
+static void lua_budget_hook(lua_State * L, lua_Debug *)
 {
+	lua_pushlightuserdata(L, &lua_state_registry_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	detail::luascript_state * state = static_cast<detail::luascript_state*>(lua_touserdata(L, -1));
+	lua_pop(L, 1);
+
+	if (state && boost::posix_time::microsec_clock::universal_time() > state->deadline)
+	{
+		state->budget_exceeded = true;
+		luaL_error(L, "script exceeded its %d ms time budget", lua_time_budget_ms);
+	}
 }
 
-callluascript::~callluascript()
+// 在时间限制内调用栈顶的函数, 失败的时候打印错误.
+static bool lua_budget_pcall(detail::luascript_state & state, lua_State * L, int nargs)
 {
+	state.deadline = boost::posix_time::microsec_clock::universal_time()
+		+ boost::posix_time::milliseconds(lua_time_budget_ms);
+	state.budget_exceeded = false;
+
+	lua_sethook(L, lua_budget_hook, LUA_MASKCOUNT, lua_hook_instructions);
+	int ret = lua_pcall(L, nargs, 0, 0);
+	lua_sethook(L, NULL, 0, 0);
 
+	if (ret != 0)
+	{
+		const char * err = lua_tostring(L, -1);
+		std::cout << "\t" << (err ? err : "lua error") << std::endl;
+		lua_pop(L, 1);
+		return false;
+	}
+	return true;
 }
 
-void callluascript::load_lua() const
+static fs::path lua_main_file()
 {
-	fs::path luafile;
 	char *old_pwd = getenv( "O_PWD" );
 
 	if( old_pwd )
 	{
-		luafile = fs::path( old_pwd ) /  "main.lua" ;
+		return fs::path( old_pwd ) /  "main.lua" ;
 	}
 	else
 	{
-		luafile = fs::current_path() / "main.lua" ;
+		return fs::current_path() / "main.lua" ;
+	}
+}
+
+// 载入 main.lua 到新的虚拟机, 成功才替换掉旧的, 改坏了的脚本不影响正在用的.
+static void load_lua(detail::luascript_state & state)
+{
+	boost::system::error_code ec;
+	std::time_t mtime = fs::last_write_time(state.luafile, ec);
+
+	if (ec)
+	{
+		state.L.reset();
+		state.mtime = 0;
+		return;
 	}
 
+	state.mtime = mtime;
+
+	boost::shared_ptr<lua_State> newstate(luaL_newstate(), lua_close);
+	lua_State* L = newstate.get();
+	luaL_openlibs( L );
+
+	luabind::open( L );
+
+	// 准备调用 LUA 脚本.
+	luabind::module( L )[
+		luabind::def( "send_channel_message", luabind::tag_function<void( const char * )>( lua_sender( state.sender ) ) )
+	];
+
+	lua_pushlightuserdata(L, &lua_state_registry_key);
+	lua_pushlightuserdata(L, &state);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+
+	if (luaL_loadfile( L, state.luafile.string().c_str() ) != 0)
+	{
+		std::cout << "\t" << lua_tostring(L, -1) << std::endl;
+		return;
+	}
+
+	if (lua_budget_pcall(state, L, 0))
+		state.L = newstate;
+}
+
+static void schedule_watch(boost::weak_ptr<detail::luascript_state> weak_state);
+
+static void on_watch_timer(boost::weak_ptr<detail::luascript_state> weak_state, boost::system::error_code ec)
+{
+	boost::shared_ptr<detail::luascript_state> state = weak_state.lock();
+
+	// 频道的扩展都已经销毁了.
+	if (ec || !state)
+		return;
+
+	boost::system::error_code mtime_ec;
+	std::time_t mtime = fs::last_write_time(state->luafile, mtime_ec);
+
 	// 实时载入, 修改后就马上生效!
-	if( fs::exists( luafile ) )
+	if (mtime_ec ? state->mtime != 0 : mtime != state->mtime)
+		load_lua(*state);
+
+	schedule_watch(weak_state);
+}
+
+static void schedule_watch(boost::weak_ptr<detail::luascript_state> weak_state)
+{
+	boost::shared_ptr<detail::luascript_state> state = weak_state.lock();
+
+	state->watch_timer.expires_from_now(boost::posix_time::seconds(lua_watch_interval));
+	state->watch_timer.async_wait(boost::bind(&on_watch_timer, weak_state, _1));
+}
+
+static void lua_setfield_string(lua_State * L, const char * key, const std::string & value)
+{
+	lua_pushlstring(L, value.data(), value.length());
+	lua_setfield(L, -2, key);
+}
+
+static void lua_setfield_if_not_empty(lua_State * L, const char * key, const std::string & value)
+{
+	if (!value.empty())
+		lua_setfield_string(L, key, value);
+}
+
+// 把消息直接构造成 lua table 放在栈顶, 字段和以前 json 格式的一样.
+static void push_message(lua_State * L, const avbot_message & message)
+{
+	lua_createtable(L, 0, 8);
+
+	lua_setfield_string(L, "protocol", message.protocol.get());
+	lua_setfield_string(L, "channel", message.channel.get());
+
+	if (message.protocol == "qq")
+	{
+		lua_createtable(L, 0, 3);
+		lua_setfield_string(L, "code", message.room.code.get());
+		lua_setfield_if_not_empty(L, "groupnumber", message.room.groupnumber.get());
+		lua_setfield_if_not_empty(L, "name", message.room.name.get());
+		lua_setfield(L, -2, "room");
+	}
+	else if (!message.room.name.get().empty())
+	{
+		lua_setfield_string(L, "room", message.room.name.get());
+	}
+
+	if (message.protocol == "mail")
+	{
+		lua_setfield_string(L, "from", message.mail.from);
+		lua_setfield_string(L, "to", message.mail.to);
+		lua_setfield_string(L, "subject", message.mail.subject);
+	}
+	else if (message.protocol != "rpc")
 	{
-		lua_State* L = luaL_newstate();
-		m_lua_State.reset( L, lua_close );
-		luaL_openlibs( L );
+		lua_createtable(L, 0, 5);
+		lua_setfield_if_not_empty(L, "code", message.who.code);
+		lua_setfield_string(L, "nick", message.who.nick);
+		lua_setfield_if_not_empty(L, "name", message.who.name);
+		lua_setfield_if_not_empty(L, "qqnumber", message.who.qqnumber);
+		lua_setfield_if_not_empty(L, "card", message.who.card);
+		lua_setfield(L, -2, "who");
+	}
 
-		luabind::open( L );
+	if (message.op)
+		lua_setfield_string(L, "op", *message.op ? "1" : "0");
+	lua_setfield_if_not_empty(L, "newbee", message.newbee);
+	lua_setfield_if_not_empty(L, "preamble", message.preamble);
 
-		// 准备调用 LUA 脚本.
-		luabind::module( L )[
-			luabind::def( "send_channel_message", luabind::tag_function<void( const char * )>( lua_sender( m_sender ) ) )
-		];
+	lua_createtable(L, 0, 2);
 
-		luaL_dofile( L, luafile.string().c_str() );
+	BOOST_FOREACH(const avbot_message_segment & s, message.segments)
+	{
+		switch (s.type)
+		{
+			case avbot_message_segment::text_segment:
+				if (message.protocol == "mail" && !message.mail.content_type.empty())
+					lua_setfield_string(L, message.mail.content_type.c_str(), s.content);
+				else
+					lua_setfield_string(L, "text", s.content);
+				break;
+			case avbot_message_segment::url_segment:
+				lua_setfield_string(L, "url", s.content);
+				break;
+			case avbot_message_segment::img_segment:
+				lua_setfield_string(L, "img", s.content);
+				break;
+			case avbot_message_segment::cface_segment:
+				lua_createtable(L, 0, 8);
+				lua_setfield_string(L, "name", s.cface->name);
+				lua_setfield_string(L, "gid", s.cface->gid);
+				lua_setfield_string(L, "uin", s.cface->uin);
+				lua_setfield_string(L, "key", s.cface->key);
+				lua_setfield_string(L, "server", s.cface->server);
+				lua_setfield_string(L, "file_id", s.cface->file_id);
+				lua_setfield_string(L, "vfwebqq", s.cface->vfwebqq);
+				lua_setfield_string(L, "gchatpicurl", s.cface->gchatpicurl);
+				lua_setfield(L, -2, "cface");
+				break;
+		}
 	}
+
+	lua_setfield(L, -2, "message");
+}
+
+callluascript::callluascript(boost::asio::io_service &_io_service, boost::function<void(std::string)> sender)
+	: io_service(_io_service)
+	, m_sender(sender)
+	, m_state(boost::make_shared<detail::luascript_state>(boost::ref(_io_service)))
+{
+	m_state->sender = sender;
+	m_state->luafile = lua_main_file();
+
+	load_lua(*m_state);
+	schedule_watch(m_state);
 }
 
-void callluascript::call_lua( std::string jsondata ) const
+callluascript::~callluascript()
+{
+
+}
+
+void callluascript::call_lua(const avbot_message & message) const
 {
-	lua_State* L = m_lua_State.get();
+	// 重新载入的时候会替换掉 m_state->L, 调用期间保持旧的虚拟机.
+	boost::shared_ptr<lua_State> holder = m_state->L;
+	lua_State* L = holder.get();
 
 	if( L )
 	{
-		try{
-		luabind::call_function<void>( L, "channel_message", jsondata);
+		lua_getglobal(L, "channel_message");
+
+		if (!lua_isfunction(L, -1))
+		{
+			lua_pop(L, 1);
+			return;
 		}
-		catch(luabind::error e)
+
+		push_message(L, message);
+
+		if (!lua_budget_pcall(*m_state, L, 1) && m_state->budget_exceeded)
 		{
-			std::cout << "\t" << e.what() << std::endl;
-			std::cout<< lua_tostring(L, -1);
+			std::cout << literal_to_localstr("\tlua 脚本运行超时, 已中止.") << std::endl;
 		}
 	}
 }
 
-void callluascript::operator()( boost::property_tree::ptree message ) const
+void callluascript::operator()( const avbot_message & message ) const
 {
-	load_lua();
-	std::stringstream jsondata;
-	boost::property_tree::json_parser::write_json(jsondata, message);
-
-	call_lua(jsondata.str());
+	call_lua(message);
 }
 
 
@@ -169,7 +367,7 @@ static bool test_lua51_dll()
 
 #endif // _MSC_VER
 
-static void dumy_func(boost::property_tree::ptree message)
+static void dumy_func(const avbot_message & message)
 {
 }
 
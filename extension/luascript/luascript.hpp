@@ -4,11 +4,13 @@
 #include <algorithm>
 #include <boost/locale.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/format.hpp>
 #include <boost/regex.hpp>
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
-#include <boost/property_tree/ptree.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 extern "C"{
 #include <luajit-2.0/luajit.h>
@@ -18,21 +20,47 @@ extern "C"{
 
 #include "../extension.hpp"
 
+namespace detail {
+
+// 一个频道的 lua 虚拟机, 所有 callluascript 的副本共享.
+// main.lua 载入一次, 之后由定时器检查修改时间, 变了才重新载入.
+struct luascript_state
+{
+	luascript_state(boost::asio::io_service & io_service)
+		: mtime(0)
+		, watch_timer(io_service)
+		, budget_exceeded(false)
+	{
+	}
+
+	boost::shared_ptr<lua_State> L;
+	boost::filesystem::path luafile;
+	std::time_t mtime;
+
+	boost::asio::deadline_timer watch_timer;
+	boost::function<void ( std::string ) > sender;
+
+	// 脚本本次调用必须在这之前返回.
+	boost::posix_time::ptime deadline;
+	bool budget_exceeded;
+};
+
+} // namespace detail
+
 class callluascript
 {
 	boost::asio::io_service &io_service;
 	boost::function<void ( std::string ) > m_sender;
 
-	mutable boost::shared_ptr<lua_State> m_lua_State;
+	boost::shared_ptr<detail::luascript_state> m_state;
 
-	void load_lua() const;
-	void call_lua(std::string jsondata) const ;
+	void call_lua(const avbot_message & message) const;
 
 public:
 	callluascript(boost::asio::io_service &_io_service, boost::function<void(std::string)> sender);
 	~callluascript();
 	// on_message 回调.
-	void operator()( boost::property_tree::ptree message ) const;
+	void operator()( const avbot_message & message ) const;
 };
 
 avbot_extension make_luascript(std::string channel_name, boost::asio::io_service &_io_service, boost::function<void(std::string)> sender);
@@ -1,96 +1,442 @@
-
 #include "pythonscriptengine.hpp"
-#include "boost/json_parser_write.hpp"
 #include <ctime>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
 #include <boost/filesystem.hpp>
+#include "boost/logging.hpp"
 namespace fs = boost::filesystem;
-#include <boost/property_tree/json_parser.hpp>
 #include <boost/python.hpp>
 
-namespace py = boost::python;
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
-boost::system::error_code no_module;
-boost::system::error_code no_handle_func;
+namespace py = boost::python;
 
-bool python_init = false;
-bool disable_python = true;
+static const char * python_script_file = "avbot.py";
 
 struct MessageSender {
+	asio::io_service * io_;
 	boost::function<void(std::string)> sender_;
 
-	void send_message(std::string msg) { sender_(msg); }
+	// 在 python 线程里被调用, 投递回 io_service 发送, 不等发送完成.
+	void send_message(std::string msg) { io_->post(boost::bind(sender_, msg)); }
 };
 
-class PythonScriptEngine {
+// 一个频道的 python 消息处理对象.
+// pyhandler_ 只在 python 线程里访问.
+struct PythonChannel {
+	PythonChannel(asio::io_service &io, boost::function<void(std::string)> sender)
+		: io_(io), sender_(sender) {}
+
+	asio::io_service &io_;
+	boost::function<void(std::string)> sender_;
+	py::object pyhandler_;
+};
+
+// avbot.py 修改后调用 on_change, 通知 python 线程重新载入.
+// linux 上用 inotify 监视当前目录, 其他平台每隔几秒检查一次修改时间.
+class PythonScriptWatcher : public boost::enable_shared_from_this<PythonScriptWatcher> {
 public:
-	PythonScriptEngine(asio::io_service &io,
-					   boost::function<void(std::string)> sender)
-		: io_(io), sender_(sender), file_changed_(true) {
-		try {
-			if (!python_init) {
-				Py_Initialize();
-				python_init = true;
-				module_ = py::import("avbot");
-				py::scope s(module_);
-				reload();
-			}
+	PythonScriptWatcher(asio::io_service &io, boost::function<void()> on_change)
+		: timer_(io)
+#ifdef __linux__
+		, inotify_(io)
+#endif
+		, on_change_(on_change)
+		, stopped_(false)
+		, last_write_time_(0) {
+		boost::system::error_code ec;
+		last_write_time_ = fs::last_write_time(python_script_file, ec);
+
+#ifdef __linux__
+		int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+		if (fd >= 0) {
+			if (inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) >= 0)
+				inotify_.assign(fd);
+			else
+				::close(fd);
 		}
-		catch (...) {
-			PyErr_Print();
+#endif
+	}
+
+	void start() {
+		async_watch();
+	}
+
+	// 取消监视, 之后不再调用 on_change.
+	void stop() {
+		boost::system::error_code ec;
+
+		stopped_ = true;
+		timer_.cancel(ec);
+#ifdef __linux__
+		inotify_.close(ec);
+#endif
+	}
+
+private:
+	void async_watch() {
+#ifdef __linux__
+		if (inotify_.is_open()) {
+			inotify_.async_read_some(asio::buffer(buffer_),
+				boost::bind(&PythonScriptWatcher::on_inotify, shared_from_this(), _1, _2));
+			return;
+		}
+#endif
+		timer_.expires_from_now(boost::posix_time::seconds(3));
+		timer_.async_wait(boost::bind(&PythonScriptWatcher::on_timer, shared_from_this(), _1));
+	}
+
+#ifdef __linux__
+	void on_inotify(boost::system::error_code ec, std::size_t bytes_transferred) {
+		if (stopped_ || ec == asio::error::operation_aborted)
+			return;
+
+		if (ec) {
+			// inotify 不能用了, 改成定时检查.
+			inotify_.close(ec);
+			async_watch();
+			return;
+		}
+
+		bool changed = false;
+
+		for (std::size_t i = 0; i + sizeof(inotify_event) <= bytes_transferred;) {
+			const inotify_event *event = reinterpret_cast<const inotify_event *>(&buffer_[i]);
+
+			if (event->len && std::strcmp(event->name, python_script_file) == 0)
+				changed = true;
+
+			i += sizeof(inotify_event) + event->len;
 		}
+
+		if (changed)
+			on_change_();
+
+		async_watch();
+	}
+#endif
+
+	void on_timer(boost::system::error_code ec) {
+		if (stopped_ || ec)
+			return;
+
+		std::time_t write_time = fs::last_write_time(python_script_file, ec);
+
+		if (!ec && write_time != last_write_time_) {
+			last_write_time_ = write_time;
+			on_change_();
+		}
+
+		async_watch();
 	}
 
-	~PythonScriptEngine() {}
+private:
+	asio::deadline_timer timer_;
+#ifdef __linux__
+	asio::posix::stream_descriptor inotify_;
+	// inotify_event 需要按 int 对齐.
+	union {
+		char buffer_[4096];
+		int align_;
+	};
+#endif
+	boost::function<void()> on_change_;
+	bool stopped_;
+	std::time_t last_write_time_;
+};
+
+// 运行 python 解释器的线程.
+// 所有的 python 调用都在这个线程里进行, 慢的脚本不会卡住 io_service.
+// 消息进入有上限的列队, 满了就丢弃新消息.
+// 所有频道共用一个, 由 avbot_extensions 持有, io_service 析构之前 stop.
+class PythonThread : boost::noncopyable {
+	static const std::size_t max_queued_messages = 256;
+
+public:
+	PythonThread(asio::io_service &io)
+		: quit_(false)
+		, dropped_(0)
+		, last_drop_report_(0) {
+		thread_ = boost::thread(&PythonThread::run, this);
+
+		watcher_ = boost::make_shared<PythonScriptWatcher>(boost::ref(io),
+			boost::bind(&PythonThread::reload, this));
+		watcher_->start();
+	}
+
+	~PythonThread() {
+		stop();
+	}
+
+	// 处理完已经在列队里的任务后退出线程, 并等待它退出.
+	void stop() {
+		watcher_->stop();
+
+		{
+			boost::mutex::scoped_lock l(mutex_);
+			quit_ = true;
+			cond_.notify_one();
+		}
+
+		if (thread_.joinable())
+			thread_.join();
+	}
+
+	void add_channel(boost::shared_ptr<PythonChannel> channel) {
+		post(boost::bind(&PythonThread::do_add_channel, this, channel), false);
+	}
 
 	void reload() {
-		file_changed_ = false;
-		global_ = module_.attr("__dict__");
-		py::class_<MessageSender>("MessageSender")
-			.def("send_message", &MessageSender::send_message);
-		py::object pysender = global_["MessageSender"]();
-		py::extract<MessageSender &>(pysender)().sender_ = sender_;
-		pyhandler_ = global_["MessageHandler"]();
-		pyhandler_.attr("send_message") = pysender.attr("send_message");
-		disable_python = false;
-		last_write_time_ = fs::last_write_time(fs::path("./avbot.py"));
-	}
-
-	void operator()(const boost::property_tree::ptree &msg) {
-		try {
-			boost::system::error_code ignore_ec;
-			fs::path script_file("./avbot.py");
-			std::time_t now_write_time = fs::last_write_time(script_file);
-			if (fs::exists(script_file) && now_write_time != last_write_time_) {
-				PyImport_ReloadModule(module_.ptr());
-				file_changed_ = true;
-				reload();
+		post(boost::bind(&PythonThread::do_reload, this), false);
+	}
+
+	// droppable 的任务在列队满的时候被丢弃, 返回 false.
+	// 丢弃的条数每分钟最多记一次日志.
+	bool post(boost::function<void()> job, bool droppable) {
+		boost::mutex::scoped_lock l(mutex_);
+
+		if (quit_)
+			return false;
+
+		if (droppable && queue_.size() >= max_queued_messages) {
+			dropped_++;
+
+			std::time_t now = std::time(NULL);
+			if (now - last_drop_report_ >= 60) {
+				AVLOG_WARN << "python script is too slow, " << dropped_ << " message(s) dropped";
+				dropped_ = 0;
+				last_drop_report_ = now;
 			}
-			if (disable_python)
-				return;
-			std::stringstream ss;
-			boost::property_tree::json_parser::write_json(ss, msg);
-			pyhandler_.attr("on_message")(ss.str());
+			return false;
+		}
+
+		queue_.push_back(job);
+		cond_.notify_one();
+		return true;
+	}
+
+private:
+	void run() {
+		Py_Initialize();
+
+		try {
+			sender_class_ = py::class_<MessageSender>("MessageSender")
+				.def("send_message", &MessageSender::send_message);
+			module_ = py::import("avbot");
 		}
 		catch (...) {
 			PyErr_Print();
 		}
+
+		for (;;) {
+			boost::function<void()> job;
+			{
+				boost::mutex::scoped_lock l(mutex_);
+
+				while (queue_.empty() && !quit_)
+					cond_.wait(l);
+
+				if (queue_.empty())
+					break;
+
+				job = queue_.front();
+				queue_.pop_front();
+			}
+
+			try {
+				job();
+			}
+			catch (...) {
+				PyErr_Print();
+			}
+		}
+
+		// python 对象必须在这个线程里释放.
+		BOOST_FOREACH(boost::shared_ptr<PythonChannel> &channel, channels_)
+			channel->pyhandler_ = py::object();
+		channels_.clear();
+		module_ = py::object();
+		sender_class_ = py::object();
+	}
+
+	void do_add_channel(boost::shared_ptr<PythonChannel> channel) {
+		channels_.push_back(channel);
+		make_handler(*channel);
+	}
+
+	void do_reload() {
+		if (module_.is_none()) {
+			module_ = py::import("avbot");
+		}
+		else {
+			module_ = py::object(py::handle<>(PyImport_ReloadModule(module_.ptr())));
+		}
+
+		BOOST_FOREACH(boost::shared_ptr<PythonChannel> &channel, channels_)
+			make_handler(*channel);
+	}
+
+	void make_handler(PythonChannel &channel) {
+		channel.pyhandler_ = py::object();
+
+		if (module_.is_none() || sender_class_.is_none())
+			return;
+
+		py::object pysender = sender_class_();
+		MessageSender &sender = py::extract<MessageSender &>(pysender);
+		sender.io_ = &channel.io_;
+		sender.sender_ = channel.sender_;
+
+		channel.pyhandler_ = module_.attr("MessageHandler")();
+		channel.pyhandler_.attr("send_message") = pysender.attr("send_message");
 	}
 
 private:
-	asio::io_service &io_;
-	boost::function<void(std::string)> sender_;
-	static py::object module_;
-	static py::object global_;
-	py::object pyhandler_;
-	bool file_changed_;
-	std::time_t last_write_time_;
+	boost::mutex mutex_;
+	boost::condition_variable cond_;
+	std::deque<boost::function<void()> > queue_;
+	bool quit_;
+	std::size_t dropped_;
+	std::time_t last_drop_report_;
+
+	// 以下只在 python 线程里访问.
+	py::object module_;
+	py::object sender_class_;
+	std::vector<boost::shared_ptr<PythonChannel> > channels_;
+
+	boost::shared_ptr<PythonScriptWatcher> watcher_;
+	boost::thread thread_;
 };
 
-py::object PythonScriptEngine::module_;
-py::object PythonScriptEngine::global_;
+// 在 python 线程里把消息转换成 dict, 字段和以前的 json 格式一样.
+static py::dict message_to_dict(const avbot_message &msg) {
+	py::dict message;
+
+	message["protocol"] = msg.protocol.get();
+	message["channel"] = msg.channel.get();
+
+	if (msg.protocol == "qq") {
+		py::dict room;
+		room["code"] = msg.room.code.get();
+		if (!msg.room.groupnumber.get().empty())
+			room["groupnumber"] = msg.room.groupnumber.get();
+		if (!msg.room.name.get().empty())
+			room["name"] = msg.room.name.get();
+		message["room"] = room;
+	}
+	else if (!msg.room.name.get().empty()) {
+		message["room"] = msg.room.name.get();
+	}
+
+	if (msg.protocol == "mail") {
+		message["from"] = msg.mail.from;
+		message["to"] = msg.mail.to;
+		message["subject"] = msg.mail.subject;
+	}
+	else if (msg.protocol != "rpc") {
+		py::dict who;
+		if (!msg.who.code.empty())
+			who["code"] = msg.who.code;
+		who["nick"] = msg.who.nick;
+		if (!msg.who.name.empty())
+			who["name"] = msg.who.name;
+		if (!msg.who.qqnumber.empty())
+			who["qqnumber"] = msg.who.qqnumber;
+		if (!msg.who.card.empty())
+			who["card"] = msg.who.card;
+		message["who"] = who;
+	}
+
+	if (msg.op)
+		message["op"] = *msg.op ? "1" : "0";
+	if (!msg.newbee.empty())
+		message["newbee"] = msg.newbee;
+	if (!msg.preamble.empty())
+		message["preamble"] = msg.preamble;
+
+	py::dict textmsg;
+
+	BOOST_FOREACH(const avbot_message_segment &s, msg.segments) {
+		switch (s.type) {
+		case avbot_message_segment::text_segment:
+			if (msg.protocol == "mail" && !msg.mail.content_type.empty())
+				textmsg[msg.mail.content_type] = s.content;
+			else
+				textmsg["text"] = s.content;
+			break;
+		case avbot_message_segment::url_segment:
+			textmsg["url"] = s.content;
+			break;
+		case avbot_message_segment::img_segment:
+			textmsg["img"] = s.content;
+			break;
+		case avbot_message_segment::cface_segment: {
+			py::dict cface;
+			cface["name"] = s.cface->name;
+			cface["gid"] = s.cface->gid;
+			cface["uin"] = s.cface->uin;
+			cface["key"] = s.cface->key;
+			cface["server"] = s.cface->server;
+			cface["file_id"] = s.cface->file_id;
+			cface["vfwebqq"] = s.cface->vfwebqq;
+			cface["gchatpicurl"] = s.cface->gchatpicurl;
+			textmsg["cface"] = cface;
+		}
+		break;
+		}
+	}
+
+	message["message"] = textmsg;
+	return message;
+}
+
+static void call_python_handler(boost::shared_ptr<PythonChannel> channel, avbot_message msg) {
+	if (channel->pyhandler_.is_none())
+		return;
+
+	channel->pyhandler_.attr("on_message")(message_to_dict(msg));
+}
+
+class PythonScriptEngine {
+public:
+	PythonScriptEngine(boost::shared_ptr<PythonThread> python_thread, asio::io_service &io,
+					   boost::function<void(std::string)> sender)
+		: python_thread_(python_thread)
+		, channel_(boost::make_shared<PythonChannel>(boost::ref(io), sender)) {
+		python_thread_->add_channel(channel_);
+	}
+
+	void operator()(const avbot_message &msg) {
+		python_thread_->post(boost::bind(&call_python_handler, channel_, msg), true);
+	}
+
+private:
+	boost::shared_ptr<PythonThread> python_thread_;
+	boost::shared_ptr<PythonChannel> channel_;
+};
+
+boost::shared_ptr<PythonThread> make_python_thread(asio::io_service &io) {
+	return boost::make_shared<PythonThread>(boost::ref(io));
+}
+
+void stop_python_thread(PythonThread &python_thread) {
+	python_thread.stop();
+}
 
 avbot_extension
-make_python_script_engine(asio::io_service &io, std::string channel_name,
+make_python_script_engine(boost::shared_ptr<PythonThread> python_thread,
+						  asio::io_service &io, std::string channel_name,
 						  boost::function<void(std::string)> sender) {
-	return avbot_extension(channel_name, PythonScriptEngine(io, sender));
+	return avbot_extension(channel_name, PythonScriptEngine(python_thread, io, sender));
 }
@@ -9,4 +9,11 @@ using boost::property_tree::ptree;
 
 #include "extension.hpp"
 
-avbot_extension make_python_script_engine(asio::io_service& io, std::string channel_name, boost::function<void(std::string)> sender);
+class PythonThread;
+
+// 运行 python 脚本的线程, 所有频道共用一个.
+boost::shared_ptr<PythonThread> make_python_thread(asio::io_service& io);
+// 停止 python 线程并等待它退出, 必须在 io_service 析构之前调用.
+void stop_python_thread(PythonThread& python_thread);
+
+avbot_extension make_python_script_engine(boost::shared_ptr<PythonThread> python_thread, asio::io_service& io, std::string channel_name, boost::function<void(std::string)> sender);
@@ -7,41 +7,145 @@
 namespace fs = boost::filesystem;
 #include <boost/regex.hpp>
 #include <ctime>
+#include <map>
+#include <deque>
+#include <vector>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#include "boost/logging.hpp"
 
 #include "staticcontent.hpp"
 
-struct StaticContent
+namespace {
+
+// Aho-Corasick 自动机, 一次扫描找出文本里出现的所有关键字.
+class keyword_automaton
 {
-	StaticContent(boost::asio::io_service& io, boost::function<void(std::string)> sender);
+	struct node
+	{
+		node() : fail(0) {}
 
-	void operator()(boost::system::error_code ec) {}
+		std::map<unsigned char, std::size_t> next;
+		std::size_t fail;
+		// 在这个状态结束的关键字, 包括沿着 fail 链能到达的.
+		std::vector<std::size_t> outputs;
+	};
 
-	void operator()(const boost::property_tree::ptree& pt);
+public:
+	keyword_automaton()
+		: nodes_(1)
+	{
+	}
 
-	boost::asio::io_service& io_;
-	boost::function<void(std::string)> sender_;
-	typedef boost::regex Keywords;
-	typedef std::vector<std::string> Messages;
-	std::map<Keywords, Messages> static_contents_;
+	void add(const std::string & keyword, std::size_t id)
+	{
+		std::size_t state = 0;
 
-	boost::random::mt19937 g_;
-	boost::uniform_int<> d_;
+		BOOST_FOREACH(char c, keyword)
+		{
+			std::map<unsigned char, std::size_t>::iterator it = nodes_[state].next.find(c);
+
+			if (it == nodes_[state].next.end())
+			{
+				nodes_.push_back(node());
+				it = nodes_[state].next.insert(std::make_pair(static_cast<unsigned char>(c), nodes_.size() - 1)).first;
+			}
+			state = it->second;
+		}
+
+		nodes_[state].outputs.push_back(id);
+	}
+
+	// 所有关键字添加完之后调用, 按广度优先计算 fail 指针.
+	void build()
+	{
+		std::deque<std::size_t> queue;
+
+		for (std::map<unsigned char, std::size_t>::iterator it = nodes_[0].next.begin(); it != nodes_[0].next.end(); ++it)
+		{
+			nodes_[it->second].fail = 0;
+			queue.push_back(it->second);
+		}
+
+		while (!queue.empty())
+		{
+			std::size_t state = queue.front();
+			queue.pop_front();
+
+			for (std::map<unsigned char, std::size_t>::iterator it = nodes_[state].next.begin(); it != nodes_[state].next.end(); ++it)
+			{
+				std::size_t child = it->second;
+				nodes_[child].fail = transition(nodes_[state].fail, it->first);
+
+				const std::vector<std::size_t> & inherited = nodes_[nodes_[child].fail].outputs;
+				nodes_[child].outputs.insert(nodes_[child].outputs.end(), inherited.begin(), inherited.end());
+
+				queue.push_back(child);
+			}
+		}
+	}
+
+	// 对文本里出现的每个关键字调用 on_match(id), 同一个关键字可能被调用多次.
+	template<class Handler>
+	void search(const std::string & text, Handler on_match) const
+	{
+		std::size_t state = 0;
+
+		BOOST_FOREACH(char c, text)
+		{
+			state = transition(state, c);
+
+			BOOST_FOREACH(std::size_t id, nodes_[state].outputs)
+				on_match(id);
+		}
+	}
+
+private:
+	// 从 state 读入 c 之后的状态, 没有对应的边就沿 fail 链回退.
+	std::size_t transition(std::size_t state, unsigned char c) const
+	{
+		for (;;)
+		{
+			std::map<unsigned char, std::size_t>::const_iterator it = nodes_[state].next.find(c);
+
+			if (it != nodes_[state].next.end())
+				return it->second;
+			if (state == 0)
+				return 0;
+			state = nodes_[state].fail;
+		}
+	}
 
+private:
+	std::vector<node> nodes_;
 };
 
-StaticContent::StaticContent(boost::asio::io_service& io, boost::function<void(std::string)> sender)
-	: io_(io)
-	, sender_(sender)
-	, d_(0, 10000)
+struct static_rule
+{
+	std::string keyword;
+	std::vector<std::string> messages;
+	boost::regex regex;
+};
+
+// static.xml 编译好的规则, 载入之后不再修改, 所有频道共享.
+// 不含正则元字符的关键字放进 Aho-Corasick 自动机, 其他的拼成一个大的正则先筛一遍,
+// 整体匹配上了才逐个检查是哪几条. 带反向引用的正则拼起来以后分组编号会变, 每次单独匹配.
+class static_rule_set : boost::noncopyable
 {
-	using namespace boost::property_tree::xml_parser;
-	g_.seed(std::time(0));
-	std::string filename = "static.xml";
-	if(fs::exists(filename))
+public:
+	explicit static_rule_set(const std::string & filename)
+		: has_prefilter_(false)
 	{
 		boost::property_tree::ptree pt;
-		read_xml(filename, pt);
+		boost::property_tree::xml_parser::read_xml(filename, pt);
+
+		// 同样的关键字, 后面的覆盖前面的.
+		std::map<std::string, std::size_t> index;
+
 		BOOST_FOREACH(const auto & item,  pt.get_child("static"))
 		{
 			std::string keyword = item.second.get<std::string>("keyword");
@@ -50,28 +154,309 @@ StaticContent::StaticContent(boost::asio::io_service& io, boost::function<void(s
 			{
 				messages.push_back(message.second.get_value<std::string>());
 			}
-			static_contents_[boost::regex(keyword)] = messages;
+
+			if (messages.empty())
+				continue;
+
+			std::map<std::string, std::size_t>::iterator it = index.find(keyword);
+
+			if (it == index.end())
+			{
+				it = index.insert(std::make_pair(keyword, rules_.size())).first;
+				rules_.push_back(static_rule());
+				rules_.back().keyword = keyword;
+			}
+
+			rules_[it->second].messages = messages;
+		}
+
+		std::string combined;
+
+		for (std::size_t i = 0; i < rules_.size(); i++)
+		{
+			if (is_literal(rules_[i].keyword))
+			{
+				literals_.add(rules_[i].keyword, i);
+			}
+			else
+			{
+				try
+				{
+					rules_[i].regex = boost::regex(rules_[i].keyword);
+				}
+				catch (const boost::regex_error & e)
+				{
+					// 写错的正则只跳过这一条.
+					AVLOG_WARN << "bad keyword in " << filename << ": " << rules_[i].keyword
+						<< ": " << e.what();
+					continue;
+				}
+
+				if (has_backref(rules_[i].keyword))
+				{
+					unfiltered_rules_.push_back(i);
+					continue;
+				}
+
+				regex_rules_.push_back(i);
+
+				if (!combined.empty())
+					combined += '|';
+				combined += "(?:" + rules_[i].keyword + ")";
+			}
+		}
+
+		literals_.build();
+
+		try
+		{
+			if (!combined.empty())
+			{
+				prefilter_ = boost::regex(combined, boost::regex::perl | boost::regex::nosubs);
+				has_prefilter_ = true;
+			}
+		}
+		catch (const boost::regex_error &)
+		{
+			// 单独能编译, 拼起来不行的, 就不做预先筛选.
 		}
 	}
-}
 
-void StaticContent::operator()(const boost::property_tree::ptree& pt)
+	std::size_t size() const
+	{
+		return rules_.size();
+	}
+
+	// 返回匹配上的规则, 按在 static.xml 里的顺序.
+	void match(const std::string & text, std::vector<const static_rule *> & out) const
+	{
+		std::vector<bool> matched(rules_.size(), false);
+
+		literals_.search(text, mark_matched(matched));
+
+		if (!regex_rules_.empty() && (!has_prefilter_ || boost::regex_search(text, prefilter_)))
+		{
+			BOOST_FOREACH(std::size_t i, regex_rules_)
+			{
+				if (boost::regex_search(text, rules_[i].regex))
+					matched[i] = true;
+			}
+		}
+
+		BOOST_FOREACH(std::size_t i, unfiltered_rules_)
+		{
+			if (boost::regex_search(text, rules_[i].regex))
+				matched[i] = true;
+		}
+
+		for (std::size_t i = 0; i < rules_.size(); i++)
+		{
+			if (matched[i])
+				out.push_back(&rules_[i]);
+		}
+	}
+
+private:
+	struct mark_matched
+	{
+		mark_matched(std::vector<bool> & matched) : matched_(matched) {}
+
+		void operator()(std::size_t id) const
+		{
+			matched_[id] = true;
+		}
+
+		std::vector<bool> & matched_;
+	};
+
+	static bool is_literal(const std::string & keyword)
+	{
+		return !keyword.empty() && keyword.find_first_of(".^$|()[]{}*+?\\") == std::string::npos;
+	}
+
+	// \1 \g{1} \k<name> (?P=name) 之类引用分组的写法, 包括递归和条件.
+	static bool has_backref(const std::string & keyword)
+	{
+		for (std::size_t i = 0; i + 1 < keyword.size(); i++)
+		{
+			if (keyword[i] == '\\')
+			{
+				char c = keyword[i + 1];
+				if ((c >= '1' && c <= '9') || c == 'g' || c == 'k')
+					return true;
+				// 跳过被转义的字符.
+				i++;
+			}
+			else if (keyword[i] == '(' && keyword[i + 1] == '?' && i + 2 < keyword.size())
+			{
+				char c = keyword[i + 2];
+				if (c == 'P' || c == '&' || c == '(' || c == 'R' || c == '+' || c == '-' || (c >= '0' && c <= '9'))
+					return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::vector<static_rule> rules_;
+	keyword_automaton literals_;
+	// 参加预先筛选的正则.
+	std::vector<std::size_t> regex_rules_;
+	// 带反向引用的, 每次都单独匹配.
+	std::vector<std::size_t> unfiltered_rules_;
+	boost::regex prefilter_;
+	bool has_prefilter_;
+};
+
+} // namespace
+
+// 持有当前的规则快照, 定时检查 static.xml 的修改时间, 改了就在旁边重新编译, 成功后整个替换.
+// 正在使用旧快照的调用者不受影响.
+class static_rule_cache
+	: boost::noncopyable
+	, public boost::enable_shared_from_this<static_rule_cache>
 {
-	std::string text = pt.get<std::string>("message.text");
+public:
+	static_rule_cache(boost::asio::io_service & io)
+		: timer_(io)
+		, filename_("static.xml")
+		, last_write_time_(0)
+		, stopped_(false)
+		, d_(0, 10000)
+	{
+		g_.seed(std::time(0));
+		reload();
+	}
+
+	void start()
+	{
+		schedule_check();
+	}
+
+	void stop()
+	{
+		boost::system::error_code ec;
+		stopped_ = true;
+		timer_.cancel(ec);
+	}
+
+	boost::shared_ptr<const static_rule_set> snapshot() const
+	{
+		return rules_;
+	}
 
-	BOOST_FOREACH(const auto & item,  static_contents_)
+	int random()
 	{
-		if(boost::regex_search(text, item.first))
+		return d_(g_);
+	}
+
+private:
+	void reload()
+	{
+		boost::system::error_code ec;
+		std::time_t write_time = fs::last_write_time(filename_, ec);
+
+		if (ec)
+		{
+			// 文件被删了.
+			rules_.reset();
+			last_write_time_ = 0;
+			return;
+		}
+
+		last_write_time_ = write_time;
+
+		try
+		{
+			rules_ = boost::make_shared<static_rule_set>(filename_);
+		}
+		catch (const std::exception & e)
 		{
-			sender_(item.second[d_(g_) % item.second.size()]);
+			// 改坏了就继续用以前的规则.
+			AVLOG_ERR << "failed to load " << filename_ << ": " << e.what();
 		}
 	}
+
+	void schedule_check()
+	{
+		timer_.expires_from_now(boost::posix_time::seconds(5));
+		timer_.async_wait(boost::bind(&static_rule_cache::on_check, shared_from_this(), _1));
+	}
+
+	void on_check(boost::system::error_code ec)
+	{
+		if (ec || stopped_)
+			return;
+
+		std::time_t write_time = fs::last_write_time(filename_, ec);
+
+		if (ec ? last_write_time_ != 0 : write_time != last_write_time_)
+			reload();
+
+		schedule_check();
+	}
+
+private:
+	boost::asio::deadline_timer timer_;
+	std::string filename_;
+	std::time_t last_write_time_;
+	boost::shared_ptr<const static_rule_set> rules_;
+	bool stopped_;
+
+	boost::random::mt19937 g_;
+	boost::uniform_int<> d_;
+};
+
+struct StaticContent
+{
+	StaticContent(boost::shared_ptr<static_rule_cache> cache, boost::function<void(std::string)> sender);
+
+	void operator()(boost::system::error_code ec) {}
+
+	void operator()(const avbot_message & msg);
+
+	boost::shared_ptr<static_rule_cache> cache_;
+	boost::function<void(std::string)> sender_;
+};
+
+StaticContent::StaticContent(boost::shared_ptr<static_rule_cache> cache, boost::function<void(std::string)> sender)
+	: cache_(cache)
+	, sender_(sender)
+{
+}
+
+void StaticContent::operator()(const avbot_message & msg)
+{
+	boost::shared_ptr<const static_rule_set> rules = cache_->snapshot();
+
+	if (!rules || rules->size() == 0)
+		return;
+
+	std::vector<const static_rule *> matched;
+	rules->match(msg.text(), matched);
+
+	BOOST_FOREACH(const static_rule * rule,  matched)
+	{
+		sender_(rule->messages[cache_->random() % rule->messages.size()]);
+	}
+}
+
+boost::shared_ptr<static_rule_cache> make_static_rule_cache(boost::asio::io_service& io)
+{
+	boost::shared_ptr<static_rule_cache> cache = boost::make_shared<static_rule_cache>(boost::ref(io));
+	cache->start();
+	return cache;
+}
+
+void stop_static_rule_cache(static_rule_cache& cache)
+{
+	cache.stop();
 }
 
-avbot_extension make_static_content(boost::asio::io_service& io, std::string channel_name, boost::function<void(std::string)> sender)
+avbot_extension make_static_content(boost::shared_ptr<static_rule_cache> cache, std::string channel_name, boost::function<void(std::string)> sender)
 {
 	return avbot_extension(
 		channel_name,
-		StaticContent(io, sender)
+		StaticContent(cache, sender)
 	);
 }
@@ -1,4 +1,11 @@
 
 #include "extension.hpp"
 
-avbot_extension make_static_content(boost::asio::io_service& io, std::string channel_name, boost::function<void(std::string)> sender);
+class static_rule_cache;
+
+// static.xml 里的规则, 所有频道共用一份, 由 avbot_extensions 持有.
+boost::shared_ptr<static_rule_cache> make_static_rule_cache(boost::asio::io_service& io);
+// 停止检查 static.xml 的修改.
+void stop_static_rule_cache(static_rule_cache& cache);
+
+avbot_extension make_static_content(boost::shared_ptr<static_rule_cache> cache, std::string channel_name, boost::function<void(std::string)> sender);
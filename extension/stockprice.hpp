@@ -389,9 +389,9 @@ public:
 	{}
 
 	void operator()(const boost::system::error_code &error);
-	void operator()(boost::property_tree::ptree msg)
+	void operator()(const avbot_message & msg)
 	{
-		std::string textmsg = boost::trim_copy(msg.get<std::string>("message.text"));
+		std::string textmsg = boost::trim_copy(msg.text());
 
 		boost::cmatch what;
 		if (boost::regex_search(textmsg.c_str(), what, boost::regex(".qqbot 股票(.*)")))
@@ -1,5 +1,14 @@
 ﻿#include <string>
 #include <algorithm>
+#include <list>
+#include <map>
+#include <deque>
+#include <vector>
+#include <cctype>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/date_time/time_duration.hpp>
 #include <boost/algorithm/string.hpp>
 
@@ -24,79 +33,457 @@ static inline bool is_html( const std::string contenttype )
 	return false;
 }
 
-static inline std::string get_char_set( std::string type,  const std::string & header )
+// 从 "text/html; charset=gbk" 这样的字符串里取出 charset, 没有就返回空.
+static inline std::string charset_from_content_type( const std::string & type )
 {
-	boost::cmatch what;
-	// 首先是 text/html; charset=XXX
-	boost::regex ex( "charset=([a-zA-Z0-9\\-_]+)" );
-	boost::regex ex2( "<meta charset=[\"\']?([a-zA-Z0-9\\-_]+)[\"\']?" );
+	std::string lower = boost::to_lower_copy( type );
+	std::string::size_type pos = lower.find( "charset=" );
+
+	if( pos == std::string::npos )
+		return std::string();
+
+	pos += 8;
+
+	if( pos < lower.size() && ( lower[pos] == '"' || lower[pos] == '\'' ) )
+		pos++;
+
+	std::string::size_type end = pos;
+
+	while( end < lower.size() && ( std::isalnum( static_cast<unsigned char>( lower[end] ) ) || lower[end] == '-' || lower[end] == '_' ) )
+		end++;
+
+	return lower.substr( pos, end - pos );
+}
 
-	if( boost::regex_search( type.c_str(), what, ex ) )
+// 增量扫描 html 的 <head> 部分, 取出 <title>, <meta charset> 和 <meta http-equiv="refresh">.
+// 数据分几次喂进来也没关系, 每个字节只处理一次, 不复制整个缓冲.
+class html_head_scanner
+{
+	enum state_type
+	{
+		text,
+		tag_open,
+		tag_name,
+		in_tag,
+		attr_name,
+		after_attr_name,
+		before_value,
+		value_quoted,
+		value_unquoted,
+		skip_declaration,
+		title_text,
+	};
+
+	// 标签名, 属性名, 属性值的长度上限, 超过的部分丢掉.
+	static const std::size_t max_name = 16;
+	static const std::size_t max_value = 512;
+	static const std::size_t max_title = 1024;
+
+public:
+	html_head_scanner()
+		: m_state(text)
+		, m_closing(false)
+		, m_quote(0)
+		, m_end_tag_matched(0)
+		, m_title_done(false)
+		, m_head_done(false)
 	{
-		return what[1];
 	}
-	else if( boost::regex_search( type.c_str(), what, ex2 ) )
+
+	void feed(const char * data, std::size_t size)
 	{
-		return what[1];
+		for (std::size_t i = 0; i < size && !m_head_done; i++)
+			feed(data[i]);
 	}
-	else if( boost::regex_search( header.c_str(), what, ex ) )
+
+	// <title> 已经读完, 也知道编码了, 或者 <head> 已经结束了, 不需要再读.
+	bool done() const
 	{
-		return what[1];
+		return m_head_done || (m_title_done && !m_charset.empty());
 	}
-	else if( boost::regex_search( header.c_str(), what, ex2 ) )
+
+	bool has_title() const { return m_title_done; }
+	const std::string & title() const { return m_title; }
+	// <meta> 里声明的编码, 小写. 没有则为空.
+	const std::string & charset() const { return m_charset; }
+	// <meta http-equiv="refresh"> 里的 url, 没有则为空.
+	const std::string & refresh_url() const { return m_refresh_url; }
+
+private:
+	static bool is_space(char c)
 	{
-		return what[1];
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
 	}
 
-	return "utf8";
-}
+	static char lower(char c)
+	{
+		return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+	}
+
+	static void append(std::string & s, char c, std::size_t limit)
+	{
+		if (s.size() < limit)
+			s += c;
+	}
+
+	void feed(char c)
+	{
+		switch (m_state)
+		{
+			case text:
+				if (c == '<')
+				{
+					m_state = tag_open;
+					m_closing = false;
+					m_tag.clear();
+					m_attr.clear();
+					m_http_equiv.clear();
+					m_content.clear();
+				}
+				break;
+			case tag_open:
+				if (c == '/' && !m_closing)
+					m_closing = true;
+				else if (c == '!' || c == '?')
+					m_state = skip_declaration;
+				else if (std::isalpha(static_cast<unsigned char>(c)))
+				{
+					append(m_tag, lower(c), max_name);
+					m_state = tag_name;
+				}
+				else
+					m_state = text;
+				break;
+			case tag_name:
+				if (is_space(c) || c == '/')
+					m_state = in_tag;
+				else if (c == '>')
+					end_tag();
+				else
+					append(m_tag, lower(c), max_name);
+				break;
+			case in_tag:
+				if (c == '>')
+					end_tag();
+				else if (!is_space(c) && c != '/')
+				{
+					m_attr.assign(1, lower(c));
+					m_value.clear();
+					m_state = attr_name;
+				}
+				break;
+			case attr_name:
+				if (c == '=')
+					m_state = before_value;
+				else if (is_space(c))
+					m_state = after_attr_name;
+				else if (c == '>')
+				{
+					end_attr();
+					end_tag();
+				}
+				else
+					append(m_attr, lower(c), max_name);
+				break;
+			case after_attr_name:
+				if (c == '=')
+					m_state = before_value;
+				else if (c == '>')
+				{
+					end_attr();
+					end_tag();
+				}
+				else if (!is_space(c))
+				{
+					end_attr();
+					m_attr.assign(1, lower(c));
+					m_value.clear();
+					m_state = attr_name;
+				}
+				break;
+			case before_value:
+				if (c == '"' || c == '\'')
+				{
+					m_quote = c;
+					m_state = value_quoted;
+				}
+				else if (c == '>')
+				{
+					end_attr();
+					end_tag();
+				}
+				else if (!is_space(c))
+				{
+					append(m_value, c, max_value);
+					m_state = value_unquoted;
+				}
+				break;
+			case value_quoted:
+				if (c == m_quote)
+				{
+					end_attr();
+					m_state = in_tag;
+				}
+				else
+					append(m_value, c, max_value);
+				break;
+			case value_unquoted:
+				if (is_space(c))
+				{
+					end_attr();
+					m_state = in_tag;
+				}
+				else if (c == '>')
+				{
+					end_attr();
+					end_tag();
+				}
+				else
+					append(m_value, c, max_value);
+				break;
+			case skip_declaration:
+				if (c == '>')
+					m_state = text;
+				break;
+			case title_text:
+				title_char(c);
+				break;
+		}
+	}
 
-inline std::size_t read_until_title(boost::system::error_code ec, std::size_t bytes_transferred, std::size_t max_transfer, boost::asio::streambuf & buf)
+	void end_attr()
+	{
+		if (m_tag != "meta" || m_closing)
+			return;
+
+		if (m_attr == "charset")
+		{
+			if (m_charset.empty())
+				m_charset = boost::to_lower_copy(m_value);
+		}
+		else if (m_attr == "http-equiv")
+			m_http_equiv = boost::to_lower_copy(m_value);
+		else if (m_attr == "content")
+			m_content = m_value;
+	}
+
+	void end_tag()
+	{
+		m_state = text;
+
+		if (m_closing)
+		{
+			if (m_tag == "head")
+				m_head_done = true;
+			return;
+		}
+
+		if (m_tag == "body")
+		{
+			m_head_done = true;
+		}
+		else if (m_tag == "title" && !m_title_done)
+		{
+			m_title.clear();
+			m_state = title_text;
+		}
+		else if (m_tag == "meta")
+		{
+			if (m_http_equiv == "content-type" && m_charset.empty())
+			{
+				m_charset = charset_from_content_type(m_content);
+			}
+			else if (m_http_equiv == "refresh" && m_refresh_url.empty())
+			{
+				// content="0; url=http://..."
+				std::string lower_content = boost::to_lower_copy(m_content);
+				std::string::size_type pos = lower_content.find("url=");
+
+				if (pos != std::string::npos)
+				{
+					m_refresh_url = boost::trim_copy_if(m_content.substr(pos + 4), boost::is_any_of(" \t'\""));
+				}
+			}
+		}
+	}
+
+	// <title> 里的文字. 只有 </title 才结束, 其他的 < 都是文字.
+	void title_char(char c)
+	{
+		static const char end_tag[] = "</title";
+		static const std::size_t end_tag_len = sizeof(end_tag) - 1;
+
+		if (lower(c) == end_tag[m_end_tag_matched])
+		{
+			if (++m_end_tag_matched == end_tag_len)
+			{
+				m_end_tag_matched = 0;
+				m_title_done = true;
+				boost::trim(m_title);
+				// 跳过 </title 后面到 > 的部分.
+				m_tag = "title";
+				m_closing = true;
+				m_state = in_tag;
+			}
+			return;
+		}
+
+		// 前面匹配了一部分 </title, 其实是标题的内容.
+		if (m_end_tag_matched)
+		{
+			for (std::size_t i = 0; i < m_end_tag_matched; i++)
+				title_append(end_tag[i]);
+			m_end_tag_matched = 0;
+
+			if (c == '<')
+			{
+				m_end_tag_matched = 1;
+				return;
+			}
+		}
+
+		title_append(c);
+	}
+
+	// 换行和连续的空白合并成一个空格.
+	void title_append(char c)
+	{
+		if (is_space(c))
+		{
+			if (!m_title.empty() && m_title[m_title.size() - 1] != ' ')
+				append(m_title, ' ', max_title);
+		}
+		else
+			append(m_title, c, max_title);
+	}
+
+private:
+	state_type m_state;
+	bool m_closing;
+	char m_quote;
+	std::size_t m_end_tag_matched;
+
+	std::string m_tag;
+	std::string m_attr;
+	std::string m_value;
+	std::string m_http_equiv;
+	std::string m_content;
+
+	std::string m_title;
+	bool m_title_done;
+	bool m_head_done;
+	std::string m_charset;
+	std::string m_refresh_url;
+};
+
+// async_read 的完成条件, 把新读到的字节喂给 html_head_scanner.
+// 扫描器说不用再读了, 或者读够 max_transfer 个字节就停.
+class read_until_title
 {
-	if (ec)
-		return 0;
-	// 有 </title> 就不读了, 或则已经读取到 4096 个字节也就不读了
-	// 或则已经读到 content_length 也不读了.
-	if (bytes_transferred >= max_transfer)
-		return 0;
-	std::string data(boost::asio::buffer_cast<const char*>(buf.data()), boost::asio::buffer_size(buf.data()));
-	boost::to_lower( data );
-	if (data.find("</title>")==std::string::npos){
-		return max_transfer - bytes_transferred;
+public:
+	read_until_title(std::size_t max_transfer, boost::asio::streambuf & buf,
+		boost::shared_ptr<html_head_scanner> scanner, boost::shared_ptr<std::size_t> scanned)
+		: m_max_transfer(max_transfer)
+		, m_buf(buf)
+		, m_scanner(scanner)
+		, m_scanned(scanned)
+	{
 	}
-	if (data.find("<meta>")==std::string::npos){
-		return max_transfer - bytes_transferred;
+
+	std::size_t operator()(boost::system::error_code ec, std::size_t bytes_transferred)
+	{
+		if (ec)
+			return 0;
+
+		scan(m_buf, *m_scanner, *m_scanned);
+
+		if (bytes_transferred >= m_max_transfer || m_scanner->done())
+			return 0;
+
+		return m_max_transfer - bytes_transferred;
 	}
 
-	return 0;
-}
+	// 只扫描 scanned 之后新的数据.
+	static void scan(boost::asio::streambuf & buf, html_head_scanner & scanner, std::size_t & scanned)
+	{
+		const char * data = boost::asio::buffer_cast<const char*>(buf.data());
+		std::size_t size = boost::asio::buffer_size(buf.data());
+
+		if (size > scanned)
+		{
+			scanner.feed(data + scanned, size - scanned);
+			scanned = size;
+		}
+	}
+
+private:
+	std::size_t m_max_transfer;
+	boost::asio::streambuf & m_buf;
+	boost::shared_ptr<html_head_scanner> m_scanner;
+	// 完成条件会被 async_read 复制, 进度放在共享的计数里.
+	boost::shared_ptr<std::size_t> m_scanned;
+};
+
+// 一次预览的结果, 和是谁发的 url 无关, 可以缓存起来给别的频道用.
+struct preview_result
+{
+	enum result_type { title, content_type, no_title, decode_error, fetch_error };
+
+	result_type type;
+	// 标题, content type 或者错误信息.
+	std::string text;
+};
 
-struct urlpreview
+typedef boost::function<void (const preview_result &)> preview_handler;
+
+// 一次获取 (包括 html 重定向) 当前用的连接, 超时的时候用来关闭它.
+struct fetch_context
+{
+	boost::shared_ptr<avhttp::http_stream> stream;
+};
+
+// 获取一个 url 的标题.
+struct urlpreview_fetch
 {
 	boost::asio::io_service &io_service;
-	boost::function<void ( std::string ) > m_sender;
-	std::string m_speaker;
+	preview_handler m_handler;
 	std::string m_url;
 	boost::shared_ptr<avhttp::http_stream> m_httpstream;
+	boost::shared_ptr<fetch_context> m_context;
 
 	boost::shared_ptr<boost::asio::streambuf> m_content;
+	boost::shared_ptr<html_head_scanner> m_scanner;
+	boost::shared_ptr<std::size_t> m_scanned;
 	int m_redirect ;
 
-	template<class MsgSender>
-	urlpreview( boost::asio::io_service &_io_service,
-				MsgSender sender,
-				std::string speaker, std::string url, int redirectlevel = 0 )
-		: io_service( _io_service ), m_sender( sender )
-		, m_speaker( speaker ), m_url( url )
+	urlpreview_fetch( boost::asio::io_service &_io_service,
+				preview_handler handler,
+				std::string url, boost::shared_ptr<fetch_context> context,
+				int redirectlevel = 0 )
+		: io_service( _io_service ), m_handler( handler )
+		, m_url( url )
 		, m_httpstream( new avhttp::http_stream( io_service ) )
+		, m_context( context )
 		, m_redirect(redirectlevel)
 	{
+		m_context->stream = m_httpstream;
+
 		// 开启 avhttp 下载页面
 		m_httpstream->check_certificate( false );
 		try{
 			// 防止 非法 url 导致错误
 			m_httpstream->async_open( url, *this );
-		}catch (...){}
+		}catch (...){
+			complete(preview_result::fetch_error, "invalid url");
+		}
+	}
+
+	void complete(preview_result::result_type type, const std::string & text)
+	{
+		preview_result result;
+		result.type = type;
+		result.text = text;
+		io_service.post(boost::bind(m_handler, result));
 	}
 
 	// 打开在这里
@@ -105,7 +492,7 @@ struct urlpreview
 		if( ec )
 		{
 			// 报告出错。
-			m_sender( boost::str( boost::format("@%s, 获取url有错 %s") % m_speaker % ec.message() ) );
+			complete(preview_result::fetch_error, ec.message());
 			return;
 		}
 
@@ -115,11 +502,13 @@ struct urlpreview
 		if( ! is_html( opt.find( avhttp::http_options::content_type ) ) )
 		{
 			// 报告类型就可以
-			m_sender( boost::str( boost::format("%s 发的 ⇪ 类型是 %s ") % m_speaker % opt.find( avhttp::http_options::content_type ) ) );
+			complete(preview_result::content_type, opt.find( avhttp::http_options::content_type ));
 			return;
 		}
 
 		m_content.reset( new boost::asio::streambuf );
+		m_scanner.reset( new html_head_scanner );
+		m_scanned.reset( new std::size_t(0) );
 
 		unsigned content_length = 0;
 
@@ -138,7 +527,7 @@ struct urlpreview
 		}
 
 		boost::asio::async_read(*m_httpstream, *m_content,
-						boost::bind(read_until_title, _1, _2, std::min<unsigned>( content_length, 4096 ), boost::ref(*m_content) ),
+						read_until_title(std::min<unsigned>( content_length, 4096 ), *m_content, m_scanner, m_scanned),
 						*this
 		);
 	}
@@ -148,72 +537,332 @@ struct urlpreview
 	{
 		if( ec && ec != boost::asio::error::eof )
 		{
-			m_sender( boost::str( boost::format("@%s, 获取url有错 %s") % m_speaker % ec.message() ) );
+			complete(preview_result::fetch_error, ec.message());
 			return;
 		}
 
-		// 解析 <title>
-		std::string content;
-		content.resize( m_content->size() );
-		m_content->sgetn( &content[0], m_content->size() );
-
-		// 转换成小写, 统一处理, 避免遗漏大写的title标签.
-		boost::to_lower( content );
-
-		//去掉换行.
-		boost::replace_all( content, "\r", "" );
-		boost::replace_all( content, "\n", "" );
-		// 获取charset
-		std::string charset = get_char_set( m_httpstream->response_options().find( avhttp::http_options::content_type ), content );
-		content = content.substr(0, content.find("</title>")+8);
-		// 匹配.
-		boost::regex ex( "<title[^>]*>(.*)</title>" );
-		boost::cmatch what;
-
-		if( boost::regex_search( content.c_str(), what, ex ) )
+		// 最后一次读取出错 (比如 eof) 的时候完成条件没有扫描新数据.
+		read_until_title::scan( *m_content, *m_scanner, *m_scanned );
+
+		if( m_scanner->has_title() )
 		{
-			std::string title = what[1];
-			boost::trim_left(title);
+			std::string title = m_scanner->title();
+
+			// 优先用 http 头里的编码, 然后是 <meta> 里声明的.
+			std::string charset = charset_from_content_type( m_httpstream->response_options().find( avhttp::http_options::content_type ) );
+
+			if( charset.empty() )
+				charset = m_scanner->charset();
 
 			try
 			{
-				if( charset != "utf8" && charset != "utf" && charset != "utf-8" )
+				if( !charset.empty() && charset != "utf8" && charset != "utf" && charset != "utf-8" )
 				{
 					title = boost::locale::conv::between( title, "UTF-8", charset );
 				}
 
 				boost::trim( title );
 
-				title = html_unescape(title);
 				// 将 &bnp 这种反格式化.
-				m_sender( boost::str( boost::format("@%s ⇪ 标题： %s ") % m_speaker % title ) );
+				title = html_unescape(title);
+				complete(preview_result::title, title);
 			}
 			catch( const std::runtime_error & )
 			{
-				m_sender( boost::str( boost::format("@%s ⇪ 解码网页发生错误 ") % m_speaker ) );
+				complete(preview_result::decode_error, "");
 			}
 		}
+		else if( m_redirect < 10 && !m_scanner->refresh_url().empty() )
+		{
+			// title 都没有！ 是 html 重定向.
+			urlpreview_fetch(io_service, m_handler, m_scanner->refresh_url(), m_context, m_redirect + 1);
+		}
 		else
 		{
-			// 解析是不是 html 重定向
-			boost::regex ex("<meta +http-equiv=\"refresh\" +content=\"[^;];url=(.*)\" *>");
-			// title 都没有！
-			if (m_redirect < 10 && boost::regex_search(content.c_str(), what, ex)){
-				urlpreview(io_service, m_sender, m_speaker, what[1], m_redirect + 1);
-			}else{
-				m_sender( boost::str( boost::format("@%s ⇪ url 无标题 ") % m_speaker ) );
+			complete(preview_result::no_title, "");
+		}
+	}
+};
+
+}
+
+// 进程内共享的 url 预览服务.
+// 结果按规范化的 url 缓存在 LRU 里, 成功的结果缓存 10 分钟, 出错的缓存 1 分钟.
+// 同一个 url 正在获取的时候, 后来的请求等着同一次获取的结果.
+// 每个 host 最多同时获取 2 个 url, 其余的排队.
+// avhttp 没有超时, 每次获取最多等 30 秒, 服务器不响应也不会一直占着 host 的位置.
+class urlpreview_service
+	: boost::noncopyable
+	, public boost::enable_shared_from_this<urlpreview_service>
+{
+	static const std::size_t max_cached = 256;
+	static const std::size_t max_fetch_per_host = 2;
+	static const long fetch_timeout = 30;
+
+	struct cache_entry
+	{
+		std::string url;
+		detail::preview_result result;
+		boost::posix_time::ptime expires;
+	};
+
+	typedef std::list<cache_entry> lru_list;
+
+	// 正在进行的一次获取, 超时以后它的结果就不要了.
+	struct fetch_state
+	{
+		fetch_state(boost::asio::io_service & io_service)
+			: timer(io_service)
+			, context(new detail::fetch_context)
+		{
+		}
+
+		boost::asio::deadline_timer timer;
+		boost::shared_ptr<detail::fetch_context> context;
+	};
+
+public:
+	urlpreview_service(boost::asio::io_service & io_service)
+		: m_io_service(io_service)
+		, m_stopped(false)
+	{
+	}
+
+	// 等着的请求直接丢掉, 不再回调.
+	void stop()
+	{
+		boost::system::error_code ignore_ec;
+
+		m_stopped = true;
+
+		for (std::map<std::string, boost::shared_ptr<fetch_state> >::iterator i = m_fetching.begin();
+			i != m_fetching.end(); ++i)
+		{
+			i->second->timer.cancel(ignore_ec);
+
+			if (i->second->context->stream)
+				i->second->context->stream->close(ignore_ec);
+		}
+
+		m_fetching.clear();
+		m_inflight.clear();
+		m_host_active.clear();
+		m_host_waiting.clear();
+	}
+
+	void async_preview(const std::string & url, detail::preview_handler handler)
+	{
+		if (m_stopped)
+			return;
+
+		std::string host;
+		std::string key = normalize(url, host);
+
+		if (key.empty())
+		{
+			detail::preview_result result;
+			result.type = detail::preview_result::fetch_error;
+			result.text = "invalid url";
+			m_io_service.post(boost::bind(handler, result));
+			return;
+		}
+
+		boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+
+		std::map<std::string, lru_list::iterator>::iterator cached = m_cache_index.find(key);
+
+		if (cached != m_cache_index.end())
+		{
+			if (cached->second->expires > now)
+			{
+				// 放到最前面.
+				m_lru.splice(m_lru.begin(), m_lru, cached->second);
+				m_io_service.post(boost::bind(handler, cached->second->result));
+				return;
 			}
+
+			m_lru.erase(cached->second);
+			m_cache_index.erase(cached);
 		}
+
+		std::vector<detail::preview_handler> & waiters = m_inflight[key];
+		waiters.push_back(handler);
+
+		// 已经在获取了.
+		if (waiters.size() > 1)
+			return;
+
+		if (m_host_active[host] < max_fetch_per_host)
+			start_fetch(key, host);
+		else
+			m_host_waiting[host].push_back(key);
+	}
+
+private:
+	// 协议和主机名转成小写, 去掉 #fragment. 返回空表示不是合法的 url.
+	static std::string normalize(const std::string & url, std::string & host)
+	{
+		std::string::size_type scheme_end = url.find("://");
+
+		if (scheme_end == std::string::npos)
+			return std::string();
+
+		std::string::size_type host_end = url.find_first_of("/?#", scheme_end + 3);
+		std::string::size_type fragment = url.find('#', scheme_end + 3);
+
+		std::string normalized = boost::to_lower_copy(url.substr(0, host_end))
+			+ (host_end == std::string::npos ? std::string() : url.substr(host_end, fragment - host_end));
+
+		host = boost::to_lower_copy(url.substr(scheme_end + 3, host_end == std::string::npos ? std::string::npos : host_end - scheme_end - 3));
+
+		if (host.empty())
+			return std::string();
+
+		return normalized;
+	}
+
+	void start_fetch(const std::string & key, const std::string & host)
+	{
+		m_host_active[host]++;
+
+		boost::shared_ptr<fetch_state> state = boost::make_shared<fetch_state>(boost::ref(m_io_service));
+		m_fetching[key] = state;
+
+		state->timer.expires_from_now(boost::posix_time::seconds(fetch_timeout));
+		state->timer.async_wait(
+			boost::bind(&urlpreview_service::on_timeout, shared_from_this(), key, host, state, _1));
+
+		detail::urlpreview_fetch(m_io_service,
+			boost::bind(&urlpreview_service::on_fetched, shared_from_this(), key, host, state, _1), key, state->context);
 	}
+
+	// 关掉连接, 按获取出错处理, 出错的结果也会缓存起来.
+	void on_timeout(const std::string & key, const std::string & host,
+		boost::shared_ptr<fetch_state> state, const boost::system::error_code & ec)
+	{
+		if (ec)
+			return;
+
+		boost::system::error_code ignore_ec;
+
+		if (state->context->stream)
+			state->context->stream->close(ignore_ec);
+
+		detail::preview_result result;
+		result.type = detail::preview_result::fetch_error;
+		result.text = "timed out";
+		on_fetched(key, host, state, result);
+	}
+
+	void on_fetched(const std::string & key, const std::string & host,
+		boost::shared_ptr<fetch_state> state, const detail::preview_result & result)
+	{
+		std::map<std::string, boost::shared_ptr<fetch_state> >::iterator fetching = m_fetching.find(key);
+
+		// 已经超时了, 或者服务已经停止, 关闭连接以后才回调的.
+		if (fetching == m_fetching.end() || fetching->second != state)
+			return;
+
+		m_fetching.erase(fetching);
+
+		boost::system::error_code ignore_ec;
+		state->timer.cancel(ignore_ec);
+
+		cache_entry entry;
+		entry.url = key;
+		entry.result = result;
+		entry.expires = boost::posix_time::second_clock::universal_time()
+			+ (result.type == detail::preview_result::fetch_error
+				? boost::posix_time::minutes(1) : boost::posix_time::minutes(10));
+
+		m_lru.push_front(entry);
+		m_cache_index[key] = m_lru.begin();
+
+		while (m_lru.size() > max_cached)
+		{
+			m_cache_index.erase(m_lru.back().url);
+			m_lru.pop_back();
+		}
+
+		std::vector<detail::preview_handler> waiters;
+		waiters.swap(m_inflight[key]);
+		m_inflight.erase(key);
+
+		BOOST_FOREACH(const detail::preview_handler & handler, waiters)
+			handler(result);
+
+		// 这个 host 空出一个位置, 开始下一个排队的.
+		m_host_active[host]--;
+
+		std::deque<std::string> & waiting = m_host_waiting[host];
+
+		if (!waiting.empty())
+		{
+			std::string next = waiting.front();
+			waiting.pop_front();
+			start_fetch(next, host);
+		}
+
+		if (m_host_active[host] == 0)
+		{
+			m_host_active.erase(host);
+			m_host_waiting.erase(host);
+		}
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	bool m_stopped;
+
+	lru_list m_lru;
+	std::map<std::string, lru_list::iterator> m_cache_index;
+
+	std::map<std::string, std::vector<detail::preview_handler> > m_inflight;
+	std::map<std::string, boost::shared_ptr<fetch_state> > m_fetching;
+	std::map<std::string, std::size_t> m_host_active;
+	std::map<std::string, std::deque<std::string> > m_host_waiting;
 };
 
+const long urlpreview_service::fetch_timeout;
+
+boost::shared_ptr<urlpreview_service> make_urlpreview_service(boost::asio::io_service &io_service)
+{
+	return boost::make_shared<urlpreview_service>(boost::ref(io_service));
+}
+
+void stop_urlpreview_service(urlpreview_service & service)
+{
+	service.stop();
+}
+
+// 把预览结果告诉发 url 的人.
+static void report_preview(boost::function<void ( std::string ) > sender, std::string speaker, const detail::preview_result & result)
+{
+	switch (result.type)
+	{
+		case detail::preview_result::title:
+			sender( boost::str( boost::format("@%s ⇪ 标题： %s ") % speaker % result.text ) );
+			break;
+		case detail::preview_result::content_type:
+			sender( boost::str( boost::format("%s 发的 ⇪ 类型是 %s ") % speaker % result.text ) );
+			break;
+		case detail::preview_result::no_title:
+			sender( boost::str( boost::format("@%s ⇪ url 无标题 ") % speaker ) );
+			break;
+		case detail::preview_result::decode_error:
+			sender( boost::str( boost::format("@%s ⇪ 解码网页发生错误 ") % speaker ) );
+			break;
+		case detail::preview_result::fetch_error:
+			sender( boost::str( boost::format("@%s, 获取url有错 %s") % speaker % result.text ) );
+			break;
+	}
 }
 
-void urlpreview::operator()( boost::property_tree::ptree message )
+void urlpreview::operator()( const avbot_message & message )
 {
 	// 检查 URL
-	std::string txt = message.get<std::string>( "message.text" );
-	std::string speaker = message.get<std::string>( "who.nick" );; // 发了 url 的人的 nick
+	std::string txt = message.text();
+	const std::string & speaker = message.who.nick; // 发了 url 的人的 nick
 
 	// 用正则表达式
 	// http://.*
@@ -300,7 +949,7 @@ void urlpreview::do_urlpreview(std::string speaker, std::string url, boost::posi
 
 	if (jiange.minutes() >= 5){
 		// 超过5分钟了,  应该说了.
-		// 把真正的工作交给真正的 urlpreview
-		detail::urlpreview( io_service, m_sender, speaker, url);
+		// 把真正的工作交给共享的预览服务.
+		m_service->async_preview(url, boost::bind(report_preview, m_sender, speaker, _1));
 	}
 }
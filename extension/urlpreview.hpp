@@ -18,6 +18,14 @@
 
 #include "extension.hpp"
 
+// 所有频道共用的 url 预览服务, 带缓存, 同一个 url 同时只获取一次.
+class urlpreview_service;
+
+boost::shared_ptr<urlpreview_service> make_urlpreview_service(boost::asio::io_service &io_service);
+
+// 关闭正在获取的连接, 之后的预览请求都不再回调.
+void stop_urlpreview_service(urlpreview_service & service);
+
 class urlpreview
 {
 	typedef std::pair<std::string, boost::posix_time::ptime> urllist_item_type;
@@ -25,17 +33,19 @@ class urlpreview
 	boost::shared_ptr<urllist_type>	urllist;
 	boost::asio::io_service &io_service;
 	boost::function<void ( std::string ) > m_sender;
+	boost::shared_ptr<urlpreview_service> m_service;
 
 public:
 	template<class MsgSender>
-	urlpreview( boost::asio::io_service &_io_service,  MsgSender sender)
+	urlpreview( boost::asio::io_service &_io_service,  MsgSender sender, boost::shared_ptr<urlpreview_service> service)
 		: m_sender(sender)
 		, io_service(_io_service)
 		, urllist(boost::make_shared<boost::circular_buffer_space_optimized<std::pair<std::string, boost::posix_time::ptime> > >(20))
+		, m_service(service)
 	{
 	}
 	// on_message 回调.
-	void operator()( boost::property_tree::ptree message );
+	void operator()( const avbot_message & message );
 private:
 	bool can_preview(std::string speaker, std::string url);
 	void do_urlpreview(std::string speaker, std::string url, boost::posix_time::ptime current);
@@ -1,103 +1,492 @@
+#include <deque>
+#include <vector>
 #include <boost/asio.hpp>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/random.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include <boost/function.hpp>
-#include <boost/property_tree/json_parser.hpp>
-#include <boost/async_coro_queue.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/thread.hpp>
-#include <boost/circular_buffer.hpp>
 
 #include "zmq.h"
 
 #include "zmqpublisher.hpp"
 
-class ZmqPublisher : boost::noncopyable
+namespace {
+
+// 直接从 avbot_message 写 json, 字段和 avbot_message::to_ptree() 的一样.
+class json_envelope_writer
 {
 public:
-	struct Message {
-		std::string channel_name;
-		std::string body;
-	};
+	json_envelope_writer(std::string & out)
+		: out_(out)
+	{
+	}
+
+	void begin_map(std::size_t)
+	{
+		out_ += '{';
+		first_.push_back(true);
+	}
+
+	void end_map()
+	{
+		out_ += '}';
+		first_.pop_back();
+	}
+
+	void key(const std::string & k)
+	{
+		if (!first_.back())
+			out_ += ',';
+		first_.back() = false;
+		string(k);
+		out_ += ':';
+	}
+
+	void value(const std::string & v)
+	{
+		string(v);
+	}
+
+private:
+	void string(const std::string & s)
+	{
+		static const char hex[] = "0123456789abcdef";
+
+		out_ += '"';
+		for (std::string::const_iterator it = s.begin(); it != s.end(); ++it)
+		{
+			unsigned char c = *it;
+			switch (c)
+			{
+				case '"': out_ += "\\\""; break;
+				case '\\': out_ += "\\\\"; break;
+				case '\n': out_ += "\\n"; break;
+				case '\r': out_ += "\\r"; break;
+				case '\t': out_ += "\\t"; break;
+				default:
+					if (c < 0x20)
+					{
+						out_ += "\\u00";
+						out_ += hex[c >> 4];
+						out_ += hex[c & 0xf];
+					}
+					else
+					{
+						// utf8 原样输出.
+						out_ += c;
+					}
+			}
+		}
+		out_ += '"';
+	}
+
+private:
+	std::string & out_;
+	std::vector<bool> first_;
+};
+
+// msgpack 格式, 结构和 json 的一样, 所有的值都是字符串.
+class msgpack_envelope_writer
+{
+public:
+	msgpack_envelope_writer(std::string & out)
+		: out_(out)
+	{
+	}
+
+	void begin_map(std::size_t n)
+	{
+		if (n < 16)
+		{
+			out_ += static_cast<char>(0x80 | n);
+		}
+		else
+		{
+			out_ += static_cast<char>(0xde);
+			put_be(n, 2);
+		}
+	}
+
+	void end_map()
+	{
+	}
+
+	void key(const std::string & k)
+	{
+		string(k);
+	}
+
+	void value(const std::string & v)
+	{
+		string(v);
+	}
+
+private:
+	void string(const std::string & s)
+	{
+		std::size_t n = s.size();
+
+		if (n < 32)
+		{
+			out_ += static_cast<char>(0xa0 | n);
+		}
+		else if (n < 0x100)
+		{
+			out_ += static_cast<char>(0xd9);
+			put_be(n, 1);
+		}
+		else if (n < 0x10000)
+		{
+			out_ += static_cast<char>(0xda);
+			put_be(n, 2);
+		}
+		else
+		{
+			out_ += static_cast<char>(0xdb);
+			put_be(n, 4);
+		}
+		out_ += s;
+	}
+
+	void put_be(std::size_t v, int bytes)
+	{
+		for (int i = bytes - 1; i >= 0; i--)
+			out_ += static_cast<char>((v >> (i * 8)) & 0xff);
+	}
+
+private:
+	std::string & out_;
+};
+
+template<class Writer>
+void put(Writer & w, const char * k, const std::string & v)
+{
+	w.key(k);
+	w.value(v);
+}
+
+template<class Writer>
+void serialize_message(Writer & w, const avbot_message & msg)
+{
+	bool is_qq = msg.protocol == "qq";
+	bool is_mail = msg.protocol == "mail";
+	bool has_who = !is_mail && msg.protocol != "rpc";
+	bool has_room = is_qq || !msg.room.name.get().empty();
+
+	std::size_t fields = 3 // protocol, channel, message
+		+ has_room
+		+ (is_mail ? 3 : 0)
+		+ has_who
+		+ !!msg.op
+		+ !msg.newbee.empty()
+		+ !msg.preamble.empty();
+
+	w.begin_map(fields);
+
+	put(w, "protocol", msg.protocol.get());
+	put(w, "channel", msg.channel.get());
+
+	if (is_qq)
+	{
+		w.key("room");
+		w.begin_map(1 + !msg.room.groupnumber.get().empty() + !msg.room.name.get().empty());
+		put(w, "code", msg.room.code.get());
+		if (!msg.room.groupnumber.get().empty())
+			put(w, "groupnumber", msg.room.groupnumber.get());
+		if (!msg.room.name.get().empty())
+			put(w, "name", msg.room.name.get());
+		w.end_map();
+	}
+	else if (has_room)
+	{
+		put(w, "room", msg.room.name.get());
+	}
+
+	if (is_mail)
+	{
+		put(w, "from", msg.mail.from);
+		put(w, "to", msg.mail.to);
+		put(w, "subject", msg.mail.subject);
+	}
+	else if (has_who)
+	{
+		w.key("who");
+		w.begin_map(1 + !msg.who.code.empty() + !msg.who.name.empty()
+			+ !msg.who.qqnumber.empty() + !msg.who.card.empty());
+		if (!msg.who.code.empty())
+			put(w, "code", msg.who.code);
+		put(w, "nick", msg.who.nick);
+		if (!msg.who.name.empty())
+			put(w, "name", msg.who.name);
+		if (!msg.who.qqnumber.empty())
+			put(w, "qqnumber", msg.who.qqnumber);
+		if (!msg.who.card.empty())
+			put(w, "card", msg.who.card);
+		w.end_map();
+	}
+
+	if (msg.op)
+		put(w, "op", *msg.op ? "1" : "0");
+	if (!msg.newbee.empty())
+		put(w, "newbee", msg.newbee);
+	if (!msg.preamble.empty())
+		put(w, "preamble", msg.preamble);
+
+	w.key("message");
+	w.begin_map(msg.segments.size());
+
+	BOOST_FOREACH(const avbot_message_segment & s, msg.segments)
+	{
+		switch (s.type)
+		{
+			case avbot_message_segment::text_segment:
+				if (is_mail && !msg.mail.content_type.empty())
+					put(w, msg.mail.content_type.c_str(), s.content);
+				else
+					put(w, "text", s.content);
+				break;
+			case avbot_message_segment::url_segment:
+				put(w, "url", s.content);
+				break;
+			case avbot_message_segment::img_segment:
+				put(w, "img", s.content);
+				break;
+			case avbot_message_segment::cface_segment:
+				w.key("cface");
+				w.begin_map(8);
+				put(w, "name", s.cface->name);
+				put(w, "gid", s.cface->gid);
+				put(w, "uin", s.cface->uin);
+				put(w, "key", s.cface->key);
+				put(w, "server", s.cface->server);
+				put(w, "file_id", s.cface->file_id);
+				put(w, "vfwebqq", s.cface->vfwebqq);
+				put(w, "gchatpicurl", s.cface->gchatpicurl);
+				w.end_map();
+				break;
+		}
+	}
+
+	w.end_map();
+	w.end_map();
+}
+
+// 一批消息序列化后连续放在 buffer 里, offsets 记录每条的结束位置.
+// buffer 在批次之间复用, 不用每条消息分配内存.
+struct envelope_batch
+{
+	std::string buffer;
+	std::vector<std::size_t> offsets;
+
+	void clear()
+	{
+		buffer.clear();
+		offsets.clear();
+	}
+};
 
+} // namespace
+
+class ZmqPublisher : boost::noncopyable
+{
+	// 发布线程来不及发送的时候最多积压这么多消息, 再多就丢弃最老的.
+	static const std::size_t max_pending = 1024;
+	// 一个 zmq 消息里最多合并的消息数.
+	static const std::size_t max_batch = 64;
+	// zmq 自己的发送高水位, 订阅者太慢的时候 zmq 会丢弃超出的消息.
+	static const int send_hwm = 1000;
+
+public:
 	ZmqPublisher()
 		: io_()
 		, work_(io_)
-		, queue_(io_, 10)
+		, flush_scheduled_(false)
+		, published_(0)
+		, batches_(0)
+		, dropped_(0)
+		, send_failed_(0)
 	{
 		ctx_.reset(zmq_ctx_new(), zmq_ctx_term);
-		socket_.reset(zmq_socket(ctx_.get(), ZMQ_PUB), zmq_close);
-		zmq_bind(socket_.get(), "tcp://*:8123");
-		queue_.async_pop(boost::bind(&ZmqPublisher::on_queue_pop, this, _1, _2));
-		boost::thread(boost::bind(&boost::asio::io_service::run, boost::ref(io_))).detach();
+		json_socket_ = make_socket("tcp://*:8123");
+		msgpack_socket_ = make_socket("tcp://*:8124");
+		thread_ = boost::thread(boost::bind(&boost::asio::io_service::run, boost::ref(io_)));
 	}
 
 	virtual ~ZmqPublisher()
 	{
-		queue_.cancele();
+		stop();
+	}
+
+	// 停止发布线程并等待它退出, 还没发出去的消息丢弃.
+	void stop()
+	{
 		io_.stop();
+
+		if (thread_.joinable())
+			thread_.join();
 	}
 
-	void send(const std::string& channel, const std::string& str)
+	// 在 avbot 的 io_service 里调用, 消息交给发布线程.
+	void publish(const avbot_message & msg)
 	{
-		Message msg;
-		msg.channel_name = channel;
-		msg.body = str;
-		queue_.push(msg);
+		if (msg.channel.get().empty())
+			return;
+
+		io_.post(boost::bind(&ZmqPublisher::enqueue, this, msg));
 	}
 
-	void on_queue_pop(boost::system::error_code ec, const Message& value)
+	boost::property_tree::ptree status()
 	{
-		zmq_send(socket_.get(), value.channel_name.c_str(), value.channel_name.size(), ZMQ_SNDMORE);
-		zmq_send(socket_.get(), value.body.c_str(), value.body.size(), 0);
-		queue_.async_pop(boost::bind(&ZmqPublisher::on_queue_pop, this, _1, _2));
+		boost::mutex::scoped_lock l(stats_mutex_);
+		boost::property_tree::ptree out;
+		out.put("published", published_);
+		out.put("batches", batches_);
+		out.put("dropped", dropped_);
+		out.put("send_failed", send_failed_);
+		out.put("max_pending", std::size_t(max_pending));
+		out.put("send_hwm", int(send_hwm));
+		return out;
 	}
 
 private:
-	boost::asio::io_service io_;
-	boost::asio::io_service::work work_;
+	boost::shared_ptr<void> make_socket(const char * endpoint)
+	{
+		boost::shared_ptr<void> socket(zmq_socket(ctx_.get(), ZMQ_PUB), zmq_close);
+		int hwm = send_hwm;
+		zmq_setsockopt(socket.get(), ZMQ_SNDHWM, &hwm, sizeof(hwm));
+		// 关闭的时候不等没发出去的消息, 否则 zmq_ctx_term 会一直阻塞.
+		int linger = 0;
+		zmq_setsockopt(socket.get(), ZMQ_LINGER, &linger, sizeof(linger));
+		zmq_bind(socket.get(), endpoint);
+		return socket;
+	}
 
-	boost::async_coro_queue<
-		boost::circular_buffer_space_optimized<
-			Message
-		> > queue_;
-	boost::shared_ptr<void> ctx_;
-	boost::shared_ptr<void> socket_;
-};
+	// 以下在发布线程里执行.
+	void enqueue(const avbot_message & msg)
+	{
+		if (pending_.size() >= max_pending)
+		{
+			pending_.pop_front();
+			boost::mutex::scoped_lock l(stats_mutex_);
+			dropped_++;
+		}
 
-class ZmqPublisherClient
-{
-public:
-	ZmqPublisherClient(boost::shared_ptr<ZmqPublisher> zmq_publisher, boost::asio::io_service &io, std::string channel_name, boost::function<void(std::string)> sender)
-		: io_(io)
-		, channel_name_(channel_name)
-		, sender_(sender)
-		, publisher_(zmq_publisher)
+		pending_.push_back(msg);
+
+		// 已经在排队的消息处理完再发送, 这样一次突发的消息可以合并.
+		if (!flush_scheduled_)
+		{
+			flush_scheduled_ = true;
+			io_.post(boost::bind(&ZmqPublisher::flush, this));
+		}
+	}
+
+	void flush()
 	{
+		flush_scheduled_ = false;
+
+		while (!pending_.empty())
+		{
+			// 取出和第一条同一个频道的消息, 其余的留到下一批.
+			avbot_interned_string channel = pending_.front().channel;
+			std::deque<avbot_message> rest;
+
+			json_batch_.clear();
+			msgpack_batch_.clear();
+
+			BOOST_FOREACH(const avbot_message & msg, pending_)
+			{
+				if (msg.channel == channel && json_batch_.offsets.size() < max_batch)
+				{
+					json_envelope_writer json(json_batch_.buffer);
+					serialize_message(json, msg);
+					json_batch_.offsets.push_back(json_batch_.buffer.size());
+
+					msgpack_envelope_writer msgpack(msgpack_batch_.buffer);
+					serialize_message(msgpack, msg);
+					msgpack_batch_.offsets.push_back(msgpack_batch_.buffer.size());
+				}
+				else
+				{
+					rest.push_back(msg);
+				}
+			}
+
+			pending_.swap(rest);
+
+			bool ok = send_batch(json_socket_.get(), channel.get(), json_batch_);
+			ok = send_batch(msgpack_socket_.get(), channel.get(), msgpack_batch_) && ok;
+
+			boost::mutex::scoped_lock l(stats_mutex_);
+			published_ += json_batch_.offsets.size();
+			batches_++;
+			if (!ok)
+				send_failed_ += json_batch_.offsets.size();
+		}
 	}
 
-	void operator()(boost::property_tree::ptree msg)
+	bool send_batch(void * socket, const std::string & channel, const envelope_batch & batch)
 	{
-		std::stringstream ss;
-		boost::property_tree::json_parser::write_json(ss, msg);
-		publisher_->send(channel_name_, ss.str());
+		if (zmq_send(socket, channel.data(), channel.size(), ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0)
+			return false;
+
+		std::size_t begin = 0;
+
+		for (std::size_t i = 0; i < batch.offsets.size(); i++)
+		{
+			int flags = ZMQ_DONTWAIT;
+			if (i + 1 < batch.offsets.size())
+				flags |= ZMQ_SNDMORE;
+
+			if (zmq_send(socket, batch.buffer.data() + begin, batch.offsets[i] - begin, flags) < 0)
+				return false;
+
+			begin = batch.offsets[i];
+		}
+		return true;
 	}
 
 private:
-	boost::asio::io_service &io_;
-	std::string channel_name_;
-	boost::function<void (std::string)> sender_;
+	boost::asio::io_service io_;
+	boost::asio::io_service::work work_;
+
+	// 以下只在发布线程里访问.
+	std::deque<avbot_message> pending_;
+	bool flush_scheduled_;
+	envelope_batch json_batch_;
+	envelope_batch msgpack_batch_;
+
+	boost::mutex stats_mutex_;
+	std::size_t published_;
+	std::size_t batches_;
+	std::size_t dropped_;
+	std::size_t send_failed_;
 
-	boost::shared_ptr<ZmqPublisher> publisher_;
+	boost::shared_ptr<void> ctx_;
+	boost::shared_ptr<void> json_socket_;
+	boost::shared_ptr<void> msgpack_socket_;
+
+	boost::thread thread_;
 };
 
-//ZmqPublisher ZmqPublisherClient::publisher_;
+boost::shared_ptr<ZmqPublisher> make_zmq_publisher()
+{
+	return boost::make_shared<ZmqPublisher>();
+}
+
+void stop_zmq_publisher(ZmqPublisher & publisher)
+{
+	publisher.stop();
+}
 
-avbot_extension make_zmq_publisher(boost::asio::io_service &io, std::string channel_name, boost::function<void (std::string)> sender)
+void zmq_publish(boost::shared_ptr<ZmqPublisher> publisher, const avbot_message & msg)
 {
-	static boost::shared_ptr<ZmqPublisher> zmq;
-	if (!zmq)
-	{
-		zmq.reset(new ZmqPublisher);
-	}
-	return avbot_extension(channel_name, ZmqPublisherClient(zmq, io, channel_name, sender));
+	publisher->publish(msg);
+}
+
+boost::property_tree::ptree zmq_publisher_status(ZmqPublisher & publisher)
+{
+	return publisher.status();
 }
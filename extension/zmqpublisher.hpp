@@ -1,4 +1,23 @@
 
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <boost/property_tree/ptree.hpp>
+
 #include "extension.hpp"
 
-avbot_extension make_zmq_publisher(boost::asio::io_service& io, std::string channel_name, boost::function<void(std::string)> sender);
+// 把所有频道的消息发布到 zmq, 整个 avbot 只连接一次 on_message.
+// json 格式发布在 tcp://*:8123, msgpack 格式发布在 tcp://*:8124.
+// 每个 zmq 消息的第一帧是频道名, 后面每帧是一条消息, 同一频道突发的消息合并在一个 zmq 消息里.
+// 发布在自己的线程里进行, 由 avbot_extensions 持有.
+class ZmqPublisher;
+
+boost::shared_ptr<ZmqPublisher> make_zmq_publisher();
+// 停止发布线程并等待它退出, 必须在 io_service 析构之前调用.
+void stop_zmq_publisher(ZmqPublisher & publisher);
+
+// 连接到 avbot::on_message.
+void zmq_publish(boost::shared_ptr<ZmqPublisher> publisher, const avbot_message & msg);
+
+// 已发布的消息数, 丢弃的消息数等统计.
+boost::property_tree::ptree zmq_publisher_status(ZmqPublisher & publisher);
@@ -85,17 +85,13 @@ static std::string	preamble_formater(std::string preamble_xmpp_fmt,  std::string
 	return preamble;
 }
 
-static std::string room_name( const avbot::av_message_tree& message )
+static std::string room_name( const avbot_message& message )
 {
-	try{
-		if ( message.get<std::string>("protocol") == "mail")
-			return "mail";
-		if (message.get<std::string>("protocol")== "qq")
-			return message.get<std::string>("protocol") + ":" + message.get<std::string>("room.groupnumber");
-		return message.get<std::string>("protocol") + ":" + message.get<std::string>("room");
-	}catch (...){
-		return "none";
-	}
+	if (message.protocol == "mail")
+		return "mail";
+	if (message.protocol == "qq")
+		return message.protocol.get() + ":" + message.room.groupnumber.get();
+	return message.protocol.get() + ":" + message.room.name.get();
 }
 
 avbot::avbot( boost::asio::io_service& io_service )
@@ -199,19 +195,16 @@ void avbot::broadcast_message(std::string channel_name, std::string exclude_room
 
 void avbot::callback_on_irc_message( irc::irc_msg pMsg )
 {
-	using boost::property_tree::ptree;
-	// formate irc message to JSON and call on_message
+	// formate irc message and call on_message
 
-	ptree message;
-	message.put("protocol", "irc");
-	message.put("room", pMsg.from.substr(1));
-	message.put("who.nick", pMsg.whom);
-	message.put("channel", get_channel_name(std::string("irc:") + pMsg.from.substr(1)));
-	message.put("preamble", preamble_formater( preamble_irc_fmt, pMsg ));
+	avbot_message message;
+	message.protocol = "irc";
+	message.room.name = pMsg.from.substr(1);
+	message.who.nick = pMsg.whom;
+	message.channel = get_channel_name(std::string("irc:") + pMsg.from.substr(1));
+	message.preamble = preamble_formater( preamble_irc_fmt, pMsg );
 
-	ptree textmsg;
-	textmsg.add("text", pMsg.msg);
-	message.add_child("message", textmsg);
+	message.add_text(pMsg.msg);
 
 	// TODO 将 识别的 URL 进行转化.
 
@@ -220,28 +213,21 @@ void avbot::callback_on_irc_message( irc::irc_msg pMsg )
 
 void avbot::callback_on_qq_group_message( std::string group_code, std::string who, const std::vector<webqq::qqMsg >& msg )
 {
-	using boost::property_tree::ptree;
-	ptree message;
-	message.put("protocol", "qq");
-	ptree ptreee_group;
-	ptreee_group.add("code", group_code);
+	avbot_message message;
+	message.protocol = "qq";
+	message.room.code = group_code;
 
 	webqq::qqGroup_ptr group = m_qq_account->get_Group_by_gid( group_code );
-	std::string groupname = group_code;
 
 	if( group ){
-		groupname = group->name;
-		ptreee_group.add("groupnumber", group->qqnum);
-		ptreee_group.add("name", group->name);
-		message.put("channel", get_channel_name(std::string("qq:") + group->qqnum));
+		message.room.groupnumber = group->qqnum;
+		message.room.name = group->name;
+		message.channel = get_channel_name(std::string("qq:") + group->qqnum);
 	}else {
-		message.put("channel", group_code);
+		message.channel = group_code;
 	}
 
-	message.add_child("room", ptreee_group);
-
-	ptree ptree_who;
-	ptree_who.add("code", who);
+	message.who.code = who;
 
 	webqq::qqBuddy_ptr buddy;
 
@@ -249,34 +235,26 @@ void avbot::callback_on_qq_group_message( std::string group_code, std::string wh
 		buddy = group->get_Buddy_by_uin( who );
 
 	if (buddy){
-		ptree_who.add("nick", buddy->nick.empty()? buddy->uin : buddy->nick) ;
-		ptree_who.add("name", buddy->nick);
-		ptree_who.add("qqnumber", buddy->qqnum);
-		ptree_who.add("card", buddy->card);
-		if( ( buddy->mflag & 1 ) == 1 || buddy->uin == group->owner )
-			message.add("op", "1");
-		else
-			message.add("op", "0");
+		message.who.nick = buddy->nick.empty()? buddy->uin : buddy->nick;
+		message.who.name = buddy->nick;
+		message.who.qqnumber = buddy->qqnum;
+		message.who.card = buddy->card;
+		message.op = ( buddy->mflag & 1 ) == 1 || buddy->uin == group->owner;
 	}else{
-		ptree_who.add("nick", who);
+		message.who.nick = who;
 	}
 
-
-	message.add_child("who", ptree_who);
-	ptree textmsg;
-
-	std::string message_preamble = preamble_formater(preamble_qq_fmt, buddy.get(), who, group.get() );
-	message.add("preamble", message_preamble);
+	message.preamble = preamble_formater(preamble_qq_fmt, buddy.get(), who, group.get() );
 
 	// 解析 qqMsg
-	BOOST_FOREACH( webqq::qqMsg qqmsg, msg )
+	BOOST_FOREACH( const webqq::qqMsg & qqmsg, msg )
 	{
 		std::string buf;
 
 		switch( qqmsg.type ) {
 			case webqq::qqMsg::LWQQ_MSG_TEXT:
 			{
-				textmsg.add("text", qqmsg.text);
+				message.add_text(qqmsg.text);
 			}
 			break;
 			case webqq::qqMsg::LWQQ_MSG_CFACE:
@@ -310,41 +288,30 @@ void avbot::callback_on_qq_group_message( std::string group_code, std::string wh
 				}
 				// 接收方，需要把 cfage 格式化为 url , loger 格式化为 ../images/XX ,
 				// 而 forwarder 则格式化为 http://http://w.qq.com/cgi-bin/get_group_pic?pic=XXX
-				textmsg.add("cface.name", qqmsg.cface.name);
-				textmsg.add("cface.gid", qqmsg.cface.gid);
-				textmsg.add("cface.uin", qqmsg.cface.uin);
-				textmsg.add("cface.key", qqmsg.cface.key);
-				textmsg.add("cface.server", qqmsg.cface.server);
-				textmsg.add("cface.file_id", qqmsg.cface.file_id);
-				textmsg.add("cface.vfwebqq", qqmsg.cface.vfwebqq);
-				textmsg.add("cface.gchatpicurl", qqmsg.cface.gchatpicurl);
+				message.add_cface(qqmsg.cface);
 			}
 			break;
 			case webqq::qqMsg::LWQQ_MSG_FACE:
 			{
  				std::string url = boost::str( boost::format("http://0.web.qstatic.com/webqqpic/style/face/%d.gif" ) % qqmsg.face );
- 				textmsg.add("img", url);
+ 				message.add_segment(avbot_message_segment::img_segment, url);
 			} break;
 		}
 	}
-	message.add_child("message", textmsg);
 	on_message(message);
 }
 
 void avbot::callback_on_xmpp_group_message( std::string xmpproom, std::string who, std::string msg )
 {
-	using boost::property_tree::ptree;
-	ptree message;
+	avbot_message message;
 
-	message.put("protocol", "xmpp");
-	message.put("channel", get_channel_name(std::string("xmpp:") + xmpproom));
-	message.put("room", xmpproom);
-	message.put("who.nick", who);
-	message.put("preamble", preamble_formater( preamble_xmpp_fmt, who, xmpproom ));
+	message.protocol = "xmpp";
+	message.channel = get_channel_name(std::string("xmpp:") + xmpproom);
+	message.room.name = xmpproom;
+	message.who.nick = who;
+	message.preamble = preamble_formater( preamble_xmpp_fmt, who, xmpproom );
 
-	ptree textmsg;
-	textmsg.add("text", msg);
-	message.add_child("message", textmsg);
+	message.add_text(msg);
 
 	on_message(message);
 }
@@ -353,17 +320,15 @@ void avbot::callback_on_mail(mailcontent mail, mx::pop3::call_to_continue_functi
 {
 	m_io_service.post(boost::asio::detail::bind_handler(call_to_contiune, m_qq_account->is_online()));
 
-	using boost::property_tree::ptree;
-	ptree message;
-	message.add("protocol", "mail");
-	message.put("channel", get_channel_name(std::string("mail")));
-
-	message.add("from", mail.from);
-	message.add("to", mail.to);
-	message.add("subject", mail.subject);
-	ptree textmessage;
-	textmessage.add(mail.content_type, mail.content);
-	message.add_child("message", textmessage);
+	avbot_message message;
+	message.protocol = "mail";
+	message.channel = get_channel_name(std::string("mail"));
+
+	message.mail.from = mail.from;
+	message.mail.to = mail.to;
+	message.mail.subject = mail.subject;
+	message.mail.content_type = mail.content_type;
+	message.add_text(mail.content);
 }
 
 void avbot::callback_on_qq_group_found(webqq::qqGroup_ptr group)
@@ -379,53 +344,33 @@ void avbot::callback_on_qq_group_newbee(webqq::qqGroup_ptr group, webqq::qqBuddy
 	if (get_channel_name(std::string("qq:")+group->qqnum)=="none")
 		return;
 
-	// 构造 json 消息,  格式同 QQ 消息, 就是多了个 newbee 字段
-
-	using boost::property_tree::ptree;
-	ptree message;
-	message.put("protocol", "qq");
-	ptree ptreee_group;
-	ptreee_group.add("code", group->code);
-
-	std::string groupname = group->name;
+	// 构造消息,  格式同 QQ 消息, 就是多了个 newbee 字段
 
-	ptreee_group.add("groupnumber", group->qqnum);
-	ptreee_group.add("name", group->name);
+	avbot_message message;
+	message.protocol = "qq";
+	message.room.code = group->code;
+	message.room.groupnumber = group->qqnum;
+	message.room.name = group->name;
 
-	message.put("channel", get_channel_name(std::string("qq:") + group->qqnum));
-	message.add_child("room", ptreee_group);
+	message.channel = get_channel_name(std::string("qq:") + group->qqnum);
 
-	ptree ptree_who;
 	if (buddy){
-		ptree_who.add("code", buddy->uin);
-
-		ptree_who.add("name", buddy->nick);
-		ptree_who.add("qqnumber", buddy->qqnum);
-		ptree_who.add("card", buddy->card);
-		ptree_who.add("nick", buddy->card.empty()? buddy->nick:buddy->card);
-		if( ( buddy->mflag & 21 ) == 21 || buddy->uin == group->owner )
-			message.add("op", "1");
-		else
-			message.add("op", "0");
-		message.add("newbee", buddy->uin);
+		message.who.code = buddy->uin;
+
+		message.who.name = buddy->nick;
+		message.who.qqnumber = buddy->qqnum;
+		message.who.card = buddy->card;
+		message.who.nick = buddy->card.empty()? buddy->nick:buddy->card;
+		message.op = ( buddy->mflag & 21 ) == 21 || buddy->uin == group->owner;
+		message.newbee = buddy->uin;
 	}else{
 		// 新人入群,  可是 webqq 暂时无法获取新人昵称.
-
-		ptree_who.add("nick", "获取名字失败");
-
 		return;
 	}
 
-	message.add_child("who", ptree_who);
-	ptree textmsg;
-
-	message.add("preamble", "群系统消息: ");
+	message.preamble = "群系统消息: ";
 
-	if (buddy){
-		message.add("message.text", boost::str(boost::format("新人 %s 入群.") % buddy->nick ));
-	}else{
-		message.add("message.text", "新人入群,  可是 webqq 暂时无法获取新人昵称.");
-	}
+	message.add_text(boost::str(boost::format("新人 %s 入群.") % buddy->nick ));
 
 	on_message(message);
 }
@@ -492,9 +437,9 @@ void avbot::set_mail_account( std::string mailaddr, std::string password, std::s
 	m_mail_account->async_fetch_mail(boost::bind(&avbot::callback_on_mail, this, _1, _2));
 }
 
-void avbot::forward_message( const boost::property_tree::ptree& message )
+void avbot::forward_message( const avbot_message& message )
 {
-	std::string channel_name = message.get<std::string>( "channel" );
+	const std::string & channel_name = message.channel;
 	// 根据 channels 的配置，执行消息转发.
 	// 转发前格式化消息.
 
@@ -516,31 +461,31 @@ void avbot::forward_message( const boost::property_tree::ptree& message )
 }
 
 
-std::string avbot::format_message( const avbot::av_message_tree& message )
+std::string avbot::format_message( const avbot_message& message )
 {
 	std::string linermessage;
 	// 首先是根据 nick 格式化
-	if ( message.get<std::string>("protocol") != "mail")
+	if ( message.protocol != "mail")
 	{
-		linermessage += message.get<std::string>("preamble", "");
+		linermessage += message.preamble;
 
-		BOOST_FOREACH(const auto & v, message.get_child("message"))
+		BOOST_FOREACH(const avbot_message_segment & v, message.segments)
 		{
-			if (v.first == "text")
+			if (v.type == avbot_message_segment::text_segment)
 			{
-				linermessage += v.second.data();
-			}else if (v.first == "url"||v.first == "img")
+				linermessage += v.content;
+			}else if (v.type == avbot_message_segment::url_segment || v.type == avbot_message_segment::img_segment)
 			{
 				linermessage += " ";
-				linermessage += v.second.data();
+				linermessage += v.content;
 				linermessage += " ";
-			}else if (v.first == "cface"){
+			}else if (v.type == avbot_message_segment::cface_segment){
 				// 老版本是显示 执行 HTTP 访问获得 302 跳转后的 URL.
 				// 但是新的webqq已经把无cookie的访问河了蟹了。于是需要显示的是avbot vps上下载后的地址。不过这个需要呵呵了。
 				if (m_urlformater)
-					linermessage += m_urlformater(v.second);
+					linermessage += m_urlformater(*v.cface);
 				else
-					linermessage += v.second.get<std::string>("gchatpicurl");
+					linermessage += v.cface->gchatpicurl;
 				linermessage += " ";
 			}
 		}
@@ -548,8 +493,8 @@ std::string avbot::format_message( const avbot::av_message_tree& message )
 
 		linermessage  = boost::str(
 			boost::format("[QQ邮件]\n发件人:%s\n收件人:%s\n主题:%s\n\n%s")
-			% message.get<std::string>("from") % message.get<std::string>("to") % message.get<std::string>("subject")
-			% message.get_child("message").data()
+			% message.mail.from % message.mail.to % message.mail.subject
+			% message.text()
 		);
  	}
 
@@ -608,12 +553,12 @@ void avbot::accountsroutine(boost::shared_ptr<boost::atomic<bool> > flag_quit, c
 		do 
 		{
 			// 等待并解析协议的消息
-			boost::property_tree::ptree message = accounts.async_recv_message(yield[ec]);
+			av_message_tree message = accounts.async_recv_message(yield[ec]);
 			flag_check();
 
 			// 调用 broadcast message, 如果没要求退出的话
 			if (!ec)
-				on_message(message);
+				on_message(avbot_message::from_ptree(message));
 			// 掉线了？重登录！
 		// 只有遇到了必须要重登录的错误才重登录
 		// 一时半会的网络错误可没事，再获取一下就可以了
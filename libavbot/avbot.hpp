@@ -16,6 +16,7 @@
 #include "libxmpp/xmpp.hpp"
 #include "libmailexchange/mx.hpp"
 #include "avbot_accounts.hpp"
+#include "avbot_message.hpp"
 
 class BOOST_SYMBOL_VISIBLE avbot : boost::noncopyable
 {
@@ -44,10 +45,11 @@ public:
 	// 这里是一些公开的成员变量.
 	typedef boost::function<void (std::string) > need_verify_image;
 	typedef boost::property_tree::ptree av_message_tree;
-	typedef boost::signals2::signal<void (av_message_tree) > on_message_type;
+	// 消息以 const 引用传给每个订阅者, 不再每个订阅者复制一份.
+	typedef boost::signals2::signal<void (const avbot_message &) > on_message_type;
 
 	// 用了传入一个 url 生成器，这样把 qq 的消息里的图片地址转换为 vps 上跑的 http 服务的地址。
-	boost::function<std::string(av_message_tree)> m_urlformater;
+	boost::function<std::string(const webqq::qqMsgCface &)> m_urlformater;
 
 	// 每当有消息的时候激发.
 	on_message_type on_message;
@@ -121,10 +123,10 @@ private:
 	void callback_on_qq_group_newbee(webqq::qqGroup_ptr, webqq::qqBuddy_ptr);
 
 private:
-	void forward_message(const av_message_tree &message);
+	void forward_message(const avbot_message &message);
 public:
 	// auto pick an nick name for IRC
 	static std::string autonick();
-	std::string format_message( const avbot::av_message_tree& message );
+	std::string format_message( const avbot_message& message );
 	static std::string image_subdir_name(std::string cface);
 };
@@ -0,0 +1,201 @@
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+
+#include "avbot_message.hpp"
+
+const std::string & avbot_message::text() const
+{
+	static const std::string empty;
+
+	BOOST_FOREACH(const avbot_message_segment & s, segments)
+	{
+		if (s.type == avbot_message_segment::text_segment)
+			return s.content;
+	}
+	return empty;
+}
+
+void avbot_message::add_text(const std::string & text)
+{
+	add_segment(avbot_message_segment::text_segment, text);
+}
+
+void avbot_message::add_segment(avbot_message_segment::segment_type type, const std::string & content)
+{
+	segments.push_back(avbot_message_segment());
+	segments.back().type = type;
+	segments.back().content = content;
+}
+
+void avbot_message::add_cface(const webqq::qqMsgCface & cface)
+{
+	segments.push_back(avbot_message_segment());
+	segments.back().type = avbot_message_segment::cface_segment;
+	segments.back().cface = boost::make_shared<webqq::qqMsgCface>(cface);
+}
+
+static void put_if_not_empty(boost::property_tree::ptree & pt, const char * path, const std::string & value)
+{
+	if (!value.empty())
+		pt.add(path, value);
+}
+
+boost::property_tree::ptree avbot_message::to_ptree() const
+{
+	using boost::property_tree::ptree;
+	ptree message;
+
+	message.put("protocol", protocol.get());
+	message.put("channel", channel.get());
+
+	if (protocol == "qq")
+	{
+		ptree ptree_room;
+		ptree_room.add("code", room.code.get());
+		put_if_not_empty(ptree_room, "groupnumber", room.groupnumber);
+		put_if_not_empty(ptree_room, "name", room.name);
+		message.add_child("room", ptree_room);
+	}
+	else if (!room.name.get().empty())
+	{
+		message.put("room", room.name.get());
+	}
+
+	if (protocol == "mail")
+	{
+		message.add("from", mail.from);
+		message.add("to", mail.to);
+		message.add("subject", mail.subject);
+	}
+	else if (protocol != "rpc")
+	{
+		ptree ptree_who;
+		put_if_not_empty(ptree_who, "code", who.code);
+		ptree_who.add("nick", who.nick);
+		put_if_not_empty(ptree_who, "name", who.name);
+		put_if_not_empty(ptree_who, "qqnumber", who.qqnumber);
+		put_if_not_empty(ptree_who, "card", who.card);
+		message.add_child("who", ptree_who);
+	}
+
+	if (op)
+		message.add("op", *op ? "1" : "0");
+	put_if_not_empty(message, "newbee", newbee);
+	put_if_not_empty(message, "preamble", preamble);
+
+	ptree textmsg;
+
+	BOOST_FOREACH(const avbot_message_segment & s, segments)
+	{
+		switch (s.type)
+		{
+			case avbot_message_segment::text_segment:
+				if (protocol == "mail" && !mail.content_type.empty())
+					textmsg.add(ptree::path_type(mail.content_type, '\0'), s.content);
+				else
+					textmsg.add("text", s.content);
+				break;
+			case avbot_message_segment::url_segment:
+				textmsg.add("url", s.content);
+				break;
+			case avbot_message_segment::img_segment:
+				textmsg.add("img", s.content);
+				break;
+			case avbot_message_segment::cface_segment:
+			{
+				ptree cface;
+				cface.add("name", s.cface->name);
+				cface.add("gid", s.cface->gid);
+				cface.add("uin", s.cface->uin);
+				cface.add("key", s.cface->key);
+				cface.add("server", s.cface->server);
+				cface.add("file_id", s.cface->file_id);
+				cface.add("vfwebqq", s.cface->vfwebqq);
+				cface.add("gchatpicurl", s.cface->gchatpicurl);
+				textmsg.add_child("cface", cface);
+			}
+			break;
+		}
+	}
+
+	message.add_child("message", textmsg);
+	return message;
+}
+
+avbot_message avbot_message::from_ptree(const boost::property_tree::ptree & message)
+{
+	using boost::property_tree::ptree;
+	avbot_message out;
+
+	out.protocol = message.get<std::string>("protocol", "");
+	out.channel = message.get<std::string>("channel", "");
+
+	if (boost::optional<const ptree &> room = message.get_child_optional("room"))
+	{
+		if (room->empty())
+		{
+			out.room.name = room->data();
+		}
+		else
+		{
+			out.room.code = room->get<std::string>("code", "");
+			out.room.groupnumber = room->get<std::string>("groupnumber", "");
+			out.room.name = room->get<std::string>("name", "");
+		}
+	}
+
+	out.who.nick = message.get<std::string>("who.nick", "");
+	out.who.code = message.get<std::string>("who.code", "");
+	out.who.name = message.get<std::string>("who.name", "");
+	out.who.qqnumber = message.get<std::string>("who.qqnumber", "");
+	out.who.card = message.get<std::string>("who.card", "");
+
+	out.preamble = message.get<std::string>("preamble", "");
+	if (boost::optional<int> op = message.get_optional<int>("op"))
+		out.op = (*op == 1);
+	out.newbee = message.get<std::string>("newbee", "");
+
+	out.mail.from = message.get<std::string>("from", "");
+	out.mail.to = message.get<std::string>("to", "");
+	out.mail.subject = message.get<std::string>("subject", "");
+
+	if (boost::optional<const ptree &> textmsg = message.get_child_optional("message"))
+	{
+		BOOST_FOREACH(const ptree::value_type & v, *textmsg)
+		{
+			if (v.first == "text")
+			{
+				out.add_text(v.second.data());
+			}
+			else if (v.first == "url")
+			{
+				out.add_segment(avbot_message_segment::url_segment, v.second.data());
+			}
+			else if (v.first == "img")
+			{
+				out.add_segment(avbot_message_segment::img_segment, v.second.data());
+			}
+			else if (v.first == "cface")
+			{
+				webqq::qqMsgCface cface;
+				cface.name = v.second.get<std::string>("name", "");
+				cface.gid = v.second.get<std::string>("gid", "");
+				cface.uin = v.second.get<std::string>("uin", "");
+				cface.key = v.second.get<std::string>("key", "");
+				cface.server = v.second.get<std::string>("server", "");
+				cface.file_id = v.second.get<std::string>("file_id", "");
+				cface.vfwebqq = v.second.get<std::string>("vfwebqq", "");
+				cface.gchatpicurl = v.second.get<std::string>("gchatpicurl", "");
+				out.add_cface(cface);
+			}
+			else if (out.protocol == "mail")
+			{
+				// 邮件的正文以 content type 为名字.
+				out.mail.content_type = v.first;
+				out.add_text(v.second.data());
+			}
+		}
+	}
+
+	return out;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/flyweight.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "libwebqq/webqq.hpp"
+
+// 协议名, 频道名, 房间名这些每条消息都带着的短字符串全局只存一份,
+// 复制和比较都只是一个指针.
+typedef boost::flyweight<std::string> avbot_interned_string;
+
+// 消息里的一段内容.
+struct avbot_message_segment
+{
+	enum segment_type { text_segment, url_segment, img_segment, cface_segment };
+
+	segment_type type;
+	// text 是文字, url 和 img 是地址.
+	std::string content;
+	// 只有 cface 才有, 不可修改, 所以消息复制的时候共享同一份.
+	boost::shared_ptr<const webqq::qqMsgCface> cface;
+};
+
+// avbot::on_message 传递的消息.
+// 字段是固定的, 订阅者直接访问成员, 不用再按字符串路径在 ptree 里查找.
+struct avbot_message
+{
+	// qq irc xmpp mail rpc
+	avbot_interned_string protocol;
+	// 组合频道的名字, 空表示所有频道.
+	avbot_interned_string channel;
+
+	struct room_type
+	{
+		// irc 和 xmpp 是房间名, qq 是群名.
+		avbot_interned_string name;
+		// 以下只有 qq 群才有.
+		avbot_interned_string code;
+		avbot_interned_string groupnumber;
+	} room;
+
+	struct who_type
+	{
+		std::string nick;
+		// 以下只有 qq 才有.
+		std::string code;
+		std::string name;
+		std::string qqnumber;
+		std::string card;
+	} who;
+
+	std::string preamble;
+
+	// 发言的人是不是管理员, 协议不支持的话就没有.
+	boost::optional<bool> op;
+
+	// 新人入群消息里是新人的 uin, 其他消息为空.
+	std::string newbee;
+
+	// 邮件才有, 正文放在 segments 里.
+	struct mail_type
+	{
+		std::string from;
+		std::string to;
+		std::string subject;
+		std::string content_type;
+	} mail;
+
+	std::vector<avbot_message_segment> segments;
+
+public:
+	// 第一段文字, 和以前 get<std::string>("message.text") 的结果一样. 没有文字则为空.
+	const std::string & text() const;
+
+	void add_text(const std::string & text);
+	void add_segment(avbot_message_segment::segment_type type, const std::string & content);
+	void add_cface(const webqq::qqMsgCface & cface);
+
+	// 转换成以前的 ptree 格式, 给脚本和 RPC 用.
+	boost::property_tree::ptree to_ptree() const;
+	// 从 ptree 格式 (RPC 客户端发来的 JSON, 或者 avbot_account 收到的消息) 转换过来.
+	static avbot_message from_ptree(const boost::property_tree::ptree & message);
+};
@@ -1,7 +1,157 @@
 
+#include <cstdio>
+#include <ctime>
 #include <boost/format.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
 #include "avlog.hpp"
 
+namespace {
+
+// 缓存的时间字符串, 同一秒之内的调用直接复制.
+struct cached_clock
+{
+	cached_clock()
+		: second(0)
+	{
+	}
+
+	boost::mutex mutex;
+	std::time_t second;
+	std::string time;
+	std::string day;
+};
+
+cached_clock & log_clock()
+{
+	static cached_clock clock;
+	return clock;
+}
+
+}
+
+avlog::avlog()
+	: m_flush_ms(0)
+	, m_flush_pending(false)
+{
+}
+
+void avlog::start(boost::asio::io_service& io_service, int flush_ms)
+{
+	m_flush_ms = flush_ms;
+	m_flush_timer.reset(new boost::asio::deadline_timer(io_service));
+	m_midnight_timer.reset(new boost::asio::deadline_timer(io_service));
+	schedule_midnight();
+}
+
+void avlog::stop()
+{
+	flush();
+	m_flush_timer.reset();
+	m_midnight_timer.reset();
+	m_flush_pending = false;
+}
+
+void avlog::flush()
+{
+	for (loglist::iterator it = m_group_list.begin(); it != m_group_list.end(); ++it)
+	{
+		if (it->second)
+			it->second->flush();
+	}
+
+	if (m_lecture_file)
+		m_lecture_file->flush();
+}
+
+std::string avlog::current_time()
+{
+	std::string time, day;
+	current_time(time, day);
+	return time;
+}
+
+void avlog::current_time(std::string& time, std::string& day)
+{
+	cached_clock & clock = log_clock();
+	std::time_t now = std::time(NULL);
+
+	boost::mutex::scoped_lock l(clock.mutex);
+
+	if (now != clock.second)
+	{
+		std::tm t = boost::posix_time::to_tm(boost::posix_time::second_clock::local_time());
+		char buf[32];
+
+		std::sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d",
+			t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+		clock.time = buf;
+		std::sprintf(buf, "%04d%02d%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
+		clock.day = buf;
+		clock.second = now;
+	}
+
+	time = clock.time;
+	day = clock.day;
+}
+
+void avlog::rotate(const std::string& day)
+{
+	if (day == m_day)
+		return;
+
+	// 文件在析构的时候刷新并关闭, 下一条消息会在新一天的文件里重新创建.
+	m_group_list.clear();
+	m_day = day;
+}
+
+void avlog::schedule_flush()
+{
+	if (!m_flush_timer)
+	{
+		flush();
+		return;
+	}
+
+	if (m_flush_pending)
+		return;
+
+	m_flush_pending = true;
+	m_flush_timer->expires_from_now(boost::posix_time::milliseconds(m_flush_ms));
+	m_flush_timer->async_wait(boost::bind(&avlog::on_flush_timer, this, _1));
+}
+
+void avlog::on_flush_timer(const boost::system::error_code& ec)
+{
+	if (ec == boost::asio::error::operation_aborted)
+		return;
+
+	m_flush_pending = false;
+	flush();
+}
+
+void avlog::schedule_midnight()
+{
+	boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+	// 多等一秒, 保证醒来的时候已经是第二天.
+	boost::posix_time::ptime midnight(now.date() + boost::gregorian::days(1), boost::posix_time::seconds(1));
+
+	m_midnight_timer->expires_from_now(midnight - now);
+	m_midnight_timer->async_wait(boost::bind(&avlog::on_midnight_timer, this, _1));
+}
+
+void avlog::on_midnight_timer(const boost::system::error_code& ec)
+{
+	if (ec == boost::asio::error::operation_aborted || !m_midnight_timer)
+		return;
+
+	std::string time, day;
+	current_time(time, day);
+	rotate(day);
+
+	schedule_midnight();
+}
+
 std::string avlog::html_escape(std::string txt)
 {
 	// escape html strings.
@@ -15,34 +165,23 @@ std::string avlog::html_escape(std::string txt)
 
 bool avlog::add_log(const std::string& groupid, const std::string& msg, long int id)
 {
-	// 在qq群列表中查找已有的项目, 如果没找到则创建一个新的.
-	ofstream_ptr file_ptr;
-	loglist::iterator finder = m_group_list.find(groupid);
+	std::string time, day;
+	current_time(time, day);
 
-	if (m_group_list.find(groupid) == m_group_list.end())
-	{
-		// 创建文件.
-		file_ptr = create_file(groupid);
+	// 跨天了但是零点的定时器还没到, 先轮换.
+	rotate(day);
 
-		m_group_list[groupid] = file_ptr;
-		finder = m_group_list.find(groupid);
-	}
+	// 在qq群列表中查找已有的项目, 如果没找到则创建一个新的.
+	loglist::iterator finder = m_group_list.find(groupid);
 
-	// 如果没有找到日期对应的文件.
-	if (!fs::exists(fs::path(make_filename(make_path(groupid)))))
+	if (finder == m_group_list.end())
 	{
-		// 创建文件.
-		file_ptr = create_file(groupid);
-
-		if (finder->second->is_open())
-			finder->second->close();	// 关闭原来的文件.
-
-		// 重置为新的文件.
-		finder->second = file_ptr;
+		// 创建文件, 失败也记下来, 今天不再重试.
+		finder = m_group_list.insert(std::make_pair(groupid, create_file(groupid, day))).first;
 	}
 
 	// 得到文件指针.
-	file_ptr = finder->second;
+	ofstream_ptr file_ptr = finder->second;
 
 	// 构造消息, 添加消息时间头.
 	std::string data;
@@ -52,7 +191,7 @@ bool avlog::add_log(const std::string& groupid, const std::string& msg, long int
 		data = boost::str(
 			boost::format("<p id=\"%d\"> %s %s </p>\n")
 			% id
-			% current_time()
+			% time
 			% msg
 		);
 	}
@@ -60,30 +199,28 @@ bool avlog::add_log(const std::string& groupid, const std::string& msg, long int
 	{
 		data = boost::str(
 			boost::format("<p> %s %s </p>\n")
-			% current_time()
+			% time
 			% msg
 		);
 	}
 
 	// 写入聊天消息.
-	file_ptr->write(data.c_str(), data.length());
-	// 刷新写入缓冲, 实时写到文件.
-	file_ptr->flush();
-
-	file_ptr = m_lecture_file;
+	if (file_ptr)
+		file_ptr->write(data.c_str(), data.length());
 
-	if (file_ptr && m_lecture_groupid == groupid)
+	if (m_lecture_file && m_lecture_groupid == groupid)
 	{
 		// 写入聊天消息.
-		file_ptr->write(data.c_str(), data.length());
-		// 刷新写入缓冲, 实时写到文件.
-		file_ptr->flush();
+		m_lecture_file->write(data.c_str(), data.length());
 	}
 
+	// 稍后一起刷新到文件.
+	schedule_flush();
+
 	return true;
 }
 
-avlog::ofstream_ptr avlog::create_file(const std::string& groupid) const
+avlog::ofstream_ptr avlog::create_file(const std::string& groupid, const std::string& day) const
 {
 	// 生成对应的路径.
 	std::string save_path = make_path(groupid);
@@ -99,7 +236,7 @@ avlog::ofstream_ptr avlog::create_file(const std::string& groupid) const
 	}
 
 	// 按时间构造文件名.
-	save_path = make_filename(save_path);
+	save_path = make_filename(save_path, day);
 
 	// 创建文件.
 	ofstream_ptr file_ptr(new std::ofstream(save_path.c_str(),
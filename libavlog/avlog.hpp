@@ -9,7 +9,13 @@
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 #include <boost/date_time.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/deadline_timer.hpp>
 
+// html 聊天日志.
+// 每个群当天的日志文件保持打开, 写入先进缓冲, 由 io_service 上的定时器每 flush_ms 毫秒刷一次,
+// 零点由定时器关闭所有文件, 之后的消息写到新一天的文件里.
+// 没有调用 start() 的时候每条消息都立即刷新.
 class avlog : public boost::noncopyable
 {
 public:
@@ -18,6 +24,15 @@ public:
 
 	static std::string html_escape(std::string);
 public:
+	avlog();
+
+	// 开始使用定时刷新和零点轮换.
+	void start(boost::asio::io_service & io_service, int flush_ms = 300);
+	// 刷新所有缓冲, 停止定时器. 必须在 io_service 销毁之前调用.
+	void stop();
+	// 把缓冲的日志写到文件.
+	void flush();
+
 	std::string log_path()
 	{
 		return  m_path.string() ;
@@ -83,35 +98,44 @@ protected:
 		return ( m_path / groupid ).string();
 	}
 
-	// 构造文件名.
-	std::string make_filename( const std::string &p = "" ) const
+	// 构造文件名, day 的格式为 "%Y%m%d".
+	std::string make_filename( const std::string &p, const std::string &day ) const
 	{
-		std::ostringstream oss;
-		boost::posix_time::time_facet* _facet = new boost::posix_time::time_facet( "%Y%m%d" );
-		oss.imbue( std::locale( std::locale::classic(), _facet ) );
-		oss << boost::posix_time::second_clock::local_time();
-		std::string filename = ( fs::path( p ) / ( oss.str() + ".html" ) ).string();
-		return filename;
+		return ( fs::path( p ) / ( day + ".html" ) ).string();
 	}
 
 	// 创建对应的日志文件, 返回日志文件指针.
-	ofstream_ptr create_file( const std::string &groupid ) const;
+	ofstream_ptr create_file( const std::string &groupid, const std::string &day ) const;
 
 public:
 	// 得到当前时间字符串, 对应printf格式: "%04d-%02d-%02d %02d:%02d:%02d"
-	static std::string current_time()
-	{
-		std::ostringstream oss;
-		boost::posix_time::time_facet* _facet = new boost::posix_time::time_facet( "%Y-%m-%d %H:%M:%S%F" );
-		oss.imbue( std::locale( std::locale::classic(), _facet ) );
-		oss << boost::posix_time::second_clock::local_time();
-		std::string time = oss.str();
-		return time;
-	}
+	// 字符串每秒只格式化一次.
+	static std::string current_time();
+
+private:
+	// 当前时间和日期, 日期格式为 "%Y%m%d".
+	static void current_time(std::string & time, std::string & day);
+
+	// 关闭前一天的文件.
+	void rotate(const std::string & day);
+	// 有日志写入, 安排一次刷新.
+	void schedule_flush();
+
+	void on_flush_timer(const boost::system::error_code & ec);
+	void on_midnight_timer(const boost::system::error_code & ec);
+	void schedule_midnight();
 
 private:
 	ofstream_ptr m_lecture_file;
 	std::string m_lecture_groupid;
 	loglist m_group_list;
 	fs::path m_path;
+
+	// m_group_list 里的文件属于哪一天.
+	std::string m_day;
+
+	int m_flush_ms;
+	bool m_flush_pending;
+	boost::shared_ptr<boost::asio::deadline_timer> m_flush_timer;
+	boost::shared_ptr<boost::asio::deadline_timer> m_midnight_timer;
 };
@@ -1,8 +1,10 @@
 ﻿
 #include <boost/circular_buffer.hpp>
 
+#include <deque>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <iostream>
 
 
@@ -22,10 +24,77 @@
 #include "boost/logging.hpp"
 
 #include "./irc.hpp"
+#include "./irc_parser.hpp"
 
 namespace irc {
 namespace impl {
 
+// 令牌桶, 控制往服务器发送的速度.
+// 桶满时可以一口气发 burst 行, 之后每 interval 毫秒补充一个令牌.
+class token_bucket
+{
+public:
+	token_bucket(std::size_t burst, int interval_ms)
+	{
+		reset(burst, interval_ms);
+	}
+
+	void reset(std::size_t burst, int interval_ms)
+	{
+		m_burst = std::max<std::size_t>(burst, 1);
+		m_interval_ms = std::max(interval_ms, 0);
+		m_tokens = m_burst;
+		m_last_refill = boost::posix_time::microsec_clock::universal_time();
+	}
+
+	// 当前可以发送的行数.
+	std::size_t available()
+	{
+		refill();
+		return m_tokens;
+	}
+
+	void consume(std::size_t n)
+	{
+		m_tokens -= std::min(n, m_tokens);
+	}
+
+	// 距离下一个令牌还要等多少毫秒.
+	int next_token_ms() const
+	{
+		boost::posix_time::time_duration elapsed =
+			boost::posix_time::microsec_clock::universal_time() - m_last_refill;
+		return std::max<int>(m_interval_ms - elapsed.total_milliseconds(), 1);
+	}
+
+private:
+	void refill()
+	{
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+		if (m_tokens >= m_burst || m_interval_ms == 0)
+		{
+			m_tokens = m_burst;
+			m_last_refill = now;
+			return;
+		}
+
+		long n = (now - m_last_refill).total_milliseconds() / m_interval_ms;
+
+		if (n > 0)
+		{
+			m_tokens = std::min<std::size_t>(m_burst, m_tokens + n);
+			m_last_refill += boost::posix_time::milliseconds(n * m_interval_ms);
+		}
+	}
+
+private:
+	std::size_t m_burst;
+	int m_interval_ms;
+	std::size_t m_tokens;
+	boost::posix_time::ptime m_last_refill;
+};
+
 class client_impl : public boost::enable_shared_from_this<client_impl>
 {
 public:
@@ -42,6 +111,9 @@ public:
 		, quitting_(false)
 		, messages_send_queue_(_io_service, 50) // 缓存最后  50 条消息
 		, irc_command_send_queue_(_io_service, 200) // 缓存最后  200 条命令
+		, pending_chat_(50)
+		, logged_in_(false)
+		, flood_bucket_(10, 500)
 	{
 	}
 
@@ -55,6 +127,7 @@ public:
 	void stop()
 	{
 		quitting_ = true;
+		// 正在连接的时候, happy eyeballs 发现 socket 被关闭会放弃所有的连接尝试.
 		boost::system::error_code ec;
 		socket_.close(ec);
 	}
@@ -96,54 +169,132 @@ public:
 		send_command("OPER " + user + " " + pwd);
 	}
 
-public:
-	void process_request(std::size_t bytes_transferred)
+	void set_flood_control(std::size_t burst, int interval_ms)
 	{
-		boost::smatch what;
-		std::string req;
+		flood_bucket_.reset(burst, interval_ms);
+	}
+
+	// 把发送列队里已经有的命令全部取出来, 按优先级放到待发送列表.
+	void collect_pending(const std::string & first)
+	{
+		std::string line = first;
+
+		do {
+			if (line.empty())
+				continue;
+
+			// PRIVMSG/NOTICE 是聊天消息, 其他的 PONG NICK JOIN 之类是控制命令, 优先发送.
+			if (boost::starts_with(line, "PRIVMSG ") || boost::starts_with(line, "NOTICE "))
+				pending_chat_.push_back(line);
+			else
+				pending_control_.push_back(line);
+		} while (irc_command_send_queue_.try_pop(line));
+	}
 
-		req.resize(bytes_transferred);
+	// 登录完成之前聊天消息先留着, 只发控制命令.
+	bool has_pending() const
+	{
+		return !pending_control_.empty() || (logged_in_ && !pending_chat_.empty());
+	}
+
+	// 取出最多 max_lines 行, 控制命令在前, 登录完成之前不取聊天消息.
+	void take_pending(std::size_t max_lines, std::vector<std::string> & batch)
+	{
+		batch.clear();
+
+		while (batch.size() < max_lines && !pending_control_.empty())
+		{
+			batch.push_back(pending_control_.front());
+			pending_control_.pop_front();
+		}
 
-		response_.sgetn(&req[0], bytes_transferred);
+		while (logged_in_ && batch.size() < max_lines && !pending_chat_.empty())
+		{
+			batch.push_back(pending_chat_.front());
+			pending_chat_.pop_front();
+		}
+	}
 
-		req.resize(bytes_transferred - 2);
+	// 重新连接上服务器的时候调用.
+	// PONG NICK JOIN 之类的控制命令是给断掉的连接的, 新连接会重新登录, 全部丢掉.
+	// 还没发出去的聊天消息留着, 等新连接登录完成再发.
+	void reset_pending()
+	{
+		collect_pending(std::string());
+		pending_control_.clear();
+		logged_in_ = false;
+	}
+
+	// 登录完成, 开始发送聊天消息.
+	void set_logged_in()
+	{
+		logged_in_ = true;
+
+		// 空行会被 collect_pending 忽略, 只是为了叫醒发送协程把攒着的聊天消息发出去.
+		if (!pending_chat_.empty())
+			irc_command_send_queue_.push(std::string());
+	}
+
+public:
+	void process_request(std::size_t bytes_transferred)
+	{
+		// asio::streambuf 的数据是连续的, 直接在读缓冲区上切片, 处理完再 consume.
+		boost::string_ref req(
+			boost::asio::buffer_cast<const char*>(response_.data()),
+			bytes_transferred
+		);
 
 #ifdef DEBUG
-		std::cout << req << std::endl;
+		std::cout << req;
 #endif
 
-		//add auto modify a nick
-		if(req.find("Nickname is already in use.") != std::string::npos)
-		{
-			user_ += "_";
-			send_command("NICK " + user_);
-			send_command("USER " + user_ + " 0 * " + user_);
+		irc_line line;
+
+		if (parse_irc_line(req, line))
+			process_line(line);
+
+		response_.consume(bytes_transferred);
+	}
 
-			BOOST_FOREACH(std::string & str, join_queue_)
-			send_command(str);
+	void process_line(const irc_line & line)
+	{
+		if (line.numeric >= 0)
+		{
+			switch (line.numeric)
+			{
+				// ERR_NICKNAMEINUSE, 自动换个昵称
+				case 433:
+					user_ += "_";
+					send_command("NICK " + user_);
+					send_command("USER " + user_ + " 0 * " + user_);
+
+					BOOST_FOREACH(std::string & str, join_queue_)
+					send_command(str);
+					break;
+			}
 			return;
 		}
 
 		//PING :5211858A
-		if (boost::regex_match(req, what, boost::regex("PING ([^ ]+).*")))
+		if (line.command == "PING")
 		{
-			send_command("PONG " + what[1]);
+			send_command("PONG :" + line.trailing().to_string());
 			return;
 		}
 
-		if (boost::regex_match(req, what,
-			boost::regex(":([^!]+)!([^ ]+) PRIVMSG ([^ ]+) :(.*)[\\r\\n]*")))
+		//:nick!user@host PRIVMSG #channel :message
+		if (line.command == "PRIVMSG" && line.param_count == 2 && !line.user_host.empty())
 		{
 			irc_msg m;
-			m.whom = what[1];
-			m.locate = what[2];
-			m.from = what[3];
-			m.msg = what[4];
+			m.whom = line.nick.to_string();
+			m.locate = line.user_host.to_string();
+			m.from = line.params[0].to_string();
+			m.msg = line.params[1].to_string();
 
 			cb_(m);
 
 			c_retry_cuont = 0;
-		};
+		}
 	}
 
 public:
@@ -176,6 +327,14 @@ public:
 			std::string
 		>
 	> messages_send_queue_;
+
+	// 从 irc_command_send_queue_ 取出来等待令牌的行.
+	std::deque<std::string> pending_control_;
+	// 聊天消息堆积太多的时候只保留最后 50 条.
+	boost::circular_buffer_space_optimized<std::string> pending_chat_;
+	bool logged_in_;
+
+	token_bucket flood_bucket_;
 };
 
 
@@ -185,10 +344,9 @@ class msg_sender_loop : boost::asio::coroutine
 public:
 	msg_sender_loop(boost::shared_ptr<client_impl> _client)
 		: m_client(_client)
-		, m_value(boost::make_shared<std::string>())
-		, m_last_line(boost::make_shared<std::string>())
+		, m_batch(boost::make_shared<std::vector<std::string> >())
+		, m_buffers(boost::make_shared<std::vector<boost::asio::const_buffer> >())
 	{
-		boost::system::error_code ec;
 		m_client->irc_command_send_queue_.async_pop(
 			boost::bind<void>(*this, _1, 0, _2)
 		);
@@ -197,30 +355,54 @@ public:
 	void operator()(boost::system::error_code ec,
 		std::size_t bytes_transferred, std::string value)
 	{
-		int i;
-
 		BOOST_ASIO_CORO_REENTER(this)
 		{for (;!m_client->quitting_ && ec != boost::system::errc::operation_canceled;) {
-			*m_value = value;
-			// 发送
-			BOOST_ASIO_CORO_YIELD boost::asio::async_write(
-				m_client->socket_,
-				boost::asio::buffer(*m_value),
-				boost::asio::transfer_all(),
-				boost::bind<void>(*this, _1, _2, value)
-			);
 
-			if (ec)
+			m_client->collect_pending(value);
+
+			while (m_client->has_pending())
 			{
-				// 错误? 恩 ~~~ 糟糕咯
-				m_client->socket_.close(ec);
-				return;
-			}
+				if (m_client->flood_bucket_.available() == 0)
+				{
+					// 令牌用完了, 等下一个令牌, 期间新来的 PONG 之类照样插到聊天消息前面.
+					BOOST_ASIO_CORO_YIELD boost::delayedcallms(
+						m_client->get_io_service(),
+						m_client->flood_bucket_.next_token_ms(),
+						boost::bind<void>(*this, ec, 0, std::string())
+					);
 
-			BOOST_ASIO_CORO_YIELD boost::delayedcallms(
-				m_client->get_io_service(), 468,
-				boost::bind<void>(*this, ec, 0, value)
-			);
+					if (m_client->quitting_ || !m_client->socket_.is_open())
+						return;
+
+					m_client->collect_pending(std::string());
+					continue;
+				}
+
+				// 令牌允许的话一次写出多行.
+				m_client->take_pending(m_client->flood_bucket_.available(), *m_batch);
+				m_client->flood_bucket_.consume(m_batch->size());
+
+				m_buffers->clear();
+				for (std::size_t i = 0; i < m_batch->size(); i++)
+					m_buffers->push_back(boost::asio::buffer((*m_batch)[i]));
+
+				// 发送
+				BOOST_ASIO_CORO_YIELD boost::asio::async_write(
+					m_client->socket_,
+					*m_buffers,
+					boost::asio::transfer_all(),
+					boost::bind<void>(*this, _1, _2, std::string())
+				);
+
+				if (ec)
+				{
+					// 错误? 恩 ~~~ 糟糕咯
+					m_client->socket_.close(ec);
+					return;
+				}
+
+				m_client->collect_pending(std::string());
+			}
 
 			BOOST_ASIO_CORO_YIELD m_client->irc_command_send_queue_.async_pop(
 				boost::bind<void>(*this, _1, 0, _2)
@@ -228,22 +410,10 @@ public:
 		}}
 	}
 
-private:
-	template<class Handler>
-	void async_send_line(std::string line, Handler handler)
-	{
-		*m_last_line = line + "\r\n";
-
-		boost::asio::async_write(
-			m_client->socket_,
-			boost::asio::buffer(*m_last_line),
-			handler
-		);
-	};
 private:
 	boost::shared_ptr<client_impl> m_client;
-	boost::shared_ptr<std::string> m_value;
-	boost::shared_ptr<std::string> m_last_line;
+	boost::shared_ptr<std::vector<std::string> > m_batch;
+	boost::shared_ptr<std::vector<boost::asio::const_buffer> > m_buffers;
 };
 
 msg_sender_loop make_sender_loop(boost::shared_ptr<client_impl> _client)
@@ -352,7 +522,7 @@ public:
 				<< m_client->server_  << " .";
 
 			m_client->response_.consume(m_client->response_.size());
-			m_client->irc_command_send_queue_.clear();
+			m_client->reset_pending();
 
 			// 立即开启 读协程.
 			make_msg_reader_loop(m_client);
@@ -401,6 +571,7 @@ public:
 			}
 
 			// 登录完成, 进入开启消息循环.
+			m_client->set_logged_in();
 
 			do {
 				// 消息循环, 每次阻塞在 async_pop 上.
@@ -410,14 +581,8 @@ public:
 
 				if (!ec)
 				{
-					// 发送消息.
+					// 发送消息, 发送速度由发送协程的令牌桶控制.
 					m_client->send_command(message);
-
-					// 等待 500ms ,  一秒最多发一条信息!
-					BOOST_ASIO_CORO_YIELD boost::delayedcallms(
-						m_client->get_io_service(), 488,
-						boost::bind<void>(*this, ec, bytes_transferred, message)
-					);
 				}
 
 			} while (ec != boost::system::errc::operation_canceled);
@@ -522,6 +687,11 @@ void client::chat(const std::string whom, const std::string msg)
 	impl->chat(whom, msg);
 }
 
+void client::set_flood_control(std::size_t burst, int interval_ms)
+{
+	impl->set_flood_control(burst, interval_ms);
+}
+
 void impl::client_impl::start()
 {
 	impl::irc_main_loop::make_main_loop(shared_from_this());
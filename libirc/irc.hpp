@@ -59,6 +59,10 @@ public:
 	void join(const std::string& ch, const std::string &pwd = "");
 
 	void chat(const std::string whom, const std::string msg);
+
+	// 令牌桶限速: 最多连续发送 burst 行, 之后每 interval_ms 毫秒发一行.
+	// 默认 10 行, 500 毫秒.
+	void set_flood_control(std::size_t burst, int interval_ms);
 private:
 	boost::shared_ptr<impl::client_impl> impl;
 };
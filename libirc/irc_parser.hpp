@@ -0,0 +1,147 @@
+/*
+ * IRC 消息分词 (RFC 1459 + IRCv3 message tags)
+ *
+ * [@tags] [:prefix] command [params] [:trailing]
+ *
+ * 所有字段都是输入行上的 string_ref 切片, 不分配内存, 也不复制数据.
+ * 切片的生命期和输入缓冲区一样, 处理完一行之前不能 consume.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <boost/utility/string_ref.hpp>
+
+namespace irc {
+
+// RFC 1459 规定最多 15 个参数.
+static const std::size_t irc_max_params = 15;
+
+struct irc_line
+{
+	// 不含前导的 '@', 没有则为空.
+	boost::string_ref tags;
+	// 不含前导的 ':', 没有则为空.
+	boost::string_ref prefix;
+	// prefix 拆开的 nick!user@host, 服务器发来的 prefix 只有 nick (也就是服务器名).
+	boost::string_ref nick;
+	boost::string_ref user_host;
+
+	boost::string_ref command;
+	// 三位数字的命令是 numeric reply, 这里是它的值, 否则是 -1.
+	int numeric;
+
+	// trailing 参数也放在这里, 去掉了前导的 ':'.
+	boost::string_ref params[irc_max_params];
+	std::size_t param_count;
+
+	boost::string_ref param(std::size_t i) const
+	{
+		return i < param_count ? params[i] : boost::string_ref();
+	}
+
+	// 最后一个参数, PRIVMSG 的消息内容, PING 的 token 都在这.
+	boost::string_ref trailing() const
+	{
+		return param_count ? params[param_count - 1] : boost::string_ref();
+	}
+};
+
+// 解析一行, line 可以带着结尾的 \r\n. 没有命令的行返回 false.
+inline bool parse_irc_line(boost::string_ref line, irc_line & out)
+{
+	const char * p = line.data();
+	const char * end = p + line.size();
+
+	while (end != p && (end[-1] == '\r' || end[-1] == '\n'))
+		--end;
+
+	out.tags.clear();
+	out.prefix.clear();
+	out.nick.clear();
+	out.user_host.clear();
+	out.command.clear();
+	out.numeric = -1;
+	out.param_count = 0;
+
+	// 跳过分隔的空格, 有的服务器会发多个.
+#define IRC_SKIP_SPACES() while (p != end && *p == ' ') ++p
+
+	// 取一个到空格为止的字段.
+#define IRC_TAKE_WORD(field) do { \
+		const char * b = p; \
+		while (p != end && *p != ' ') ++p; \
+		field = boost::string_ref(b, p - b); \
+	} while (0)
+
+	IRC_SKIP_SPACES();
+
+	if (p != end && *p == '@')
+	{
+		++p;
+		IRC_TAKE_WORD(out.tags);
+		IRC_SKIP_SPACES();
+	}
+
+	if (p != end && *p == ':')
+	{
+		++p;
+		IRC_TAKE_WORD(out.prefix);
+		IRC_SKIP_SPACES();
+
+		std::size_t bang = out.prefix.find('!');
+		if (bang == boost::string_ref::npos)
+			bang = out.prefix.find('@');
+
+		if (bang == boost::string_ref::npos)
+		{
+			out.nick = out.prefix;
+		}
+		else
+		{
+			out.nick = out.prefix.substr(0, bang);
+			out.user_host = out.prefix.substr(bang + 1);
+		}
+	}
+
+	IRC_TAKE_WORD(out.command);
+
+	if (out.command.empty())
+		return false;
+
+	if (out.command.size() == 3
+		&& out.command[0] >= '0' && out.command[0] <= '9'
+		&& out.command[1] >= '0' && out.command[1] <= '9'
+		&& out.command[2] >= '0' && out.command[2] <= '9')
+	{
+		out.numeric = (out.command[0] - '0') * 100
+			+ (out.command[1] - '0') * 10 + (out.command[2] - '0');
+	}
+
+	for (;;)
+	{
+		IRC_SKIP_SPACES();
+
+		if (p == end)
+			break;
+
+		// 第 15 个参数之后的内容全部当作最后一个参数.
+		if (*p == ':' || out.param_count == irc_max_params - 1)
+		{
+			if (*p == ':')
+				++p;
+			out.params[out.param_count++] = boost::string_ref(p, end - p);
+			break;
+		}
+
+		IRC_TAKE_WORD(out.params[out.param_count]);
+		++out.param_count;
+	}
+
+#undef IRC_TAKE_WORD
+#undef IRC_SKIP_SPACES
+
+	return true;
+}
+
+} // namespace irc
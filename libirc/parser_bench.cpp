@@ -0,0 +1,170 @@
+/*
+ * irc 消息分词的性能测试.
+ *
+ * 用法: ircparserbench [raw-irc-log] [rounds]
+ *
+ * raw-irc-log 是服务器发来的原始行, 一行一条 (比如 DEBUG 编译的 avbot 输出的
+ * 内容, 或者 tcpdump 抓下来的). 不指定的话就生成一份模拟高流量频道的数据.
+ * 分别用旧的每行构造 boost::regex 的做法和 parse_irc_line 解析, 比较耗时.
+ */
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include <boost/regex.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "irc_parser.hpp"
+
+static std::vector<std::string> make_sample_log()
+{
+	std::vector<std::string> lines;
+
+	for (int i = 0; i < 20000; i++)
+	{
+		std::string n = boost::lexical_cast<std::string>(i % 97);
+
+		switch (i % 10)
+		{
+			case 0:
+				lines.push_back("PING :card.freenode.net\r\n");
+				break;
+			case 1:
+				lines.push_back(":nick" + n + "!~user" + n + "@unaffiliated/nick" + n + " JOIN #avplayer\r\n");
+				break;
+			case 2:
+				lines.push_back(":nick" + n + "!~user" + n + "@gateway/web/freenode/ip.10.0.0." + n + " QUIT :Ping timeout: 240 seconds\r\n");
+				break;
+			case 3:
+				lines.push_back(":card.freenode.net 353 avbot = #avplayer :avbot nick1 nick2 @op nick3 nick4 nick5\r\n");
+				break;
+			case 4:
+				lines.push_back("@time=2014-05-01T12:00:00.000Z;account=nick" + n + " :nick" + n + "!~user@host" + n + ".example.com PRIVMSG #avplayer :tagged message with some text in it\r\n");
+				break;
+			default:
+				lines.push_back(":nick" + n + "!~user" + n + "@host" + n + ".example.com PRIVMSG #avplayer :hello everybody, this is line " + boost::lexical_cast<std::string>(i) + " of a busy channel\r\n");
+				break;
+		}
+	}
+
+	return lines;
+}
+
+// 以前 process_request 的做法.
+static std::size_t regex_round(const std::vector<std::string> & lines)
+{
+	std::size_t hits = 0;
+
+	for (std::size_t i = 0; i < lines.size(); i++)
+	{
+		boost::smatch what;
+		std::string req = lines[i];
+		req.resize(req.size() - 2);
+
+		if (req.find("Nickname is already in use.") != std::string::npos)
+			continue;
+
+		if (boost::regex_match(req, what, boost::regex("PING ([^ ]+).*")))
+		{
+			hits++;
+			continue;
+		}
+
+		if (boost::regex_match(req, what,
+			boost::regex(":([^!]+)!([^ ]+) PRIVMSG ([^ ]+) :(.*)[\\r\\n]*")))
+		{
+			hits += what[4].length() ? 1 : 0;
+		}
+	}
+
+	return hits;
+}
+
+static std::size_t parser_round(const std::vector<std::string> & lines)
+{
+	std::size_t hits = 0;
+	irc::irc_line line;
+
+	for (std::size_t i = 0; i < lines.size(); i++)
+	{
+		if (!irc::parse_irc_line(lines[i], line))
+			continue;
+
+		if (line.numeric == 433)
+			continue;
+
+		if (line.command == "PING")
+		{
+			hits++;
+			continue;
+		}
+
+		if (line.command == "PRIVMSG" && line.param_count == 2 && !line.user_host.empty())
+		{
+			hits += line.params[1].size() ? 1 : 0;
+		}
+	}
+
+	return hits;
+}
+
+template<class Round>
+static void run(const char * name, Round round, const std::vector<std::string> & lines, int rounds)
+{
+	using namespace boost::posix_time;
+
+	std::size_t hits = 0;
+	ptime start = microsec_clock::universal_time();
+
+	for (int i = 0; i < rounds; i++)
+		hits += round(lines);
+
+	time_duration used = microsec_clock::universal_time() - start;
+	double ns = used.total_microseconds() * 1000.0 / (double(lines.size()) * rounds);
+
+	std::cout << name << ": " << used.total_milliseconds() << " ms, "
+		<< ns << " ns/line, " << hits << " hits" << std::endl;
+}
+
+int main(int argc, char ** argv)
+{
+	std::vector<std::string> lines;
+	int rounds = 10;
+
+	if (argc > 1)
+	{
+		std::ifstream log(argv[1]);
+		std::string l;
+
+		while (std::getline(log, l))
+		{
+			if (!l.empty() && l[l.size() - 1] == '\r')
+				l.resize(l.size() - 1);
+			lines.push_back(l + "\r\n");
+		}
+	}
+	else
+	{
+		lines = make_sample_log();
+	}
+
+	if (argc > 2)
+		rounds = std::atoi(argv[2]);
+
+	if (lines.empty() || rounds <= 0)
+	{
+		std::cerr << "nothing to parse" << std::endl;
+		return 1;
+	}
+
+	std::cout << lines.size() << " lines x " << rounds << " rounds" << std::endl;
+
+	run("boost::regex  ", regex_round, lines, rounds);
+	run("parse_irc_line", parser_round, lines, rounds);
+
+	return 0;
+}
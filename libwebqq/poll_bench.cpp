@@ -0,0 +1,206 @@
+/*
+ * poll2 返回解析的性能测试.
+ *
+ * 用法: webqqpollbench [poll-response ...] [-n rounds]
+ *
+ * 每个文件是一次 poll2 的完整返回 (用浏览器或者 DEBUG 编译的 avbot 抓下来).
+ * 不指定的话就生成几份模拟活跃群的数据.
+ * 分别用旧的 utf8_wide + wptree 的做法和 parse_poll_response 解析, 比较耗时.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iterator>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <avhttp/detail/utf8.hpp>
+
+#include "src/impl/webqq_poll_response.hpp"
+
+namespace pt = boost::property_tree;
+
+static std::vector<std::string> make_sample_responses()
+{
+	std::vector<std::string> responses;
+
+	for (int r = 0; r < 50; r++)
+	{
+		std::string json = "{\"retcode\":0,\"result\":[";
+
+		for (int i = 0; i < 20; i++)
+		{
+			std::string n = boost::lexical_cast<std::string>(r * 20 + i);
+
+			if (i)
+				json += ",";
+
+			if (i % 10 == 9)
+			{
+				json += "{\"poll_type\":\"buddylist_change\",\"value\":{\"added_friends\":[],\"removed_friends\":[]}}";
+				continue;
+			}
+
+			json += "{\"poll_type\":\"group_message\",\"value\":{\"msg_id\":" + n + ",\"from_uin\":3123456789,"
+				"\"to_uin\":2234567890,\"msg_id2\":" + boost::lexical_cast<std::string>(100000 + r * 20 + i) + ",\"msg_type\":43,\"reply_ip\":176498455,"
+				"\"group_code\":1234567890,\"send_uin\":" + boost::lexical_cast<std::string>(1000000 + i) + ",\"seq\":" + n + ",\"time\":1400000000,\"info_seq\":123456,"
+				"\"content\":[[\"font\",{\"size\":10,\"color\":\"000000\",\"style\":[0,0,0],\"name\":\"\\u5B8B\\u4F53\"}],"
+				"\"大家好, 这是第 " + n + " 条消息 \\\"引号\\\" 和换行\\n\",[\"face\",14],\" 后面还有一些文字 \","
+				"[\"cface\",{\"name\":\"{11111111-2222-3333-4444-555555555555}.jpg\",\"file_id\":1234567890,\"key\":\"abcdefghijklmnop\",\"server\":\"123.45.67.89:8000\"}],"
+				"\"\"]}}";
+		}
+
+		json += "]}";
+		responses.push_back(json);
+	}
+
+	return responses;
+}
+
+// 以前 poll_message_op 和 process_group_message_op 的做法.
+static std::size_t wptree_round(const std::vector<std::string> & responses)
+{
+	std::size_t hits = 0;
+
+	for (std::size_t r = 0; r < responses.size(); r++)
+	{
+		pt::wptree jstree;
+		std::wstringstream jsondata;
+		jsondata << avhttp::detail::utf8_wide(responses[r]);
+		pt::json_parser::read_json(jsondata, jstree);
+
+		if (jstree.get<int>(L"retcode"))
+			continue;
+
+		BOOST_FOREACH(pt::wptree::value_type & result, jstree.get_child(L"result"))
+		{
+			std::string poll_type = avhttp::detail::wide_utf8(result.second.get<std::wstring>(L"poll_type"));
+
+			if (poll_type != "group_message")
+				continue;
+
+			std::string group_code = avhttp::detail::wide_utf8(result.second.get<std::wstring>(L"value.from_uin"));
+			std::string who = avhttp::detail::wide_utf8(result.second.get<std::wstring>(L"value.send_uin"));
+
+			BOOST_FOREACH(pt::wptree::value_type & content, result.second.get_child(L"value.content"))
+			{
+				if (content.second.count(L""))
+				{
+					if (content.second.begin()->second.data() == L"font")
+						hits += !avhttp::detail::wide_utf8(content.second.rbegin()->second.get<std::wstring>(L"name")).empty();
+					else if (content.second.begin()->second.data() == L"face")
+						hits += boost::lexical_cast<int>(content.second.rbegin()->second.data()) != 0;
+					else if (content.second.begin()->second.data() == L"cface")
+						hits += !avhttp::detail::wide_utf8(content.second.rbegin()->second.get<std::wstring>(L"file_id")).empty();
+				}
+				else
+				{
+					hits += !avhttp::detail::wide_utf8(content.second.data()).empty();
+				}
+			}
+		}
+	}
+
+	return hits;
+}
+
+static std::size_t reader_round(const std::vector<std::string> & responses)
+{
+	std::size_t hits = 0;
+	webqq::qqimpl::poll_response response;
+
+	for (std::size_t r = 0; r < responses.size(); r++)
+	{
+		const char * data = responses[r].data();
+
+		if (!webqq::qqimpl::parse_poll_response(data, data + responses[r].size(), response) || response.retcode)
+			continue;
+
+		for (std::size_t i = 0; i < response.result.size(); i++)
+		{
+			const webqq::qqimpl::poll_message & msg = response.result[i];
+
+			for (std::size_t j = 0; j < msg.content.size(); j++)
+			{
+				switch (msg.content[j].type)
+				{
+					case webqq::qqMsg::LWQQ_MSG_FONT:
+						hits += !msg.content[j].font.empty();
+						break;
+					case webqq::qqMsg::LWQQ_MSG_FACE:
+						hits += msg.content[j].face != 0;
+						break;
+					case webqq::qqMsg::LWQQ_MSG_CFACE:
+						hits += !msg.content[j].cface.file_id.empty();
+						break;
+					case webqq::qqMsg::LWQQ_MSG_TEXT:
+						hits += !msg.content[j].text.empty();
+						break;
+				}
+			}
+		}
+	}
+
+	return hits;
+}
+
+template<class Round>
+static void run(const char * name, Round round, const std::vector<std::string> & responses, int rounds)
+{
+	using namespace boost::posix_time;
+
+	std::size_t hits = 0;
+	ptime start = microsec_clock::universal_time();
+
+	for (int i = 0; i < rounds; i++)
+		hits += round(responses);
+
+	time_duration used = microsec_clock::universal_time() - start;
+	double us = used.total_microseconds() / (double(responses.size()) * rounds);
+
+	std::cout << name << ": " << used.total_milliseconds() << " ms, "
+		<< us << " us/response, " << hits << " hits" << std::endl;
+}
+
+int main(int argc, char ** argv)
+{
+	std::vector<std::string> responses;
+	int rounds = 20;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+		{
+			rounds = std::atoi(argv[++i]);
+			continue;
+		}
+
+		std::ifstream file(argv[i], std::ios::binary);
+		responses.push_back(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+	}
+
+	if (responses.empty())
+		responses = make_sample_responses();
+
+	if (rounds <= 0)
+	{
+		std::cerr << "nothing to parse" << std::endl;
+		return 1;
+	}
+
+	std::cout << responses.size() << " responses x " << rounds << " rounds" << std::endl;
+
+	run("utf8_wide + wptree", wptree_round, responses, rounds);
+	run("parse_poll_response", reader_round, responses, rounds);
+
+	return 0;
+}
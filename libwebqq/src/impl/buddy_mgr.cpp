@@ -10,20 +10,23 @@ void buddy_mgr::update_group_list(std::string gid, std::string name, std::string
 {
 	using namespace soci;
 
-	std::string qqnum, owner;
+	group_row group;
+	group.gid = gid;
+	group.name = name;
+	group.code = code;
 
-	soci::indicator qqnum_indicator, owner_indicator;
+	// 群代码不变的话, 保留已经获取到的群号和群主.
+	std::string old_gid;
+	boost::unordered_map<std::string, std::string>::iterator old = m_group_by_code.find(code);
 
-	transaction trans(m_sql);
-
-	m_sql << "select qqnum, owner from groups where group_code= :group_code"
-		  , into(qqnum, qqnum_indicator), into(owner, owner_indicator), use(code);
-
-	if (qqnum_indicator == i_null)
-		qqnum = "";
+	if (old != m_group_by_code.end())
+	{
+		old_gid = old->second;
+		group.qqnum = m_groups[old_gid].qqnum;
+		group.owner = m_groups[old_gid].owner;
+	}
 
-	if (owner_indicator == i_null)
-		owner = "";
+	transaction trans(m_sql);
 
 	m_sql << "delete from groups where gid = :gid or group_code = :group_code "
 		  , use(gid), use(code);
@@ -32,27 +35,28 @@ void buddy_mgr::update_group_list(std::string gid, std::string name, std::string
 		  "(gid, group_code, name, qqnum, owner, generate_time)"
 		  " values "
 		  "(:gid, :group_code, :name, :qqnum, :owner, datetime('now') )"
-		  , use(gid), use(code), use(name), use(qqnum), use(owner);
+		  , use(gid), use(code), use(name), use(group.qqnum), use(group.owner);
 
 	trans.commit();
+
+	// 和数据库一样, 删掉 gid 或者群代码相同的旧记录.
+	roster_erase_group(gid);
+	roster_erase_group(old_gid);
+
+	m_groups[gid] = group;
+	m_group_by_code[code] = gid;
+	if (!group.qqnum.empty())
+		m_group_by_qqnum[group.qqnum] = gid;
 }
 
 bool buddy_mgr::group_has_qqnum(std::string code)
 {
-	using namespace soci;
-
-	std::string qqnum;
-	soci::indicator qqnum_indicator;
+	boost::unordered_map<std::string, std::string>::iterator it = m_group_by_code.find(code);
 
-	m_sql << "select qqnum from groups where group_code = :group_code"
-		, into(qqnum, qqnum_indicator), use(code);
+	if (it == m_group_by_code.end())
+		return false;
 
-	if (qqnum_indicator == soci::i_ok)
-	{
-		return  !qqnum.empty();
-	}
-
-	return false;
+	return !m_groups[it->second].qqnum.empty();
 }
 
 void buddy_mgr::map_group_qqnum(std::string code, std::string qqnum)
@@ -65,24 +69,32 @@ void buddy_mgr::map_group_qqnum(std::string code, std::string qqnum)
 		, use(qqnum), use(code);
 
 	trans.commit();
-}
 
-bool buddy_mgr::buddy_has_qqnum(std::string uid)
-{
-	using namespace soci;
+	boost::unordered_map<std::string, std::string>::iterator it = m_group_by_code.find(code);
 
-	std::string qqnum;
-	soci::indicator qqnum_indicator;
+	if (it != m_group_by_code.end())
+	{
+		group_row & group = m_groups[it->second];
 
-	m_sql << "select qqnum from group_buddies where uid = :uid"
-		, into(qqnum, qqnum_indicator), use(uid);
+		// 群号变了, 旧的群号不能再找到这个群.
+		boost::unordered_map<std::string, std::string>::iterator old = m_group_by_qqnum.find(group.qqnum);
+		if (old != m_group_by_qqnum.end() && old->second == it->second)
+			m_group_by_qqnum.erase(old);
 
-	if (qqnum_indicator == soci::i_ok)
-	{
-		return  !qqnum.empty();
+		group.qqnum = qqnum;
+		if (!qqnum.empty())
+			m_group_by_qqnum[qqnum] = it->second;
 	}
+}
+
+bool buddy_mgr::buddy_has_qqnum(std::string uid)
+{
+	boost::unordered_map<std::string, group_buddy_row>::iterator it = m_group_buddies.find(uid);
+
+	if (it == m_group_buddies.end())
+		return false;
 
-	return false;
+	return !it->second.buddy->qqnum.empty();
 }
 
 void buddy_mgr::map_buddy_qqnum(std::string uid, std::string qqnum)
@@ -95,39 +107,46 @@ void buddy_mgr::map_buddy_qqnum(std::string uid, std::string qqnum)
 		, use(qqnum), use(uid);
 
 	trans.commit();
+
+	boost::unordered_map<std::string, group_buddy_row>::iterator it = m_group_buddies.find(uid);
+
+	if (it != m_group_buddies.end())
+	{
+		qqBuddy_ptr old = it->second.buddy;
+		it->second.buddy = boost::make_shared<qqBuddy>(old->uin, old->nick, old->card, old->mflag, qqnum);
+	}
 }
 
 qqGroup_ptr buddy_mgr::get_group_by_gid(std::string gid)
 {
-	qqGroup group;
+	boost::unordered_map<std::string, group_row>::iterator it = m_groups.find(gid);
+
+	if (it == m_groups.end())
+		return qqGroup_ptr();
 
-	soci::indicator indicator;
+	// 调用者会修改返回的 qqGroup, 所以每次都返回一个新的.
+	qqGroup_ptr group = boost::make_shared<qqGroup>();
 
-	group.get_Buddy_by_uin = boost::bind(&buddy_mgr::get_buddy_by_uin, this, _1);
-	group.add_new_buddy = boost::bind(&buddy_mgr::group_new_buddy, this, gid, _1, _2, _3);
+	group->gid = it->second.gid;
+	group->code = it->second.code;
+	group->name = it->second.name;
+	group->qqnum = it->second.qqnum;
+	group->owner = it->second.owner;
 
-	m_sql << "select gid, group_code, name, qqnum, owner from groups where gid = :gid"
-	  , soci::into(group.gid, indicator)
-	  , soci::into(group.code)
-	  , soci::into(group.name)
-	  , soci::into(group.qqnum)
-	  , soci::into(group.owner)
-	  , soci::use(gid);
+	group->get_Buddy_by_uin = boost::bind(&buddy_mgr::get_buddy_by_uin, this, _1);
+	group->add_new_buddy = boost::bind(&buddy_mgr::group_new_buddy, this, gid, _1, _2, _3);
 
-	if (indicator == soci::i_ok)
-		return boost::make_shared<qqGroup>(group);
-	return qqGroup_ptr();
+	return group;
 }
 
 qqGroup_ptr buddy_mgr::get_group_by_qq(std::string qqnum)
 {
-	std::string gid;
+	boost::unordered_map<std::string, std::string>::iterator it = m_group_by_qqnum.find(qqnum);
 
-	m_sql << "select gid from groups where qqnum = :qqnum order by generate_time desc"
-	  , soci::into(gid)
-	  , soci::use(qqnum);
+	if (it == m_group_by_qqnum.end())
+		return qqGroup_ptr();
 
-	return get_group_by_gid(gid);
+	return get_group_by_gid(it->second);
 }
 
 std::vector< qqBuddy_ptr > buddy_mgr::get_buddies()
@@ -172,25 +191,12 @@ std::vector<std::string> buddy_mgr::get_group_all_buddies_uin(std::string gid)
 
 qqBuddy_ptr buddy_mgr::get_buddy_by_uin(std::string uid)
 {
-	using namespace soci;
-
-	std::string uin, nick, card, qqnum;
-	unsigned int mflag;
-
-	indicator uid_indicator, nick_indicator, card_indicator, mflag_indicator, qqnum_indicator;
+	boost::unordered_map<std::string, group_buddy_row>::iterator it = m_group_buddies.find(uid);
 
-	m_sql << "select uid, nick, card, mflag, qqnum from group_buddies where uid=:uid"
-		, into(uid, uid_indicator)
-		, into(nick, nick_indicator)
-		, into(card, card_indicator)
-		, into(mflag, mflag_indicator)
-		, into(qqnum, qqnum_indicator)
-		, use(uid);
-
-	if (uid_indicator!= i_ok)
+	if (it == m_group_buddies.end())
 		return qqBuddy_ptr();
 
-	return boost::make_shared<qqBuddy>(uin, nick, card, mflag, qqnum);
+	return it->second.buddy;
 }
 
 void buddy_mgr::set_group_owner(std::string gid, std::string owner)
@@ -203,6 +209,11 @@ void buddy_mgr::set_group_owner(std::string gid, std::string owner)
 		, use(owner), use(gid);
 
 	trans.commit();
+
+	boost::unordered_map<std::string, group_row>::iterator it = m_groups.find(gid);
+
+	if (it != m_groups.end())
+		it->second.owner = owner;
 }
 
 void buddy_mgr::group_new_buddy(std::string gid, std::string uid, std::string qqnum, std::string nick)
@@ -215,18 +226,33 @@ void buddy_mgr::group_new_buddy(std::string gid, std::string uid, std::string qq
 		, use(gid), use(uid), use(qqnum), use(nick);
 
 	trans.commit();
+
+	// uid 是 UNIQUE ON CONFLICT replace 的, 旧的记录整个被替换掉.
+	group_buddy_row & row = m_group_buddies[uid];
+	row.gid = gid;
+	row.buddy = boost::make_shared<qqBuddy>(uid, nick, "", 0, qqnum);
 }
 
 void buddy_mgr::group_buddy_update_mflag(std::string uid, unsigned int mflag)
 {
 	using namespace soci;
 
+	int _mflag = mflag;
+
 	transaction trans(m_sql);
 
 	m_sql << "update group_buddies set mflag = :mflag where uid = :uid "
-		, use(uid), use(mflag);
+		, use(_mflag), use(uid);
 
 	trans.commit();
+
+	boost::unordered_map<std::string, group_buddy_row>::iterator it = m_group_buddies.find(uid);
+
+	if (it != m_group_buddies.end())
+	{
+		qqBuddy_ptr old = it->second.buddy;
+		it->second.buddy = boost::make_shared<qqBuddy>(old->uin, old->nick, old->card, mflag, old->qqnum);
+	}
 }
 
 void buddy_mgr::group_buddy_update_card(std::string uid, std::string card)
@@ -239,6 +265,14 @@ void buddy_mgr::group_buddy_update_card(std::string uid, std::string card)
 		, use(card), use(uid);
 
 	trans.commit();
+
+	boost::unordered_map<std::string, group_buddy_row>::iterator it = m_group_buddies.find(uid);
+
+	if (it != m_group_buddies.end())
+	{
+		qqBuddy_ptr old = it->second.buddy;
+		it->second.buddy = boost::make_shared<qqBuddy>(old->uin, old->nick, card, old->mflag, old->qqnum);
+	}
 }
 
 /**
@@ -257,6 +291,94 @@ void buddy_mgr::clean_out_outdated()
 	m_sql << "delete from group_buddies where gid not in (select gid from groups);";
 
 	transaction.commit();
+
+	load_roster();
+}
+
+void buddy_mgr::load_roster()
+{
+	using namespace soci;
+
+	m_groups.clear();
+	m_group_by_code.clear();
+	m_group_by_qqnum.clear();
+	m_group_buddies.clear();
+
+	group_row group;
+	indicator qqnum_indicator, owner_indicator;
+
+	// 按时间排序, 同一个群号有多个 gid 的时候以最新的为准.
+	statement groups = (m_sql.prepare <<
+		"select gid, group_code, name, qqnum, owner from groups order by generate_time"
+		, into(group.gid)
+		, into(group.code)
+		, into(group.name)
+		, into(group.qqnum, qqnum_indicator)
+		, into(group.owner, owner_indicator));
+
+	groups.execute();
+
+	while (groups.fetch())
+	{
+		if (qqnum_indicator != i_ok)
+			group.qqnum.clear();
+		if (owner_indicator != i_ok)
+			group.owner.clear();
+
+		m_groups[group.gid] = group;
+		m_group_by_code[group.code] = group.gid;
+		if (!group.qqnum.empty())
+			m_group_by_qqnum[group.qqnum] = group.gid;
+	}
+
+	std::string gid, uid, nick, card, qqnum;
+	int mflag;
+	indicator nick_indicator, card_indicator, mflag_indicator;
+
+	statement buddies = (m_sql.prepare <<
+		"select gid, uid, nick, card, mflag, qqnum from group_buddies"
+		, into(gid)
+		, into(uid)
+		, into(nick, nick_indicator)
+		, into(card, card_indicator)
+		, into(mflag, mflag_indicator)
+		, into(qqnum, qqnum_indicator));
+
+	buddies.execute();
+
+	while (buddies.fetch())
+	{
+		if (nick_indicator != i_ok)
+			nick.clear();
+		if (card_indicator != i_ok)
+			card.clear();
+		if (mflag_indicator != i_ok)
+			mflag = 0;
+		if (qqnum_indicator != i_ok)
+			qqnum.clear();
+
+		group_buddy_row & row = m_group_buddies[uid];
+		row.gid = gid;
+		row.buddy = boost::make_shared<qqBuddy>(uid, nick, card, mflag, qqnum);
+	}
+}
+
+void buddy_mgr::roster_erase_group(std::string gid)
+{
+	boost::unordered_map<std::string, group_row>::iterator it = m_groups.find(gid);
+
+	if (it == m_groups.end())
+		return;
+
+	boost::unordered_map<std::string, std::string>::iterator code = m_group_by_code.find(it->second.code);
+	if (code != m_group_by_code.end() && code->second == gid)
+		m_group_by_code.erase(code);
+
+	boost::unordered_map<std::string, std::string>::iterator qqnum = m_group_by_qqnum.find(it->second.qqnum);
+	if (qqnum != m_group_by_qqnum.end() && qqnum->second == gid)
+		m_group_by_qqnum.erase(qqnum);
+
+	m_groups.erase(it);
 }
 
 void buddy_mgr::db_initialize()
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <soci-sqlite3.h>
 #include <boost-optional.h>
@@ -31,6 +32,7 @@ public:
 	{
 		m_sql.open(soci::sqlite3, dbname);
 		db_initialize();
+		load_roster();
 	}
 
 	void update_group_list(std::string gid, std::string name, std::string code);
@@ -67,9 +69,32 @@ private:
 
 	void db_initialize();
 
+	// 从数据库载入群和群成员到内存.
+	void load_roster();
+
+	void roster_erase_group(std::string gid);
+
 private:
 	soci::session	m_sql;
 
+	// 群和群成员在内存里的副本, 每次修改都同时写入数据库和这里.
+	// 处理消息时的查询只读内存, 不访问数据库.
+	struct group_row
+	{
+		std::string gid, code, name, qqnum, owner;
+	};
+
+	struct group_buddy_row
+	{
+		std::string gid;
+		// qqBuddy 是不可修改的, 更新的时候整个替换, 查询直接返回这个指针.
+		qqBuddy_ptr buddy;
+	};
+
+	boost::unordered_map<std::string, group_row> m_groups;			// gid -> group
+	boost::unordered_map<std::string, std::string> m_group_by_code;	// code -> gid
+	boost::unordered_map<std::string, std::string> m_group_by_qqnum;	// qqnum -> gid
+	boost::unordered_map<std::string, group_buddy_row> m_group_buddies;	// uid -> buddy
 };
 
 
@@ -5,8 +5,16 @@
 
 #pragma once
 
+#include <map>
+#include <deque>
+#include <vector>
+#include <algorithm>
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+namespace pt = boost::property_tree;
+namespace js = boost::property_tree::json_parser;
 #include <boost/regex/pending/unicode_iterator.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
@@ -80,11 +88,61 @@ struct escape_iterator
 	}
 };
 
+// 等待发送的一条群消息.
+struct pending_group_message
+{
+	std::string msg;
+	WebQQ::send_group_message_cb cb;
+	boost::posix_time::ptime queued;
+	// 这条消息因为 108 被退回的次数, 每条消息自己计数, 别的群发送成功不影响它.
+	int retries;
+};
+
+// 发送协程的状态. 协程对象每次回调都会被复制, 所以状态统一放这里用 shared_ptr 持有.
+struct group_message_sender_state
+{
+	group_message_sender_state()
+		: delay_ms(0)
+	{
+	}
+
+	// 每个群一个列队, 一个群刷屏不会挡住其他群的消息.
+	std::map<std::string, std::deque<pending_group_message> > queues;
+	// 有消息等待发送的群, 轮流发送.
+	std::deque<std::string> round_robin;
+
+	// 正在发送的群和消息, 合并发送的时候有多条.
+	std::string gid;
+	std::vector<pending_group_message> inflight;
+	std::string merged;
+
+	// 发送间隔, 服务器返回 108 (发得太快) 时加倍, 成功后逐渐减少到 0.
+	int delay_ms;
+
+	// 复用 keep-alive 连接.
+	boost::shared_ptr<avhttp::http_stream> stream;
+	boost::shared_ptr<boost::asio::streambuf> buffer;
+};
+
 class group_message_sender_op:boost::asio::coroutine
 {
+	// 每个群最多保留最后的 20 条未发送消息.
+	static const std::size_t max_queued_per_group = 20;
+	// 比这短的消息, 如果是连续在 merge_window_ms 之内发给同一个群的, 合并成一条发送.
+	static const std::size_t short_message_size = 120;
+	static const std::size_t max_merged_size = 480;
+	static const int merge_window_ms = 800;
+	// 108 的退避.
+	static const int min_backoff_ms = 400;
+	static const int max_backoff_ms = 8000;
+	static const int max_retries = 5;
+
+	typedef boost::tuple<std::string, std::string, WebQQ::send_group_message_cb> queue_item;
+
 public:
 	group_message_sender_op(boost::shared_ptr<qqimpl::WebQQ> webqq)
 		: m_webqq(webqq)
+		, m_state(boost::make_shared<group_message_sender_state>())
 	{
 		// 进入循环吧.
 		webqq->m_group_message_queue.async_pop(
@@ -92,56 +150,259 @@ public:
 		);
 	}
 
-	void operator()(boost::system::error_code ec, std::size_t bytes_transfered, boost::tuple<std::string, std::string, WebQQ::send_group_message_cb> v)
+	void operator()(boost::system::error_code ec, std::size_t bytes_transfered, queue_item v)
 	{
 		if (ec == boost::system::errc::operation_canceled)
 			return;
 		BOOST_ASIO_CORO_REENTER(this)
 		{for (;m_webqq->m_status != LWQQ_STATUS_QUITTING;){
+			collect(v);
+
 			// 等待状态为登录.
 			while(m_webqq->m_status != LWQQ_STATUS_ONLINE || m_webqq->m_psessionid.empty())
 			{
 				BOOST_ASIO_CORO_YIELD boost::delayedcallsec(
 						m_webqq->get_ioservice(),
 						20,
-						boost::asio::detail::bind_handler(*this, ec, bytes_transfered, v)
+						boost::asio::detail::bind_handler(*this, ec, bytes_transfered, queue_item())
 				);
 			}
 
-			while(m_webqq->m_status == LWQQ_STATUS_ONLINE)
+			while(m_webqq->m_status == LWQQ_STATUS_ONLINE && !m_state->round_robin.empty())
 			{
+				take_next();
+
 				// 开始发送.
-				BOOST_ASIO_CORO_YIELD send_group_message(v);
+				if (m_state->stream && m_state->stream->is_open())
+				{
+					// 复用上次的连接.
+					BOOST_ASIO_CORO_YIELD m_state->stream->async_request(
+						make_request(true),
+						boost::bind<void>(*this, _1, 0, queue_item())
+					);
+
+					if (!ec)
+					{
+						BOOST_ASIO_CORO_YIELD boost::asio::async_read(
+							*m_state->stream,
+							*m_state->buffer,
+							avhttp::transfer_response_body(m_state->stream->content_length()),
+							boost::bind<void>(*this, _1, _2, queue_item())
+						);
+					}
+
+					if (ec == boost::asio::error::eof && m_state->stream->content_length() == -1)
+					{
+						// 没有 Content-Length 的回应读到连接关闭为止, 下次用新连接.
+						m_state->stream.reset();
+						ec = boost::system::error_code();
+					}
+					else if (ec)
+					{
+						// 连接已经被服务器关掉了, 换新连接重发, 不算失败.
+						m_state->stream.reset();
+						requeue_inflight();
+						continue;
+					}
+				}
+				else
+				{
+					m_state->stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_webqq->get_ioservice()));
+					m_state->buffer = boost::make_shared<boost::asio::streambuf>();
+					m_state->stream->request_options(make_request(false));
+
+					BOOST_ASIO_CORO_YIELD avhttp::async_read_body(
+						*m_state->stream,
+						LWQQ_URL_SEND_QUN_MSG,
+						*m_state->buffer,
+						boost::bind<void>(*this, _1, _2, queue_item())
+					);
+				}
+
+				if (ec)
+					m_state->stream.reset();
+
+				if (!ec && is_too_fast())
+				{
+					// 发得太快了, 放回列队, 加大间隔.
+					m_state->delay_ms = std::min(
+						std::max(m_state->delay_ms * 2, static_cast<int>(min_backoff_ms)),
+						static_cast<int>(max_backoff_ms)
+					);
+
+					AVLOG_DBG << "webqq: group message too fast, retry in " << m_state->delay_ms << "ms";
+					retry_inflight();
+				}
+				else
+				{
+					finish_inflight(ec);
+					m_state->delay_ms /= 2;
+					if (m_state->delay_ms < min_backoff_ms / 4)
+						m_state->delay_ms = 0;
+				}
+
+				if (m_state->delay_ms > 0)
+				{
+					BOOST_ASIO_CORO_YIELD boost::delayedcallms(
+							m_webqq->get_ioservice(),
+							m_state->delay_ms,
+							boost::asio::detail::bind_handler(*this, ec, bytes_transfered, queue_item())
+					);
+				}
+
+				// 发送期间新来的消息.
+				collect(queue_item());
+			}
+
+			BOOST_ASIO_CORO_YIELD m_webqq->m_group_message_queue.async_pop(
+				boost::bind<void>(*this, _1, 0, _2)
+			);
+		}
+		}
+	}
+
+private:
+	// 把总列队里的消息分到各个群的列队.
+	void collect(const queue_item & first)
+	{
+		queue_item v = first;
+
+		do {
+			const std::string & gid = v.get<0>();
+
+			if (gid.empty())
+				continue;
+
+			std::deque<pending_group_message> & queue = m_state->queues[gid];
+
+			if (queue.empty() && m_state->gid != gid)
+				m_state->round_robin.push_back(gid);
 
-				m_stream.reset();
-				m_buffer.reset();
+			pending_group_message m;
+			m.msg = v.get<1>();
+			m.cb = v.get<2>();
+			m.queued = boost::posix_time::microsec_clock::universal_time();
+			m.retries = 0;
+			queue.push_back(m);
 
+			if (queue.size() > max_queued_per_group)
+			{
 				m_webqq->get_ioservice().post(
-					boost::asio::detail::bind_handler(v.get<2>(), ec)
+					boost::asio::detail::bind_handler(queue.front().cb,
+						boost::system::error_code(boost::asio::error::operation_aborted))
 				);
+				queue.pop_front();
+			}
+		} while (m_webqq->m_group_message_queue.try_pop(v));
+	}
 
-				// 发送完毕， 延时 400ms 再发送
-				BOOST_ASIO_CORO_YIELD boost::delayedcallms(
-						m_webqq->get_ioservice(),
-						400,
-						boost::asio::detail::bind_handler(*this, ec, bytes_transfered, v)
-				);
+	// 轮到下一个群, 取出它排在最前面的消息, 连续的短消息合并成一条.
+	void take_next()
+	{
+		m_state->gid = m_state->round_robin.front();
+		m_state->round_robin.pop_front();
+
+		std::deque<pending_group_message> & queue = m_state->queues[m_state->gid];
+
+		m_state->inflight.clear();
+		m_state->inflight.push_back(queue.front());
+		m_state->merged = queue.front().msg;
+		queue.pop_front();
+
+		while (!queue.empty()
+			&& m_state->inflight.back().msg.size() < short_message_size
+			&& queue.front().msg.size() < short_message_size
+			&& m_state->merged.size() + queue.front().msg.size() + 1 <= max_merged_size
+			&& (queue.front().queued - m_state->inflight.front().queued).total_milliseconds() <= merge_window_ms)
+		{
+			m_state->inflight.push_back(queue.front());
+			m_state->merged += "\n";
+			m_state->merged += queue.front().msg;
+			queue.pop_front();
+		}
+	}
+
+	// 这一批消息放回列队最前面, 这个群排到最后.
+	void requeue_inflight()
+	{
+		std::deque<pending_group_message> & queue = m_state->queues[m_state->gid];
+
+		queue.insert(queue.begin(), m_state->inflight.begin(), m_state->inflight.end());
+		m_state->inflight.clear();
+		m_state->round_robin.push_back(m_state->gid);
+		m_state->gid.clear();
+	}
+
+	// 这一批被 108 退回, 重试次数用完的消息报告失败, 其余的放回列队.
+	void retry_inflight()
+	{
+		std::vector<pending_group_message> retry;
 
-				BOOST_ASIO_CORO_YIELD m_webqq->m_group_message_queue.async_pop(
-					boost::bind<void>(*this, _1, 0, _2)
+		for (std::size_t i = 0; i < m_state->inflight.size(); i++)
+		{
+			pending_group_message & m = m_state->inflight[i];
+
+			if (++m.retries < max_retries)
+			{
+				retry.push_back(m);
+			}
+			else
+			{
+				m_webqq->get_ioservice().post(
+					boost::asio::detail::bind_handler(m.cb,
+						error::make_error_code(error::send_message_failed_too_often))
 				);
 			}
 		}
+
+		m_state->inflight.swap(retry);
+
+		if (m_state->inflight.empty())
+			finish_inflight(boost::system::error_code());
+		else
+			requeue_inflight();
+	}
+
+	void finish_inflight(boost::system::error_code ec)
+	{
+		for (std::size_t i = 0; i < m_state->inflight.size(); i++)
+		{
+			m_webqq->get_ioservice().post(
+				boost::asio::detail::bind_handler(m_state->inflight[i].cb, ec)
+			);
 		}
+		m_state->inflight.clear();
+
+		std::map<std::string, std::deque<pending_group_message> >::iterator it
+			= m_state->queues.find(m_state->gid);
+
+		if (it->second.empty())
+			m_state->queues.erase(it);
+		else
+			m_state->round_robin.push_back(m_state->gid);
+
+		m_state->gid.clear();
 	}
 
-private:
-	void send_group_message(boost::tuple<std::string, std::string, WebQQ::send_group_message_cb> v)
+	// 服务器返回 {"retcode":108, ...} 说明发得太快了.
+	bool is_too_fast()
 	{
+		pt::ptree json;
+		std::istream response(m_state->buffer.get());
 
-		std::string group = v.get<0>();
-		std::string msg = v.get<1>();
+		try
+		{
+			js::read_json(response, json);
+			return json.get<int>("retcode", 0) == LWQQ_MC_TOO_FAST;
+		}
+		catch (const pt::ptree_error &)
+		{
+			return false;
+		}
+	}
 
+	avhttp::request_opts make_request(bool keep_alive_url)
+	{
 		//unescape for POST
 		std::string messagejson = boost::str(
 		boost::format("{\"group_uin\":\"%s\", "
@@ -153,8 +414,8 @@ private:
 			"\"msg_id\":%ld,"
 			"\"clientid\":\"%s\","
 			"\"psessionid\":\"%s\"}")
-			% group
-			% parse_unescape( msg )
+			% m_state->gid
+			% parse_unescape( m_state->merged )
 			% m_webqq->m_msg_id ++
 			% m_webqq->m_clientid
 			% m_webqq->m_psessionid
@@ -166,28 +427,25 @@ private:
 				% m_webqq->m_clientid
 				% m_webqq->m_psessionid
 				);
-		m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_webqq->get_ioservice()));
-		m_buffer = boost::make_shared<boost::asio::streambuf>();
-		m_webqq->m_cookie_mgr.get_cookie(LWQQ_URL_SEND_QUN_MSG, *m_stream);
-
-		m_stream->request_options(
-			avhttp::request_opts()
-				( avhttp::http_options::request_method, "POST" )
-				( avhttp::http_options::referer, "http://d.web2.qq.com/proxy.html?v=20130916001&callback=1&id=2" )
-				( avhttp::http_options::content_type, "application/x-www-form-urlencoded; charset=UTF-8" )
-				( avhttp::http_options::request_body, postdata )
-				( avhttp::http_options::content_length, boost::lexical_cast<std::string>( postdata.length() ) )
-				( avhttp::http_options::connection, "close" )
-				("Origin", "http://d.web2.qq.com")
-				("Accept", "*/*")
-		);
 
-		avhttp::async_read_body(
-			*m_stream,
-			LWQQ_URL_SEND_QUN_MSG,
-			*m_buffer,
-			boost::bind<void>(*this, _1, _2, v)
-		);
+		m_state->buffer->consume(m_state->buffer->size());
+		m_webqq->m_cookie_mgr.get_cookie(LWQQ_URL_SEND_QUN_MSG, *m_state->stream);
+
+		avhttp::request_opts opts;
+		opts
+			( avhttp::http_options::request_method, "POST" )
+			( avhttp::http_options::referer, "http://d.web2.qq.com/proxy.html?v=20130916001&callback=1&id=2" )
+			( avhttp::http_options::content_type, "application/x-www-form-urlencoded; charset=UTF-8" )
+			( avhttp::http_options::request_body, postdata )
+			( avhttp::http_options::content_length, boost::lexical_cast<std::string>( postdata.length() ) )
+			( avhttp::http_options::connection, "keep-alive" )
+			("Origin", "http://d.web2.qq.com")
+			("Accept", "*/*");
+
+		if (keep_alive_url)
+			opts(avhttp::http_options::url, LWQQ_URL_SEND_QUN_MSG);
+
+		return opts;
 	}
 private:
 
@@ -212,8 +470,7 @@ private:
 	}
 private:
 	boost::shared_ptr<qqimpl::WebQQ> m_webqq;
-	boost::shared_ptr<avhttp::http_stream> m_stream;
-	boost::shared_ptr<boost::asio::streambuf> m_buffer;
+	boost::shared_ptr<group_message_sender_state> m_state;
 };
 
 }
@@ -0,0 +1,558 @@
+
+/*
+ * 直接在 UTF-8 缓冲上解析 json, 不转换成宽字符, 也不复制字符串.
+ * 解析结果是一个平坦的节点数组, 每个节点记录它在原始缓冲里的位置,
+ * 只有真正取值的时候才把带转义的字符串解码出来.
+ * 原始缓冲必须在 json_document 使用期间一直有效.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+namespace webqq{
+namespace qqimpl{
+namespace json{
+
+enum value_type
+{
+	null_value,
+	bool_value,
+	number_value,
+	string_value,
+	array_value,
+	object_value,
+};
+
+namespace detail{
+
+struct node
+{
+	value_type type;
+	// 字符串是引号里面的内容, 其他类型是整个值的原文.
+	const char * begin;
+	const char * end;
+	// 在对象里的时候, 键的内容.
+	const char * key_begin;
+	const char * key_end;
+	bool escaped;
+	bool key_escaped;
+
+	uint32_t first_child;
+	uint32_t last_child;
+	uint32_t next_sibling;
+	uint32_t size;
+};
+
+static const uint32_t npos = 0xffffffffu;
+
+static inline void append_utf8(std::string & out, uint32_t cp)
+{
+	if (cp < 0x80)
+	{
+		out += static_cast<char>(cp);
+	}
+	else if (cp < 0x800)
+	{
+		out += static_cast<char>(0xc0 | (cp >> 6));
+		out += static_cast<char>(0x80 | (cp & 0x3f));
+	}
+	else if (cp < 0x10000)
+	{
+		out += static_cast<char>(0xe0 | (cp >> 12));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+		out += static_cast<char>(0x80 | (cp & 0x3f));
+	}
+	else
+	{
+		out += static_cast<char>(0xf0 | (cp >> 18));
+		out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+		out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+		out += static_cast<char>(0x80 | (cp & 0x3f));
+	}
+}
+
+static inline bool parse_hex4(const char * p, const char * end, uint32_t & v)
+{
+	if (end - p < 4)
+		return false;
+
+	v = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		char c = p[i];
+		v <<= 4;
+
+		if (c >= '0' && c <= '9')
+			v |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v |= c - 'A' + 10;
+		else
+			return false;
+	}
+	return true;
+}
+
+// 解码 json 字符串的转义, 追加到 out.
+static inline void unescape(const char * p, const char * end, std::string & out)
+{
+	out.reserve(out.size() + (end - p));
+
+	while (p < end)
+	{
+		const char * backslash = static_cast<const char*>(std::memchr(p, '\\', end - p));
+
+		if (!backslash)
+		{
+			out.append(p, end);
+			return;
+		}
+
+		out.append(p, backslash);
+		p = backslash + 1;
+
+		if (p == end)
+			return;
+
+		switch (*p++)
+		{
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'u':
+			{
+				uint32_t cp;
+
+				if (!parse_hex4(p, end, cp))
+					break;
+				p += 4;
+
+				// UTF-16 代理对.
+				if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+				{
+					uint32_t low;
+
+					if (parse_hex4(p + 2, end, low) && low >= 0xdc00 && low < 0xe000)
+					{
+						cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+						p += 6;
+					}
+				}
+
+				append_utf8(out, cp);
+				break;
+			}
+			default:
+				// \" \\ \/
+				out += p[-1];
+		}
+	}
+}
+
+} // namespace detail
+
+class json_document;
+
+// 指向 json_document 里一个节点的句柄, 复制的代价很小.
+// 不存在的节点 (比如找不到的键) 也是一个合法的句柄, 对它取值得到空字符串或者 0.
+class json_value
+{
+public:
+	json_value()
+		: m_doc(0)
+		, m_index(detail::npos)
+	{
+	}
+
+	json_value(const json_document * doc, uint32_t index)
+		: m_doc(doc)
+		, m_index(index)
+	{
+	}
+
+	bool valid() const { return m_index != detail::npos; }
+
+	value_type type() const { return valid() ? node().type : null_value; }
+
+	bool is_array() const { return type() == array_value; }
+	bool is_object() const { return type() == object_value; }
+	bool is_string() const { return type() == string_value; }
+
+	// 数组或者对象的元素个数.
+	std::size_t size() const { return valid() ? node().size : 0; }
+
+	json_value first_child() const
+	{
+		return json_value(m_doc, valid() ? node().first_child : detail::npos);
+	}
+
+	json_value last_child() const
+	{
+		return json_value(m_doc, valid() ? node().last_child : detail::npos);
+	}
+
+	json_value next_sibling() const
+	{
+		return json_value(m_doc, valid() ? node().next_sibling : detail::npos);
+	}
+
+	// 对象成员, 找不到返回无效的句柄.
+	json_value operator[](const char * key) const;
+
+	// 字符串解码转义以后的内容, 其他类型返回原文.
+	std::string str() const
+	{
+		if (!valid())
+			return std::string();
+
+		const detail::node & n = node();
+
+		if (n.escaped)
+		{
+			std::string out;
+			detail::unescape(n.begin, n.end, out);
+			return out;
+		}
+		return std::string(n.begin, n.end);
+	}
+
+	// 和 s 比较, 不带转义的字符串不需要分配内存.
+	bool equals(const char * s) const
+	{
+		if (!valid())
+			return false;
+
+		const detail::node & n = node();
+
+		if (n.escaped)
+			return str() == s;
+
+		std::size_t len = std::strlen(s);
+		return static_cast<std::size_t>(n.end - n.begin) == len && std::memcmp(n.begin, s, len) == 0;
+	}
+
+	long long to_int() const
+	{
+		if (!valid())
+			return 0;
+		// 数字和字符串形式的数字都可以.
+		return std::strtoll(str().c_str(), 0, 10);
+	}
+
+	// 原文, 字符串不含引号.
+	const char * raw_begin() const { return valid() ? node().begin : 0; }
+	const char * raw_end() const { return valid() ? node().end : 0; }
+
+private:
+	const detail::node & node() const;
+
+	bool key_equals(const char * key, std::size_t len) const
+	{
+		const detail::node & n = node();
+
+		if (n.key_escaped)
+		{
+			std::string decoded;
+			detail::unescape(n.key_begin, n.key_end, decoded);
+			return decoded.size() == len && std::memcmp(decoded.data(), key, len) == 0;
+		}
+
+		return static_cast<std::size_t>(n.key_end - n.key_begin) == len && std::memcmp(n.key_begin, key, len) == 0;
+	}
+
+	const json_document * m_doc;
+	uint32_t m_index;
+};
+
+class json_document
+{
+	// 嵌套太深的一律当作格式错误.
+	enum { max_depth = 64 };
+
+public:
+	// 解析 [begin, end), 格式错误返回 false.
+	bool parse(const char * begin, const char * end)
+	{
+		m_nodes.clear();
+		m_nodes.reserve((end - begin) / 16 + 16);
+		m_end = end;
+
+		const char * p = skip_space(begin);
+
+		if (!parse_value(p, 0))
+		{
+			m_nodes.clear();
+			return false;
+		}
+
+		p = skip_space(p);
+		if (p != end)
+		{
+			m_nodes.clear();
+			return false;
+		}
+		return true;
+	}
+
+	json_value root() const
+	{
+		return json_value(this, m_nodes.empty() ? detail::npos : 0);
+	}
+
+private:
+	friend class json_value;
+
+	const char * skip_space(const char * p) const
+	{
+		while (p < m_end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+			p++;
+		return p;
+	}
+
+	uint32_t new_node(value_type type, const char * begin)
+	{
+		detail::node n;
+		n.type = type;
+		n.begin = begin;
+		n.end = begin;
+		n.key_begin = n.key_end = 0;
+		n.escaped = n.key_escaped = false;
+		n.first_child = n.last_child = n.next_sibling = detail::npos;
+		n.size = 0;
+		m_nodes.push_back(n);
+		return m_nodes.size() - 1;
+	}
+
+	// p 指向开始的引号, 成功后 p 指向结束引号之后.
+	bool scan_string(const char *& p, const char *& begin, const char *& end, bool & escaped) const
+	{
+		begin = ++p;
+		escaped = false;
+
+		for (;;)
+		{
+			while (p < m_end && *p != '"' && *p != '\\')
+				p++;
+
+			if (p >= m_end)
+				return false;
+
+			if (*p == '"')
+				break;
+
+			// 跳过转义的字符.
+			escaped = true;
+			p += 2;
+		}
+
+		end = p++;
+		return true;
+	}
+
+	void add_child(uint32_t parent, uint32_t child)
+	{
+		detail::node & n = m_nodes[parent];
+
+		if (n.last_child == detail::npos)
+			n.first_child = child;
+		else
+			m_nodes[n.last_child].next_sibling = child;
+
+		m_nodes[parent].last_child = child;
+		m_nodes[parent].size++;
+	}
+
+	bool parse_value(const char *& p, int depth)
+	{
+		if (p >= m_end || depth > max_depth)
+			return false;
+
+		switch (*p)
+		{
+			case '{':
+				return parse_object(p, depth);
+			case '[':
+				return parse_array(p, depth);
+			case '"':
+			{
+				uint32_t index = new_node(string_value, p);
+				const char * begin, * end;
+				bool escaped;
+
+				if (!scan_string(p, begin, end, escaped))
+					return false;
+
+				m_nodes[index].begin = begin;
+				m_nodes[index].end = end;
+				m_nodes[index].escaped = escaped;
+				return true;
+			}
+			case 't':
+				return parse_literal(p, "true", bool_value);
+			case 'f':
+				return parse_literal(p, "false", bool_value);
+			case 'n':
+				return parse_literal(p, "null", null_value);
+			default:
+			{
+				const char * begin = p;
+
+				while (p < m_end && (std::strchr("0123456789+-.eE", *p) && *p))
+					p++;
+
+				if (p == begin)
+					return false;
+
+				uint32_t index = new_node(number_value, begin);
+				m_nodes[index].end = p;
+				return true;
+			}
+		}
+	}
+
+	bool parse_literal(const char *& p, const char * literal, value_type type)
+	{
+		std::size_t len = std::strlen(literal);
+
+		if (static_cast<std::size_t>(m_end - p) < len || std::memcmp(p, literal, len) != 0)
+			return false;
+
+		uint32_t index = new_node(type, p);
+		p += len;
+		m_nodes[index].end = p;
+		return true;
+	}
+
+	bool parse_array(const char *& p, int depth)
+	{
+		uint32_t index = new_node(array_value, p);
+
+		p = skip_space(p + 1);
+
+		if (p < m_end && *p == ']')
+		{
+			m_nodes[index].end = ++p;
+			return true;
+		}
+
+		for (;;)
+		{
+			uint32_t child = m_nodes.size();
+
+			if (!parse_value(p, depth + 1))
+				return false;
+
+			add_child(index, child);
+
+			p = skip_space(p);
+
+			if (p >= m_end)
+				return false;
+
+			if (*p == ',')
+			{
+				p = skip_space(p + 1);
+				continue;
+			}
+
+			if (*p != ']')
+				return false;
+
+			m_nodes[index].end = ++p;
+			return true;
+		}
+	}
+
+	bool parse_object(const char *& p, int depth)
+	{
+		uint32_t index = new_node(object_value, p);
+
+		p = skip_space(p + 1);
+
+		if (p < m_end && *p == '}')
+		{
+			m_nodes[index].end = ++p;
+			return true;
+		}
+
+		for (;;)
+		{
+			const char * key_begin, * key_end;
+			bool key_escaped;
+
+			if (p >= m_end || *p != '"' || !scan_string(p, key_begin, key_end, key_escaped))
+				return false;
+
+			p = skip_space(p);
+
+			if (p >= m_end || *p != ':')
+				return false;
+
+			p = skip_space(p + 1);
+
+			uint32_t child = m_nodes.size();
+
+			if (!parse_value(p, depth + 1))
+				return false;
+
+			m_nodes[child].key_begin = key_begin;
+			m_nodes[child].key_end = key_end;
+			m_nodes[child].key_escaped = key_escaped;
+			add_child(index, child);
+
+			p = skip_space(p);
+
+			if (p >= m_end)
+				return false;
+
+			if (*p == ',')
+			{
+				p = skip_space(p + 1);
+				continue;
+			}
+
+			if (*p != '}')
+				return false;
+
+			m_nodes[index].end = ++p;
+			return true;
+		}
+	}
+
+private:
+	std::vector<detail::node> m_nodes;
+	const char * m_end;
+};
+
+inline const detail::node & json_value::node() const
+{
+	return m_doc->m_nodes[m_index];
+}
+
+inline json_value json_value::operator[](const char * key) const
+{
+	if (type() != object_value)
+		return json_value();
+
+	std::size_t len = std::strlen(key);
+
+	for (json_value child = first_child(); child.valid(); child = child.next_sibling())
+	{
+		if (child.key_equals(key, len))
+			return child;
+	}
+	return json_value();
+}
+
+} // namespace json
+} // namespace qqimpl
+} // namespace webqq
@@ -41,6 +41,7 @@ namespace js = boost::property_tree::json_parser;
 #include "webqq_impl.hpp"
 
 #include "constant.hpp"
+#include "webqq_poll_response.hpp"
 
 namespace webqq{
 namespace qqimpl{
@@ -49,8 +50,10 @@ namespace detail{
 template<class Handler>
 struct process_group_message_op : boost::asio::coroutine
 {
-	process_group_message_op(boost::shared_ptr<WebQQ> webqq, const boost::property_tree::wptree& jstree, Handler handler)
-		: m_jstree(boost::make_shared<boost::property_tree::wptree>(jstree))
+	process_group_message_op(boost::shared_ptr<WebQQ> webqq, boost::shared_ptr<poll_response> response, std::size_t index, Handler handler)
+		: m_response(response)
+		, m_index(index)
+		, m_content(0)
 		, m_webqq(webqq)
 		, m_handler(handler)
 	{
@@ -59,14 +62,9 @@ struct process_group_message_op : boost::asio::coroutine
 
 	void operator()(boost::system::error_code ec, std::string url)
 	{
-		std::string group_code = avhttp::detail::wide_utf8( m_jstree->get<std::wstring>( L"value.from_uin" ) );
-		std::string who = avhttp::detail::wide_utf8( m_jstree->get<std::wstring>( L"value.send_uin" ) );
-
-		//parse content
-
-		namespace pt = boost::property_tree;
-
-		pt::wptree::value_type * content;
+		poll_message & message = m_response->result[m_index];
+		const std::string & group_code = message.from_uin;
+		const std::string & who = message.send_uin;
 
 		BOOST_ASIO_CORO_REENTER(this)
 		{
@@ -94,111 +92,70 @@ struct process_group_message_op : boost::asio::coroutine
 				}
 			}
 
-			m_iterator = m_jstree->get_child( L"value.content" ).begin();
-			m_iterator_end = m_jstree->get_child( L"value.content" ).end();
-
-			for( ; m_iterator != m_iterator_end; m_iterator ++ )
+			// 消息内容已经解码好了, 这里只需要转换表情编号和获取群图片的地址.
+			for( m_content = 0; m_content < message.content.size(); m_content ++ )
 			{
-				content = &(*m_iterator);
-
-
-				if( content->second.count( L"" ) )
+				if( message.content[m_content].type == qqMsg::LWQQ_MSG_FACE )
+				{
+					message.content[m_content].face = m_webqq->facemap[message.content[m_content].face];
+				}
+				else if( message.content[m_content].type == qqMsg::LWQQ_MSG_CFACE )
 				{
-					if( content->second.begin()->second.data() == L"font" )
-					{
-						msg.type = qqMsg::LWQQ_MSG_FONT;
-						msg.font = avhttp::detail::wide_utf8( content->second.rbegin()->second.get<std::wstring> ( L"name" ) );
-						messagecontent.push_back( msg );
-					}
-					else if( content->second.begin()->second.data() == L"face" )
-					{
-						msg.type = qqMsg::LWQQ_MSG_FACE;
-
-						int wface = boost::lexical_cast<int>(
-							content->second.rbegin()->second.data()
-						);
-
-						msg.face = m_webqq->facemap[wface];
-						messagecontent.push_back(msg);
-					}
-					else if( content->second.begin()->second.data() == L"cface" )
 					{
-						msg.type = qqMsg::LWQQ_MSG_CFACE;
-						msg.cface.uin = who;
-						msg.cface.gid = m_webqq->get_Group_by_gid( group_code )->code;
+						qqMsgCface & cface = message.content[m_content].cface;
 
-						msg.cface.file_id = avhttp::detail::wide_utf8(
-							content->second.rbegin()->second.get<std::wstring>(L"file_id")
-						);
-						msg.cface.name = avhttp::detail::wide_utf8(
-							content->second.rbegin()->second.get<std::wstring>(L"name")
-						);
-						msg.cface.vfwebqq = m_webqq->m_vfwebqq;
-						msg.cface.key = avhttp::detail::wide_utf8(
-							content->second.rbegin()->second.get<std::wstring> (L"key")
-						);
-						msg.cface.server = avhttp::detail::wide_utf8(
-							content->second.rbegin()->second.get<std::wstring> (L"server")
-						);
+						cface.uin = who;
+						cface.gid = m_webqq->get_Group_by_gid( group_code )->code;
+						cface.vfwebqq = m_webqq->m_vfwebqq;
 
-						msg.cface.cookie = m_webqq->m_cookie_mgr.get_cookie(
+						cface.cookie = m_webqq->m_cookie_mgr.get_cookie(
 							avhttp::url("http://web.qq.com/cgi-bin/get_group_pic")
 						).get_cookie_line(false);
+					}
 
-						BOOST_ASIO_CORO_YIELD webqq::async_cface_url_final(
-							m_webqq->get_ioservice(), msg.cface, *this
-						);
-
-						msg.cface.gchatpicurl = url;
+					BOOST_ASIO_CORO_YIELD webqq::async_cface_url_final(
+						m_webqq->get_ioservice(), message.content[m_content].cface, *this
+					);
 
-						messagecontent.push_back( msg );
-					}
-				}
-				else
-				{
-					//聊天字符串就在这里.
-					msg.type = qqMsg::LWQQ_MSG_TEXT;
-					msg.text = avhttp::detail::wide_utf8(content->second.data());
-					messagecontent.push_back( msg );
+					message.content[m_content].cface.gchatpicurl = url;
 				}
 			}
 
 			m_handler(ec);
 
-			m_webqq->siggroupmessage( group_code, who, messagecontent );
+			m_webqq->siggroupmessage( group_code, who, message.content );
 
 		}
 
 	}
 
 private:
+	boost::shared_ptr<poll_response> m_response;
+	std::size_t m_index;
+	std::size_t m_content;
+
 	boost::shared_ptr<WebQQ> m_webqq;
 	Handler m_handler;
-
-	boost::shared_ptr<boost::property_tree::wptree> m_jstree;
-	boost::property_tree::wptree * value_content;
-	boost::property_tree::wptree::iterator	m_iterator, m_iterator_end;
-	std::vector<qqMsg>	messagecontent;
-	qqMsg msg;
 };
 
 template<class Handler>
 process_group_message_op<Handler>
 make_process_group_message_op(boost::shared_ptr<WebQQ> webqq,
-	const boost::property_tree::wptree& jstree,
+	boost::shared_ptr<poll_response> response, std::size_t index,
 	Handler handler)
 {
-	return process_group_message_op<Handler>(webqq, jstree, handler);
+	return process_group_message_op<Handler>(webqq, response, index, handler);
 }
 
 
 }
 
+// response->result[index] 必须是 group_message.
 template<class Handler>
 void process_group_message(boost::shared_ptr<WebQQ> webqq,
-	const boost::property_tree::wptree& jstree, Handler handler)
+	boost::shared_ptr<poll_response> response, std::size_t index, Handler handler)
 {
-	detail::make_process_group_message_op(webqq, jstree, handler);
+	detail::make_process_group_message_op(webqq, response, index, handler);
 }
 
 } // namespace qqimpl
@@ -5,11 +5,8 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
-#include <boost/property_tree/json_parser.hpp>
-namespace js = boost::property_tree::json_parser;
 
 #include <avhttp/async_read_body.hpp>
-#include <boost/json_create_escapes_utf8.hpp>
 
 #include "boost/timedcall.hpp"
 #include "boost/stringencodings.hpp"
@@ -19,6 +16,7 @@ namespace js = boost::property_tree::json_parser;
 
 #include "constant.hpp"
 
+#include "webqq_poll_response.hpp"
 #include "process_group_msg.hpp"
 
 namespace webqq{
@@ -73,61 +71,14 @@ public:
 			return;
 		}
 
-		m_jstree = boost::make_shared<pt::wptree>();
+		m_response = boost::make_shared<poll_response>();
 
-		std::wstring response = avhttp::detail::utf8_wide(
-			std::string(
-				boost::asio::buffer_cast<const char*>(m_buffer->data()) , m_buffer->size()
-			)
-		);
-
-
-		std::wstringstream jsondata;
-		jsondata << response;
-
-		int retcode;
-
-		ec =  boost::system::error_code();
-
-		//处理!
-		try
-		{
-			pt::json_parser::read_json( jsondata, *m_jstree );
-
-			retcode = m_jstree->get<int>( L"retcode" );
+		const char * response = boost::asio::buffer_cast<const char*>(m_buffer->data());
 
-			if(retcode == 116)
-			{
-				// update ptwebqq
-				std::string ptwebqq = avhttp::detail::wide_utf8(m_jstree->get<std::wstring>( L"p"));
-				m_webqq->m_cookie_mgr.save_cookie("qq.com", "/", "ptwebqq", ptwebqq, "session");
-				ec =  boost::system::error_code();
-			}else if(retcode == 102)
-			{
-			}
-			else if(retcode == 121 || retcode == 120 || retcode == 100)
-			{
-				// 需要认证
-				ec = error::make_error_code(error::poll_failed_need_login);
-			}else if(retcode == 103)
-			{
-				ec = error::make_error_code(error::poll_failed_need_login);
-			}else if (retcode == 110)
-			{
-				ec = error::make_error_code(error::poll_failed_user_quit);
-			}else if (retcode == 100006)
-			{
-				ec = error::make_error_code(error::poll_failed_need_refresh);
-			}else if (retcode){
-				ec = error::make_error_code(error::poll_failed_unknow_ret_code);
-			}else
-			{
-				retcode = 0;
-			}
-		}
-		catch( const pt::ptree_error & badpath )
+		// 直接在接收缓冲上解析, 不再转换成宽字符.
+		if (!parse_poll_response(response, response + m_buffer->size(), *m_response))
 		{
-			AVLOG_ERR <<  __FILE__ << " : " << __LINE__ << " : " <<  "bad path" <<  badpath.what();
+			AVLOG_ERR <<  __FILE__ << " : " << __LINE__ << " : " <<  "bad poll response";
 			// 出现网络错误
 			m_webqq->get_ioservice().post(
 				boost::asio::detail::bind_handler(
@@ -138,6 +89,36 @@ public:
 			return;
 		}
 
+		int retcode = m_response->retcode;
+
+		ec =  boost::system::error_code();
+
+		//处理!
+		if(retcode == 116)
+		{
+			// update ptwebqq
+			m_webqq->m_cookie_mgr.save_cookie("qq.com", "/", "ptwebqq", m_response->p, "session");
+			ec =  boost::system::error_code();
+		}else if(retcode == 102)
+		{
+		}
+		else if(retcode == 121 || retcode == 120 || retcode == 100)
+		{
+			// 需要认证
+			ec = error::make_error_code(error::poll_failed_need_login);
+		}else if(retcode == 103)
+		{
+			ec = error::make_error_code(error::poll_failed_need_login);
+		}else if (retcode == 110)
+		{
+			ec = error::make_error_code(error::poll_failed_user_quit);
+		}else if (retcode == 100006)
+		{
+			ec = error::make_error_code(error::poll_failed_need_refresh);
+		}else if (retcode){
+			ec = error::make_error_code(error::poll_failed_unknow_ret_code);
+		}
+
 		if (retcode)
 		{
 			return m_webqq->get_ioservice().post(
@@ -152,47 +133,32 @@ public:
 
 	void operator()(boost::system::error_code ec)
 	{
-		std::string poll_type;
- 		pt::wptree::value_type * result;
+		const poll_message * result;
 
 		BOOST_ASIO_CORO_REENTER(this)
 		{
-
-			m_iterator = m_jstree->get_child( L"result" ).begin();
-			m_iterator_end = m_jstree->get_child( L"result" ).end();
-
-			for( ; m_iterator != m_iterator_end; m_iterator ++ )
+			for( m_index = 0; m_index < m_response->result.size(); m_index ++ )
 			{
-				result = &(*m_iterator);
+				result = &m_response->result[m_index];
 
-				poll_type = avhttp::detail::wide_utf8( result->second.get<std::wstring>( L"poll_type" ) );
-
-				if (poll_type != "group_message")
-				{
-					js::write_json( std::wcout, *m_jstree );
-				}
-				else if( poll_type == "group_message" )
+				if( result->poll_type == "group_message" )
 				{
 					BOOST_ASIO_CORO_YIELD process_group_message(
-						m_webqq, result->second,
+						m_webqq, m_response, m_index,
 						*this
 					);
 				}
-				else if( poll_type == "sys_g_msg" )
+				else if( result->poll_type == "sys_g_msg" )
 				{
 					//群消息.
-					if( result->second.get<std::wstring>( L"value.type" ) == L"group_join" )
+					if( result->sys_type == "group_join" )
 					{
 						// 新人进来 !
 						// 检查一下新人.
 						// 这个是群号.
-						std::string groupnumber = avhttp::detail::wide_utf8(
-							result->second.get<std::wstring>(L"value.t_gcode")
-						);
+						std::string groupnumber = result->t_gcode;
 
-						std::string newuseruid = avhttp::detail::wide_utf8(
-							result->second.get<std::wstring>(L"value.new_member")
-						);
+						std::string newuseruid = result->new_member;
 
 						qqGroup_ptr group = m_webqq->get_Group_by_gid(groupnumber);
 
@@ -204,17 +170,19 @@ public:
 								groupnumber
 							)
 						);
-					}else if(result->second.get<std::wstring>( L"value.type" ) == L"group_leave")
+					}else if(result->sys_type == "group_leave")
 					{
 						// 旧人滚蛋.
 					}
-				} else if( poll_type == "buddylist_change" ) {
+				} else if( result->poll_type == "buddylist_change" ) {
 					//群列表变化了，reload列表.
-					js::write_json( std::wcout, result->second );
-				} else if( poll_type == "kick_message" ) {
-					js::write_json( std::wcout, result->second );
+					std::cout << result->raw << std::endl;
+				} else if( result->poll_type == "kick_message" ) {
+					std::cout << result->raw << std::endl;
 					//强制下线了，重登录.
 					ec = error::make_error_code(error::poll_failed_user_kicked_off);
+				} else {
+					std::cout << result->raw << std::endl;
 				}
 			}
 
@@ -231,8 +199,8 @@ private:
 	boost::shared_ptr<boost::asio::streambuf> m_buffer;
 
 	//
-	boost::shared_ptr<pt::wptree> m_jstree;
-	boost::property_tree::wptree::iterator m_iterator, m_iterator_end;
+	boost::shared_ptr<poll_response> m_response;
+	std::size_t m_index;
 };
 
 template<class Handler>
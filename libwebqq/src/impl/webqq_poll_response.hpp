@@ -0,0 +1,149 @@
+
+/*
+ * poll2 返回的 json 直接解码成下面这些结构, 不再经过 wptree.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "libwebqq/webqq.hpp"
+
+#include "json_reader.hpp"
+
+namespace webqq{
+namespace qqimpl{
+
+struct poll_message
+{
+	std::string poll_type;
+
+	// group_message
+	std::string from_uin;
+	std::string send_uin;
+	// face 是服务器给的表情编号, 还没有经过 facemap 转换.
+	// cface 只填了 name, file_id, key, server.
+	std::vector<qqMsg> content;
+
+	// sys_g_msg
+	std::string sys_type;
+	std::string t_gcode;
+	std::string new_member;
+
+	// 这条消息的 json 原文, 不处理的消息打印出来看看.
+	std::string raw;
+};
+
+struct poll_response
+{
+	int retcode;
+	// retcode 为 116 的时候更新 ptwebqq.
+	std::string p;
+	std::vector<poll_message> result;
+};
+
+namespace detail{
+
+static inline void decode_group_content(json::json_value content, std::vector<qqMsg> & out)
+{
+	for (json::json_value item = content.first_child(); item.valid(); item = item.next_sibling())
+	{
+		qqMsg msg;
+		msg.face = 0;
+
+		if (item.is_array())
+		{
+			json::json_value tag = item.first_child();
+			json::json_value value = item.last_child();
+
+			if (tag.equals("font"))
+			{
+				msg.type = qqMsg::LWQQ_MSG_FONT;
+				msg.font = value["name"].str();
+			}
+			else if (tag.equals("face"))
+			{
+				msg.type = qqMsg::LWQQ_MSG_FACE;
+				msg.face = value.to_int();
+			}
+			else if (tag.equals("cface"))
+			{
+				msg.type = qqMsg::LWQQ_MSG_CFACE;
+				msg.cface.file_id = value["file_id"].str();
+				msg.cface.name = value["name"].str();
+				msg.cface.key = value["key"].str();
+				msg.cface.server = value["server"].str();
+			}
+			else
+			{
+				continue;
+			}
+		}
+		else
+		{
+			//聊天字符串就在这里.
+			msg.type = qqMsg::LWQQ_MSG_TEXT;
+			msg.text = item.str();
+		}
+
+		out.push_back(msg);
+	}
+}
+
+} // namespace detail
+
+// 解析 poll2 的返回, json 格式错误或者没有 retcode 返回 false.
+static inline bool parse_poll_response(const char * begin, const char * end, poll_response & out)
+{
+	json::json_document doc;
+
+	if (!doc.parse(begin, end))
+		return false;
+
+	json::json_value root = doc.root();
+	json::json_value retcode = root["retcode"];
+
+	if (!retcode.valid())
+		return false;
+
+	out.retcode = retcode.to_int();
+	out.p = root["p"].str();
+	out.result.clear();
+
+	json::json_value result = root["result"];
+	out.result.reserve(result.size());
+
+	for (json::json_value item = result.first_child(); item.valid(); item = item.next_sibling())
+	{
+		out.result.push_back(poll_message());
+		poll_message & msg = out.result.back();
+		json::json_value value = item["value"];
+
+		msg.poll_type = item["poll_type"].str();
+
+		if (msg.poll_type == "group_message")
+		{
+			msg.from_uin = value["from_uin"].str();
+			msg.send_uin = value["send_uin"].str();
+			detail::decode_group_content(value["content"], msg.content);
+		}
+		else
+		{
+			if (msg.poll_type == "sys_g_msg")
+			{
+				msg.sys_type = value["type"].str();
+				msg.t_gcode = value["t_gcode"].str();
+				msg.new_member = value["new_member"].str();
+			}
+
+			// 对象节点的原文就是整个 {...}
+			msg.raw.assign(item.raw_begin(), item.raw_end());
+		}
+	}
+
+	return true;
+}
+
+} // namespace qqimpl
+} // namespace webqq
@@ -74,6 +74,8 @@ namespace po = boost::program_options;
 #include "input.hpp"
 #include "avbot_vc_feed_input.hpp"
 #include "rpc/server.hpp"
+#include "avbot_log_search.hpp"
+#include "avbot_log_writer.hpp"
 
 #include "extension/extension.hpp"
 #include "deCAPTCHA/decaptcha.hpp"
@@ -238,9 +240,9 @@ static void build_group(std::string chanelmapstring, avbot & mybot)
 	}
 }
 
-static std::string imgurlformater(avbot::av_message_tree qqmessage, std::string baseurl)
+static std::string imgurlformater(const webqq::qqMsgCface & qqcface, std::string baseurl)
 {
-	std::string cface = qqmessage.get<std::string>("name");
+	const std::string & cface = qqcface.name;
 
 	return avhttp::detail::escape_path(
 		boost::str(
@@ -252,7 +254,29 @@ static std::string imgurlformater(avbot::av_message_tree qqmessage, std::string
 	);
 }
 
-static void avbot_log(avbot::av_message_tree message, avbot & mybot, soci::session & db)
+// 日志写入数据库得到 rowid 之后, 再写 html 日志.
+static void avbot_log_html(std::string channel_name, std::string linemessage, avbot & mybot, long rowid)
+{
+	// 如果最好的办法就是遍历组里的所有QQ群，都记录一次.
+	avbot::av_chanels_t channelmap = mybot.get_channel_map(channel_name);
+
+	// 如果没有Q群，诶，只好，嘻嘻.
+	logfile.add_log(channel_name, linemessage, rowid);
+
+	BOOST_FOREACH(std::string roomname, channelmap)
+	{
+		if (roomname.substr(0, 3) == "qq:")
+		{
+			// 避免重复记录.
+			if (roomname.substr(3) != channel_name)
+			{
+				logfile.add_log(roomname.substr(3), linemessage, rowid);
+			}
+		}
+	}
+}
+
+static void avbot_log(const avbot_message & message, avbot & mybot, avlog_writer & dbwriter)
 {
 	std::string linemessage;
 
@@ -260,33 +284,33 @@ static void avbot_log(avbot::av_message_tree message, avbot & mybot, soci::sessi
 
 	curtime = avlog::current_time();
 
-	protocol = message.get<std::string>("protocol");
+	protocol = message.protocol;
 	// 首先是根据 nick 格式化
 	if ( protocol != "mail")
 	{
 		std::string textonly;
-		linemessage += message.get<std::string>("preamble", "");
+		linemessage += message.preamble;
 
-		BOOST_FOREACH(const avbot::av_message_tree::value_type & v, message.get_child("message"))
+		BOOST_FOREACH(const avbot_message_segment & v, message.segments)
 		{
-			if (v.first == "text")
+			if (v.type == avbot_message_segment::text_segment)
 			{
-				textonly += v.second.data();
-				linemessage += avlog::html_escape(v.second.data());
+				textonly += v.content;
+				linemessage += avlog::html_escape(v.content);
 			}
-			else if (v.first == "url")
+			else if (v.type == avbot_message_segment::url_segment)
 			{
 				linemessage += boost::str(
 					boost::format("<a href=\"%s\">%s</a>")
-					% v.second.data()
-					% v.second.data()
+					% v.content
+					% v.content
 				);
 			}
-			else if (v.first == "cface")
+			else if (v.type == avbot_message_segment::cface_segment)
 			{
 				if (mybot.fetch_img)
 				{
-					std::string cface = v.second.get<std::string>("name");
+					const std::string & cface = v.cface->name;
 					linemessage += boost::str(
 						boost::format("<img src=\"../images/%s/%s\" />")
 						% avbot::image_subdir_name(cface)
@@ -296,24 +320,24 @@ static void avbot_log(avbot::av_message_tree message, avbot & mybot, soci::sessi
 				else
 				{
 
-					std::string url = v.second.get<std::string>("gchatpicurl");
+					const std::string & url = v.cface->gchatpicurl;
 					linemessage += boost::str(
 						boost::format("\t\t<img src=\"%s\" />\r\n")
 						% url
 					);
 				}
 			}
-			else if (v.first == "img")
+			else if (v.type == avbot_message_segment::img_segment)
 			{
 				linemessage += boost::str(
 					boost::format("\t\t<img src=\"%s\" />\r\n")
-					% v.second.data()
+					% v.content
 				);
 			}
 		}
-		std::string channel_name = message.get<std::string>("channel", "");
+		std::string channel_name = message.channel;
 		if(protocol != "rpc")
-			nick = message.get<std::string>("who.nick", "");
+			nick = message.who.nick;
 
 		if (channel_name.empty())
 		{
@@ -322,40 +346,17 @@ static void avbot_log(avbot::av_message_tree message, avbot & mybot, soci::sessi
 		}
 		else
 		{
-			long rowid = 0;
-			{
-			// log to database
-			db << "insert into avlog (date, protocol, channel, nick, message)"
-				" values (:date, :protocol, :channel, :nick, :message)"
-				, soci::use(curtime)
-				, soci::use(protocol)
-				, soci::use(channel_name)
-				, soci::use(nick)
-				, soci::use(textonly);
-			}
-
-			if (db.get_backend_name() == "sqlite3")
-			rowid =  sqlite_api::sqlite3_last_insert_rowid(
-				dynamic_cast<soci::sqlite3_session_backend*>(db.get_backend())->conn_
+			// log to database, 批量写入, 拿到 rowid 以后再写 html 日志.
+			avlog_row row;
+			row.date = curtime;
+			row.protocol = protocol;
+			row.channel = channel_name;
+			row.nick = nick;
+			row.message = textonly;
+
+			dbwriter.async_insert(row,
+				boost::bind(&avbot_log_html, channel_name, linemessage, boost::ref(mybot), _1)
 			);
-
-			// 如果最好的办法就是遍历组里的所有QQ群，都记录一次.
-			avbot::av_chanels_t channelmap = mybot.get_channel_map(channel_name);
-
-			// 如果没有Q群，诶，只好，嘻嘻.
-			logfile.add_log(channel_name, linemessage, rowid);
-
-			BOOST_FOREACH(std::string roomname, channelmap)
-			{
-				if (roomname.substr(0, 3) == "qq:")
-				{
-					// 避免重复记录.
-					if (roomname.substr(3) != channel_name)
-					{
-						logfile.add_log(roomname.substr(3), linemessage, rowid);
-					}
-				}
-			}
 		}
 	}
 	else
@@ -377,6 +378,11 @@ static void init_database(soci::session & db)
 {
 	db.open(soci::sqlite3, "avlog.db");
 
+	// WAL 模式下, 搜索线程的读连接和写入互不阻塞.
+	// WAL 模式下 synchronous=NORMAL 也不会损坏数据库, 只在 checkpoint 的时候 fsync.
+	db << "pragma journal_mode=WAL";
+	db << "pragma synchronous=NORMAL";
+
 	db <<
 	"create table if not exists avlog ("
 		"`date` TEXT not null, "
@@ -385,35 +391,30 @@ static void init_database(soci::session & db)
 		"`nick` TEXT not null default \"\", "
 		"`message` TEXT not null default \" \""
 	");";
+
+	avlog_init_index(db);
 }
 
-static void my_on_bot_command(avbot::av_message_tree message, avbot & mybot)
+static void my_on_bot_command(const avbot_message & message, avbot & mybot)
 {
 	try
 	{
-		std::string textmessage;
-
-		try
+		if (!message.newbee.empty())
 		{
-			textmessage = message.get<std::string>("newbee");
-			// 如果没有发生异常, 那就是新人入群消息了, 嘻嘻.
+			// 新人入群消息了, 嘻嘻.
 			// 格式化为 .qqbot newbee XXX, 哼!
-			std::string nick = message.get<std::string>("who.name");
-			textmessage = boost::str(boost::format(".qqbot newbee %s") % nick);
-			message.put("message.text", textmessage);
-			message.put("op", 1);
+			avbot_message newbee = message;
+			newbee.segments.clear();
+			newbee.add_text(boost::str(boost::format(".qqbot newbee %s") % message.who.name));
+			newbee.op = true;
 
 			boost::delayedcallsec(
 					mybot.get_io_service(),
 					6,
-					boost::bind(on_bot_command, message, boost::ref(mybot))
+					boost::bind(on_bot_command, newbee, boost::ref(mybot))
 			);
 			return;
 		}
-		catch (const boost::property_tree::ptree_bad_path &)
-		{
-			textmessage = message.get<std::string>("message.text");
-		}
 
 		on_bot_command(message, mybot);
 	}
@@ -445,6 +446,8 @@ int main(int argc, char * argv[])
 
 	std::string qqnumber, qqpwd;
 	std::string ircnick, ircroom, ircroom_pass, ircpwd, ircserver;
+	unsigned ircburst;
+	int ircinterval;
 	std::string xmppuser, xmppserver, xmpppwd, xmpproom, xmppnick;
 	std::string cfgfile;
 	std::string logdir;
@@ -507,6 +510,10 @@ int main(int argc, char * argv[])
 		"irc passwd for room")
 	("ircserver", po::value<std::string>(&ircserver)->default_value("irc.freenode.net:6667"),
 		"irc server, default to freenode")
+	("ircburst", po::value<unsigned>(&ircburst)->default_value(10),
+		"max lines sent to irc server in a burst")
+	("ircinterval", po::value<int>(&ircinterval)->default_value(500),
+		"milliseconds per line once the irc burst is used up")
 
 	("xmppuser", po::value<std::string>(&xmppuser),
 		"id for XMPP,  eg: (microcaicai@gmail.com)")
@@ -686,6 +693,13 @@ rungui:
 
 	init_database(avlogdb);
 
+	// 搜索使用独立的只读连接, 在自己的线程里跑.
+	avlog_search_executor avlog_searcher(io_service, "avlog.db");
+	// 写入也在自己的线程里, 成批提交.
+	avlog_writer avlog_dbwriter(io_service, avlogdb);
+	// html 日志缓冲写入, 定时刷新.
+	logfile.start(io_service);
+
 	decaptcha::deCAPTCHA decaptcha_agent(io_service);
 
 	avbot_vc_feed_input vcinput(io_service);
@@ -748,14 +762,8 @@ rungui:
 	mybot.preamble_qq_fmt = preamble_qq_fmt;
 	mybot.preamble_xmpp_fmt = preamble_xmpp_fmt;
 
-	mybot.signal_new_channel.connect(
-		boost::bind(
-			new_channel_set_extension,
-			boost::ref(io_service),
-			boost::ref(mybot),
-			_1
-		)
-	);
+	// 每个频道的扩展, 在 io_service 之前析构.
+	avbot_extensions extensions(io_service, mybot);
 
 	mybot.set_qq_account(
 		qqnumber, qqpwd,
@@ -764,7 +772,10 @@ rungui:
 	);
 
 	if (!ircnick.empty())
+	{
 		mybot.set_irc_account(ircnick, ircpwd, ircserver);
+		mybot.get_irc()->set_flood_control(ircburst, ircinterval);
+	}
 
 	if (!xmppuser.empty())
 		mybot.set_xmpp_account(xmppuser, xmpppwd, xmppnick, xmppserver);
@@ -775,7 +786,7 @@ rungui:
 	build_group(chanelmap, mybot);
 	// 记录到日志.
 	mybot.on_message.connect(
-		boost::bind(avbot_log, _1, boost::ref(mybot), boost::ref(avlogdb))
+		boost::bind(avbot_log, _1, boost::ref(mybot), boost::ref(avlog_dbwriter))
 	);
 	// 开启 bot 控制.
 	mybot.on_message.connect(
@@ -814,7 +825,7 @@ rungui:
 
 	if (rpcport > 0)
 	{
-		if (!avbot_start_rpc(io_service, rpcport, mybot, avlogdb))
+		if (!avbot_start_rpc(io_service, rpcport, mybot, avlog_searcher, avlog_dbwriter, extensions))
 		{
 			AVLOG_WARN <<  "bind to port " <<  rpcport <<  " failed!";
 			AVLOG_WARN <<  "Did you happened to already run an avbot? ";
@@ -845,7 +856,7 @@ rungui:
 	uint64_t watchdog_usec;
 	if(sd_watchdog_enabled(1, &watchdog_usec))
 	{
-		mybot.on_message.connect([](avbot::av_message_tree)
+		mybot.on_message.connect([](const avbot_message &)
 		{
 			sd_notify(0, "WATCHDOG=1");
 		});
@@ -855,5 +866,6 @@ rungui:
 #endif
 
 	avloop_run_gui(io_service);
+	logfile.stop();
 	return 0;
 }
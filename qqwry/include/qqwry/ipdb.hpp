@@ -613,6 +613,18 @@ public:
 		return retips;
 	}
 
+	// 按索引顺序遍历所有记录, visitor(start, end, location) 里的 ip 是主机字节序, 地址是文件里的 GBK 编码.
+	template<class Visitor>
+	void ForEachRecord(Visitor visitor)
+	{
+		for (size_t i = m_first_record; i <= m_last_record && i + 7 <= m_filesize; i += 7)
+		{
+			detail::RECORD_INDEX* pindex = (detail::RECORD_INDEX*)(m_file + i);
+
+			visitor(detail::to_hostending(pindex->ip), GetDWORD(pindex->offset), GetIPLocation(m_file + pindex->offset + 4));
+		}
+	}
+
 public:
 	ipdb(const char*	memptr, size_t len)
 		: m_file(memptr)
@@ -702,9 +714,12 @@ private:
 	ipdb& operator = (const ipdb&);
 };
 
-template<class UncompressFunction>
-std::string decodeQQWryDat(std::string copywrite_rar, std::string qqwry_rar, UncompressFunction uncompressfunc)
+// 就地解密 qqwry.rar 的前 0x200 字节, 解密后就是 zlib 格式的数据.
+static inline bool decryptQQWryRar(const std::string& copywrite_rar, std::string& qqwry_rar)
 {
+	if (copywrite_rar.size() < sizeof(detail::copywritetag) || qqwry_rar.size() < 0x200)
+		return false;
+
 	uint32_t key = QQWry::detail::to_hostending(reinterpret_cast<const detail::copywritetag*>(copywrite_rar.data())->key);
 	// 解密
 	for (int i = 0; i<0x200; i++)
@@ -716,6 +731,13 @@ std::string decodeQQWryDat(std::string copywrite_rar, std::string qqwry_rar, Unc
 
 		qqwry_rar[i] = v;
 	}
+	return true;
+}
+
+template<class UncompressFunction>
+std::string decodeQQWryDat(std::string copywrite_rar, std::string qqwry_rar, UncompressFunction uncompressfunc)
+{
+	decryptQQWryRar(copywrite_rar, qqwry_rar);
 
 	std::string deflated;
 	deflated.resize(20 * 1024 * 1024);
@@ -0,0 +1,437 @@
+
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+#include <cstring>
+#include <cstdlib>
+
+#include <boost/shared_ptr.hpp>
+
+#include "ipdb.hpp"
+
+namespace QQWry{
+namespace detail{
+
+// 按 cache line 对齐的定长数组, 查找时每次比较尽量只碰一条 cache line.
+template<class T>
+class aligned_array
+{
+	enum { alignment = 64 };
+
+public:
+	aligned_array()
+		: m_raw(0)
+		, m_data(0)
+		, m_size(0)
+	{
+	}
+
+	~aligned_array()
+	{
+		std::free(m_raw);
+	}
+
+	void resize(std::size_t size)
+	{
+		std::free(m_raw);
+		m_raw = std::malloc(size * sizeof(T) + alignment);
+		if (!m_raw)
+			throw std::bad_alloc();
+		std::size_t addr = reinterpret_cast<std::size_t>(m_raw);
+		m_data = reinterpret_cast<T*>((addr + alignment - 1) & ~std::size_t(alignment - 1));
+		m_size = size;
+	}
+
+	T& operator[](std::size_t i) { return m_data[i]; }
+	const T& operator[](std::size_t i) const { return m_data[i]; }
+	const T* data() const { return m_data; }
+	std::size_t size() const { return m_size; }
+
+private:
+	aligned_array(const aligned_array&);
+	aligned_array& operator = (const aligned_array&);
+
+	void* m_raw;
+	T* m_data;
+	std::size_t m_size;
+};
+
+} // namespace detail
+
+// 把 QQWry.Dat 展开成按起始 ip 排序的平坦数组, 查询不再走文件里的 7 字节索引和重定向.
+// 起始 ip, 结束 ip, 地址编号分开存放, 相同的地址只存一份, 载入的时候就转换好编码.
+class iptable
+{
+	struct record
+	{
+		uint32_t start;
+		uint32_t end;
+		uint32_t location;
+
+		bool operator < (const record& other) const
+		{
+			return start < other.start;
+		}
+	};
+
+public:
+	// 一次批量查询里交错进行的查找个数, 让几次访存互相重叠.
+	enum { batch_width = 8 };
+
+	class region_query;
+
+	explicit iptable(ipdb& db)
+	{
+		std::vector<record> records;
+		std::map<std::pair<std::string, std::string>, uint32_t> interned;
+		std::map<std::string, uint32_t> countries;
+
+		db.ForEachRecord(record_collector(records, interned, countries, m_locations, m_location_country));
+		m_country_count = countries.size();
+
+		std::sort(records.begin(), records.end());
+
+		m_start.resize(records.size());
+		m_end.resize(records.size());
+		m_location.resize(records.size());
+
+		for (std::size_t i = 0; i < records.size(); i++)
+		{
+			m_start[i] = records[i].start;
+			m_end[i] = records[i].end;
+			m_location[i] = records[i].location;
+		}
+
+		// 反向索引: 按地址编号分组的记录下标, m_location_ranges[m_location_offsets[l]] 开始的
+		// m_location_offsets[l+1] - m_location_offsets[l] 个记录属于地址 l, 组内按 ip 排序.
+		m_location_offsets.assign(m_locations.size() + 1, 0);
+
+		for (std::size_t i = 0; i < records.size(); i++)
+			m_location_offsets[records[i].location + 1]++;
+
+		for (std::size_t l = 0; l < m_locations.size(); l++)
+			m_location_offsets[l + 1] += m_location_offsets[l];
+
+		std::vector<uint32_t> fill(m_location_offsets.begin(), m_location_offsets.end() - 1);
+		m_location_ranges.resize(records.size());
+
+		for (std::size_t i = 0; i < records.size(); i++)
+			m_location_ranges[fill[records[i].location]++] = i;
+	}
+
+	std::size_t size() const
+	{
+		return m_start.size();
+	}
+
+	// 没有找到返回 0.
+	const IPLocation* lookup(in_addr ip) const
+	{
+		if (m_start.size() == 0)
+			return 0;
+
+		uint32_t hostip = ntohl(ip.s_addr);
+		const uint32_t* base = m_start.data();
+		std::size_t n = m_start.size();
+
+		// 无分支的二分查找, 找到最后一个 start <= ip 的区间.
+		while (n > 1)
+		{
+			std::size_t half = n / 2;
+			base = (base[half] <= hostip) ? base + half : base;
+			n -= half;
+		}
+
+		return check(base - m_start.data(), hostip);
+	}
+
+	// 和 ipdb::GetIPLocation 一样, 找不到抛异常.
+	IPLocation GetIPLocation(in_addr ip) const
+	{
+		const IPLocation* l = lookup(ip);
+		if (!l)
+			throw std::runtime_error("IP Record Not Found");
+		return *l;
+	}
+
+	// 查询 count 个 ip, 结果写到 out, 没找到的为 0.
+	// 所有查找的步数都一样, 所以可以一步一步交错着做.
+	void lookup_batch(const in_addr* ips, std::size_t count, const IPLocation** out) const
+	{
+		if (m_start.size() == 0)
+		{
+			std::fill(out, out + count, static_cast<const IPLocation*>(0));
+			return;
+		}
+
+		for (std::size_t i = 0; i < count; i += batch_width)
+		{
+			std::size_t width = std::min<std::size_t>(batch_width, count - i);
+			uint32_t hostip[batch_width];
+			const uint32_t* base[batch_width];
+
+			for (std::size_t j = 0; j < width; j++)
+			{
+				hostip[j] = ntohl(ips[i + j].s_addr);
+				base[j] = m_start.data();
+			}
+
+			std::size_t n = m_start.size();
+
+			while (n > 1)
+			{
+				std::size_t half = n / 2;
+
+				for (std::size_t j = 0; j < width; j++)
+					base[j] = (base[j][half] <= hostip[j]) ? base[j] + half : base[j];
+
+				n -= half;
+			}
+
+			for (std::size_t j = 0; j < width; j++)
+				out[i + j] = check(base[j] - m_start.data(), hostip[j]);
+		}
+	}
+
+	// 和 ipdb::GetIPs 一样的通配符 (* 和 ?), 但是不读文件, 只在去重后的地址上匹配,
+	// 匹配到的区间用 region_query::next 一个一个取出来.
+	// 表达式的编码和 IPLocation 一样, 非 windows 平台上是 UTF-8.
+	region_query GetIPs(const char* exp_country, const char* exp_area) const;
+
+private:
+	const IPLocation* check(std::size_t i, uint32_t hostip) const
+	{
+		if (hostip < m_start[i] || hostip > m_end[i])
+			return 0;
+		return &m_locations[m_location[i]];
+	}
+
+	struct record_collector
+	{
+		record_collector(std::vector<record>& records,
+			std::map<std::pair<std::string, std::string>, uint32_t>& interned,
+			std::map<std::string, uint32_t>& countries,
+			std::vector<IPLocation>& locations,
+			std::vector<uint32_t>& location_country)
+			: m_records(records)
+			, m_interned(interned)
+			, m_countries(countries)
+			, m_locations(locations)
+			, m_location_country(location_country)
+		{
+		}
+
+		void operator()(uint32_t start, uint32_t end, const IPLocation& gbk) const
+		{
+			std::pair<std::string, std::string> key(gbk.country, gbk.area);
+			std::map<std::pair<std::string, std::string>, uint32_t>::iterator it = m_interned.find(key);
+
+			if (it == m_interned.end())
+			{
+				IPLocation l;
+#ifndef _WIN32
+				detail::code_convert(l.country, sizeof(l.country), (char*) key.first.c_str(), key.first.size());
+				detail::code_convert(l.area, sizeof(l.area), (char*) key.second.c_str(), key.second.size());
+#else
+				l = gbk;
+#endif
+				it = m_interned.insert(std::make_pair(key, static_cast<uint32_t>(m_locations.size()))).first;
+				m_locations.push_back(l);
+
+				std::map<std::string, uint32_t>::iterator country = m_countries.insert(
+					std::make_pair(key.first, static_cast<uint32_t>(m_countries.size()))).first;
+				m_location_country.push_back(country->second);
+			}
+
+			record r;
+			r.start = start;
+			r.end = end;
+			r.location = it->second;
+			m_records.push_back(r);
+		}
+
+		std::vector<record>& m_records;
+		std::map<std::pair<std::string, std::string>, uint32_t>& m_interned;
+		std::map<std::string, uint32_t>& m_countries;
+		std::vector<IPLocation>& m_locations;
+		std::vector<uint32_t>& m_location_country;
+	};
+
+private:
+	detail::aligned_array<uint32_t> m_start;
+	detail::aligned_array<uint32_t> m_end;
+	detail::aligned_array<uint32_t> m_location;
+	std::vector<IPLocation> m_locations;
+
+	// 每个地址的国家编号, 同一个国家只需要匹配一次.
+	std::vector<uint32_t> m_location_country;
+	std::size_t m_country_count;
+
+	std::vector<uint32_t> m_location_offsets;
+	std::vector<uint32_t> m_location_ranges;
+};
+
+namespace detail{
+
+// 通配符表达式, 常见的 "*", 不带通配符的, 只在末尾带 * 的 直接比较, 其他的交给 match_exp.
+// 和 ipdb::GetIPs 一样, match_exp 在 GBK 上匹配, ? 匹配一个字节, 一个汉字要用 ?? .
+// 空的表达式只匹配空的字段.
+class region_pattern
+{
+	enum kind_type { any, exact, prefix, wildcard };
+
+public:
+	explicit region_pattern(const char* exp)
+		: m_exp(exp)
+	{
+		std::string::size_type wild = m_exp.find_first_of("*?");
+
+		if (!m_exp.empty() && m_exp.find_first_not_of('*') == std::string::npos)
+			m_kind = any;
+		else if (wild == std::string::npos)
+			m_kind = exact;
+		else if (wild == m_exp.size() - 1 && m_exp[wild] == '*')
+		{
+			m_kind = prefix;
+			m_exp.resize(wild);
+		}
+		else
+		{
+			m_kind = wildcard;
+#ifndef _WIN32
+			iconv_t cd = iconv_open("GBK", "UTF-8");
+			if (cd != (iconv_t) -1)
+				m_iconv.reset(cd, iconv_close);
+			m_exp = to_gbk(exp);
+#endif
+		}
+	}
+
+	bool match(const char* str) const
+	{
+		switch (m_kind)
+		{
+		case any:
+			return true;
+		case exact:
+			return m_exp == str;
+		case prefix:
+			return std::strncmp(str, m_exp.c_str(), m_exp.size()) == 0;
+		default:
+#ifndef _WIN32
+			return match_exp(const_cast<char*>(to_gbk(str).c_str()), const_cast<char*>(m_exp.c_str()));
+#else
+			return match_exp(const_cast<char*>(str), const_cast<char*>(m_exp.c_str()));
+#endif
+		}
+	}
+
+private:
+#ifndef _WIN32
+	// 每个地址都要转换, 所以不用 utf8_gbk, 一直用同一个 iconv_t.
+	std::string to_gbk(const char* utf8) const
+	{
+		if (!m_iconv)
+			return utf8;
+
+		char gbk[256];
+		char* in = const_cast<char*>(utf8);
+		char* out = gbk;
+		std::size_t inlen = std::strlen(utf8);
+		std::size_t outlen = sizeof(gbk);
+
+		iconv(m_iconv.get(), &in, &inlen, &out, &outlen);
+		return std::string(gbk, out - gbk);
+	}
+#endif
+
+	kind_type m_kind;
+	std::string m_exp;
+#ifndef _WIN32
+	boost::shared_ptr<void> m_iconv;
+#endif
+};
+
+} // namespace detail
+
+// GetIPs 的结果, 边匹配边取, 不会一次生成所有的区间.
+// 按地址分组返回, 同一个地址的区间按 ip 排序. 使用期间 iptable 必须一直存在.
+class iptable::region_query
+{
+public:
+	region_query(const iptable& table, const char* exp_country, const char* exp_area)
+		: m_table(&table)
+		, m_country(exp_country)
+		, m_area(exp_area)
+		, m_country_matched(table.m_country_count, unknown)
+		, m_location(0)
+		, m_range(0)
+		, m_range_end(0)
+	{
+	}
+
+	// 取出下一个匹配的区间, 没有了返回 false.
+	bool next(IP_regon& out)
+	{
+		while (m_range == m_range_end)
+		{
+			if (!next_location())
+				return false;
+		}
+
+		uint32_t i = m_table->m_location_ranges[m_range++];
+
+		out.start.s_addr = htonl(m_table->m_start[i]);
+		out.end.s_addr = htonl(m_table->m_end[i]);
+		out.location = m_table->m_locations[m_table->m_location[i]];
+		return true;
+	}
+
+private:
+	enum { unknown, matched, not_matched };
+
+	// 找下一个匹配的地址, 把 m_range 指向它的区间.
+	bool next_location()
+	{
+		while (m_location < m_table->m_locations.size())
+		{
+			std::size_t l = m_location++;
+			const IPLocation& location = m_table->m_locations[l];
+			char& country = m_country_matched[m_table->m_location_country[l]];
+
+			if (country == unknown)
+				country = m_country.match(location.country) ? matched : not_matched;
+
+			if (country == matched && m_area.match(location.area))
+			{
+				m_range = m_table->m_location_offsets[l];
+				m_range_end = m_table->m_location_offsets[l + 1];
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	const iptable* m_table;
+	detail::region_pattern m_country;
+	detail::region_pattern m_area;
+	std::vector<char> m_country_matched;
+
+	std::size_t m_location;
+	std::size_t m_range;
+	std::size_t m_range_end;
+};
+
+inline iptable::region_query iptable::GetIPs(const char* exp_country, const char* exp_area) const
+{
+	return region_query(*this, exp_country, exp_area);
+}
+
+} // namespace QQWry
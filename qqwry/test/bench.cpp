@@ -0,0 +1,194 @@
+/*
+ * bench.cpp
+ *
+ * 比较 ipdb 和 iptable 的查询速度.
+ * 用法: qqwry_bench [QQWry.Dat [国家 地区]]
+ * 不给文件就在内存里生成一个假的数据库.
+ */
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include "qqwry/ipdb.hpp"
+#include "qqwry/iptable.hpp"
+
+static void put_uint32(std::string& out, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		out += static_cast<char>((v >> (i * 8)) & 0xff);
+}
+
+static void put_uint24(std::string& out, uint32_t v)
+{
+	for (int i = 0; i < 3; i++)
+		out += static_cast<char>((v >> (i * 8)) & 0xff);
+}
+
+// 生成一个和 QQWry.Dat 格式一样的数据库, count 个连续的区间.
+static std::string make_fake_qqwry(std::size_t count)
+{
+	std::string records;
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> starts;
+
+	uint32_t step = 0xffffffffu / count;
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		uint32_t start = i * step;
+		uint32_t end = (i + 1 == count) ? 0xffffffffu : start + step - 1;
+
+		char country[32], area[32];
+		std::sprintf(country, "country%u", unsigned(i % 300));
+		std::sprintf(area, "area%u", unsigned(i % 5000));
+
+		offsets.push_back(8 + records.size());
+		starts.push_back(start);
+
+		put_uint32(records, end);
+		records += country;
+		records += '\0';
+		records += area;
+		records += '\0';
+	}
+
+	std::string file;
+	uint32_t first_record = 8 + records.size();
+	put_uint32(file, first_record);
+	put_uint32(file, first_record + (count - 1) * 7);
+	file += records;
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		put_uint32(file, starts[i]);
+		put_uint24(file, offsets[i]);
+	}
+
+	return file;
+}
+
+template<class F>
+static double measure(F f)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+	std::string content;
+
+	if (argc > 1)
+	{
+		std::ifstream file(argv[1], std::ios::binary);
+		content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		if (content.size() < 8)
+		{
+			std::cerr << "can not read " << argv[1] << std::endl;
+			return 1;
+		}
+	}
+	else
+	{
+		content = make_fake_qqwry(500000);
+	}
+
+	QQWry::ipdb db(content.data(), content.size());
+
+	QQWry::iptable* table = 0;
+	double build_ms = measure([&]{ table = new QQWry::iptable(db); });
+
+	std::cout << table->size() << " records, table built in " << build_ms << " ms" << std::endl;
+
+	const std::size_t queries = 1000000;
+	std::vector<in_addr> ips(queries);
+	std::mt19937 rng(42);
+
+	for (std::size_t i = 0; i < queries; i++)
+		ips[i].s_addr = htonl(rng());
+
+	std::size_t found_ipdb = 0, found_table = 0, found_batch = 0, mismatch = 0;
+
+	double ipdb_ms = measure([&]{
+		for (std::size_t i = 0; i < queries; i++)
+		{
+			try
+			{
+				db.GetIPLocation(ips[i]);
+				found_ipdb++;
+			}
+			catch (const std::runtime_error&)
+			{
+			}
+		}
+	});
+
+	std::vector<const QQWry::IPLocation*> results(queries);
+
+	double table_ms = measure([&]{
+		for (std::size_t i = 0; i < queries; i++)
+		{
+			results[i] = table->lookup(ips[i]);
+			found_table += results[i] != 0;
+		}
+	});
+
+	std::vector<const QQWry::IPLocation*> batch_results(queries);
+
+	double batch_ms = measure([&]{
+		table->lookup_batch(&ips[0], queries, &batch_results[0]);
+	});
+
+	for (std::size_t i = 0; i < queries; i++)
+	{
+		found_batch += batch_results[i] != 0;
+		mismatch += batch_results[i] != results[i];
+	}
+
+	std::cout << "ipdb::GetIPLocation  " << ipdb_ms << " ms, " << found_ipdb << " found" << std::endl;
+	std::cout << "iptable::lookup      " << table_ms << " ms, " << found_table << " found" << std::endl;
+	std::cout << "iptable::lookup_batch " << batch_ms << " ms, " << found_batch << " found" << std::endl;
+
+	if (mismatch)
+	{
+		std::cerr << mismatch << " batch results differ from lookup" << std::endl;
+		return 1;
+	}
+
+	// 按地区反查 ip 段
+	const char* exp_country = argc > 3 ? argv[2] : "country7*";
+	const char* exp_area = argc > 3 ? argv[3] : "*";
+	std::size_t regions_ipdb = 0, regions_table = 0;
+
+	double getips_ms = measure([&]{
+		regions_ipdb = db.GetIPs(exp_country, exp_area).size();
+	});
+
+	double query_ms = measure([&]{
+		QQWry::iptable::region_query query = table->GetIPs(exp_country, exp_area);
+		QQWry::IP_regon regon;
+
+		while (query.next(regon))
+			regions_table++;
+	});
+
+	std::cout << "ipdb::GetIPs         " << getips_ms << " ms, " << regions_ipdb << " ranges" << std::endl;
+	std::cout << "iptable::GetIPs      " << query_ms << " ms, " << regions_table << " ranges" << std::endl;
+
+	delete table;
+	return 0;
+}
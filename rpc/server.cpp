@@ -23,6 +23,8 @@
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string.hpp>
 #include <boost/signals2.hpp>
 #include <boost/property_tree/ptree.hpp>
 namespace pt = boost::property_tree;
@@ -33,17 +35,16 @@ namespace js = boost::property_tree::json_parser;
 #include <boost/async_coro_queue.hpp>
 
 #include <avhttp/detail/parsers.hpp>
+#include <avhttp/detail/escape_string.hpp>
 
 #include "boost/avloop.hpp"
 #include "boost/acceptor_server.hpp"
 
-#include <soci-sqlite3.h>
-#include <boost-optional.h>
-#include <boost-tuple.h>
-#include <boost-gregorian-date.h>
-
 #include "rpc/server.hpp"
 #include "avhttpd.hpp"
+#include "avbot_log_search.hpp"
+#include "avbot_log_writer.hpp"
+#include "extension/extension.hpp"
 
 // avbot_rpc_server 由 acceptor_server 这个辅助类调用
 // 为其构造函数传入一个 m_socket, 是 shared_ptr 的.
@@ -52,23 +53,23 @@ class avbot_rpc_server
 	, public boost::enable_shared_from_this<avbot_rpc_server>
 {
 public:
-	typedef boost::signals2::signal <
-	void( boost::property_tree::ptree )
-	> on_message_signal_type;
+	typedef avbot::on_message_type on_message_signal_type;
 
 	on_message_signal_type &broadcast_message;
 
 	typedef boost::asio::ip::tcp Protocol;
 	typedef boost::asio::basic_stream_socket<Protocol> socket_type;
 
-	template<typename T>
 	avbot_rpc_server( boost::shared_ptr<socket_type> _socket,
-		on_message_signal_type & on_message, T do_search_func)
+		on_message_signal_type & on_message, avlog_search_executor & searcher,
+		avlog_writer & dbwriter, avbot_extensions & extensions)
 		: m_socket( _socket )
 		, m_streambuf( new boost::asio::streambuf )
 		, m_responses(boost::ref(_socket->get_io_service()), 20)
 		, broadcast_message(on_message)
-		, do_search(do_search_func)
+		, m_searcher(searcher)
+		, m_dbwriter(dbwriter)
+		, m_extensions(extensions)
 	{
 	}
 
@@ -88,8 +89,12 @@ private:
 	void client_loop(boost::system::error_code ec, std::size_t bytestransfered);
 
 	// signal 的回调到这里
-	void callback_message(const boost::property_tree::ptree & jsonmessage );
+	void callback_message(const avbot_message & message);
 	void done_search(boost::system::error_code ec, boost::property_tree::ptree);
+	void write_json_response(const boost::property_tree::ptree &);
+	boost::property_tree::ptree status();
+	// 等待搜索结果的时候客户端断开了, 就取消搜索.
+	void check_client_gone(boost::system::error_code ec);
 private:
 	boost::shared_ptr<socket_type> m_socket;
 
@@ -104,17 +109,77 @@ private:
 		>
 	> m_responses;
 
-	boost::function<void(
-		std::string c,
-		std::string q,
-		std::string date,
-		boost::function<void (boost::system::error_code, pt::ptree)> cb
-	)> do_search;
+	avlog_search_executor & m_searcher;
+	avlog_search_executor::search_id m_search;
+	avlog_writer & m_dbwriter;
+	avbot_extensions & m_extensions;
 
 	int process_post( std::size_t bytestransfered );
 };
 
 
+/**
+ * 解析 /search?channel=xxx&q=xxx&date=xxx 形式的搜索请求.
+ * channel 和 q 是必须的, 另外还支持
+ *  date=YYYY-MM-DD 只查找这一天, from= 和 to= 指定日期范围,
+ *  offset= 和 limit= 分页.
+ */
+static bool parse_search_request(const std::string & uri, avlog_search_request & request)
+{
+	if (uri.compare(0, 8, "/search?") != 0)
+		return false;
+
+	std::string querystring = uri.substr(8);
+	std::vector<std::string> params;
+	boost::split(params, querystring, boost::is_any_of("&"));
+
+	bool has_channel = false, has_q = false;
+
+	BOOST_FOREACH(const std::string & param, params)
+	{
+		std::string::size_type eq = param.find('=');
+		if (eq == std::string::npos)
+			continue;
+
+		std::string key = param.substr(0, eq);
+		std::string value;
+		avhttp::detail::unescape_path(param.substr(eq + 1), value);
+
+		try
+		{
+			if (key == "channel")
+			{
+				request.channel = value;
+				has_channel = true;
+			}
+			else if (key == "q")
+			{
+				request.q = value;
+				has_q = true;
+			}
+			else if (key == "date" && !value.empty())
+			{
+				request.date_from = value;
+				request.date_to = value + " 23:59:59.999999";
+			}
+			else if (key == "from")
+				request.date_from = value;
+			else if (key == "to")
+				request.date_to = value;
+			else if (key == "offset")
+				request.offset = boost::lexical_cast<int>(value);
+			else if (key == "limit")
+				request.limit = boost::lexical_cast<int>(value);
+		}
+		catch (const boost::bad_lexical_cast &)
+		{
+			return false;
+		}
+	}
+
+	return has_channel && has_q;
+}
+
 /**
  * avbot rpc 接受的 JSON 格式为
  *
@@ -138,7 +203,7 @@ int avbot_rpc_server::process_post( std::size_t bytes_transfered )
 	{
 		// 读取 json
 		js::read_json( jsonpostdata, msg );
-		broadcast_message( msg );
+		broadcast_message( avbot_message::from_ptree(msg) );
 	}
 	catch( const pt::ptree_error &err )
 	{
@@ -175,7 +240,50 @@ void avbot_rpc_server::on_pop(boost::shared_ptr<boost::asio::streambuf> v)
 	);
 }
 
+void avbot_rpc_server::check_client_gone(boost::system::error_code ec)
+{
+	if (ec == boost::asio::error::operation_aborted)
+		return;
+
+	// 可读但是没有数据, 说明对方已经关闭连接.
+	boost::system::error_code ignore_ec;
+	if (ec || m_socket->available(ignore_ec) == 0)
+	{
+		m_searcher.cancel(m_search);
+	}
+}
+
 void avbot_rpc_server::done_search(boost::system::error_code ec, boost::property_tree::ptree jsonout)
+{
+	m_search.reset();
+
+	// 取消 check_client_gone 的等待.
+	boost::system::error_code ignore_ec;
+	m_socket->cancel(ignore_ec);
+
+	if (ec == boost::asio::error::operation_aborted)
+	{
+		// 客户端已经走了.
+		return;
+	}
+	else if (ec)
+	{
+		// 只有排队的搜索太多才是 503, 客户端可以稍后重试.
+		// 数据库出错之类的重试也没用, 返回 500.
+		avhttpd::async_write_response(
+			*m_socket,
+			ec == boost::system::errc::resource_unavailable_try_again
+				? avhttpd::errc::service_unavailable : avhttpd::errc::internal_server_error,
+			boost::bind(&avbot_rpc_server::get_response_sended, shared_from_this(),
+				boost::shared_ptr<boost::asio::streambuf>(), _1, 0)
+		);
+		return;
+	}
+
+	write_json_response(jsonout);
+}
+
+void avbot_rpc_server::write_json_response(const boost::property_tree::ptree & jsonout)
 {
 	boost::shared_ptr<boost::asio::streambuf> v = boost::make_shared<boost::asio::streambuf>();
 	std::ostream outstream(v.get());
@@ -197,10 +305,19 @@ void avbot_rpc_server::done_search(boost::system::error_code ec, boost::property
 	);
 }
 
+boost::property_tree::ptree avbot_rpc_server::status()
+{
+	boost::property_tree::ptree out;
+	out.put_child("avlog_writer", m_dbwriter.status());
+	out.put_child("extension", m_extensions.status());
+	return out;
+}
+
 // 数据操作跑这里，嘻嘻.
 void avbot_rpc_server::client_loop(boost::system::error_code ec, std::size_t bytestransfered)
 {
 	std::string uri;
+	avlog_search_request search_request;
 
 	boost::smatch what;
 	//for (;;)
@@ -247,16 +364,16 @@ void avbot_rpc_server::client_loop(boost::system::error_code ec, std::size_t byt
 					boost::bind(&avbot_rpc_server::on_pop, shared_from_this(), _2)
 				);
 			}
-			else if(
-				boost::regex_match(uri, what,
-					boost::regex("/search\\?channel=([^&]*)&q=([^&]*)&date=([^&]*).*")
-				)
-			)
+			else if(parse_search_request(uri, search_request))
 			{
 				// 取出这几个参数, 到数据库里查找, 返回结果吧.
-				BOOST_ASIO_CORO_YIELD do_search(what[1],what[2],what[3],
+				// 搜索在 avlog_search_executor 的线程里跑, 同时监视客户端是否断开.
+				m_search = m_searcher.async_search(search_request,
 					boost::bind(&avbot_rpc_server::done_search, shared_from_this(), _1, _2)
 				);
+				BOOST_ASIO_CORO_YIELD m_socket->async_read_some(boost::asio::null_buffers(),
+					boost::bind(&avbot_rpc_server::check_client_gone, shared_from_this(), _1)
+				);
 				return;
 			}
 			else if(boost::regex_match(uri, what,boost::regex("/search(\\?)?")))
@@ -276,7 +393,7 @@ void avbot_rpc_server::client_loop(boost::system::error_code ec, std::size_t byt
 			else if (boost::regex_match(uri, what,boost::regex("/status(\\?)?")))
 			{
 				// 获取 avbot 的状态.
-				//boost::regex_match();
+				BOOST_ASIO_CORO_YIELD write_json_response(status());
 			}
 			else
 			{
@@ -330,13 +447,13 @@ void avbot_rpc_server::client_loop(boost::system::error_code ec, std::size_t byt
 	}}
 }
 
-void avbot_rpc_server::callback_message(const boost::property_tree::ptree& jsonmessage)
+void avbot_rpc_server::callback_message(const avbot_message & message)
 {
 	boost::shared_ptr<boost::asio::streambuf> buf(new boost::asio::streambuf);
 	std::ostream stream(buf.get());
 	std::stringstream teststream;
 
-	js::write_json(stream, jsonmessage);
+	js::write_json(stream, message.to_ptree());
 
 	m_responses.push(buf);
 }
@@ -346,26 +463,21 @@ void avbot_rpc_server::callback_message(const boost::property_tree::ptree& jsonm
 static void accepte_handler(
 	boost::shared_ptr<boost::asio::ip::tcp::socket> m_socket,
 	avbot & mybot,
-	soci::session & db)
+	avlog_search_executor & searcher,
+	avlog_writer & dbwriter,
+	avbot_extensions & extensions)
 {
-	void avlog_do_search(boost::asio::io_service & io_service,
-		std::string c, std::string q, std::string date,
-		boost::function<void (boost::system::error_code, pt::ptree)> handler,
-		soci::session & db);
-
 	boost::make_shared<avbot_rpc_server>(
 		m_socket,
 		boost::ref(mybot.on_message),
-		boost::bind(
-			avlog_do_search,
-			boost::ref(m_socket->get_io_service()),
-			_1,_2,_3,_4,
-			boost::ref(db)
-		)
+		boost::ref(searcher),
+		boost::ref(dbwriter),
+		boost::ref(extensions)
 	)->start();
 }
 
-bool avbot_start_rpc(boost::asio::io_service & io_service, int port, avbot & mybot, soci::session & avlogdb)
+bool avbot_start_rpc(boost::asio::io_service & io_service, int port, avbot & mybot,
+	avlog_search_executor & searcher, avlog_writer & dbwriter, avbot_extensions & extensions)
 {
 	try
 	{
@@ -373,7 +485,7 @@ bool avbot_start_rpc(boost::asio::io_service & io_service, int port, avbot & myb
 		boost::acceptor_server(
 			io_service,
 			boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v6(), port),
-			boost::bind(accepte_handler, _1, boost::ref(mybot), boost::ref(avlogdb))
+			boost::bind(accepte_handler, _1, boost::ref(mybot), boost::ref(searcher), boost::ref(dbwriter), boost::ref(extensions))
 		);
 	}
 	catch (...)
@@ -383,7 +495,7 @@ bool avbot_start_rpc(boost::asio::io_service & io_service, int port, avbot & myb
 			boost::acceptor_server(
 				io_service,
 				boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port),
-				boost::bind(accepte_handler, _1, boost::ref(mybot), boost::ref(avlogdb))
+				boost::bind(accepte_handler, _1, boost::ref(mybot), boost::ref(searcher), boost::ref(dbwriter), boost::ref(extensions))
 			);
 		}
 		catch (...)
@@ -20,8 +20,12 @@
 #pragma once
 
 #include <boost/asio/io_service.hpp>
-#include <session.h>
 
 #include "libavbot/avbot.hpp"
 
-bool avbot_start_rpc(boost::asio::io_service & io_service, int port, avbot & bot, soci::session & avlogdb);
+class avlog_search_executor;
+class avlog_writer;
+class avbot_extensions;
+
+bool avbot_start_rpc(boost::asio::io_service & io_service, int port, avbot & bot,
+	avlog_search_executor & searcher, avlog_writer & dbwriter, avbot_extensions & extensions);